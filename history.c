@@ -0,0 +1,338 @@
+/*
+ *
+ * history.c
+ *
+ *  Scrollback history for the terminal emulator.
+ *  Lines that scroll off the top of the screen are kept in a ring arena made
+ *  of far heap blocks, so the history is not limited to one 64KB segment and
+ *  does not use the near data segment. The arena size is set when the history
+ *  is created and never grows.
+ *  Lines are compressed: trailing blanks are dropped, and attributes are kept
+ *  as runs, so a typical text line takes a fraction of its 160 screen bytes.
+ *  Adding a line is a single encode and one or two block copies, so the cost
+ *  on the receive path is small and constant.
+ *
+ */
+
+#include    <string.h>
+#include    <malloc.h>
+
+#include    "history.h"
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     RECORD_MAX          (3 + 3 * HISTORY_COLS)  // Length, count, characters and runs, length
+
+/* -----------------------------------------
+   Static prototypes
+----------------------------------------- */
+static uint32_t history_forward(history_t*, uint32_t, int);
+static uint32_t history_backward(history_t*, uint32_t, int);
+static uint8_t  history_byte(history_t*, uint32_t);
+static void     history_write(history_t*, uint32_t, const uint8_t*, int);
+static void     history_read(history_t*, uint32_t, uint8_t*, int);
+
+/*------------------------------------------------
+ * history_init()
+ *
+ *  Allocate a history arena of up to 'kbytes' rounded up to whole blocks.
+ *  If the far heap runs out, the arena is made of the blocks that
+ *  could be allocated.
+ *
+ * param:  Pointer to history, arena size in KB, '0' for no history,
+ *         and the blank cell to trim from line ends
+ * return: Arena size allocated in KB
+ *
+ */
+int history_init(history_t *h, int kbytes, uint16_t blank)
+{
+    int     blocks;
+
+    memset(h, 0, sizeof(history_t));
+    h->blank = blank;
+
+    if ( kbytes <= 0 )
+        return 0;
+
+    blocks = (int)(((uint32_t) kbytes * 1024UL + HISTORY_BLOCK - 1) / HISTORY_BLOCK);
+    if ( blocks > HISTORY_BLOCKS )
+        blocks = HISTORY_BLOCKS;
+
+    while ( h->blocks < blocks )
+    {
+        h->block[h->blocks] = (uint8_t __far*) _fmalloc(HISTORY_BLOCK);
+        if ( h->block[h->blocks] == NULL )
+            break;
+        h->blocks++;
+    }
+
+    h->size = (uint32_t) h->blocks * HISTORY_BLOCK;
+
+    return (int)(h->size / 1024);
+}
+
+/*------------------------------------------------
+ * history_free()
+ *
+ *  Release the history arena.
+ *
+ * param:  Pointer to history
+ * return: none
+ *
+ */
+void history_free(history_t *h)
+{
+    while ( h->blocks )
+        _ffree(h->block[--h->blocks]);
+
+    h->size = 0;
+    history_clear(h);
+}
+
+/*------------------------------------------------
+ * history_clear()
+ *
+ *  Drop all lines.
+ *
+ * param:  Pointer to history
+ * return: none
+ *
+ */
+void history_clear(history_t *h)
+{
+    h->head = 0;
+    h->tail = 0;
+    h->used = 0;
+    h->lines = 0;
+    h->cursor = 0;
+    h->cursor_line = 0;
+}
+
+/*------------------------------------------------
+ * history_push()
+ *
+ *  Add a line of screen cells to the history, dropping
+ *  the oldest lines if there is not enough room.
+ *
+ * param:  Pointer to history, cells with the character in the low byte
+ *         and the attribute in the high byte, and cell count
+ * return: none
+ *
+ */
+void history_push(history_t *h, const uint16_t *cells, int count)
+{
+    uint8_t     record[RECORD_MAX];
+    uint8_t     attr, old;
+    int         i, j, len;
+
+    if ( h->blocks == 0 )
+        return;
+
+    if ( count > HISTORY_COLS )
+        count = HISTORY_COLS;
+
+    while ( count > 0 && cells[count - 1] == h->blank )
+        count--;
+
+    len = 1;
+    record[len++] = (uint8_t) count;
+
+    for ( i = 0; i < count; i++ )
+        record[len++] = (uint8_t) cells[i];
+
+    for ( i = 0; i < count; i = j )
+    {
+        attr = (uint8_t)(cells[i] >> 8);
+        for ( j = i + 1; j < count && (uint8_t)(cells[j] >> 8) == attr; j++ );
+        record[len++] = (uint8_t)(j - i);
+        record[len++] = attr;
+    }
+
+    len++;
+    record[0] = (uint8_t) len;
+    record[len - 1] = (uint8_t) len;
+
+    /* Make room by dropping the oldest lines
+     */
+    while ( h->lines > 0 && ((h->used + len) > h->size || h->lines >= HISTORY_MAX_LINES) )
+    {
+        old = history_byte(h, h->tail);
+        h->tail = history_forward(h, h->tail, old);
+        h->used -= old;
+        h->lines--;
+    }
+
+    history_write(h, h->head, record, len);
+    h->head = history_forward(h, h->head, len);
+    h->used += len;
+    h->lines++;
+
+    /* The browsing cursor stays on its line, which is now one more line back
+     */
+    h->cursor_line++;
+    if ( h->cursor_line > h->lines )
+    {
+        h->cursor = h->head;
+        h->cursor_line = 0;
+    }
+}
+
+/*------------------------------------------------
+ * history_line()
+ *
+ *  Get a line from the history.
+ *
+ * param:  Pointer to history, lines back from the newest line which is '1',
+ *         output cells and cell count, cells past the end of the line are blank
+ * return: '0' line returned, '-1' no such line
+ *
+ */
+int history_line(history_t *h, int back, uint16_t *cells, int count)
+{
+    uint8_t     record[RECORD_MAX];
+    uint8_t     len;
+    int         i, n, run, col;
+
+    if ( back < 1 || back > h->lines )
+        return -1;
+
+    while ( h->cursor_line < back )
+    {
+        len = history_byte(h, history_backward(h, h->cursor, 1));
+        h->cursor = history_backward(h, h->cursor, len);
+        h->cursor_line++;
+    }
+
+    while ( h->cursor_line > back )
+    {
+        len = history_byte(h, h->cursor);
+        h->cursor = history_forward(h, h->cursor, len);
+        h->cursor_line--;
+    }
+
+    len = history_byte(h, h->cursor);
+    history_read(h, h->cursor, record, len);
+
+    n = record[1];
+    if ( n > count )
+        n = count;
+
+    for ( i = 0, col = 0; col < n; i += 2 )
+    {
+        for ( run = record[2 + record[1] + i]; run && col < n; run--, col++ )
+            cells[col] = record[2 + col] | ((uint16_t) record[3 + record[1] + i] << 8);
+    }
+
+    for ( ; col < count; col++ )
+        cells[col] = h->blank;
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * history_forward()
+ *
+ *  Advance an arena offset, wrapping at the end.
+ *
+ * param:  Pointer to history, offset, byte count
+ * return: New offset
+ *
+ */
+static uint32_t history_forward(history_t *h, uint32_t pos, int len)
+{
+    pos += len;
+    if ( pos >= h->size )
+        pos -= h->size;
+
+    return pos;
+}
+
+/*------------------------------------------------
+ * history_backward()
+ *
+ *  Move an arena offset back, wrapping at the start.
+ *
+ * param:  Pointer to history, offset, byte count
+ * return: New offset
+ *
+ */
+static uint32_t history_backward(history_t *h, uint32_t pos, int len)
+{
+    if ( pos >= (uint32_t) len )
+        return (pos - len);
+
+    return (pos + h->size - len);
+}
+
+/*------------------------------------------------
+ * history_byte()
+ *
+ *  Read one arena byte.
+ *
+ * param:  Pointer to history, offset
+ * return: Byte
+ *
+ */
+static uint8_t history_byte(history_t *h, uint32_t pos)
+{
+    return h->block[(int)(pos >> HISTORY_SHIFT)][(uint16_t) pos & (HISTORY_BLOCK - 1)];
+}
+
+/*------------------------------------------------
+ * history_write()
+ *
+ *  Copy a record into the arena, split at block boundaries.
+ *
+ * param:  Pointer to history, offset, data and its length
+ * return: none
+ *
+ */
+static void history_write(history_t *h, uint32_t pos, const uint8_t *data, int len)
+{
+    uint16_t    offset;
+    int         chunk;
+
+    while ( len > 0 )
+    {
+        offset = (uint16_t) pos & (HISTORY_BLOCK - 1);
+        chunk = HISTORY_BLOCK - offset;
+        if ( chunk > len )
+            chunk = len;
+
+        _fmemcpy(&h->block[(int)(pos >> HISTORY_SHIFT)][offset], data, chunk);
+
+        pos = history_forward(h, pos, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+}
+
+/*------------------------------------------------
+ * history_read()
+ *
+ *  Copy a record out of the arena, split at block boundaries.
+ *
+ * param:  Pointer to history, offset, buffer and length
+ * return: none
+ *
+ */
+static void history_read(history_t *h, uint32_t pos, uint8_t *data, int len)
+{
+    uint16_t    offset;
+    int         chunk;
+
+    while ( len > 0 )
+    {
+        offset = (uint16_t) pos & (HISTORY_BLOCK - 1);
+        chunk = HISTORY_BLOCK - offset;
+        if ( chunk > len )
+            chunk = len;
+
+        _fmemcpy(data, &h->block[(int)(pos >> HISTORY_SHIFT)][offset], chunk);
+
+        pos = history_forward(h, pos, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+}
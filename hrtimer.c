@@ -0,0 +1,290 @@
+/*
+ *
+ * hrtimer.c
+ *
+ *  High resolution time stamps for latency measurement.
+ *  The BIOS tick count at 0040:006C advances every 65536 counts of PIT channel 0,
+ *  so latching the channel 0 counter gives the position within the current
+ *  55 mili-second tick, in 0.838 micro-second counts. Time stamps combine the two
+ *  into a 32 bit count that wraps about once an hour, so differences are valid
+ *  for intervals of up to an hour.
+ *
+ *  The BIOS runs channel 0 in mode 3 (square wave), where the counter goes
+ *  down by two and runs through its range twice per tick, which makes the latched
+ *  value ambiguous on an 8253 without a read-back command. hrt_init() reprograms
+ *  channel 0 to mode 2 (rate generator) with the same 65536 divisor, so the tick
+ *  rate is unchanged and the counter runs down once per tick. hrt_close() restores
+ *  mode 3 and is registered to run at exit.
+ *
+ *  A tick interrupt that is pending while the counter is read is detected through
+ *  the 8259 IRR register, so a counter that already wrapped is not paired with
+ *  the previous tick count.
+ *
+ *  resources:
+ *      http://www.brokenthorn.com/Resources/OSDevPit.html
+ *      Michael Abrash, Zen of Code Optimization, chapter 3, the Zen timer
+ *
+ */
+
+#include    <stdlib.h>
+#include    <conio.h>
+#include    <dos.h>
+#include    <i86.h>
+
+#include    "hrtimer.h"
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     PIT_CHANNEL0        0x40
+#define     PIT_CONTROL         0x43
+#define     PIT_LATCH0          0x00        // Counter latch command, channel 0
+#define     PIT_MODE2           0x34        // Channel 0, LSB then MSB, mode 2, binary
+#define     PIT_MODE3           0x36        // Channel 0, LSB then MSB, mode 3, binary
+
+#define     PIC_COMMAND         0x20
+#define     PIC_READ_IRR        0x0a        // OCW3, next read returns the IRR
+#define     PIC_IRQ0            0x01
+
+#define     BIOS_TICKS_DAY      0x001800b0UL    // Tick count at midnight, when the BIOS count restarts
+#define     CALIBRATE_TICKS     2
+#define     CALIBRATE_LIMIT     30000           // Reads before giving up on the tick advancing
+
+/* -----------------------------------------
+   Static prototypes
+----------------------------------------- */
+static uint32_t hrt_raw(uint32_t*, uint16_t*);
+
+/* -----------------------------------------
+   Globals
+----------------------------------------- */
+static volatile uint32_t __far *bios_ticks = 0;
+static uint32_t     last_ticks = 0;
+static uint32_t     tick_offset = 0;            // Ticks added for each midnight passed
+static uint32_t     last_stamp = 0;
+static uint32_t     read_overhead = 0;          // Counts between two back to back reads
+static int          linear = 0;                 // '1' counter is in mode 2, counts are usable
+
+/*------------------------------------------------
+ * hrt_init()
+ *
+ *  Set PIT channel 0 to mode 2 and calibrate.
+ *  Calibration reads time stamps back to back for two ticks, which measures
+ *  the cost of a read and checks that time stamps never go back. If they do,
+ *  for example under an emulator that does not implement mode 2, the counter is
+ *  not used and time stamps have tick resolution.
+ *
+ * param:  none
+ * return: '1' high resolution time stamps, '0' tick resolution only
+ *
+ */
+int hrt_init(void)
+{
+    uint32_t    start_tick, prev, now, delta;
+    int         backwards, reads;
+
+    bios_ticks = (volatile uint32_t __far*) MK_FP(0x40, 0x6c);
+
+    _disable();
+    outp(PIT_CONTROL, PIT_MODE2);
+    outp(PIT_CHANNEL0, 0);
+    outp(PIT_CHANNEL0, 0);
+    _enable();
+
+    atexit(hrt_close);
+
+    /* Start on a tick boundary, the mode change takes effect on the next reload
+     */
+    start_tick = *bios_ticks;
+    for ( reads = 0; *bios_ticks == start_tick && reads < CALIBRATE_LIMIT; reads++ );
+
+    linear = 1;
+    backwards = 0;
+    read_overhead = 0xffffffffUL;
+
+    start_tick = *bios_ticks;
+    prev = hrt_raw(NULL, NULL);
+
+    for ( reads = 0; (*bios_ticks - start_tick) < CALIBRATE_TICKS && reads < CALIBRATE_LIMIT; reads++ )
+    {
+        now = hrt_raw(NULL, NULL);
+        delta = now - prev;
+
+        if ( (int32_t) delta < 0 )
+            backwards++;
+        else if ( delta < read_overhead )
+            read_overhead = delta;
+
+        prev = now;
+    }
+
+    if ( backwards || reads == CALIBRATE_LIMIT )
+    {
+        linear = 0;
+        read_overhead = 0;
+    }
+
+    last_stamp = hrt_raw(NULL, NULL);
+
+    return linear;
+}
+
+/*------------------------------------------------
+ * hrt_close()
+ *
+ *  Restore PIT channel 0 to the BIOS mode 3.
+ *
+ * param:  none
+ * return: none
+ *
+ */
+void hrt_close(void)
+{
+    if ( bios_ticks == 0 )
+        return;
+
+    _disable();
+    outp(PIT_CONTROL, PIT_MODE3);
+    outp(PIT_CHANNEL0, 0);
+    outp(PIT_CHANNEL0, 0);
+    _enable();
+
+    bios_ticks = 0;
+}
+
+/*------------------------------------------------
+ * hrt_read()
+ *
+ *  Read a monotonic time stamp, after hrt_init().
+ *
+ * param:  none
+ * return: Time stamp in PIT counts
+ *
+ */
+uint32_t hrt_read(void)
+{
+    uint32_t    stamp;
+
+    stamp = hrt_raw(NULL, NULL);
+
+    if ( (int32_t)(stamp - last_stamp) < 0 )
+        stamp = last_stamp;
+
+    last_stamp = stamp;
+
+    return stamp;
+}
+
+/*------------------------------------------------
+ * hrt_tod()
+ *
+ *  Read a time stamp together with the time of day it was taken at,
+ *  so time stamps can be converted to clock time. The time of day is the
+ *  BIOS tick count since midnight and the PIT counts into that tick.
+ *
+ * param:  Pointers to the tick count and the counts into the tick
+ * return: Time stamp in PIT counts
+ *
+ */
+uint32_t hrt_tod(uint32_t *ticks, uint16_t *count)
+{
+    return hrt_raw(ticks, count);
+}
+
+/*------------------------------------------------
+ * hrt_us()
+ *
+ *  Convert a time stamp difference to micro-seconds.
+ *  65536 counts are 54925.4 micro-seconds.
+ *
+ * param:  Time stamp difference in PIT counts
+ * return: Micro-seconds
+ *
+ */
+uint32_t hrt_us(uint32_t counts)
+{
+    return ((counts >> 16) * 54925UL) + (((counts & 0xffff) * 54925UL) >> 16);
+}
+
+/*------------------------------------------------
+ * hrt_since()
+ *
+ *  Time passed since a time stamp.
+ *
+ * param:  Time stamp
+ * return: Micro-seconds since the time stamp
+ *
+ */
+uint32_t hrt_since(uint32_t stamp)
+{
+    return hrt_us(hrt_read() - stamp);
+}
+
+/*------------------------------------------------
+ * hrt_overhead()
+ *
+ *  Cost of reading a time stamp, measured by hrt_init(),
+ *  to subtract from very short measurements.
+ *
+ * param:  none
+ * return: PIT counts
+ *
+ */
+uint32_t hrt_overhead(void)
+{
+    return read_overhead;
+}
+
+/*------------------------------------------------
+ * hrt_raw()
+ *
+ *  Latch the counter and combine it with the tick count.
+ *  With interrupts disabled a tick interrupt cannot be serviced between
+ *  the two reads, but the counter may have wrapped with the interrupt still
+ *  pending. A pending IRQ0 with a counter early in its tick means the tick
+ *  count is one behind.
+ *
+ * param:  Pointers to return the tick count and counts into the tick, or NULL
+ * return: Time stamp in PIT counts
+ *
+ */
+static uint32_t hrt_raw(uint32_t *tod_ticks, uint16_t *tod_count)
+{
+    uint32_t    ticks;
+    uint16_t    count;
+    uint8_t     lo, hi, irr;
+
+    _disable();
+    outp(PIT_CONTROL, PIT_LATCH0);
+    lo = inp(PIT_CHANNEL0);
+    hi = inp(PIT_CHANNEL0);
+    ticks = *bios_ticks;
+    outp(PIC_COMMAND, PIC_READ_IRR);
+    irr = inp(PIC_COMMAND);
+    _enable();
+
+    /* The counter runs down from 65536 (read as 0),
+     * counts into the tick are its distance from 65536
+     */
+    count = (uint16_t)(0 - (((uint16_t) hi << 8) | lo));
+
+    if ( (irr & PIC_IRQ0) && count < 0x8000 )
+        ticks++;
+
+    /* The BIOS restarts the tick count at midnight
+     */
+    if ( ticks < last_ticks && (last_ticks - ticks) > 0x10000UL )
+        tick_offset += BIOS_TICKS_DAY;
+    last_ticks = ticks;
+
+    if ( !linear )
+        count = 0;
+
+    if ( tod_ticks )
+    {
+        *tod_ticks = ticks;
+        *tod_count = count;
+    }
+
+    return (((ticks + tick_offset) << 16) + count);
+}
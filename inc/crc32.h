@@ -0,0 +1,14 @@
+/*
+ *
+ * crc32.h
+ *
+ *  CRC-32 (IEEE 802.3) calculation
+ *
+ */
+
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *buf, int len);
+
+#endif /* _CRC32_H_ */
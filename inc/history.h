@@ -0,0 +1,57 @@
+/*
+ *
+ * history.h
+ *
+ *  Terminal scrollback history, kept compressed in a far heap ring arena
+ *
+ */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include    <stdint.h>
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     HISTORY_COLS        80          // Widest line kept
+#define     HISTORY_BLOCK       8192U       // Arena block size, allocated separately from the far heap
+#define     HISTORY_SHIFT       13
+#define     HISTORY_BLOCKS      64          // Largest arena, 512KB
+#define     HISTORY_MAX_LINES   30000       // Line count limit, keeps line numbers in an 'int'
+
+/* -----------------------------------------
+   Types and data structures
+----------------------------------------- */
+
+/* Scrollback ring arena.
+ * A line is stored as a record: its length, the character count after trimming
+ * trailing blanks, the characters, (count, attribute) pairs for attribute runs,
+ * and its length again so the ring can be walked in both directions.
+ * The oldest lines are dropped to make room for new ones.
+ * Browsing keeps a cursor on the last line read, so paging moves relative to it.
+ */
+typedef struct
+{
+    uint8_t __far  *block[HISTORY_BLOCKS];
+    int             blocks;
+    uint32_t        size;                       // Arena size in bytes
+    uint32_t        head;                       // Offset the next line is written to
+    uint32_t        tail;                       // Offset of the oldest line
+    uint32_t        used;
+    int             lines;                      // Lines held
+    uint32_t        cursor;                     // Offset of the line 'cursor_line' lines back
+    int             cursor_line;                // '0' is the head
+    uint16_t        blank;                      // Blank cell trimmed from line ends
+} history_t;
+
+/* -----------------------------------------
+   Function prototypes
+----------------------------------------- */
+int  history_init(history_t*, int, uint16_t);
+void history_free(history_t*);
+void history_clear(history_t*);
+void history_push(history_t*, const uint16_t*, int);
+int  history_line(history_t*, int, uint16_t*, int);
+
+#endif /* _HISTORY_H_ */
@@ -0,0 +1,32 @@
+/*
+ *
+ * hrtimer.h
+ *
+ *  High resolution time stamps from the 8253 PIT channel 0 counter
+ *  and the BIOS tick count
+ *
+ */
+
+#ifndef _HRTIMER_H_
+#define _HRTIMER_H_
+
+#include    <stdint.h>
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     HRT_HZ              1193182UL   // PIT input clock, time stamp counts per second
+#define     HRT_PRECISION       -20         // log2 of the count period in seconds (0.838 uSec), for NTP
+
+/* -----------------------------------------
+   Function prototypes
+----------------------------------------- */
+int      hrt_init(void);
+void     hrt_close(void);
+uint32_t hrt_read(void);
+uint32_t hrt_tod(uint32_t*, uint16_t*);
+uint32_t hrt_us(uint32_t);
+uint32_t hrt_since(uint32_t);
+uint32_t hrt_overhead(void);
+
+#endif /* _HRTIMER_H_ */
@@ -0,0 +1,70 @@
+/*
+ *
+ * inflate.h
+ *
+ *  Streaming zlib (RFC 1950) / deflate (RFC 1951) decompression
+ *
+ */
+
+#ifndef _INFLATE_H_
+#define _INFLATE_H_
+
+#include    <stdint.h>
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     INFLATE_MAX_WINDOW  32768U      // Largest history window accepted from a zlib header
+#define     INFLATE_OUT         256         // Output is passed on in chunks of up to this size
+
+#define     INFLATE_OK          0           // All input consumed, more is expected
+#define     INFLATE_DONE        1           // End of zlib stream
+#define     INFLATE_ERROR       -1          // Bad stream data or out of memory
+
+/* -----------------------------------------
+   Types and data structures
+----------------------------------------- */
+typedef void (*inflate_output_t)(void*, uint8_t*, int);
+
+/* Decompressor state.
+ * Decoding advances one element (header field, code, extra bits) at a time,
+ * and an element is only consumed when all its bits are available, so input
+ * can be split anywhere between calls. Bits are pulled one byte at a time
+ * as needed, so at most 7 unused bits are ever held.
+ */
+typedef struct
+{
+    int                 state;
+    uint32_t            bitbuf;
+    int                 bitcnt;
+    uint8_t            *window;                 // History window, allocated from the zlib header size
+    uint16_t            wmask;
+    uint16_t            wpos;
+    int                 final;                  // Processing the last block
+    uint16_t            count;                  // Stored bytes or trailer bytes left, code length index
+    int                 hlit;
+    int                 hdist;
+    int                 hclen;
+    int                 symbol;                 // Length or distance symbol waiting for its extra bits
+    uint16_t            length;
+    uint8_t             lengths[288+32];        // Code lengths of a dynamic block
+    uint16_t            lencnt[16];             // Literal/length code, canonical Huffman counts and symbols
+    uint16_t            lensym[288];
+    uint16_t            distcnt[16];            // Distance code
+    uint16_t            distsym[32];
+    uint8_t             out[INFLATE_OUT];
+    int                 out_len;
+    inflate_output_t    output;
+    void               *context;
+    uint32_t            total_in;
+    uint32_t            total_out;
+} inflate_t;
+
+/* -----------------------------------------
+   Function prototypes
+----------------------------------------- */
+void inflate_init(inflate_t*, inflate_output_t, void*);
+int  inflate_input(inflate_t*, const uint8_t*, int, int*);
+void inflate_end(inflate_t*);
+
+#endif /* _INFLATE_H_ */
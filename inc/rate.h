@@ -0,0 +1,16 @@
+/*
+ *
+ * rate.h
+ *
+ *  Transfer rate calculation
+ *
+ */
+
+#ifndef _RATE_H_
+#define _RATE_H_
+
+#include    <stdint.h>
+
+uint32_t rate_bps(uint32_t bytes, uint32_t elapsed);
+
+#endif /* _RATE_H_ */
@@ -0,0 +1,49 @@
+/*
+ *
+ * slew.h
+ *
+ *  Resident clock slewing (NTPSLEW.EXE), adjusts the BIOS tick count
+ *  to correct the clock frequency and amortize small offsets
+ *
+ */
+
+#ifndef _SLEW_H_
+#define _SLEW_H_
+
+#include    <stdint.h>
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     SLEW_MUX_ID         0xc7        // INT 2Fh multiplex function number
+#define     SLEW_SIGNATURE      0x4e54      // 'NT'
+#define     SLEW_SHIFT          24
+#define     SLEW_ONE_TICK       (1L << SLEW_SHIFT)  // Corrections are in 2^-24 of a tick
+#define     SLEW_MAX_RATE       8389        // Phase slew limit per tick, 500 ppm
+#define     SLEW_TICK_SECONDS   (65536.0 / 1193182.0)
+
+/* -----------------------------------------
+   Types and data structures
+----------------------------------------- */
+
+/* Resident state, found through INT 2Fh and updated in place.
+ * Every timer tick adds the frequency correction and up to SLEW_MAX_RATE
+ * of the remaining phase correction to an accumulator, and a whole tick
+ * in the accumulator is added to or removed from the BIOS tick count.
+ */
+typedef struct
+{
+    uint16_t    signature;
+    int32_t     freq;                   // Correction per tick, positive runs the clock faster
+    int32_t     phase;                  // Phase correction still to apply
+    int32_t     accum;
+    int32_t     adjusted;               // Ticks added (positive) or removed since installed
+    uint32_t    sync;                   // NTP seconds of the last synchronization, kept for the client
+} slew_t;
+
+/* -----------------------------------------
+   Function prototypes
+----------------------------------------- */
+slew_t __far *slew_find(void);
+
+#endif /* _SLEW_H_ */
@@ -0,0 +1,89 @@
+/*
+ *
+ * vt100.h
+ *
+ *  VT100/ANSI terminal emulation with a shadow screen,
+ *  rendered to an 80x25 text screen through BIOS INT 10h
+ *
+ */
+
+#ifndef _VT100_H_
+#define _VT100_H_
+
+#include    <stdint.h>
+
+#include    "history.h"
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     VT100_COLS          80
+#define     VT100_ROWS          25
+#define     VT100_PARAMS        8           // Maximum CSI parameters
+#define     VT100_SEQ_LEN       8           // Longest key sequence
+
+#define     VT100_BLANK         0x0720      // Blank cell, space with the default attribute
+
+#define     VT100_KEY_EXT       0x100       // Extended key flag, or-ed with the BIOS scan code
+
+/* -----------------------------------------
+   Types and data structures
+----------------------------------------- */
+typedef void (*vt100_reply_t)(int, const uint8_t*, int);
+
+/* A terminal's shadow screen and parser state.
+ * Screen cells hold the character in the low byte and the BIOS attribute in the high byte.
+ * Dirty column ranges mark rows that differ from the display,
+ * they are only tracked while the terminal is displayed.
+ * Lines scrolled off the top of the screen go to the scrollback history, if there is one.
+ * While the history is browsed the display shows it instead of the screen.
+ */
+typedef struct
+{
+    uint16_t        screen[VT100_ROWS][VT100_COLS];
+    uint8_t         dirty_first[VT100_ROWS];    // First changed column, VT100_COLS if row is clean
+    uint8_t         dirty_last[VT100_ROWS];     // Last changed column
+    int             row;                        // Cursor position
+    int             col;
+    int             wrap_pending;               // Character written to last column, wrap on next
+    int             top;                        // Scroll region
+    int             bottom;
+    uint8_t         attr;                       // BIOS attribute from SGR state
+    int             fg;                         // SGR state
+    int             bg;
+    int             bold;
+    int             underline;
+    int             blink;
+    int             reverse;
+    int             saved_row;                  // DECSC saved cursor
+    int             saved_col;
+    uint8_t         saved_attr;
+    int             autowrap;                   // DECAWM
+    int             origin;                     // DECOM
+    int             cursor_keys;                // DECCKM application cursor keys
+    int             cursor_visible;             // DECTCEM
+    int             graphics[2];                // G0/G1 is DEC special graphics
+    int             shift;                      // '1' G1 selected (SO)
+    int             state;                      // Parser state
+    int             params[VT100_PARAMS];
+    int             param_count;
+    int             private_mark;
+    int             id;                         // Passed to the reply function
+    vt100_reply_t   reply;                      // Function to send responses to the host
+    history_t      *history;                    // Scrollback history or NULL
+    int             view;                       // History lines the view is scrolled back, '0' is live
+} vt100_t;
+
+/* -----------------------------------------
+   Function prototypes
+----------------------------------------- */
+void vt100_init(vt100_t*, int, vt100_reply_t);
+void vt100_write(vt100_t*, const uint8_t*, int);
+void vt100_flush(vt100_t*);
+void vt100_show(vt100_t*);
+void vt100_restore(void);
+int  vt100_key(vt100_t*, int, uint8_t*);
+void vt100_history(vt100_t*, history_t*);
+int  vt100_view(vt100_t*, int);
+
+#endif /* _VT100_H_ */
@@ -0,0 +1,89 @@
+/*
+ *
+ * zmodem.h
+ *
+ *  ZMODEM file transfer engine, driven by a byte stream and a poll call
+ *
+ */
+
+#ifndef _ZMODEM_H_
+#define _ZMODEM_H_
+
+#include    <stdio.h>
+#include    <stdint.h>
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     ZM_BLOCK            1024        // Data subpacket size
+#define     ZM_WINDOW           16384U      // Unacknowledged bytes sent to a streaming receiver
+#define     ZM_NAME_LEN         80
+
+#define     ZM_OFF              0           // Engine role
+#define     ZM_RECEIVE          1
+#define     ZM_SEND             2
+
+/* -----------------------------------------
+   Types and data structures
+----------------------------------------- */
+typedef int  (*zmodem_send_t)(void*, const uint8_t*, int);
+typedef void (*zmodem_status_t)(void*, const char*);
+typedef int  (*zmodem_ask_t)(void*, char*, int);
+
+/* Transfer state.
+ * Input is parsed one character at a time so headers and subpackets can
+ * be split anywhere. Output is encoded into 'out' and drained through the
+ * send function, which may accept only part of it.
+ */
+typedef struct
+{
+    int             role;                       // ZM_OFF, ZM_RECEIVE or ZM_SEND
+    int             state;                      // Transfer state within the role
+    int             detect;                     // Characters of a ZRQINIT/ZRINIT header matched while off
+    int             rx_state;                   // Frame input parser
+    int             rx_escape;                  // ZDLE received, next character is escaped
+    int             rx_format;                  // Header format 'A', 'B' or 'C'
+    int             rx_crc32;                   // Data subpackets carry a CRC-32
+    int             rx_count;                   // Header or CRC characters received
+    int             rx_end;                     // Subpacket frame end type
+    char            rx_hex[14];                 // Hex header digits
+    uint8_t         rx_hdr[9];                  // Header type, 4 bytes, CRC
+    uint8_t         rx_crc[4];
+    int             can_count;                  // Consecutive CAN characters, five abort the transfer
+    uint8_t         data[ZM_BLOCK + 1];         // Subpacket data and its frame end for the CRC
+    int             data_len;
+    FILE           *file;
+    char            name[ZM_NAME_LEN];
+    uint32_t        size;
+    uint32_t        pos;                        // File position received or sent
+    uint32_t        acked;                      // Sender: position acknowledged by the receiver
+    uint32_t        window;                     // Sender: unacknowledged bytes allowed
+    uint16_t        rx_buffer;                  // Sender: receiver buffer size, '0' can stream
+    int             use_crc32;                  // Sender: receiver can check CRC-32
+    int             packets;                    // Sender: subpackets since the last ZCRCQ
+    int             last_type;                  // Last header sent, resent on timeout
+    uint32_t        last_pos;
+    uint32_t        now;                        // Time of last poll
+    uint32_t        timer;                      // Time of last progress
+    int             retries;
+    uint32_t        start;
+    uint32_t        shown;                      // Time progress was last shown
+    uint8_t         out[2 * ZM_BLOCK + 64];
+    int             out_len;
+    int             out_pos;
+    zmodem_send_t   send;
+    zmodem_status_t status;
+    zmodem_ask_t    ask;
+    void           *context;
+} zmodem_t;
+
+/* -----------------------------------------
+   Function prototypes
+----------------------------------------- */
+void zmodem_init(zmodem_t*, zmodem_send_t, zmodem_status_t, zmodem_ask_t, void*);
+int  zmodem_detect(zmodem_t*, const uint8_t*, int);
+int  zmodem_input(zmodem_t*, const uint8_t*, int);
+void zmodem_poll(zmodem_t*, uint32_t);
+void zmodem_cancel(zmodem_t*);
+
+#endif /* _ZMODEM_H_ */
@@ -0,0 +1,619 @@
+/*
+ *
+ * inflate.c
+ *
+ *  Streaming zlib/deflate decompression, small enough for an 8088.
+ *  The history window is allocated to the size the compressor declares in
+ *  the zlib header, so a server that compresses with a small window needs
+ *  only that much memory. Huffman codes are decoded bit by bit from canonical
+ *  code counts, which needs no decoding tables beyond the symbol lists.
+ *  Input can be fed in pieces of any size, the decompressor suspends and
+ *  resumes between deflate elements. Decompressed data is passed to an output
+ *  function in chunks, and input bytes following the end of the zlib stream
+ *  are not consumed.
+ *
+ *  resources:
+ *      zlib format:    https://tools.ietf.org/html/rfc1950
+ *      deflate format: https://tools.ietf.org/html/rfc1951
+ *      puff.c:         https://github.com/madler/zlib/blob/master/contrib/puff/puff.c
+ *
+ */
+
+#include    <stdlib.h>
+#include    <string.h>
+
+#include    "inflate.h"
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     I_ZHEADER           0           // Decompressor states
+#define     I_BLOCK             1
+#define     I_STORED            2
+#define     I_STORED_COPY       3
+#define     I_TABLE             4
+#define     I_CODELEN_CODES     5
+#define     I_CODELENS          6
+#define     I_CODELENS_EXTRA    7
+#define     I_CODES             8
+#define     I_LENGTH_EXTRA      9
+#define     I_DISTANCE          10
+#define     I_DISTANCE_EXTRA    11
+#define     I_TRAILER           12
+#define     I_DONE              13
+#define     I_ERROR             14
+
+#define     MORE                -2          // Decoder needs more bits
+#define     BAD                 -1          // Invalid code
+
+/* -----------------------------------------
+   Static prototypes
+----------------------------------------- */
+static int  inf_need(inflate_t*, int, const uint8_t**, const uint8_t*);
+static int  inf_bits(inflate_t*, int);
+static int  inf_decode(inflate_t*, const uint16_t*, const uint16_t*, const uint8_t**, const uint8_t*);
+static int  inf_build(uint16_t*, uint16_t*, const uint8_t*, int);
+static void inf_fixed(inflate_t*);
+static void inf_emit(inflate_t*, uint8_t);
+static int  inf_copy(inflate_t*, uint16_t);
+static void inf_flush(inflate_t*);
+
+/* -----------------------------------------
+   Globals
+----------------------------------------- */
+static const uint16_t   length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t    length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t   distance_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const uint8_t    distance_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t    codelen_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+/*------------------------------------------------
+ * inflate_init()
+ *
+ *  Initialize a decompressor for a new zlib stream.
+ *
+ * param:  Pointer to decompressor, output function and its context
+ * return: none
+ *
+ */
+void inflate_init(inflate_t *inf, inflate_output_t output, void *context)
+{
+    memset(inf, 0, sizeof(inflate_t));
+
+    inf->state = I_ZHEADER;
+    inf->output = output;
+    inf->context = context;
+}
+
+/*------------------------------------------------
+ * inflate_input()
+ *
+ *  Decompress a piece of the input stream.
+ *  Decompression stops at the end of the zlib stream, any input after it
+ *  is left unconsumed for the caller.
+ *
+ * param:  Pointer to decompressor, input data and its length,
+ *         pointer to output of number of input bytes consumed
+ * return: INFLATE_OK, INFLATE_DONE at end of stream, or INFLATE_ERROR
+ *
+ */
+int inflate_input(inflate_t *inf, const uint8_t *data, int len, int *consumed)
+{
+    const uint8_t  *p, *end;
+    int             value, i;
+    uint16_t        size;
+
+    p = data;
+    end = data + len;
+
+    while ( inf->state != I_DONE && inf->state != I_ERROR )
+    {
+        switch ( inf->state )
+        {
+            /* zlib header, deflate method without a preset dictionary
+             */
+            case I_ZHEADER:
+                if ( !inf_need(inf, 16, &p, end) )
+                    goto suspend;
+                value = inf_bits(inf, 8);
+                i = inf_bits(inf, 8);
+                if ( (value & 0x0f) != 8 || (i & 0x20) || ((value << 8) + i) % 31 )
+                {
+                    inf->state = I_ERROR;
+                    break;
+                }
+                if ( (value >> 4) > 7 )
+                {
+                    inf->state = I_ERROR;
+                    break;
+                }
+                size = 1U << ((value >> 4) + 8);
+                if ( size > INFLATE_MAX_WINDOW ||
+                     (inf->window = (uint8_t*) malloc(size)) == NULL )
+                {
+                    inf->state = I_ERROR;
+                    break;
+                }
+                inf->wmask = size - 1;
+                inf->state = I_BLOCK;
+                break;
+
+            /* Block header
+             */
+            case I_BLOCK:
+                if ( !inf_need(inf, 3, &p, end) )
+                    goto suspend;
+                inf->final = inf_bits(inf, 1);
+                value = inf_bits(inf, 2);
+                if ( value == 0 )
+                {
+                    inf_bits(inf, inf->bitcnt);         // Stored block starts on a byte boundary
+                    inf->state = I_STORED;
+                }
+                else if ( value == 1 )
+                {
+                    inf_fixed(inf);
+                    inf->state = I_CODES;
+                }
+                else if ( value == 2 )
+                {
+                    inf->state = I_TABLE;
+                }
+                else
+                {
+                    inf->state = I_ERROR;
+                }
+                break;
+
+            /* Stored block length and its complement
+             */
+            case I_STORED:
+                if ( !inf_need(inf, 32, &p, end) )
+                    goto suspend;
+                inf->count = inf_bits(inf, 16);
+                if ( (uint16_t) inf_bits(inf, 16) != (uint16_t) ~inf->count )
+                {
+                    inf->state = I_ERROR;
+                    break;
+                }
+                inf->state = I_STORED_COPY;
+                break;
+
+            case I_STORED_COPY:
+                while ( inf->count && p < end )
+                {
+                    inf_emit(inf, *p++);
+                    inf->count--;
+                }
+                if ( inf->count )
+                    goto suspend;
+                inf->state = inf->final ? I_TRAILER : I_BLOCK;
+                break;
+
+            /* Dynamic block code counts
+             */
+            case I_TABLE:
+                if ( !inf_need(inf, 14, &p, end) )
+                    goto suspend;
+                inf->hlit = inf_bits(inf, 5) + 257;
+                inf->hdist = inf_bits(inf, 5) + 1;
+                inf->hclen = inf_bits(inf, 4) + 4;
+                if ( inf->hlit > 286 || inf->hdist > 30 )
+                {
+                    inf->state = I_ERROR;
+                    break;
+                }
+                memset(inf->lengths, 0, 19);
+                inf->count = 0;
+                inf->state = I_CODELEN_CODES;
+                break;
+
+            /* Code lengths of the code length code, kept in the distance code arrays
+             */
+            case I_CODELEN_CODES:
+                while ( inf->count < inf->hclen )
+                {
+                    if ( !inf_need(inf, 3, &p, end) )
+                        goto suspend;
+                    inf->lengths[codelen_order[inf->count++]] = (uint8_t) inf_bits(inf, 3);
+                }
+                /* The code length code must be complete and not empty
+                 */
+                if ( inf_build(inf->distcnt, inf->distsym, inf->lengths, 19) != 0 ||
+                     inf->distcnt[0] == 19 )
+                {
+                    inf->state = I_ERROR;
+                    break;
+                }
+                inf->count = 0;
+                inf->state = I_CODELENS;
+                break;
+
+            /* Literal/length and distance code lengths
+             */
+            case I_CODELENS:
+                if ( inf->count >= (inf->hlit + inf->hdist) )
+                {
+                    if ( inf->lengths[256] == 0 ||
+                         inf_build(inf->lencnt, inf->lensym, inf->lengths, inf->hlit) < 0 ||
+                         inf_build(inf->distcnt, inf->distsym, &inf->lengths[inf->hlit], inf->hdist) < 0 )
+                    {
+                        inf->state = I_ERROR;
+                        break;
+                    }
+                    inf->state = I_CODES;
+                    break;
+                }
+                value = inf_decode(inf, inf->distcnt, inf->distsym, &p, end);
+                if ( value == MORE )
+                    goto suspend;
+                if ( value == BAD || (value == 16 && inf->count == 0) )
+                {
+                    inf->state = I_ERROR;
+                    break;
+                }
+                if ( value < 16 )
+                {
+                    inf->lengths[inf->count++] = (uint8_t) value;
+                    break;
+                }
+                inf->symbol = value;
+                inf->state = I_CODELENS_EXTRA;
+                break;
+
+            case I_CODELENS_EXTRA:
+                i = (inf->symbol == 16) ? 2 : ((inf->symbol == 17) ? 3 : 7);
+                if ( !inf_need(inf, i, &p, end) )
+                    goto suspend;
+                value = inf_bits(inf, i) + ((inf->symbol == 18) ? 11 : 3);
+                if ( (inf->count + value) > (inf->hlit + inf->hdist) )
+                {
+                    inf->state = I_ERROR;
+                    break;
+                }
+                i = (inf->symbol == 16) ? inf->lengths[inf->count - 1] : 0;
+                while ( value-- )
+                    inf->lengths[inf->count++] = (uint8_t) i;
+                inf->state = I_CODELENS;
+                break;
+
+            /* Compressed data
+             */
+            case I_CODES:
+                value = inf_decode(inf, inf->lencnt, inf->lensym, &p, end);
+                if ( value == MORE )
+                    goto suspend;
+                if ( value < 256 && value >= 0 )
+                {
+                    inf_emit(inf, (uint8_t) value);
+                }
+                else if ( value == 256 )
+                {
+                    inf->state = inf->final ? I_TRAILER : I_BLOCK;
+                }
+                else if ( value > 256 && value < 286 )
+                {
+                    inf->symbol = value - 257;
+                    inf->state = I_LENGTH_EXTRA;
+                }
+                else
+                {
+                    inf->state = I_ERROR;
+                }
+                break;
+
+            case I_LENGTH_EXTRA:
+                if ( !inf_need(inf, length_extra[inf->symbol], &p, end) )
+                    goto suspend;
+                inf->length = length_base[inf->symbol] + inf_bits(inf, length_extra[inf->symbol]);
+                inf->state = I_DISTANCE;
+                break;
+
+            case I_DISTANCE:
+                value = inf_decode(inf, inf->distcnt, inf->distsym, &p, end);
+                if ( value == MORE )
+                    goto suspend;
+                if ( value < 0 || value > 29 )
+                {
+                    inf->state = I_ERROR;
+                    break;
+                }
+                inf->symbol = value;
+                inf->state = I_DISTANCE_EXTRA;
+                break;
+
+            case I_DISTANCE_EXTRA:
+                if ( !inf_need(inf, distance_extra[inf->symbol], &p, end) )
+                    goto suspend;
+                size = distance_base[inf->symbol] + inf_bits(inf, distance_extra[inf->symbol]);
+                inf->state = inf_copy(inf, size) ? I_CODES : I_ERROR;
+                break;
+
+            /* Adler-32 check value, byte aligned after the last block, not verified
+             */
+            case I_TRAILER:
+                inf_bits(inf, inf->bitcnt);
+                while ( inf->count < 4 && p < end )
+                {
+                    p++;
+                    inf->count++;
+                }
+                if ( inf->count < 4 )
+                    goto suspend;
+                inf->state = I_DONE;
+                break;
+
+            default:
+                inf->state = I_ERROR;
+        }
+
+        if ( inf->state == I_TRAILER )
+            inf->count = 0;
+    }
+
+suspend:
+    inf_flush(inf);
+
+    inf->total_in += (p - data);
+    *consumed = p - data;
+
+    if ( inf->state == I_ERROR )
+        return INFLATE_ERROR;
+
+    if ( inf->state == I_DONE )
+        return INFLATE_DONE;
+
+    return INFLATE_OK;
+}
+
+/*------------------------------------------------
+ * inflate_end()
+ *
+ *  Release the decompressor's window.
+ *
+ * param:  Pointer to decompressor
+ * return: none
+ *
+ */
+void inflate_end(inflate_t *inf)
+{
+    if ( inf->window )
+        free(inf->window);
+
+    inf->window = NULL;
+}
+
+/*------------------------------------------------
+ * inf_need()
+ *
+ *  Make sure a number of bits is available, pulling input one byte at a time.
+ *
+ * param:  Pointer to decompressor, bit count, pointer to input pointer and input end
+ * return: '1' bits are available, '0' input ran out
+ *
+ */
+static int inf_need(inflate_t *inf, int bits, const uint8_t **p, const uint8_t *end)
+{
+    while ( inf->bitcnt < bits )
+    {
+        if ( *p == end )
+            return 0;
+
+        inf->bitbuf |= (uint32_t)(*(*p)++) << inf->bitcnt;
+        inf->bitcnt += 8;
+    }
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * inf_bits()
+ *
+ *  Consume bits from the bit buffer, least significant bit first.
+ *
+ * param:  Pointer to decompressor, bit count up to 16
+ * return: Bits value
+ *
+ */
+static int inf_bits(inflate_t *inf, int bits)
+{
+    int     value;
+
+    value = (int)(inf->bitbuf & ((1UL << bits) - 1));
+    inf->bitbuf >>= bits;
+    inf->bitcnt -= bits;
+
+    return value;
+}
+
+/*------------------------------------------------
+ * inf_decode()
+ *
+ *  Decode a Huffman coded symbol. The code is read from the bit buffer without
+ *  consuming it until it is complete, one more input byte is pulled in
+ *  each time the available bits do not make a complete code.
+ *
+ * param:  Pointer to decompressor, code counts per length and symbols,
+ *         pointer to input pointer and input end
+ * return: Symbol, MORE if input ran out or BAD for an invalid code
+ *
+ */
+static int inf_decode(inflate_t *inf, const uint16_t *count, const uint16_t *symbol,
+                      const uint8_t **p, const uint8_t *end)
+{
+    int         len, code, first, index;
+    uint32_t    bits;
+
+    while ( 1 )
+    {
+        bits = inf->bitbuf;
+        code = first = index = 0;
+
+        for ( len = 1; len <= 15 && len <= inf->bitcnt; len++ )
+        {
+            code |= (int)(bits & 1);
+            bits >>= 1;
+
+            if ( (code - (int) count[len]) < first )
+            {
+                inf_bits(inf, len);
+                return symbol[index + (code - first)];
+            }
+
+            index += count[len];
+            first += count[len];
+            first <<= 1;
+            code <<= 1;
+        }
+
+        if ( len > 15 )
+            return BAD;
+
+        if ( !inf_need(inf, inf->bitcnt + 1, p, end) )
+            return MORE;
+    }
+}
+
+/*------------------------------------------------
+ * inf_build()
+ *
+ *  Build canonical Huffman code counts and symbol list from code lengths.
+ *
+ * param:  Count and symbol output arrays, code lengths and number of symbols
+ * return: '0' complete code, positive for an incomplete code, negative for an over-subscribed code
+ *
+ */
+static int inf_build(uint16_t *count, uint16_t *symbol, const uint8_t *lengths, int n)
+{
+    int         sym, len, left;
+    uint16_t    offs[16];
+
+    memset(count, 0, 16 * sizeof(uint16_t));
+
+    for ( sym = 0; sym < n; sym++ )
+        count[lengths[sym]]++;
+
+    if ( count[0] == n )
+        return 0;
+
+    left = 1;
+    for ( len = 1; len < 16; len++ )
+    {
+        left <<= 1;
+        left -= count[len];
+        if ( left < 0 )
+            return left;
+    }
+
+    offs[1] = 0;
+    for ( len = 1; len < 15; len++ )
+        offs[len + 1] = offs[len] + count[len];
+
+    for ( sym = 0; sym < n; sym++ )
+        if ( lengths[sym] != 0 )
+            symbol[offs[lengths[sym]]++] = sym;
+
+    return left;
+}
+
+/*------------------------------------------------
+ * inf_fixed()
+ *
+ *  Build the fixed Huffman codes of block type 1.
+ *
+ * param:  Pointer to decompressor
+ * return: none
+ *
+ */
+static void inf_fixed(inflate_t *inf)
+{
+    int     sym;
+
+    for ( sym = 0; sym < 144; sym++ )
+        inf->lengths[sym] = 8;
+    for ( ; sym < 256; sym++ )
+        inf->lengths[sym] = 9;
+    for ( ; sym < 280; sym++ )
+        inf->lengths[sym] = 7;
+    for ( ; sym < 288; sym++ )
+        inf->lengths[sym] = 8;
+    inf_build(inf->lencnt, inf->lensym, inf->lengths, 288);
+
+    for ( sym = 0; sym < 30; sym++ )
+        inf->lengths[sym] = 5;
+    inf_build(inf->distcnt, inf->distsym, inf->lengths, 30);
+}
+
+/*------------------------------------------------
+ * inf_emit()
+ *
+ *  Output a byte and add it to the history window.
+ *
+ * param:  Pointer to decompressor, byte
+ * return: none
+ *
+ */
+static void inf_emit(inflate_t *inf, uint8_t c)
+{
+    inf->window[inf->wpos] = c;
+    inf->wpos = (inf->wpos + 1) & inf->wmask;
+    inf->total_out++;
+
+    inf->out[inf->out_len++] = c;
+    if ( inf->out_len == INFLATE_OUT )
+        inf_flush(inf);
+}
+
+/*------------------------------------------------
+ * inf_copy()
+ *
+ *  Copy a match from the history window.
+ *
+ * param:  Pointer to decompressor, match distance, match length is in 'length'
+ * return: '1' copied, '0' distance beyond the window or data so far
+ *
+ */
+static int inf_copy(inflate_t *inf, uint16_t distance)
+{
+    uint16_t    from;
+
+    if ( distance > (uint16_t)(inf->wmask + 1) || distance > inf->total_out )
+        return 0;
+
+    from = (inf->wpos - distance) & inf->wmask;
+
+    while ( inf->length-- )
+    {
+        inf_emit(inf, inf->window[from]);
+        from = (from + 1) & inf->wmask;
+    }
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * inf_flush()
+ *
+ *  Pass buffered output to the output function.
+ *
+ * param:  Pointer to decompressor
+ * return: none
+ *
+ */
+static void inf_flush(inflate_t *inf)
+{
+    if ( inf->out_len && inf->output )
+        inf->output(inf->context, inf->out, inf->out_len);
+
+    inf->out_len = 0;
+}
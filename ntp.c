@@ -14,6 +14,8 @@
 #include    <dos.h>
 #include    <time.h>
 #include    <signal.h>
+#include    <math.h>
+#include    <i86.h>
 
 #include    "ip/netif.h"
 #include    "ip/stack.h"
@@ -24,21 +26,28 @@
 
 #include    "ip/slip.h"     // TODO for slip_close(), remove once this is in a stack_close() call
 
+#include    "hrtimer.h"
+#include    "slew.h"
+
 /* -----------------------------------------
    definitions
 ----------------------------------------- */
 #define     VERSION                 "v1.0"
-#define     USAGE                   "Usage: ntp [-u | -h | -V]"
-#define     HELP                    USAGE                           \
-                                    "\n"                            \
-                                    "-V     Version information\n"  \
-                                    "-u     Update system clock\n"  \
+#define     USAGE                   "Usage: ntp [-u | -d] [-b <count>] [server ...] | -h | -V"
+#define     HELP                    USAGE                                   \
+                                    "\n"                                    \
+                                    "-V     Version information\n"          \
+                                    "-u     Update system clock\n"          \
+                                    "-d     Discipline clock through NTPSLEW\n" \
+                                    "-b     Burst of 4 to 8 requests\n"     \
+                                    "server Names or addresses, overrides NTP\n" \
                                     "-h     Help\n"
 
 // NTP
 #define     NTP_STATE_REQUEST       1               // send a request
 #define     NTP_STATE_WAIT_RESP     2               // wait for a response
 #define     NTP_STATE_COMPLETE      3               // response received and processed
+#define     NTP_STATE_PAUSE         4               // wait before the next request of a burst
 
 #define     NTP_PORT                123             // NTP port number
 #define     NTP_MINPOLL             4               // minimum poll exponent (16 s)
@@ -49,6 +58,20 @@
 #define     NTP_MAXSTRAT            16              // maximum stratum number
 #define     NTP_REQUEST_INTERVAL    5000            // mSec between repeat requests
 #define     NTP_RETRY_COUNT         3               // max retries
+#define     NTP_PHI                 15e-6           // frequency tolerance (15 ppm)
+#define     NTP_FILTER              8               // clock filter stages
+#define     NTP_BURST_MIN           4               // burst request count range
+#define     NTP_BURST_MAX           NTP_FILTER
+#define     NTP_BURST_INTERVAL      2000            // mSec between requests of a burst
+#define     NTP_STEPT               0.128           // step threshold (s), smaller offsets are slewed
+#define     NTP_MAXFREQ             500.0           // frequency correction limit (ppm)
+#define     NTP_FLL_GAIN            0.5             // part of the measured frequency error applied per update
+#define     NTP_DRIFT_MIN           900             // shortest interval (s) to estimate the frequency over
+#define     NTP_DRIFT_FILE          "NTP.DRF"       // default drift file, NTPDRIFT environment variable overrides
+#define     NTP_MINCLOCK            3               // minimum survivors kept by the cluster algorithm
+#define     NTP_MAXPEERS            8               // servers queried at once
+#define     NTP_STAGGER             250             // mSec between the first requests to each server
+#define     NTP_TICK_PRECISION      -4              // log2 of the 55 mSec DOS clock tick, without the PIT counter
 
 #define     NTP_LI_NONE             0x00            // NTP Leap Second indicator (b7..b6)
 #define     NTP_LI_ADD_SEC          0x40
@@ -69,10 +92,13 @@
 
 #define     DIFF_SEC_1900_1970      (2208988800UL)  // number of seconds between 1900 and 1970 (MSB=1)
 #define     DIFF_SEC_1970_2036      (2085978496UL)  // number of seconds between 1970 and Feb 7, 2036 (6:28:16 UTC) (MSB=0)
+#define     NTP_FRACTION            4294967296.0    // NTP time stamp fraction units per second
+#define     BIOS_TICK_COUNTS        65536.0         // PIT counts per BIOS clock tick
+#define     LOG2D(a)                ldexp(1.0, (a)) // seconds of a log2 precision
 
 #define     MY_PORT                 (30000+NTP_PORT)
 
-#define     NAME_LIST_LEN           2               // Get only first two resolutions
+#define     NAME_LIST_LEN           NTP_MAXPEERS    // Resolutions per server name, all A records are queried
 
 /* -----------------------------------------
    types and data structures
@@ -100,6 +126,43 @@ struct ntp_date_t
     uint32_t    eraFraction3;
 };
 
+// Clock filter sample
+struct ntp_sample_t
+{
+    double      offset;         // seconds
+    double      delay;
+    double      dispersion;
+    uint32_t    stamp;          // arrival time stamp, for aging the dispersion
+};
+
+// Server state, clock filter and selection results
+struct ntp_peer_t
+{
+    ip4_addr_t              address;
+    int                     state;
+    int                     requests;       // requests left, including ones that may be lost
+    uint32_t                last_request;
+    struct ntp_timestamp_t  t1;             // transmit time of the outstanding request
+    struct ntp_sample_t     filter[NTP_FILTER];
+    int                     samples;
+    uint8_t                 stratum;
+    double                  rootdelay;      // server's delay and dispersion to its reference clock
+    double                  rootdisp;
+    double                  offset;
+    double                  delay;
+    double                  dispersion;
+    double                  jitter;
+    double                  distance;       // root distance, the bound on the peer's error
+    char                    tally;          // 'x' falseticker, '-' outlier, '+' survivor, '*' system peer
+};
+
+// Selection interval edge
+struct ntp_edge_t
+{
+    double      value;
+    int         type;           // -1 low, 0 midpoint, +1 high
+};
+
 struct ntp_t
 {
     uint8_t                 flagsMode;
@@ -119,35 +182,624 @@ struct ntp_t
    globals
 ----------------------------------------- */
 struct udp_pcb_t   *ntp;
-ip4_addr_t          ntp_server_address;
-int                 ntp_request_state = NTP_STATE_REQUEST;
 int                 dos_time_update = 0;
 char                ip[16] = {0};
+int8_t              precision = NTP_TICK_PRECISION;
+
+// Local clock, time stamps are converted to clock time relative to a reference
+uint32_t            clock_base;     // NTP seconds of local midnight on the reference date
+double              clock_ref;      // seconds from midnight to the reference time stamp
+uint32_t            ref_stamp;      // reference time stamp
+
+// Servers and the combined results of the survivors
+struct ntp_peer_t   peers[NTP_MAXPEERS];
+int                 peer_count = 0;
+struct ntp_peer_t  *sys_peer = NULL;
+int                 burst = 1;
+double              ntp_offset;     // server clock minus local clock in seconds
+double              ntp_delay;      // round trip delay in seconds
+double              ntp_dispersion;
+double              ntp_jitter;
+
+// Clock discipline
+int                 discipline = 0;
+slew_t __far       *resident = NULL;
 
 char                    env_var[256];
 size_t                  env_var_len;
-struct dns_resolution_t ntp_host_resolution;
+char                   *server_names[NTP_MAXPEERS];
+int                     name_count = 0;
 struct hostent_t        host_entity[NAME_LIST_LEN];
 dns_result_t            dns_result;
 
+/*------------------------------------------------
+ * ntp_clock_init()
+ *
+ *  Tie high resolution time stamps to the DOS clock.
+ *  The DOS date and BIOS tick count give local midnight and the time since,
+ *  and mktime() converts local midnight to UTC with the TZ time zone.
+ *  The date is read again to catch midnight passing in between.
+ *
+ * param:  none
+ * return: none
+ *
+ */
+void ntp_clock_init(void)
+{
+    struct dosdate_t    date, check;
+    struct tm           tmbuf;
+    uint32_t            ticks;
+    uint16_t            count;
+
+    do
+    {
+        _dos_getdate(&date);
+        ref_stamp = hrt_tod(&ticks, &count);
+        _dos_getdate(&check);
+    } while ( date.day != check.day );
+
+    memset(&tmbuf, 0, sizeof(tmbuf));
+    tmbuf.tm_year = date.year - 1900;
+    tmbuf.tm_mon = date.month - 1;
+    tmbuf.tm_mday = date.day;
+    tmbuf.tm_isdst = -1;
+
+    clock_base = (uint32_t) mktime(&tmbuf) + DIFF_SEC_1900_1970;
+    clock_ref = ((double) ticks * BIOS_TICK_COUNTS + count) / HRT_HZ;
+}
+
+/*------------------------------------------------
+ * ntp_local_time()
+ *
+ *  Convert a time stamp to an NTP time stamp of the local clock.
+ *
+ * param:  time stamp taken after ntp_clock_init(), pointer to NTP time stamp
+ * return: none
+ *
+ */
+void ntp_local_time(uint32_t stamp, struct ntp_timestamp_t *ts)
+{
+    double      seconds, whole;
+
+    seconds = clock_ref + (double)(stamp - ref_stamp) / HRT_HZ;
+    whole = floor(seconds);
+
+    ts->seconds = clock_base + (uint32_t) whole;
+    ts->fraction = (uint32_t)((seconds - whole) * NTP_FRACTION);
+}
+
+/*------------------------------------------------
+ * ntp_diff()
+ *
+ *  Difference between two NTP time stamps.
+ *  Seconds are subtracted as 32 bit numbers, so the result is correct
+ *  across an era boundary as long as the time stamps are within 68 years.
+ *
+ * param:  pointers to time stamps 'a' and 'b' in host byte order
+ * return: a - b in seconds
+ *
+ */
+double ntp_diff(struct ntp_timestamp_t *a, struct ntp_timestamp_t *b)
+{
+    return (double)(int32_t)(a->seconds - b->seconds) +
+           ((double) a->fraction - (double) b->fraction) / NTP_FRACTION;
+}
+
+/*------------------------------------------------
+ * ntp_time_t()
+ *
+ *  Convert NTP time stamp seconds to Unix time.
+ *  If the MSB is 0 the time stamp is in the era starting 2036.
+ *
+ * param:  NTP seconds in host byte order
+ * return: Unix time
+ *
+ */
+time_t ntp_time_t(uint32_t seconds)
+{
+    if ( seconds & 0x80000000 )
+        return (time_t)(seconds - DIFF_SEC_1900_1970);
+
+    return (time_t)(seconds + DIFF_SEC_1970_2036);
+}
+
+/*------------------------------------------------
+ * ntp_set_clock()
+ *
+ *  Set the DOS date and time to the local clock corrected by an offset.
+ *  The time is set with hundredths of a second through DOS, and then the
+ *  BIOS tick count is set directly, rounded to the nearest tick, from a
+ *  fresh time stamp, so the clock is not off by DOS's conversion or by
+ *  the time taken to set it.
+ *
+ * param:  offset to add in seconds
+ * return: none
+ *
+ */
+void ntp_set_clock(double offset)
+{
+    struct ntp_timestamp_t  now;
+    struct dosdate_t        date;
+    struct dostime_t        time;
+    struct tm               tmbuf;
+    union REGS              regs;
+    time_t                  time_of_day;
+    uint32_t                stamp, ticks;
+    double                  seconds, whole;
+
+    stamp = hrt_read();
+    ntp_local_time(stamp, &now);
+
+    seconds = (double) now.fraction / NTP_FRACTION + offset;
+    whole = floor(seconds);
+    seconds -= whole;
+    time_of_day = ntp_time_t(now.seconds) + (time_t) whole;
+
+    _localtime(&time_of_day, &tmbuf);
+    date.year = tmbuf.tm_year + 1900;
+    date.month = tmbuf.tm_mon + 1;
+    date.day = tmbuf.tm_mday;
+    date.dayofweek = tmbuf.tm_wday;
+    time.hour = tmbuf.tm_hour;
+    time.minute = tmbuf.tm_min;
+    time.second = tmbuf.tm_sec;
+    time.hsecond = (uint8_t)(seconds * 100.0);
+    _dos_setdate(&date);
+    _dos_settime(&time);
+
+    /* Seconds since midnight at this moment, and the BIOS
+     * tick count for them, through INT 1A function 01h
+     */
+    seconds += (double)(tmbuf.tm_hour * 3600L + tmbuf.tm_min * 60 + tmbuf.tm_sec) +
+               (double)(hrt_read() - stamp) / HRT_HZ;
+    ticks = (uint32_t)(seconds * HRT_HZ / BIOS_TICK_COUNTS + 0.5);
+
+    regs.h.ah = 0x01;
+    regs.w.cx = (uint16_t)(ticks >> 16);
+    regs.w.dx = (uint16_t) ticks;
+    int86(0x1a, &regs, &regs);
+}
+
+/*------------------------------------------------
+ * ntp_clock_filter()
+ *
+ *  Select the best sample, as the RFC 5905 clock filter does.
+ *  Sample dispersions grow at NTP_PHI since they were taken, and the samples
+ *  are sorted by delay. The lowest delay sample is the one least affected by
+ *  queuing on the link, and gives the offset and delay. The dispersion is
+ *  the sum of the sorted dispersions weighted by powers of 1/2, and the
+ *  jitter is the RMS of the offset differences from the selected sample.
+ *  The root distance bounds the peer's error for selection.
+ *
+ * param:  pointer to a peer with samples
+ * return: none
+ *
+ */
+void ntp_clock_filter(struct ntp_peer_t *peer)
+{
+    struct ntp_sample_t sorted[NTP_FILTER], swap;
+    uint32_t            now;
+    double              weight, sum;
+    int                 i, j;
+
+    now = hrt_read();
+
+    for ( i = 0; i < peer->samples; i++ )
+    {
+        sorted[i] = peer->filter[i];
+        sorted[i].dispersion += NTP_PHI * (double)(now - peer->filter[i].stamp) / HRT_HZ;
+    }
+
+    for ( i = 1; i < peer->samples; i++ )
+    {
+        for ( j = i; j > 0 && sorted[j].delay < sorted[j - 1].delay; j-- )
+        {
+            swap = sorted[j];
+            sorted[j] = sorted[j - 1];
+            sorted[j - 1] = swap;
+        }
+    }
+
+    peer->offset = sorted[0].offset;
+    peer->delay = sorted[0].delay;
+
+    /* Stages that were not filled count with the maximum dispersion
+     */
+    peer->dispersion = 0.0;
+    for ( i = 0, weight = 0.5; i < NTP_FILTER; i++, weight /= 2.0 )
+        peer->dispersion += weight * ((i < peer->samples) ? sorted[i].dispersion : NTP_MAXDISP);
+
+    sum = 0.0;
+    for ( i = 1; i < peer->samples; i++ )
+        sum += (sorted[i].offset - peer->offset) * (sorted[i].offset - peer->offset);
+
+    peer->jitter = (peer->samples > 1) ? sqrt(sum / (peer->samples - 1)) : 0.0;
+    if ( peer->jitter < LOG2D(precision) )
+        peer->jitter = LOG2D(precision);
+
+    /* The root distance uses the selected sample's own dispersion,
+     * so a short burst is not rejected for the stages it did not fill
+     */
+    peer->distance = (peer->rootdelay + peer->delay) / 2.0 + peer->rootdisp + sorted[0].dispersion + peer->jitter;
+    if ( peer->distance < NTP_MINDISP )
+        peer->distance = NTP_MINDISP;
+}
+
+/*------------------------------------------------
+ * ntp_select()
+ *
+ *  Combine the servers' clock filter results, as the RFC 5905 selection,
+ *  cluster and combine algorithms do.
+ *  Each server's offset is bounded by its root distance. The intersection
+ *  algorithm finds the smallest interval that holds the midpoints of all but
+ *  a minority of the servers, and servers with their offset outside it are
+ *  falsetickers. The cluster algorithm then drops the survivor furthest from
+ *  the others, while that spread is larger than the best server's own jitter,
+ *  down to NTP_MINCLOCK survivors. The offset is the average of the survivors
+ *  weighted by the inverse of their root distance, and the system peer, the
+ *  survivor with the lowest stratum and distance, gives the delay and
+ *  dispersion.
+ *
+ * param:  none
+ * return: number of survivors, '0' if no majority agrees
+ *
+ */
+int ntp_select(void)
+{
+    struct ntp_peer_t  *cand[NTP_MAXPEERS], *peer;
+    struct ntp_edge_t   edge[3 * NTP_MAXPEERS], swap;
+    double              low, high, weight, sum, jitter, max_jitter, min_jitter;
+    int                 n, m, i, j, allow, found, chime, worst;
+
+    sys_peer = NULL;
+
+    for ( i = 0, n = 0; i < peer_count; i++ )
+    {
+        peer = &peers[i];
+        peer->tally = ' ';
+        if ( peer->samples == 0 )
+            continue;
+
+        ntp_clock_filter(peer);
+        if ( peer->distance < NTP_MAXDIST )
+            cand[n++] = peer;
+    }
+
+    if ( n == 0 )
+        return 0;
+
+    for ( i = 0, m = 0; i < n; i++ )
+    {
+        edge[m].value = cand[i]->offset - cand[i]->distance;
+        edge[m++].type = -1;
+        edge[m].value = cand[i]->offset;
+        edge[m++].type = 0;
+        edge[m].value = cand[i]->offset + cand[i]->distance;
+        edge[m++].type = 1;
+    }
+
+    for ( i = 1; i < m; i++ )
+    {
+        for ( j = i; j > 0 && edge[j].value < edge[j - 1].value; j-- )
+        {
+            swap = edge[j];
+            edge[j] = edge[j - 1];
+            edge[j - 1] = swap;
+        }
+    }
+
+    /* Allow for more falsetickers until an intersection
+     * holds the midpoints of all the others
+     */
+    for ( allow = 0; 2 * allow < n; allow++ )
+    {
+        low = NTP_MAXDISP;
+        high = -NTP_MAXDISP;
+
+        found = 0;
+        chime = 0;
+        for ( i = 0; i < m; i++ )
+        {
+            chime -= edge[i].type;
+            if ( chime >= n - allow )
+            {
+                low = edge[i].value;
+                break;
+            }
+            if ( edge[i].type == 0 )
+                found++;
+        }
+
+        chime = 0;
+        for ( i = m - 1; i >= 0; i-- )
+        {
+            chime += edge[i].type;
+            if ( chime >= n - allow )
+            {
+                high = edge[i].value;
+                break;
+            }
+            if ( edge[i].type == 0 )
+                found++;
+        }
+
+        if ( found <= allow && low < high )
+            break;
+    }
+
+    if ( 2 * allow >= n )
+    {
+        for ( i = 0; i < n; i++ )
+            cand[i]->tally = 'x';
+        return 0;
+    }
+
+    for ( i = 0, j = 0; i < n; i++ )
+    {
+        if ( cand[i]->offset < low || cand[i]->offset > high )
+            cand[i]->tally = 'x';
+        else
+            cand[j++] = cand[i];
+    }
+    n = j;
+
+    /* Order the survivors by stratum and distance
+     */
+    for ( i = 1; i < n; i++ )
+    {
+        for ( j = i; j > 0 &&
+              (cand[j]->stratum * NTP_MAXDIST + cand[j]->distance) <
+              (cand[j - 1]->stratum * NTP_MAXDIST + cand[j - 1]->distance); j-- )
+        {
+            peer = cand[j];
+            cand[j] = cand[j - 1];
+            cand[j - 1] = peer;
+        }
+    }
+
+    while ( n > NTP_MINCLOCK )
+    {
+        max_jitter = 0.0;
+        min_jitter = NTP_MAXDISP;
+        worst = 0;
+
+        for ( i = 0; i < n; i++ )
+        {
+            sum = 0.0;
+            for ( j = 0; j < n; j++ )
+                sum += (cand[i]->offset - cand[j]->offset) * (cand[i]->offset - cand[j]->offset);
+
+            jitter = sqrt(sum / (n - 1));
+            if ( jitter > max_jitter )
+            {
+                max_jitter = jitter;
+                worst = i;
+            }
+            if ( cand[i]->jitter < min_jitter )
+                min_jitter = cand[i]->jitter;
+        }
+
+        if ( max_jitter <= min_jitter )
+            break;
+
+        cand[worst]->tally = '-';
+        for ( i = worst; i < (n - 1); i++ )
+            cand[i] = cand[i + 1];
+        n--;
+    }
+
+    sum = 0.0;
+    ntp_offset = 0.0;
+    for ( i = 0; i < n; i++ )
+    {
+        weight = 1.0 / cand[i]->distance;
+        sum += weight;
+        ntp_offset += weight * cand[i]->offset;
+        cand[i]->tally = '+';
+    }
+    ntp_offset /= sum;
+
+    jitter = 0.0;
+    for ( i = 0; i < n; i++ )
+        jitter += (cand[i]->offset - ntp_offset) * (cand[i]->offset - ntp_offset) / cand[i]->distance;
+    jitter /= sum;
+
+    sys_peer = cand[0];
+    sys_peer->tally = '*';
+    ntp_delay = sys_peer->delay;
+    ntp_dispersion = sys_peer->dispersion;
+    ntp_jitter = sqrt(sys_peer->jitter * sys_peer->jitter + jitter);
+
+    return n;
+}
+
+/*------------------------------------------------
+ * ntp_add_peer()
+ *
+ *  Add a server address to query, once.
+ *
+ * param:  server IP address
+ * return: none
+ *
+ */
+void ntp_add_peer(ip4_addr_t address)
+{
+    int     i;
+
+    for ( i = 0; i < peer_count; i++ )
+        if ( peers[i].address == address )
+            return;
+
+    if ( peer_count == NTP_MAXPEERS )
+    {
+        printf("Too many NTP servers, using first %d\n", NTP_MAXPEERS);
+        return;
+    }
+
+    memset(&peers[peer_count], 0, sizeof(struct ntp_peer_t));
+    peers[peer_count].address = address;
+    peer_count++;
+}
+
+/*------------------------------------------------
+ * ntp_add_server()
+ *
+ *  Add a server by IP address or by name,
+ *  with every A record the name resolves to.
+ *
+ * param:  server name or IP address
+ * return: none
+ *
+ */
+void ntp_add_server(char *name)
+{
+    struct dns_resolution_t ntp_host_resolution;
+    ip4_addr_t              address;
+    int                     i;
+
+    if ( stack_ip4addr_aton(name, &address) )
+    {
+        ntp_add_peer(address);
+        return;
+    }
+
+    memset(host_entity, 0, sizeof(host_entity));
+    ntp_host_resolution.h_list_len = NAME_LIST_LEN;
+    ntp_host_resolution.h_error = DNS_NOT_SET;
+    ntp_host_resolution.h_info_list = host_entity;
+
+    dns_result = dnsresolve_gethostbyname(name, &ntp_host_resolution);
+    if ( dns_result == DNS_OK || dns_result == DNS_LIST_TRUNC )
+    {
+        for ( i = 0; i < ntp_host_resolution.h_list_len; i ++ )
+        {
+            if ( host_entity[i].h_type == T_A &&
+                 stack_ip4addr_aton(host_entity[i].h_aliases, &address) )
+                ntp_add_peer(address);
+        }
+    }
+    else
+    {
+        printf("Could not resolve NTP host %s (DNS error %d)\n", name, dns_result);
+    }
+}
+
+/*------------------------------------------------
+ * ntp_discipline()
+ *
+ *  Correct the clock through the resident slewer.
+ *  The drift file holds the frequency correction in ppm and the NTP time
+ *  of the last synchronization. If the slewer ran since then, which it
+ *  confirms by holding the same synchronization time, the clock ran with that
+ *  correction and the offset now is its remaining error over the interval,
+ *  so the correction is moved by part of that error. Offsets above NTP_STEPT
+ *  step the clock, smaller ones are slewed. A slewer loaded since the last
+ *  synchronization, for example at boot, gets the frequency from the drift
+ *  file, so the clock holds between synchronizations and across reboots.
+ *  Without the slewer (NTPSLEW.EXE) resident the clock is only stepped.
+ *
+ * param:  none
+ * return: none
+ *
+ */
+void ntp_discipline(void)
+{
+    struct ntp_timestamp_t  now;
+    FILE                   *drift;
+    char                   *drift_spec;
+    double                  freq = 0.0, interval;
+    uint32_t                last_sync = 0, sync;
+    int32_t                 phase = 0;
+
+    drift_spec = getenv("NTPDRIFT");
+    if ( drift_spec == NULL )
+        drift_spec = NTP_DRIFT_FILE;
+
+    drift = fopen(drift_spec, "r");
+    if ( drift )
+    {
+        if ( fscanf(drift, "%lf %lu", &freq, &last_sync) != 2 )
+        {
+            freq = 0.0;
+            last_sync = 0;
+        }
+        fclose(drift);
+    }
+
+    resident = slew_find();
+    if ( resident == NULL )
+    {
+        ntp_set_clock(ntp_offset);
+        printf("System time stepped %+.6f s, NTPSLEW is not resident\n", ntp_offset);
+        return;
+    }
+
+    ntp_local_time(hrt_read(), &now);
+    sync = now.seconds + (uint32_t)(int32_t) floor((double) now.fraction / NTP_FRACTION + ntp_offset);
+
+    if ( last_sync != 0 && resident->sync == last_sync )
+    {
+        interval = (double)(int32_t)(sync - last_sync);
+        if ( interval >= NTP_DRIFT_MIN )
+        {
+            freq += NTP_FLL_GAIN * ntp_offset / interval * 1e6;
+            if ( freq > NTP_MAXFREQ )
+                freq = NTP_MAXFREQ;
+            else if ( freq < -NTP_MAXFREQ )
+                freq = -NTP_MAXFREQ;
+        }
+        printf("Slewed %ld tick(s) since loaded\n", resident->adjusted);
+    }
+
+    if ( fabs(ntp_offset) > NTP_STEPT )
+    {
+        ntp_set_clock(ntp_offset);
+        printf("System time stepped %+.6f s\n", ntp_offset);
+    }
+    else
+    {
+        phase = (int32_t)(ntp_offset / SLEW_TICK_SECONDS * SLEW_ONE_TICK);
+        printf("System time slewing %+.6f s\n", ntp_offset);
+    }
+
+    _disable();
+    resident->freq = (int32_t)(freq * 1e-6 * SLEW_ONE_TICK);
+    resident->phase = phase;
+    resident->sync = sync;
+    _enable();
+
+    printf("Frequency correction %+.3f ppm\n", freq);
+
+    drift = fopen(drift_spec, "w");
+    if ( drift )
+    {
+        fprintf(drift, "%.3f %lu\n", freq, sync);
+        fclose(drift);
+    }
+    else
+    {
+        printf("Cannot write drift file '%s'\n", drift_spec);
+    }
+}
+
 /*------------------------------------------------
  * ntp_send_request()
  *
  *  Send and NTP request
  *
- * param:  send a request to NTP server address
+ * param:  pointer to the peer to send a request to
  * return: stack status
  *
  */
-ip4_err_t ntp_send_request(ip4_addr_t ntp_server_address)
+ip4_err_t ntp_send_request(struct ntp_peer_t *peer)
 {
     struct ntp_t    ntpPayload;
     ip4_err_t       result;
 
-    ntpPayload.flagsMode = NTP_LI_UNKNOWN | NTP_VERSION3 | NTP_MODE_CLIENT;
+    ntpPayload.flagsMode = NTP_LI_UNKNOWN | NTP_VERSION4 | NTP_MODE_CLIENT;
     ntpPayload.stratum = 0;
     ntpPayload.poll = 10;
-    ntpPayload.precision = -6;                                      // approx 18mSec (DOS clock tick)
+    ntpPayload.precision = precision;
     ntpPayload.rootDelay.seconds = stack_ntoh(0x0001);
     ntpPayload.rootDelay.fraction = 0;
     ntpPayload.rootDispersion.seconds = stack_ntoh(0x0001);
@@ -162,10 +814,14 @@ ip4_err_t ntp_send_request(ip4_addr_t ntp_server_address)
     ntpPayload.orgTimestamp.fraction = 0;
     ntpPayload.recTimestamp.seconds = 0;
     ntpPayload.recTimestamp.fraction = 0;
-    ntpPayload.xmtTimestamp.seconds = 0;
-    ntpPayload.xmtTimestamp.fraction = 0;
 
-    result = udp_sendto(ntp,(uint8_t*) &ntpPayload, sizeof(struct ntp_t), ntp_server_address, NTP_PORT);
+    /* T1, the server returns it as the origin time stamp
+     */
+    ntp_local_time(hrt_read(), &peer->t1);
+    ntpPayload.xmtTimestamp.seconds = stack_htonl(peer->t1.seconds);
+    ntpPayload.xmtTimestamp.fraction = stack_htonl(peer->t1.fraction);
+
+    result = udp_sendto(ntp,(uint8_t*) &ntpPayload, sizeof(struct ntp_t), peer->address, NTP_PORT);
 
     return result;
 }
@@ -174,6 +830,13 @@ ip4_err_t ntp_send_request(ip4_addr_t ntp_server_address)
  * ntp_response()
  *
  *  Callback to receive NTP server responses and process time information
+ *  The response is checked to answer our request (RFC 5905 section 8), and
+ *  T4 is taken on arrival, so with T1 sent in the request and T2 and T3
+ *  from the server:
+ *      offset = ((T2 - T1) + (T3 - T4)) / 2
+ *      delay  = (T4 - T1) - (T3 - T2)
+ *  The sample is added to the server's clock filter, and the burst
+ *  continues until it has the requested number of samples.
  *
  * param:  pointer to response pbuf, source IP address and source port
  * return: none
@@ -181,48 +844,132 @@ ip4_err_t ntp_send_request(ip4_addr_t ntp_server_address)
  */
 void ntp_response(struct pbuf_t* const p, const ip4_addr_t srcIP, const uint16_t srcPort)
 {
-    struct ntp_t   *ntpResponse;
-    uint32_t        rx_secs, t, us;
-    int             is_1900_based;
+    struct ntp_t           *ntpResponse;
+    struct ntp_sample_t    *sample;
+    struct ntp_peer_t      *peer;
+    struct ntp_timestamp_t  t2, t3, t4;
+    uint32_t                stamp;
+    int                     i;
 
-    time_t              time_of_day;
-    struct dosdate_t    date;
-    struct dostime_t    time;
-    struct tm           tmbuf;
+    stamp = hrt_read();
 
     ntpResponse = (struct ntp_t*) &(p->pbuf[FRAME_HDR_LEN+IP_HDR_LEN+UDP_HDR_LEN]); // crude way to get pointer the NTP response payload
 
-    /* convert NTP time (1900-based) to unix GMT time (1970-based)
-     * if MSB is 0, SNTP time is 2036-based!
+    for ( i = 0; i < peer_count && peers[i].address != srcIP; i++ );
+
+    if ( i == peer_count || peers[i].state != NTP_STATE_WAIT_RESP )
+        return;
+
+    peer = &peers[i];
+
+    /* Drop bogus or replayed responses, and unsynchronized servers
+     */
+    if ( (ntpResponse->flagsMode & 0x07) != NTP_MODE_SERVER ||
+         stack_ntohl(ntpResponse->orgTimestamp.seconds) != peer->t1.seconds ||
+         stack_ntohl(ntpResponse->orgTimestamp.fraction) != peer->t1.fraction ||
+         ntpResponse->xmtTimestamp.seconds == 0 )
+        return;
+
+    if ( (ntpResponse->flagsMode & NTP_LI_UNKNOWN) == NTP_LI_UNKNOWN ||
+         ntpResponse->stratum == 0 || ntpResponse->stratum >= NTP_MAXSTRAT )
+    {
+        stack_ip4addr_ntoa(srcIP, ip, sizeof(ip));
+        printf("NTP server %s is not synchronized (stratum %d)\n", ip, ntpResponse->stratum);
+        return;
+    }
+
+    ntp_local_time(stamp, &t4);
+    t2.seconds = stack_ntohl(ntpResponse->recTimestamp.seconds);
+    t2.fraction = stack_ntohl(ntpResponse->recTimestamp.fraction);
+    t3.seconds = stack_ntohl(ntpResponse->xmtTimestamp.seconds);
+    t3.fraction = stack_ntohl(ntpResponse->xmtTimestamp.fraction);
+
+    sample = &peer->filter[peer->samples++];
+    sample->offset = (ntp_diff(&t2, &peer->t1) + ntp_diff(&t3, &t4)) / 2.0;
+    sample->delay = ntp_diff(&t4, &peer->t1) - ntp_diff(&t3, &t2);
+    sample->dispersion = LOG2D(ntpResponse->precision) + LOG2D(precision) + NTP_PHI * ntp_diff(&t4, &peer->t1);
+    sample->stamp = stamp;
+    peer->stratum = ntpResponse->stratum;
+    peer->rootdelay = stack_ntoh(ntpResponse->rootDelay.seconds) + stack_ntoh(ntpResponse->rootDelay.fraction) / 65536.0;
+    peer->rootdisp = stack_ntoh(ntpResponse->rootDispersion.seconds) + stack_ntoh(ntpResponse->rootDispersion.fraction) / 65536.0;
+
+    if ( burst > 1 )
+    {
+        stack_ip4addr_ntoa(srcIP, ip, sizeof(ip));
+        printf("%s sample %d: offset %+.6f s, delay %.6f s\n", ip, peer->samples, sample->offset, sample->delay);
+    }
+
+    peer->state = (peer->samples < burst) ? NTP_STATE_PAUSE : NTP_STATE_COMPLETE;
+}
+
+/*------------------------------------------------
+ * ntp_peer_poll()
+ *
+ *  Run a server's request state machine.
+ *  A server is complete when its burst has all its samples, or when
+ *  its requests ran out, with or without samples.
+ *
+ * param:  pointer to peer
+ * return: none
+ *
+ */
+void ntp_peer_poll(struct ntp_peer_t *peer)
+{
+    ip4_err_t   result;
+
+    /* Send an NTP request
+     */
+    if ( peer->state == NTP_STATE_REQUEST )
+    {
+        peer->last_request = stack_time();
+        peer->requests--;
+
+        result = ntp_send_request(peer);
+
+        if ( result == ERR_OK ||
+             result == ERR_ARP_QUEUE )
+        {
+            /* Wait for NTP response
+             */
+            peer->state = NTP_STATE_WAIT_RESP;
+        }
+        else
+        {
+            /* NTP server address could not be resolved or was not found,
+             * will not happen with SLIP.
+             */
+            stack_ip4addr_ntoa(peer->address, ip, sizeof(ip));
+            if ( result == ERR_ARP_NONE )
+                printf("Cannot resolve NTP server address %s\n", ip);
+            else
+                printf("NTP server %s error code %d\n", ip, result);
+            peer->state = NTP_STATE_COMPLETE;
+        }
+    }
+
+    /* Wait for NTP response
      */
-    rx_secs = stack_ntohl(ntpResponse->recTimestamp.seconds);
-    //printf("NTP time, net order: %08lx host order: %08lx\n", ntpResponse->recTimestamp.seconds, rx_secs);
-    is_1900_based = ((rx_secs & 0x80000000) != 0);
-    t = is_1900_based ? (rx_secs - DIFF_SEC_1900_1970) : (rx_secs + DIFF_SEC_1970_2036);
-    time_of_day = t;
-
-    us = stack_ntohl(ntpResponse->recTimestamp.fraction) / 4295;
-    //SNTP_SET_SYSTEM_TIME_US(t, us);
-    /* display local time from GMT time */
-    printf("NTP time: %s", ctime(&time_of_day));
-
-    if ( dos_time_update )
-    {
-        _localtime(&time_of_day, &tmbuf);
-        date.year = tmbuf.tm_year+1900;
-        date.month = tmbuf.tm_mon+1;
-        date.day = tmbuf.tm_mday;
-        date.dayofweek = tmbuf.tm_wday;
-        time.hour = tmbuf.tm_hour;
-        time.minute = tmbuf.tm_min;
-        time.second = tmbuf.tm_sec;
-        time.hsecond = 0;
-        _dos_setdate(&date);
-        _dos_settime(&time);
-        printf("System time updated\n");
-    }
-
-    ntp_request_state = NTP_STATE_COMPLETE;
+    else if ( peer->state == NTP_STATE_WAIT_RESP )
+    {
+        if ( (stack_time() - peer->last_request) > NTP_REQUEST_INTERVAL )
+        {
+            if ( peer->requests )
+                peer->state = NTP_STATE_REQUEST;
+            else
+                peer->state = NTP_STATE_COMPLETE;
+        }
+    }
+
+    /* Space out the requests of a burst, and end it
+     * early when the requests that may be lost ran out
+     */
+    else if ( peer->state == NTP_STATE_PAUSE )
+    {
+        if ( peer->requests == 0 )
+            peer->state = NTP_STATE_COMPLETE;
+        else if ( (stack_time() - peer->last_request) > NTP_BURST_INTERVAL )
+            peer->state = NTP_STATE_REQUEST;
+    }
 }
 
 /*------------------------------------------------
@@ -233,13 +980,16 @@ void ntp_response(struct pbuf_t* const p, const ip4_addr_t srcIP, const uint16_t
 int main(int argc, char* argv[])
 {
     int                     i;
-    ip4_err_t               result;
+    time_t                  time_of_day;
+    struct ntp_timestamp_t  now;
     struct net_interface_t *netif;
+    struct ntp_peer_t      *peer;
     int                     linkState;
-    uint32_t                lastNtpRequest;
+    uint32_t                start;
+    char                   *token;
 
     int                     done = 0, dos_exit = 0;
-    int                     ntp_request_count = NTP_RETRY_COUNT;
+    int                     quorum, completed, answered, survivors;
 
     ip4_addr_t              gateway = 0;
     ip4_addr_t              net_mask = 0;
@@ -247,22 +997,39 @@ int main(int argc, char* argv[])
 
     /* parse command line variables
      */
-    if ( argc == 2 )
+    for ( i = 1; i < argc; i++ )
     {
-        if ( strcmp(argv[1], "-V") == 0 )
+        if ( strcmp(argv[i], "-V") == 0 )
         {
             printf("ntp.exe %s %s %s\n", VERSION, __DATE__, __TIME__);
             return 0;
         }
-        else if ( strcmp(argv[1], "-u") == 0 )
+        else if ( strcmp(argv[i], "-u") == 0 )
         {
             dos_time_update = 1;
         }
-        else if ( strcmp(argv[1], "-h") == 0 )
+        else if ( strcmp(argv[i], "-d") == 0 )
+        {
+            discipline = 1;
+        }
+        else if ( strcmp(argv[i], "-b") == 0 && (i + 1) < argc )
+        {
+            i++;
+            burst = atoi(argv[i]);
+            if ( burst < NTP_BURST_MIN )
+                burst = NTP_BURST_MIN;
+            else if ( burst > NTP_BURST_MAX )
+                burst = NTP_BURST_MAX;
+        }
+        else if ( strcmp(argv[i], "-h") == 0 )
         {
             printf("%s\n", HELP);
             return 0;
         }
+        else if ( argv[i][0] != '-' && name_count < NTP_MAXPEERS )
+        {
+            server_names[name_count++] = argv[i];
+        }
         else
         {
             printf("%s\n", USAGE);
@@ -270,42 +1037,35 @@ int main(int argc, char* argv[])
         }
     }
 
-    /* Get and resolve NTP server name or IP address
+    if ( discipline && burst == 1 )
+        burst = NTP_BURST_MIN;
+
+    /* Get and resolve NTP server names or IP addresses, from the
+     * command line or the NTP variable, separated by spaces or commas
      */
-    if ( getenv_s(&env_var_len, env_var, sizeof(env_var), "NTP") == 0 )
+    if ( name_count == 0 && getenv_s(&env_var_len, env_var, sizeof(env_var), "NTP") == 0 )
     {
-        if( !stack_ip4addr_aton(env_var, &ntp_server_address) )
-        {
-            memset(host_entity, 0, sizeof(host_entity));
-            ntp_host_resolution.h_list_len = NAME_LIST_LEN;
-            ntp_host_resolution.h_error = DNS_NOT_SET;
-            ntp_host_resolution.h_info_list = host_entity;
-
-            dns_result = dnsresolve_gethostbyname(env_var, &ntp_host_resolution);
-            if ( dns_result == DNS_OK || DNS_OK == DNS_LIST_TRUNC )
-            {
-                for ( i = 0; i < ntp_host_resolution.h_list_len; i ++ )
-                {
-                    if ( host_entity[i].h_type == T_A )
-                    {
-                        stack_ip4addr_aton(host_entity[i].h_aliases, &ntp_server_address);
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                printf("Could not resolve NTP host %s (DNS error %d)\n", env_var, dns_result);
-                return -1;
-            }
-        }
+        for ( token = strtok(env_var, " ,"); token && name_count < NTP_MAXPEERS; token = strtok(NULL, " ,") )
+            server_names[name_count++] = token;
     }
-    else
+
+    if ( name_count == 0 )
     {
         printf("Missing NTP server name or address\n");
         return -1;
     }
 
+    for ( i = 0; i < name_count; i++ )
+        ntp_add_server(server_names[i]);
+
+    if ( peer_count == 0 )
+        return -1;
+
+    /* All servers are queried at once, their first requests
+     * spaced out so they do not queue behind each other on the link
+     */
+    quorum = peer_count / 2 + 1;
+
     /* Initialize IP stack
      */
     if ( !stack_ip4addr_getenv("GATEWAY", &gateway) ||
@@ -333,6 +1093,10 @@ int main(int argc, char* argv[])
      */
     linkState = interface_link_state(netif);
 
+    if ( hrt_init() )
+        precision = HRT_PRECISION;
+    ntp_clock_init();
+
     /* prepare UDP protocol and initialize for NTP
      */
     udp_init();
@@ -340,7 +1104,14 @@ int main(int argc, char* argv[])
     assert(ntp);
     assert(udp_bind(ntp, local_host, MY_PORT) == ERR_OK);
     assert(udp_recv(ntp, ntp_response) == ERR_OK);
-    lastNtpRequest = 0;
+
+    start = stack_time();
+    for ( i = 0; i < peer_count; i++ )
+    {
+        peers[i].state = NTP_STATE_PAUSE;
+        peers[i].requests = burst + NTP_RETRY_COUNT - 1;
+        peers[i].last_request = start - NTP_BURST_INTERVAL + i * NTP_STAGGER;
+    }
 
     while ( !done && linkState )
     {
@@ -362,66 +1133,74 @@ int main(int argc, char* argv[])
          */
         stack_timers();
 
-        /* Send an NTP request
+        /* Run the servers' requests, and stop when a majority of them
+         * completed their bursts, without waiting for slow ones
          */
-        if ( ntp_request_state == NTP_STATE_REQUEST )
+        completed = 0;
+        answered = 0;
+        for ( i = 0; i < peer_count; i++ )
         {
-            lastNtpRequest = stack_time();
-            ntp_request_count--;
-
-            result = ntp_send_request(ntp_server_address);
-
-            if ( result == ERR_OK ||
-                 result == ERR_ARP_QUEUE )
-            {
-                /* Wait for NTP response
-                 */
-                ntp_request_state = NTP_STATE_WAIT_RESP;
-            }
-            else if ( result == ERR_ARP_NONE )
+            ntp_peer_poll(&peers[i]);
+            if ( peers[i].state == NTP_STATE_COMPLETE )
             {
-                /* NTP server address could not be resolved or was not found.
-                 * Exit with error.
-                 * Will not happen with SLIP.
-                 */
-                printf("Cannot resolve NTP server address\n");
-                dos_exit = 1;
-                done = 1;
-            }
-            else
-            {
-                printf("Error code %d\n", result);
-                dos_exit = 1;
-                done = 1;
+                completed++;
+                if ( peers[i].samples )
+                    answered++;
             }
         }
 
-        /* Wait for NTP response and display NTP time,
-         * optionally update DOS time.
+        if ( answered < quorum && completed < peer_count )
+            continue;
+
+        /* Select and combine the servers' results,
+         * display NTP time and optionally update DOS time.
          */
-        else if ( ntp_request_state == NTP_STATE_WAIT_RESP )
+        survivors = ntp_select();
+
+        for ( i = 0; i < peer_count; i++ )
         {
-            if ( (stack_time() - lastNtpRequest) > NTP_REQUEST_INTERVAL )
-            {
-                if ( ntp_request_count )
-                {
-                    ntp_request_state = NTP_STATE_REQUEST;
-                }
-                else
-                {
-                    printf("No response from NTP server\n");
-                    dos_exit = 1;
-                    done = 1;
-                }
-            }
+            peer = &peers[i];
+            stack_ip4addr_ntoa(peer->address, ip, sizeof(ip));
+            if ( peer->samples )
+                printf("%c%-15s stratum %2d, %d sample(s), offset %+.6f s, delay %.6f s, jitter %.6f s\n",
+                       peer->tally, ip, peer->stratum, peer->samples, peer->offset, peer->delay, peer->jitter);
+            else
+                printf(" %-15s no response\n", ip);
         }
 
-        /* NTP response was received and processed
-         */
+        done = 1;
+
+        if ( answered == 0 )
+        {
+            printf("No response from NTP server\n");
+            dos_exit = 1;
+        }
+        else if ( survivors == 0 )
+        {
+            printf("No majority of NTP servers agree\n");
+            dos_exit = 1;
+        }
         else
         {
+            printf("%d of %d server(s) selected, system peer stratum %d\n", survivors, answered, sys_peer->stratum);
+            printf("offset %+.6f s, delay %.6f s, dispersion %.6f s, jitter %.6f s\n",
+                   ntp_offset, ntp_delay, ntp_dispersion, ntp_jitter);
+
+            ntp_local_time(hrt_read(), &now);
+            time_of_day = ntp_time_t(now.seconds) + (time_t) floor((double) now.fraction / NTP_FRACTION + ntp_offset);
+            printf("NTP time: %s", ctime(&time_of_day));
+
+            if ( discipline )
+            {
+                ntp_discipline();
+            }
+            else if ( dos_time_update )
+            {
+                ntp_set_clock(ntp_offset);
+                printf("System time updated\n");
+            }
+
             dos_exit = 0;
-            done = 1;
         }
     } /* main loop */
 
@@ -0,0 +1,152 @@
+/*
+ *
+ * ntpslew.c
+ *
+ *  Resident clock slewing for the NTP client.
+ *  The BIOS clock advances one tick per timer interrupt, so a clock that runs
+ *  fast or slow is corrected by occasionally removing or adding a tick, from the
+ *  INT 1Ch user timer hook that the BIOS calls after counting the tick.
+ *  A frequency correction keeps the clock in step between synchronizations,
+ *  and an offset is applied gradually, at most 500 ppm, instead of stepping
+ *  the clock. The state is found by 'ntp -d' through an INT 2Fh multiplex
+ *  function, which returns its address so it can be updated in place.
+ *
+ *  This is a separate program so that only the handlers, their state and
+ *  the C start-up code stay resident, not the NTP client and its IP stack.
+ *  It is loaded once, for example from AUTOEXEC.BAT, and does no output
+ *  through the C library, links with a small stack and releases its
+ *  environment before it exits resident with _dos_keep().
+ *
+ */
+
+#include    <conio.h>
+#include    <dos.h>
+#include    <i86.h>
+
+#include    "slew.h"
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     BIOS_TICKS_DAY      0x001800b0UL    // Tick count at midnight, when the BIOS count restarts
+#define     PSP_ENVIRONMENT     0x2c            // PSP offset of the environment segment
+
+/* -----------------------------------------
+   Static prototypes
+----------------------------------------- */
+static void __interrupt __far slew_tick(void);
+static void __interrupt __far slew_mux(union INTPACK);
+
+/* -----------------------------------------
+   Globals
+----------------------------------------- */
+static slew_t   slew = { SLEW_SIGNATURE, 0, 0, 0, 0, 0 };
+static volatile uint32_t __far *bios_ticks = 0;
+
+static void (__interrupt __far *original_int1c)();
+static void (__interrupt __far *original_int2f)();
+
+/*------------------------------------------------
+ * main()
+ *
+ *  Hook INT 1Ch and INT 2Fh and stay resident.
+ *  The hooks are never removed.
+ *
+ */
+int main(int argc, char* argv[])
+{
+    uint16_t __far *environment;
+
+    if ( slew_find() )
+    {
+        cputs("NTPSLEW is already resident\r\n");
+        return 1;
+    }
+
+    bios_ticks = (volatile uint32_t __far*) MK_FP(0x40, 0x6c);
+
+    original_int2f = _dos_getvect(0x2f);
+    _dos_setvect(0x2f, slew_mux);
+
+    original_int1c = _dos_getvect(0x1c);
+    _dos_setvect(0x1c, slew_tick);
+
+    cputs("NTPSLEW resident, run 'ntp -d' to discipline the clock\r\n");
+
+    /* The environment is not needed resident
+     */
+    environment = (uint16_t __far*) MK_FP(_psp, PSP_ENVIRONMENT);
+    _dos_freemem(*environment);
+    *environment = 0;
+
+    /* Keep the program's memory, the size is in the PSP's memory control block
+     */
+    _dos_keep(0, *((uint16_t __far*) MK_FP(_psp - 1, 3)));
+
+    return 0;
+}
+
+/* The handlers run on the stack of whichever program they interrupted,
+ * and stay resident after this program exits, so the compiler's stack
+ * overflow check, which tests against this program's stack, must be off
+ */
+#pragma off (check_stack)
+
+/*------------------------------------------------
+ * slew_tick()
+ *
+ *  INT 1Ch handler, called by the BIOS on every timer tick after
+ *  the tick count was advanced. Ticks are not added or removed right
+ *  at midnight, where the BIOS restarts the count, they wait a tick.
+ *
+ */
+static void __interrupt __far slew_tick(void)
+{
+    int32_t     step;
+
+    step = slew.phase;
+    if ( step > SLEW_MAX_RATE )
+        step = SLEW_MAX_RATE;
+    else if ( step < -SLEW_MAX_RATE )
+        step = -SLEW_MAX_RATE;
+
+    slew.phase -= step;
+    slew.accum += slew.freq + step;
+
+    if ( slew.accum >= SLEW_ONE_TICK && *bios_ticks < (BIOS_TICKS_DAY - 1) )
+    {
+        (*bios_ticks)++;
+        slew.accum -= SLEW_ONE_TICK;
+        slew.adjusted++;
+    }
+    else if ( slew.accum <= -SLEW_ONE_TICK && *bios_ticks > 0 )
+    {
+        (*bios_ticks)--;
+        slew.accum += SLEW_ONE_TICK;
+        slew.adjusted--;
+    }
+
+    _chain_intr(original_int1c);
+}
+
+/*------------------------------------------------
+ * slew_mux()
+ *
+ *  INT 2Fh handler, answers the installation check of SLEW_MUX_ID
+ *  with AL=FFh and the state's address in ES:DI.
+ *
+ */
+static void __interrupt __far slew_mux(union INTPACK r)
+{
+    if ( r.h.ah == SLEW_MUX_ID && r.h.al == 0 )
+    {
+        r.h.al = 0xff;
+        r.w.es = FP_SEG(&slew);
+        r.w.di = FP_OFF(&slew);
+        return;
+    }
+
+    _chain_intr(original_int2f);
+}
+
+#pragma on (check_stack)
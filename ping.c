@@ -13,6 +13,7 @@
 #include    <dos.h>
 #include    <time.h>
 #include    <signal.h>
+#include    <math.h>
 
 #include    "ip/netif.h"
 #include    "ip/stack.h"
@@ -22,16 +23,44 @@
 
 #include    "ip/slip.h"     // TODO for slip_close(), remove once this is in a stack_close() call
 
+#include    "hrtimer.h"
+
 /* -----------------------------------------
    definitions
 ----------------------------------------- */
 #define     VERSION                 "v1.0"
-#define     USAGE                   "ping  [-V] [-c count] [-i interval] destination_ip_address\n"
+#define     USAGE                   "ping  [-V] [-q] [-f] [-M probe] [-l preload] [-c count] [-i interval] [-s size] [-t timeout]\n" \
+                                    "      [-r retries] [-F list_file] destination_ip_address[/prefix] [...]\n"
 
 // PING
 #define     PING_INTERVAL           1000            // interval increments in mSec
 #define     MAX_PING_INTERVAL       30              // maximum of 30sec between PINGs
 #define     WAIT_FOR_PING_RESPONSE  5000            // in mSec
+#define     FLOOD_INTERVAL          10              // flood mode minimum send rate in mSec, in practice one timer tick
+#define     PING_TABLE              64              // outstanding request table, power of 2
+#define     MAX_PRELOAD             (PING_TABLE - 1)
+
+// Payload
+#define     ICMP_HDR_LEN            8
+#define     MAX_PAYLOAD             (1500 - IP_HDR_LEN - ICMP_HDR_LEN)  // largest echo in a 1500 byte SLIP MTU
+#define     MIN_PAYLOAD             4               // the time stamp
+#define     PROBE_TIMEOUT           2000            // path MTU probe reply wait in mSec
+#define     PROBE_TRIES             2               // probes per size before it is considered too big
+#define     TFTP_OVERHEAD           (IP_HDR_LEN + 8 + 4)    // IP, UDP and TFTP DATA headers
+#define     TCP_OVERHEAD            (IP_HDR_LEN + 20)       // IP and TCP headers
+
+// Multi-target sweep
+#define     MAX_TARGETS             512
+#define     TARGET_TABLE            4               // per target request table, power of 2
+#define     SWEEP_IDENT             0x8000          // target identifiers start here, the index is added
+#define     SWEEP_PACE              10              // minimum mSec between requests to any target
+#define     SWEEP_TIMEOUT           1000            // default reply wait in mSec
+#define     SWEEP_RETRIES           2               // extra requests to a target that did not answer
+#define     COUNTS_PER_MSEC         (HRT_HZ / 1000)
+
+// Statistics
+#define     HIST_BUCKETS            13              // RTT histogram, <1mSec then doubling up to >=2048mSec
+#define     HIST_BAR                40              // longest histogram bar
 #define     TEXT_PAYLOAD_LEN        30
 #define     PING_TEXT               "ping from px-xt 8088\0"
 
@@ -41,24 +70,160 @@
 // PING
 struct ping_payload_t
 {
-    uint32_t    time;
-    char        payload[TEXT_PAYLOAD_LEN];
+    uint32_t    time;           // high resolution time stamp
+    uint8_t     data[MAX_PAYLOAD - MIN_PAYLOAD];
 } pingPayload;
 
+// Request table, indexed by sequence number modulo table size
+#define     PING_FREE               0
+#define     PING_SENT               1               // waiting for a reply
+#define     PING_DONE               2               // reply received
+#define     PING_LOST               3               // timed out
+
+struct ping_request_t
+{
+    uint16_t    seq;
+    int         state;
+    int         size;           // payload size sent
+    int         corrupt;        // '1' reply came back with the wrong length or content
+    uint32_t    sent;           // high resolution time stamp
+} pingTable[PING_TABLE];
+
+// Sweep target, with its own sequence numbers and request table
+struct ping_target_t
+{
+    ip4_addr_t  addr;
+    uint16_t    seq;
+    int         sent;           // requests sent
+    int         limit;          // requests to send
+    int         pending;        // '1' a request is waiting for a reply
+    int         finished;       // '1' no more requests
+    uint32_t    last_send;      // high resolution time stamp
+    uint32_t    received;
+    uint32_t    duplicates;
+    uint32_t    rtt_min;        // in uSec
+    uint32_t    rtt_max;
+    uint32_t    rtt_sum;
+    struct ping_request_t request[TARGET_TABLE];
+};
+
 /* -----------------------------------------
    globals
 ----------------------------------------- */
-uint16_t    rxSeq;
 char        ip[17];
-int         ping_count = -1;    // '-1' ping forever, '0' stop ping, >0 remaining PING count
+int         ping_count = -1;    // '-1' ping forever, '0' stop ping, >0 remaining PINGs to send
+int         flood = 0;
+int         outstanding = 0;    // requests waiting for a reply
+uint32_t    transmitted = 0;
+uint32_t    received = 0;
+uint32_t    duplicates = 0;
+int         quiet = 0;
+int         payload_size = MIN_PAYLOAD + TEXT_PAYLOAD_LEN;  // ICMP echo data bytes, including the time stamp
+uint32_t    reply_timeout = WAIT_FOR_PING_RESPONSE;         // in mSec
+uint32_t    corrupted = 0;      // replies with the wrong length or content
+
+// Multi-target sweep
+struct ping_target_t *targets = NULL;
+int         target_count = 0;
+int         sweep = 0;          // '1' sweep mode, more than one target, a range or a list
+int         remaining = 0;      // targets not done yet
+int         next_target = 0;    // round robin send position
+int         retries = SWEEP_RETRIES;
+
+// RTT statistics of replies, in uSec
+uint32_t    rtt_count = 0;
+uint32_t    rtt_min = 0xffffffffUL;
+uint32_t    rtt_max = 0;
+double      rtt_sum = 0.0;
+double      rtt_sum2 = 0.0;
+uint32_t    histogram[HIST_BUCKETS];
+uint32_t    reordered = 0;
+uint16_t    highest_seq = 0;            // highest sequence number answered so far
 int         dos_exit = 0;
 volatile int done = 0;
 
+/*------------------------------------------------
+ * ping_statistics()
+ *
+ *  Add a reply's round trip time to the statistics.
+ *  A reply with a lower sequence number than one already
+ *  answered arrived out of order.
+ *
+ * param:  round trip time in uSec and reply sequence number
+ * return: none
+ *
+ */
+void ping_statistics(uint32_t us, uint16_t rxSeq)
+{
+    uint32_t    limit;
+    int         bucket;
+
+    if ( us < rtt_min )
+        rtt_min = us;
+    if ( us > rtt_max )
+        rtt_max = us;
+
+    rtt_sum += (double) us;
+    rtt_sum2 += (double) us * (double) us;
+
+    for ( bucket = 0, limit = 1000; bucket < (HIST_BUCKETS - 1) && us >= limit; bucket++, limit <<= 1 );
+    histogram[bucket]++;
+
+    if ( rtt_count && (int16_t)(rxSeq - highest_seq) < 0 )
+        reordered++;
+    else
+        highest_seq = rxSeq;
+
+    rtt_count++;
+}
+
+/*------------------------------------------------
+ * ping_verify()
+ *
+ *  Check that a reply echoed back the request's data.
+ *  All requests carry the same data after the time stamp, and only
+ *  their size differs, so the reply is compared to the payload buffer.
+ *
+ * param:  pointer to reply's ICMP data, its length, and the request's length
+ * return: '1' reply is intact, '0' wrong length or content
+ *
+ */
+int ping_verify(uint8_t *data, int length, int size)
+{
+    int     i;
+
+    if ( length != size )
+    {
+        if ( !flood && !quiet )
+            printf("wrong data length %d should be %d\n", length, size);
+        corrupted++;
+        return 0;
+    }
+
+    for ( i = 0; i < (length - MIN_PAYLOAD); i++ )
+    {
+        if ( data[MIN_PAYLOAD + i] != pingPayload.data[i] )
+        {
+            if ( !flood && !quiet )
+                printf("wrong data byte #%d should be 0x%02x but was 0x%02x\n",
+                       MIN_PAYLOAD + i, pingPayload.data[i], data[MIN_PAYLOAD + i]);
+            corrupted++;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 /*------------------------------------------------
  * ping_input()
  *
  *  Ping response handler.
  *  Register as a call-back function
+ *  The reply is matched to its request by sequence number, so replies
+ *  can arrive in any order. A second reply to a request is a duplicate, and
+ *  a reply to a request that timed out is reported as late. The echoed data
+ *  is checked against the request, except for late replies to reused entries.
  *
  * param:  pointer response pbuf
  * return: none
@@ -66,30 +231,756 @@ volatile int done = 0;
  */
 void ping_input(struct pbuf_t* const p)
 {
-    struct ip_header_t *ip_in;
-    struct icmp_t      *icmp_in;
-    uint32_t            pingTime;
+    struct ip_header_t    *ip_in;
+    struct icmp_t         *icmp_in;
+    struct ping_request_t *request;
+    uint32_t               pingTime, us;
+    uint16_t               rxSeq;
+    char                  *note = "";
 
-    pingTime = stack_time();
+    pingTime = hrt_read();
 
     ip_in = (struct ip_header_t*) &(p->pbuf[FRAME_HDR_LEN]);                // get pointers to data sections in packet
     icmp_in = (struct icmp_t*) &(p->pbuf[FRAME_HDR_LEN + IP_HDR_LEN]);
 
+    rxSeq = stack_ntoh(icmp_in->seq);
+    request = &pingTable[rxSeq & (PING_TABLE - 1)];
+
+    if ( request->state == PING_FREE || request->seq != rxSeq )
+    {
+        /* Request entry was reused, time from the echoed payload
+         */
+        pingTime -= ((struct ping_payload_t*) &(icmp_in->payloadStart))->time;
+        note = " (late)";
+    }
+    else
+    {
+        pingTime -= request->sent;
+
+        request->corrupt = !ping_verify(&(icmp_in->payloadStart),
+                                        stack_ntoh(ip_in->length) - IP_HDR_LEN - ICMP_HDR_LEN,
+                                        request->size);
+
+        if ( request->state == PING_SENT )
+        {
+            outstanding--;
+            received++;
+            ping_statistics(hrt_us(pingTime), rxSeq);
+        }
+        else if ( request->state == PING_LOST )
+        {
+            received++;
+            ping_statistics(hrt_us(pingTime), rxSeq);
+            note = " (late)";
+        }
+        else
+        {
+            duplicates++;
+            note = " (DUP!)";
+        }
+
+        request->state = PING_DONE;
+
+        if ( request->corrupt )
+            note = " (BAD DATA)";
+    }
+
+    dos_exit = 0;
+
+    if ( flood )
+    {
+        putchar('\b');
+        return;
+    }
+
+    if ( quiet )
+        return;
+
+    us = hrt_us(pingTime);
+
     stack_ip4addr_ntoa(ip_in->srcIp, ip, sizeof(ip));                       // print out response in Ping format
-    pingTime -= ((struct ping_payload_t*) &(icmp_in->payloadStart))->time;
-    printf("%d bytes from %s: icmp_seq=%d ttl=%d time=%lu ms\n",
+    printf("%d bytes from %s: icmp_seq=%u ttl=%d time=%lu.%03lu ms%s\n",
             stack_ntoh(ip_in->length),
             ip,
-            stack_ntoh(icmp_in->seq),
+            rxSeq,
             ip_in->ttl,
-            pingTime);
+            us / 1000,
+            us % 1000,
+            note);
+}
+
+/*------------------------------------------------
+ * ping_send()
+ *
+ *  Send the next PING request and enter it into the request table.
+ *
+ * param:  destination address, identifier and pointer to sequence number
+ * return: '1' request sent, '0' on error
+ *
+ */
+int ping_send(ip4_addr_t ping_addr, uint16_t ident, uint16_t *seq)
+{
+    struct ping_request_t *request;
+    ip4_err_t              result;
+
+    (*seq)++;
+    request = &pingTable[*seq & (PING_TABLE - 1)];
+
+    pingPayload.time = hrt_read();
+    request->seq = *seq;
+    request->sent = pingPayload.time;
+    request->size = payload_size;
+    request->corrupt = 0;
+    request->state = PING_SENT;
+
+    result = icmp_ping_output(ping_addr, ident, *seq,
+                              (uint8_t* const) &pingPayload, (uint16_t) payload_size);    // output an ICMP Ping packet
+
+    switch ( result )
+    {
+        case ERR_OK:                                        // keep sending ping requests
+        case ERR_ARP_QUEUE:                                 // ARP sent, packet queued (will not happen with SLIP)
+            break;
+
+        case ERR_ARP_NONE:                                  // a route to the ping destination was not found (will not happen with SLIP)
+            printf("cannot resolve destination address, packet dropped.\n retrying...\n");
+            break;
+
+        case ERR_NETIF:
+        case ERR_NO_ROUTE:
+        case ERR_MEM:
+        case ERR_DRV:
+        case ERR_TX_COLL:
+        case ERR_TX_LCOLL:
+            printf("error code %d\n", result);
+            request->state = PING_FREE;
+            return 0;
+
+        default:
+            printf("unexpected error code %d\n", result);
+            request->state = PING_FREE;
+            return 0;
+    }
+
+    transmitted++;
+    outstanding++;
 
     if ( ping_count > 0 )
         ping_count--;
 
-    dos_exit = 0;
+    if ( flood )
+        putchar('.');
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * ping_timeout()
+ *
+ *  Mark requests that were not answered in time as lost.
+ *
+ * param:  local address for the message
+ * return: none
+ *
+ */
+void ping_timeout(ip4_addr_t local_addr)
+{
+    uint32_t    now;
+    int         i;
+
+    now = hrt_read();
 
-    rxSeq = stack_ntoh(icmp_in->seq);                                       // signal a valid response
+    for ( i = 0; i < PING_TABLE; i++ )
+    {
+        if ( pingTable[i].state != PING_SENT ||
+             hrt_us(now - pingTable[i].sent) <= (reply_timeout * 1000UL) )
+            continue;
+
+        pingTable[i].state = PING_LOST;
+        outstanding--;
+        dos_exit = 1;
+
+        if ( !flood && !quiet )
+        {
+            stack_ip4addr_ntoa(local_addr, ip, sizeof(ip));
+            printf("From %s icmp_seq=%u Destination Host Unreachable\n", ip, pingTable[i].seq);
+        }
+    }
+}
+
+/*------------------------------------------------
+ * ping_summary()
+ *
+ *  Print end of run statistics, an RTT histogram, and the
+ *  same results as one 'key=value' line for scripts.
+ *
+ * param:  destination address as text, run time in mSec
+ * return: none
+ *
+ */
+void ping_summary(char *destination, uint32_t elapsed)
+{
+    uint32_t    loss, avg, mdev, peak, limit;
+    double      mean, variance;
+    int         bucket, bar;
+
+    loss = transmitted ? ((transmitted - received) * 1000UL / transmitted) : 0;
+    if ( received > transmitted )
+        loss = 0;
+
+    avg = 0;
+    mdev = 0;
+    if ( rtt_count )
+    {
+        mean = rtt_sum / rtt_count;
+        variance = rtt_sum2 / rtt_count - mean * mean;
+        avg = (uint32_t)(mean + 0.5);
+        mdev = (variance > 0.0) ? (uint32_t)(sqrt(variance) + 0.5) : 0;
+    }
+    else
+    {
+        rtt_min = 0;
+    }
+
+    printf("\n--- %s ping statistics ---\n", destination);
+    printf("%lu packets transmitted, %lu received, ", transmitted, received);
+    if ( duplicates )
+        printf("+%lu duplicates, ", duplicates);
+    if ( reordered )
+        printf("%lu out of order, ", reordered);
+    if ( corrupted )
+        printf("%lu corrupted, ", corrupted);
+    printf("%lu.%lu%% packet loss, time %lums\n", loss / 10, loss % 10, elapsed);
+
+    if ( rtt_count )
+    {
+        printf("rtt min/avg/max/mdev = %lu.%03lu/%lu.%03lu/%lu.%03lu/%lu.%03lu ms\n",
+               rtt_min / 1000, rtt_min % 1000, avg / 1000, avg % 1000,
+               rtt_max / 1000, rtt_max % 1000, mdev / 1000, mdev % 1000);
+
+        for ( bucket = 0, peak = 1; bucket < HIST_BUCKETS; bucket++ )
+        {
+            if ( histogram[bucket] > peak )
+                peak = histogram[bucket];
+        }
+
+        for ( bucket = 0, limit = 1; bucket < HIST_BUCKETS; bucket++, limit <<= 1 )
+        {
+            if ( histogram[bucket] == 0 )
+                continue;
+
+            if ( bucket == 0 )
+                printf("       <1 ms %6lu ", histogram[bucket]);
+            else if ( bucket == (HIST_BUCKETS - 1) )
+                printf("  >=%5lu ms %6lu ", limit / 2, histogram[bucket]);
+            else
+                printf("%5lu-%-5lu ms %6lu ", limit / 2, limit, histogram[bucket]);
+
+            for ( bar = (int)((histogram[bucket] * HIST_BAR + peak - 1) / peak); bar; bar-- )
+                putchar('#');
+            putchar('\n');
+        }
+    }
+
+    printf("PINGSTAT dst=%s tx=%lu rx=%lu dup=%lu reorder=%lu corrupt=%lu loss=%lu.%lu min=%lu avg=%lu max=%lu mdev=%lu time=%lu\n",
+           destination, transmitted, received, duplicates, reordered, corrupted, loss / 10, loss % 10,
+           rtt_min, avg, rtt_max, mdev, elapsed);
+}
+
+/*------------------------------------------------
+ * ping_probe_size()
+ *
+ *  Send echo requests of one size, one at a time, until one
+ *  comes back intact or PROBE_TRIES went unanswered.
+ *  A request the stack refuses to send is too big for the interface.
+ *
+ * param:  interface, destination address, identifier,
+ *         pointer to sequence number, and payload size
+ * return: '1' the size made the round trip, '0' it did not
+ *
+ */
+int ping_probe_size(struct net_interface_t *netif, ip4_addr_t ping_addr, uint16_t ident, uint16_t *seq, int size)
+{
+    struct ping_request_t *request;
+    int                    tries;
+
+    payload_size = size;
+
+    for ( tries = 0; tries < PROBE_TRIES && !done; tries++ )
+    {
+        if ( !ping_send(ping_addr, ident, seq) )
+            return 0;
+
+        request = &pingTable[*seq & (PING_TABLE - 1)];
+
+        while ( !done && request->state == PING_SENT )
+        {
+            interface_input(netif);
+            stack_timers();
+            ping_timeout(netif->ip4addr);
+        }
+
+        if ( request->state == PING_DONE && !request->corrupt )
+            return 1;
+    }
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * ping_probe()
+ *
+ *  Find the largest echo that makes the round trip to the destination,
+ *  with a binary search between the smallest payload and 'max_size'.
+ *  The stack does not set the IP Don't Fragment flag, so a router that
+ *  fragments will not stop a large echo. The limit found is the smallest of
+ *  the local SLIP MTU, the stack's buffers and the destination's reassembly,
+ *  which is what TFTP blocks and TCP segments from this host run into.
+ *
+ * param:  interface, destination address, identifier,
+ *         pointer to sequence number, and largest payload to try
+ * return: largest payload size that made the round trip, '-1' none did
+ *
+ */
+int ping_probe(struct net_interface_t *netif, ip4_addr_t ping_addr, uint16_t ident, uint16_t *seq, int max_size)
+{
+    int     low, high, size, ok;
+
+    low = MIN_PAYLOAD;
+    high = max_size;
+
+    if ( !ping_probe_size(netif, ping_addr, ident, seq, low) )
+        return -1;
+
+    while ( low < high && !done )
+    {
+        size = (low + high + 1) / 2;
+        ok = ping_probe_size(netif, ping_addr, ident, seq, size);
+
+        printf("probe %4d bytes (MTU %4d) %s\n", size, size + IP_HDR_LEN + ICMP_HDR_LEN, ok ? "ok" : "no reply");
+
+        if ( ok )
+            low = size;
+        else
+            high = size - 1;
+    }
+
+    return low;
+}
+
+/*------------------------------------------------
+ * sweep_add()
+ *
+ *  Add a target to the sweep.
+ *
+ * param:  target address
+ * return: '1' added, '0' too many targets or out of memory
+ *
+ */
+int sweep_add(ip4_addr_t addr)
+{
+    if ( targets == NULL )
+    {
+        targets = (struct ping_target_t*) malloc(MAX_TARGETS * sizeof(struct ping_target_t));
+        if ( targets == NULL )
+        {
+            printf("Not enough memory for targets\n");
+            return 0;
+        }
+    }
+
+    if ( target_count == MAX_TARGETS )
+    {
+        printf("Too many targets, up to %d\n", MAX_TARGETS);
+        return 0;
+    }
+
+    memset(&targets[target_count], 0, sizeof(struct ping_target_t));
+    targets[target_count].addr = addr;
+    targets[target_count].rtt_min = 0xffffffffUL;
+    target_count++;
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * sweep_parse()
+ *
+ *  Add an address, or all host addresses of a CIDR range 'a.b.c.d/n'.
+ *  The network and broadcast addresses of ranges up to /30 are skipped.
+ *
+ * param:  address or range text
+ * return: '1' targets added, '0' bad format or too many targets
+ *
+ */
+int sweep_parse(char *text)
+{
+    char        address[17];
+    char       *slash;
+    ip4_addr_t  addr;
+    uint32_t    first, last, mask, host;
+    int         prefix;
+
+    slash = strchr(text, '/');
+    if ( slash == NULL )
+    {
+        if ( !stack_ip4addr_aton(text, &addr) )
+            return 0;
+        return sweep_add(addr);
+    }
+
+    if ( (slash - text) >= (int) sizeof(address) )
+        return 0;
+
+    strncpy(address, text, slash - text);
+    address[slash - text] = 0;
+
+    prefix = atoi(slash + 1);
+    if ( !stack_ip4addr_aton(address, &addr) || prefix < 0 || prefix > 32 )
+        return 0;
+
+    sweep = 1;
+
+    mask = prefix ? (0xffffffffUL << (32 - prefix)) : 0;
+    first = stack_ntohl(addr) & mask;
+    last = first | ~mask;
+
+    if ( prefix <= 30 )
+    {
+        first++;
+        last--;
+    }
+
+    if ( (last - first) >= (uint32_t)(MAX_TARGETS - target_count) )
+    {
+        printf("Too many targets in %s, up to %d\n", text, MAX_TARGETS);
+        return 0;
+    }
+
+    for ( host = first; host <= last; host++ )
+    {
+        if ( !sweep_add(stack_htonl(host)) )
+            return 0;
+    }
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * sweep_list()
+ *
+ *  Add the targets in a list file, one address or range per line.
+ *  Empty lines and lines starting with '#' are skipped.
+ *
+ * param:  list file name
+ * return: '1' targets added, '0' on error
+ *
+ */
+int sweep_list(char *list_spec)
+{
+    FILE   *list;
+    char    line[80];
+    char   *entry;
+    int     result = 1;
+
+    list = fopen(list_spec, "r");
+    if ( list == NULL )
+    {
+        printf("Cannot open list file '%s'\n", list_spec);
+        return 0;
+    }
+
+    sweep = 1;
+
+    while ( result && fgets(line, sizeof(line), list) != NULL )
+    {
+        entry = strtok(line, " \t\r\n");
+        if ( entry == NULL || *entry == '#' )
+            continue;
+
+        result = sweep_parse(entry);
+        if ( !result )
+            printf("Bad list entry '%s'\n", entry);
+    }
+
+    fclose(list);
+
+    return result;
+}
+
+/*------------------------------------------------
+ * sweep_finish()
+ *
+ *  Check whether a target needs more requests, and
+ *  report an unreachable target when it is done.
+ *
+ * param:  pointer to target
+ * return: none
+ *
+ */
+void sweep_finish(struct ping_target_t *target)
+{
+    if ( target->finished || target->pending ||
+         (target->sent < target->limit && !(ping_count < 0 && target->received)) )
+        return;
+
+    target->finished = 1;
+    remaining--;
+
+    if ( target->received == 0 && !quiet )
+    {
+        stack_ip4addr_ntoa(target->addr, ip, sizeof(ip));
+        printf("%s is unreachable\n", ip);
+    }
+}
+
+/*------------------------------------------------
+ * sweep_input()
+ *
+ *  Ping response handler for sweep mode.
+ *  Register as a call-back function
+ *  The target is found from the reply's identifier, and the request in
+ *  the target's own table from the sequence number.
+ *
+ * param:  pointer response pbuf
+ * return: none
+ *
+ */
+void sweep_input(struct pbuf_t* const p)
+{
+    struct ip_header_t    *ip_in;
+    struct icmp_t         *icmp_in;
+    struct ping_target_t  *target;
+    struct ping_request_t *request;
+    uint32_t               pingTime, us;
+    uint16_t               index, rxSeq;
+    char                  *note = "";
+
+    pingTime = hrt_read();
+
+    ip_in = (struct ip_header_t*) &(p->pbuf[FRAME_HDR_LEN]);
+    icmp_in = (struct icmp_t*) &(p->pbuf[FRAME_HDR_LEN + IP_HDR_LEN]);
+
+    index = stack_ntoh(icmp_in->id) - SWEEP_IDENT;
+    if ( index >= (uint16_t) target_count || targets[index].addr != ip_in->srcIp )
+        return;
+
+    target = &targets[index];
+    rxSeq = stack_ntoh(icmp_in->seq);
+    request = &target->request[rxSeq & (TARGET_TABLE - 1)];
+
+    if ( request->state == PING_FREE || request->seq != rxSeq )
+        return;
+
+    pingTime -= request->sent;
+    us = hrt_us(pingTime);
+
+    request->corrupt = !ping_verify(&(icmp_in->payloadStart),
+                                    stack_ntoh(ip_in->length) - IP_HDR_LEN - ICMP_HDR_LEN,
+                                    request->size);
+
+    if ( request->state == PING_DONE )
+    {
+        target->duplicates++;
+        duplicates++;
+        note = " (DUP!)";
+    }
+    else
+    {
+        if ( request->state == PING_SENT )
+        {
+            target->pending = 0;
+            outstanding--;
+        }
+        else
+        {
+            note = " (late)";
+        }
+
+        target->received++;
+        received++;
+
+        if ( us < target->rtt_min )
+            target->rtt_min = us;
+        if ( us > target->rtt_max )
+            target->rtt_max = us;
+        target->rtt_sum += us;
+    }
+
+    request->state = PING_DONE;
+
+    if ( request->corrupt )
+        note = " (BAD DATA)";
+
+    if ( !quiet )
+    {
+        stack_ip4addr_ntoa(target->addr, ip, sizeof(ip));
+
+        if ( ping_count < 0 )
+        {
+            if ( target->received == 1 && !target->duplicates )
+                printf("%s is alive (%lu.%03lu ms)%s\n", ip, us / 1000, us % 1000, note);
+        }
+        else
+        {
+            printf("%-15s : [%u], %d bytes, %lu.%03lu ms (%lu.%03lu avg, %lu%% loss)%s\n",
+                   ip, rxSeq, stack_ntoh(ip_in->length), us / 1000, us % 1000,
+                   (target->rtt_sum / target->received) / 1000, (target->rtt_sum / target->received) % 1000,
+                   (target->sent - target->pending - target->received) * 100UL / target->sent, note);
+        }
+    }
+
+    sweep_finish(target);
+}
+
+/*------------------------------------------------
+ * sweep_send()
+ *
+ *  Send the next request to a target.
+ *
+ * param:  target index
+ * return: '1' request sent, '0' on error
+ *
+ */
+int sweep_send(int index)
+{
+    struct ping_target_t  *target;
+    struct ping_request_t *request;
+    ip4_err_t              result;
+
+    target = &targets[index];
+    target->seq++;
+    request = &target->request[target->seq & (TARGET_TABLE - 1)];
+
+    pingPayload.time = hrt_read();
+    request->seq = target->seq;
+    request->sent = pingPayload.time;
+    request->size = payload_size;
+    request->corrupt = 0;
+    request->state = PING_SENT;
+
+    result = icmp_ping_output(target->addr, SWEEP_IDENT + index, target->seq,
+                              (uint8_t* const) &pingPayload, (uint16_t) payload_size);
+
+    if ( result != ERR_OK && result != ERR_ARP_QUEUE )
+    {
+        printf("error code %d\n", result);
+        request->state = PING_FREE;
+        return 0;
+    }
+
+    target->last_send = pingPayload.time;
+    target->sent++;
+    target->pending = 1;
+    transmitted++;
+    outstanding++;
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * sweep_poll()
+ *
+ *  Time out requests that were not answered, and send the next request.
+ *  One request is sent every SWEEP_PACE to the next target in turn that
+ *  has no reply pending, needs more requests and was last sent to at least
+ *  an interval ago, so many targets are in flight at once without
+ *  flooding the link.
+ *
+ * param:  interval between requests to the same target in mSec
+ * return: '1' ok, '0' send error
+ *
+ */
+int sweep_poll(uint32_t interval)
+{
+    static uint32_t        last_pace = 0;
+    struct ping_target_t  *target;
+    uint32_t               now;
+    int                    i, n;
+
+    now = hrt_read();
+
+    for ( i = 0; i < target_count; i++ )
+    {
+        target = &targets[i];
+        if ( !target->pending ||
+             (now - target->last_send) <= (reply_timeout * COUNTS_PER_MSEC) )
+            continue;
+
+        target->request[target->seq & (TARGET_TABLE - 1)].state = PING_LOST;
+        target->pending = 0;
+        outstanding--;
+        sweep_finish(target);
+    }
+
+    if ( transmitted && (now - last_pace) < (SWEEP_PACE * COUNTS_PER_MSEC) )
+        return 1;
+
+    for ( n = 0; n < target_count; n++ )
+    {
+        i = next_target;
+        next_target = (next_target + 1) % target_count;
+
+        target = &targets[i];
+        if ( target->finished || target->pending ||
+             (target->sent && (now - target->last_send) < (interval * COUNTS_PER_MSEC)) )
+            continue;
+
+        last_pace = now;
+        return sweep_send(i);
+    }
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * sweep_summary()
+ *
+ *  Print per target results, totals, and the totals
+ *  as one 'key=value' line for scripts.
+ *
+ * param:  run time in mSec
+ * return: number of targets that answered
+ *
+ */
+int sweep_summary(uint32_t elapsed)
+{
+    struct ping_target_t  *target;
+    uint32_t               avg;
+    int                    i, alive = 0;
+
+    printf("\n");
+
+    for ( i = 0; i < target_count; i++ )
+    {
+        target = &targets[i];
+        stack_ip4addr_ntoa(target->addr, ip, sizeof(ip));
+
+        printf("%-15s : xmt/rcv/%%loss = %d/%lu/%lu%%", ip, target->sent, target->received,
+               (target->sent && target->received < (uint32_t) target->sent) ?
+               ((target->sent - target->received) * 100UL / target->sent) : 0);
+
+        if ( target->received )
+        {
+            alive++;
+            avg = target->rtt_sum / target->received;
+            printf(", min/avg/max = %lu.%03lu/%lu.%03lu/%lu.%03lu",
+                   target->rtt_min / 1000, target->rtt_min % 1000, avg / 1000, avg % 1000,
+                   target->rtt_max / 1000, target->rtt_max % 1000);
+        }
+
+        if ( target->duplicates )
+            printf(", +%lu duplicates", target->duplicates);
+
+        printf("\n");
+    }
+
+    printf("\n%d targets, %d alive, %d unreachable\n", target_count, alive, target_count - alive);
+    printf("%lu packets transmitted, %lu received, time %lums\n", transmitted, received, elapsed);
+    printf("PINGSWEEP targets=%d alive=%d unreachable=%d tx=%lu rx=%lu dup=%lu corrupt=%lu time=%lu\n",
+           target_count, alive, target_count - alive, transmitted, received, duplicates, corrupted, elapsed);
+
+    return alive;
 }
 
 /*------------------------------------------------
@@ -114,12 +1005,14 @@ void ctrl_break(int sig_no)
 int main(int argc, char* argv[])
 {
     int             interval = 1;
+    int             preload = 0;
+    int             size = -1, probe = 0, mtu, timeout = 0;
+    uint32_t        last_send = 0, start_time;
     int             a = -1, b = -1, c = -1, d = -1, conv = 0;
 
-    int             linkState, i;
+    int             linkState, i, send;
     uint16_t        ident, seq;
     ip4_addr_t      ping_addr;
-    ip4_err_t       result;
 
     struct net_interface_t *netif;
 
@@ -151,6 +1044,80 @@ int main(int argc, char* argv[])
             if ( ping_count < 1 )
                 ping_count = 1;
         }
+        else if ( strcmp(argv[i], "-q") == 0 )
+        {
+            /* Only print the summary
+             */
+            quiet = 1;
+        }
+        else if ( strcmp(argv[i], "-f") == 0 )
+        {
+            /* Flood PING, send as fast as replies come back
+             */
+            flood = 1;
+            interval = 0;
+        }
+        else if ( strcmp(argv[i], "-l") == 0 )
+        {
+            /* Requests sent at once without waiting
+             */
+            i++;
+            preload = atoi(argv[i]);
+            if ( preload < 0 )
+                preload = 0;
+            else if ( preload > MAX_PRELOAD )
+                preload = MAX_PRELOAD;
+        }
+        else if ( strcmp(argv[i], "-s") == 0 )
+        {
+            /* Payload size, time stamp and a byte pattern
+             */
+            i++;
+            size = atoi(argv[i]);
+            if ( size < MIN_PAYLOAD )
+                size = MIN_PAYLOAD;
+            else if ( size > MAX_PAYLOAD )
+                size = MAX_PAYLOAD;
+        }
+        else if ( strcmp(argv[i], "-M") == 0 )
+        {
+            /* Path MTU probe, only 'probe' is supported
+             */
+            i++;
+            if ( i == argc || strcmp(argv[i], "probe") != 0 )
+            {
+                printf("%s\n", USAGE);
+                return -1;
+            }
+            probe = 1;
+        }
+        else if ( strcmp(argv[i], "-t") == 0 )
+        {
+            /* Reply wait in mSec
+             */
+            i++;
+            timeout = atoi(argv[i]);
+            if ( timeout < 1 )
+                timeout = 1;
+        }
+        else if ( strcmp(argv[i], "-r") == 0 )
+        {
+            /* Sweep retries of targets that do not answer
+             */
+            i++;
+            retries = atoi(argv[i]);
+            if ( retries < 0 )
+                retries = 0;
+        }
+        else if ( strcmp(argv[i], "-F") == 0 )
+        {
+            /* Sweep target list file
+             */
+            i++;
+            if ( !sweep_list(argv[i]) )
+                return -1;
+            conv = 1;
+        }
         else if ( strcmp(argv[i], "-i") == 0 )
         {
             /* PING interval
@@ -164,18 +1131,31 @@ int main(int argc, char* argv[])
         }
         else
         {
-            /* PING address
+            /* PING address or range, more than one is a sweep
              */
-            conv = stack_ip4addr_aton(argv[i], &ping_addr);
+            conv = sweep_parse(argv[i]);
+            if ( conv == 0 )
+                break;
         }
     }
 
-    if ( conv == 0 )
+    if ( conv == 0 || target_count == 0 )
     {
-        printf("PING address must be in IPv4 format 0.0.0.0\n");
+        printf("PING address must be in IPv4 format 0.0.0.0 or 0.0.0.0/prefix\n");
         return -1;
     }
 
+    if ( target_count > 1 )
+        sweep = 1;
+
+    if ( sweep && probe )
+    {
+        printf("Path MTU probe takes a single destination\n");
+        return -1;
+    }
+
+    ping_addr = targets[0].addr;
+
     /* Initialize IP stack and ICMP PING
      */
     if ( !stack_ip4addr_getenv("GATEWAY", &gateway) ||
@@ -198,24 +1178,102 @@ int main(int argc, char* argv[])
                               net_mask,
                               gateway);
 
-    icmp_ping_init(ping_input);
+    icmp_ping_init(sweep ? sweep_input : ping_input);
+    if ( !hrt_init() )
+        printf("PIT counter not usable, times have 55 mSec resolution\n");
     ident = 0xbeef;
     seq = 0;
-    rxSeq = seq;
     interval *= PING_INTERVAL;
-    strncpy(pingPayload.payload, PING_TEXT, TEXT_PAYLOAD_LEN);
+
+    /* the default payload is the text, '-s' sends a byte pattern
+     * that makes shifted or corrupted data easy to spot
+     */
+    for ( i = 0; i < (MAX_PAYLOAD - MIN_PAYLOAD); i++ )
+        pingPayload.data[i] = (uint8_t) i;
+
+    if ( size < 0 )
+        strncpy((char*) pingPayload.data, PING_TEXT, TEXT_PAYLOAD_LEN);
+    else
+        payload_size = size;
+
+    if ( timeout )
+        reply_timeout = timeout;
+    else if ( sweep )
+        reply_timeout = SWEEP_TIMEOUT;
 
     /* test link state and other info
      */
     linkState = interface_link_state(netif);
     stack_ip4addr_ntoa(ping_addr, ip, sizeof(ip));
-    printf("PING %s (%s '%s')\n", ip, netif->name, linkState ? "up" : "down");
+    if ( sweep )
+        printf("PING %d targets, %s first (%s '%s')\n", target_count, ip, netif->name, linkState ? "up" : "down");
+    else
+        printf("PING %s (%s '%s')\n", ip, netif->name, linkState ? "up" : "down");
 
     /* setup Ctrl-Break / Ctrl-C signal call back
      */
     //signal(SIGBREAK, ctrl_break);
     signal(SIGINT, ctrl_break);
 
+    start_time = stack_time();
+
+    /* sweep: every target in turn, each with ping_count requests, or
+     * in the default alive check up to 1 + retries requests until one is answered
+     */
+    if ( sweep )
+    {
+        remaining = target_count;
+        for ( i = 0; i < target_count; i++ )
+            targets[i].limit = (ping_count > 0) ? ping_count : (1 + retries);
+
+        while ( !done && linkState && remaining )
+        {
+            linkState = interface_link_state(netif);
+            interface_input(netif);
+            stack_timers();
+
+            if ( !sweep_poll(interval) )
+                done = 1;
+        }
+
+        i = sweep_summary(stack_time() - start_time);
+
+        slip_close();
+
+        return (i < target_count);
+    }
+
+    /* path MTU probe instead of the main loop
+     */
+    if ( probe )
+    {
+        quiet = 1;
+        flood = 0;
+        reply_timeout = PROBE_TIMEOUT;
+
+        stack_ip4addr_ntoa(ping_addr, ip, sizeof(ip));
+        size = ping_probe(netif, ping_addr, ident, &seq, (size < 0) ? MAX_PAYLOAD : size);
+
+        if ( size < 0 )
+        {
+            printf("%s did not answer\n", ip);
+            dos_exit = 1;
+        }
+        else
+        {
+            mtu = size + IP_HDR_LEN + ICMP_HDR_LEN;
+            printf("\n--- %s path MTU ---\n", ip);
+            printf("largest echo %d bytes, MTU %d, TFTP blksize %d, TCP MSS %d\n",
+                   size, mtu, mtu - TFTP_OVERHEAD, mtu - TCP_OVERHEAD);
+            printf("PINGMTU dst=%s payload=%d mtu=%d blksize=%d mss=%d probes=%lu time=%lu\n",
+                   ip, size, mtu, mtu - TFTP_OVERHEAD, mtu - TCP_OVERHEAD, transmitted, stack_time() - start_time);
+        }
+
+        slip_close();
+
+        return dos_exit;
+    }
+
     /* main loop
      *
      */
@@ -239,64 +1297,48 @@ int main(int argc, char* argv[])
          */
         stack_timers();
 
-        /* send a PING per set interval
-         * print 'no response' if response times out.
-         * a response will be handled by the ping_input() callback
-         * and (rxSeq == seq) will be true.
+        /* send the preload requests at once, then a PING per set interval,
+         * or in flood mode whenever fewer than the preload count (at least one)
+         * are outstanding and at least every FLOOD_INTERVAL.
+         * responses are handled by the ping_input() callback, and requests
+         * not answered in time are reported by ping_timeout().
+         * a request table entry still waiting for a reply is not reused.
          */
-        if ( rxSeq == seq )
+        if ( ping_count != 0 &&
+             pingTable[(uint16_t)(seq + 1) & (PING_TABLE - 1)].state != PING_SENT )
         {
-            if ( (stack_time() - pingPayload.time) > interval )
+            if ( transmitted < (uint32_t) preload )
+                send = 1;
+            else if ( flood )
+                send = (outstanding < (preload ? preload : 1)) ||
+                       ((stack_time() - last_send) >= FLOOD_INTERVAL);
+            else
+                send = (transmitted == 0) || ((stack_time() - last_send) >= interval);
+
+            if ( send )
             {
-                pingPayload.time = stack_time();
-                seq++;
-                result = icmp_ping_output(ping_addr, ident, seq,
-                                          (uint8_t* const) &pingPayload, sizeof(struct ping_payload_t));    // output an ICMP Ping packet
-
-                switch ( result )
-                {
-                    case ERR_OK:                                        // keep sending ping requests
-                    case ERR_ARP_QUEUE:                                 // ARP sent, packet queued (will not happen with SLIP)
-                        break;
-
-                    case ERR_ARP_NONE:                                  // a route to the ping destination was not found (will not happen with SLIP)
-                        printf("cannot resolve destination address, packet dropped.\n retrying...\n");
-                        break;
-
-                    case ERR_NETIF:
-                    case ERR_NO_ROUTE:
-                    case ERR_MEM:
-                    case ERR_DRV:
-                    case ERR_TX_COLL:
-                    case ERR_TX_LCOLL:
-                        printf("error code %d\n", result);
-                        done = 1;
-                        break;
-
-                    default:
-                        printf("unexpected error code %d\n", result);
-                        done = 1;
-                }
+                last_send = stack_time();
+                if ( !ping_send(ping_addr, ident, &seq) )
+                    done = 1;
             }
         }
-        else if ( (stack_time() - pingPayload.time) > WAIT_FOR_PING_RESPONSE )
-        {
-            stack_ip4addr_ntoa(netif->ip4addr, ip, 17);
-            printf("From %s icmp_seq=%d Destination Host Unreachable\n", ip, seq);
-            rxSeq = seq;
-            dos_exit = 1;
-            if ( ping_count > 0 )
-                ping_count--;
-        }
+
+        ping_timeout(netif->ip4addr);
 
         /* exit if a PING count was specified
          * otherwise run forever at set interval time.
          */
-        if ( ping_count == 0 )
+        if ( ping_count == 0 && outstanding == 0 )
             done = 1;
 
     } /* main loop */
 
+    if ( flood )
+        printf("\n");
+
+    stack_ip4addr_ntoa(ping_addr, ip, sizeof(ip));
+    ping_summary(ip, stack_time() - start_time);
+
     slip_close();
 
     return dos_exit;
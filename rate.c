@@ -0,0 +1,31 @@
+/*
+ *
+ * rate.c
+ *
+ *  Transfer rate calculation, shared by the programs that report throughput.
+ *
+ */
+
+#include    <stdint.h>
+#include    "rate.h"
+
+/*------------------------------------------------
+ * rate_bps()
+ *
+ *  Calculate bytes per second without overflowing 32 bit math.
+ *  Time is rounded down to 0.1 second, with a 0.1 second minimum.
+ *
+ * param:  Byte count and elapsed time in mili-seconds
+ * return: Bytes per second
+ *
+ */
+uint32_t rate_bps(uint32_t bytes, uint32_t elapsed)
+{
+    if ( elapsed < 100 )
+        elapsed = 100;
+
+    if ( bytes < 0x10000000UL )
+        return (bytes * 10) / (elapsed / 100);
+
+    return bytes / (elapsed / 1000 + 1);
+}
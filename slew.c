@@ -0,0 +1,45 @@
+/*
+ *
+ * slew.c
+ *
+ *  Find the resident clock slewer, NTPSLEW.EXE, through its INT 2Fh
+ *  multiplex function, which returns the address of its state so the
+ *  NTP client can update it in place.
+ *
+ */
+
+#include    <dos.h>
+#include    <i86.h>
+
+#include    "slew.h"
+
+/*------------------------------------------------
+ * slew_find()
+ *
+ *  Find the resident state of an installed copy.
+ *
+ * param:  none
+ * return: Pointer to the resident state, NULL if not installed
+ *
+ */
+slew_t __far *slew_find(void)
+{
+    union REGS      regs;
+    struct SREGS    segment_regs;
+    slew_t __far   *resident;
+
+    segment_regs.es = 0;
+    regs.h.ah = SLEW_MUX_ID;
+    regs.h.al = 0;
+    regs.w.di = 0;
+    int86x(0x2f, &regs, &regs, &segment_regs);
+
+    if ( regs.h.al != 0xff )
+        return NULL;
+
+    resident = (slew_t __far*) MK_FP(segment_regs.es, regs.w.di);
+    if ( resident == NULL || resident->signature != SLEW_SIGNATURE )
+        return NULL;
+
+    return resident;
+}
@@ -0,0 +1,481 @@
+/*
+ *  tcping.c
+ *
+ *      TCP connection latency probe for PC-XT
+ *      Repeatedly opens a TCP connection to a server port, and measures the
+ *      time from sending SYN to the connection being established, and the time
+ *      from then until the first byte of data arrives. Servers such as telnet,
+ *      SMTP or FTP send a greeting on their own; for HTTP servers '-H' sends a HEAD
+ *      request once connected. The connection is then closed and the next attempt
+ *      starts after the interval.
+ *
+ *      Usage: tcping [-V] [-q] [-H] [-n] [-c count] [-i interval] [-t timeout] ipv4_address[:port] [port]
+ *
+ */
+
+#include    <stdlib.h>
+#include    <stdio.h>
+#include    <string.h>
+#include    <assert.h>
+#include    <signal.h>
+#include    <unistd.h>
+#include    <math.h>
+
+#include    "ip/netif.h"
+#include    "ip/stack.h"
+#include    "ip/tcp.h"
+#include    "ip/error.h"
+#include    "ip/types.h"
+
+#include    "ip/slip.h"     // TODO for slip_close(), remove once this is in a stack_close() call
+
+#include    "hrtimer.h"
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     VERSION             "v1.0"
+#define     USAGE               "tcping [-V] [-q] [-H] [-n] [-c count] [-i interval] [-t timeout] ipv4_address[:port] [port]\n"
+
+#define     DEF_PORT            80
+#define     MY_PORT             31000       // Local port of the first attempt, the next ones follow
+#define     MY_PORTS            1000        // Local ports used in turn, so closing connections do not collide
+#define     DEF_INTERVAL        1000        // mSec between attempts
+#define     DEF_TIMEOUT         5000        // mSec to connect, and then for the first byte
+#define     CLOSE_TIMEOUT       5000        // mSec to wait for a closed connection to be released
+#define     BUFLEN              512
+#define     HTTP_HEAD           "HEAD / HTTP/1.0\r\n\r\n"
+
+#define     TCPING_IDLE         0           // Attempt states
+#define     TCPING_CONNECT      1
+#define     TCPING_WAIT_DATA    2
+#define     TCPING_CLOSE        3
+
+#define     RESULT_OK           0           // Attempt results
+#define     RESULT_REFUSED      1
+#define     RESULT_TIMEOUT      2
+#define     RESULT_NO_DATA      3
+#define     RESULT_CLOSED       4
+#define     RESULT_ERROR        5
+#define     RESULTS             6
+
+/* -----------------------------------------
+   Types and data structures
+----------------------------------------- */
+struct timing_t                             // Statistics of one measured time, in uSec
+{
+    uint32_t    count;
+    uint32_t    min;
+    uint32_t    max;
+    double      sum;
+    double      sum2;
+};
+
+/* -----------------------------------------
+   Globals
+----------------------------------------- */
+char            ip[17];
+uint8_t         buf[BUFLEN];
+
+pcbid_t         pcb = -1;
+volatile tcp_event_t event = TCP_EVENT_NONE;    // Last event from the stack for the open connection
+int             state = TCPING_IDLE;
+
+struct timing_t connect_time = {0, 0xffffffffUL, 0, 0.0, 0.0};
+struct timing_t first_byte = {0, 0xffffffffUL, 0, 0.0, 0.0};
+uint32_t        results[RESULTS];
+uint32_t        attempts = 0;
+
+char           *result_text[RESULTS] = { "ok", "refused", "timeout", "no data", "closed", "error" };
+
+volatile int    done = 0;
+
+/*------------------------------------------------
+ * timing_add()
+ *
+ *  Add a measurement to a time statistic.
+ *
+ * param:  pointer to statistic, time in uSec
+ * return: none
+ *
+ */
+void timing_add(struct timing_t *t, uint32_t us)
+{
+    if ( us < t->min )
+        t->min = us;
+    if ( us > t->max )
+        t->max = us;
+
+    t->sum += (double) us;
+    t->sum2 += (double) us * (double) us;
+    t->count++;
+}
+
+/*------------------------------------------------
+ * timing_print()
+ *
+ *  Print a time statistic as min/avg/max/mdev in mSec.
+ *
+ * param:  label, pointer to statistic
+ * return: average in uSec
+ *
+ */
+uint32_t timing_print(char *label, struct timing_t *t)
+{
+    double      mean, variance;
+    uint32_t    avg, mdev;
+
+    if ( t->count == 0 )
+    {
+        t->min = 0;
+        return 0;
+    }
+
+    mean = t->sum / t->count;
+    variance = t->sum2 / t->count - mean * mean;
+    avg = (uint32_t)(mean + 0.5);
+    mdev = (variance > 0.0) ? (uint32_t)(sqrt(variance) + 0.5) : 0;
+
+    printf("%s min/avg/max/mdev = %lu.%03lu/%lu.%03lu/%lu.%03lu/%lu.%03lu ms\n", label,
+           t->min / 1000, t->min % 1000, avg / 1000, avg % 1000,
+           t->max / 1000, t->max % 1000, mdev / 1000, mdev % 1000);
+
+    return avg;
+}
+
+/*------------------------------------------------
+ * notify_callback()
+ *
+ *  Notified by the TCP stack of connection events.
+ *  Register as a call-back function
+ *
+ * param:  connection and event
+ * return: none
+ *
+ */
+void notify_callback(pcbid_t connection, tcp_event_t reason)
+{
+    if ( connection == pcb )
+        event = reason;
+}
+
+/*------------------------------------------------
+ * ctrl_break()
+ *
+ *  Ctrl-Break / Ctrl-C function
+ *
+ * param:  signal type
+ * return: none
+ *
+ */
+void ctrl_break(int sig_no)
+{
+    done = 1;
+}
+
+/*------------------------------------------------
+ * main()
+ *
+ *
+ */
+int main(int argc, char* argv[])
+{
+    int             c, i, count = -1, quiet = 0, http = 0, wait_data = 1;
+    int             linkState, result, port = DEF_PORT;
+    uint32_t        interval = DEF_INTERVAL, timeout = DEF_TIMEOUT;
+    uint32_t        attempt_start = 0, start_time, stamp, syn, established = 0, us;
+    uint32_t        conn_avg, data_avg, failed, loss;
+    char           *colon;
+
+    struct tcp_conn_state_t connection_state;
+    struct net_interface_t *netif;
+
+    ip4_addr_t      server = 0;
+    ip4_addr_t      gateway = 0;
+    ip4_addr_t      net_mask = 0;
+    ip4_addr_t      local_host = 0;
+
+    /* parse command line variables
+     */
+    while ( (c = getopt(argc, argv, ":VqHnc:i:t:")) != -1 )
+    {
+        switch ( c )
+        {
+            case 'V':
+                printf("tcping.exe %s %s %s\n", VERSION, __DATE__, __TIME__);
+                return 0;
+
+            case 'q':
+                // Only print the summary
+                quiet = 1;
+                break;
+
+            case 'H':
+                // Send an HTTP HEAD request once connected
+                http = 1;
+                break;
+
+            case 'n':
+                // Connect only, do not wait for data
+                wait_data = 0;
+                break;
+
+            case 'c':
+                count = atoi(optarg);
+                if ( count < 1 )
+                    count = 1;
+                break;
+
+            case 'i':
+                // Interval between attempts in mSec
+                interval = atol(optarg);
+                break;
+
+            case 't':
+                // Time to wait for connection and data in mSec
+                timeout = atol(optarg);
+                if ( timeout < 1 )
+                    timeout = DEF_TIMEOUT;
+                break;
+
+            case ':':
+                printf("'-%c' requires an argument\n", optopt);
+                return -1;
+
+            default:
+                printf("%s\n", USAGE);
+                return -1;
+        }
+    }
+
+    if ( (argc - optind) < 1 || (argc - optind) > 2 )
+    {
+        printf("%s\n", USAGE);
+        return -1;
+    }
+
+    /* Server is 'address[:port]', or 'address port'
+     */
+    if ( (colon = strchr(argv[optind], ':')) != NULL )
+    {
+        *colon = 0;
+        port = atoi(colon + 1);
+    }
+
+    if ( (argc - optind) == 2 )
+        port = atoi(argv[optind + 1]);
+
+    if ( !stack_ip4addr_aton(argv[optind], &server) || port < 1 )
+    {
+        printf("Server must be in IPv4 format 0.0.0.0[:port]\n");
+        return -1;
+    }
+
+    /* Initialize IP stack
+     */
+    if ( !stack_ip4addr_getenv("GATEWAY", &gateway) ||
+         !stack_ip4addr_getenv("NETMASK", &net_mask) ||
+         !stack_ip4addr_getenv("LOCALHOST", &local_host) )
+    {
+        printf("Missing IP stack environment variable(s)\n");
+        return 1;
+    }
+
+    stack_init();                                       // initialize IP stack
+    assert(stack_set_route(net_mask,
+                           gateway,
+                           0) == ERR_OK);               // setup default route
+    netif = stack_get_ethif(0);                         // get pointer to interface 0
+    assert(netif);
+
+    assert(interface_slip_init(netif) == ERR_OK);       // initialize interface and link HW
+    interface_set_addr(netif, local_host,               // setup static IP addressing
+                              net_mask,
+                              gateway);
+
+    tcp_init();                                         // initialize TCP
+
+    if ( !hrt_init() )
+        printf("PIT counter not usable, times have 55 mSec resolution\n");
+
+    linkState = interface_link_state(netif);
+    stack_ip4addr_ntoa(server, ip, sizeof(ip));
+    printf("TCPING %s port %d (%s '%s')\n", ip, port, netif->name, linkState ? "up" : "down");
+
+    signal(SIGINT, ctrl_break);
+
+    start_time = stack_time();
+    syn = 0;
+
+    /* main loop
+     * one connection at a time: connect, wait for the first byte,
+     * close, and wait for the connection to be released before the next.
+     */
+    while ( linkState )
+    {
+        linkState = interface_link_state(netif);
+        interface_input(netif);
+        stack_timers();
+
+        stamp = hrt_read();
+        result = -1;
+
+        switch ( state )
+        {
+            case TCPING_IDLE:
+                if ( done || count == 0 )
+                    break;
+
+                if ( attempts && (stack_time() - attempt_start) < interval )
+                    break;
+
+                pcb = tcp_new();
+                if ( pcb < 0 ||
+                     tcp_bind(pcb, local_host, (uint16_t)(MY_PORT + (attempts % MY_PORTS))) != ERR_OK ||
+                     tcp_notify(pcb, notify_callback) != ERR_OK )
+                {
+                    printf("no TCP connection available\n");
+                    done = 1;
+                    break;
+                }
+
+                attempt_start = stack_time();
+                attempts++;
+                if ( count > 0 )
+                    count--;
+
+                event = TCP_EVENT_NONE;
+                syn = hrt_read();
+
+                if ( tcp_connect(pcb, server, (uint16_t) port) != ERR_OK )
+                {
+                    result = RESULT_ERROR;
+                    break;
+                }
+
+                state = TCPING_CONNECT;
+                break;
+
+            /* The connection is established when the SYN-ACK was processed,
+             * which happens in the interface_input() call above, so the
+             * time stamp taken right after it is the handshake time
+             */
+            case TCPING_CONNECT:
+                if ( tcp_util_conn_state(pcb, &connection_state) &&
+                     connection_state.state == ESTABLISHED )
+                {
+                    established = stamp;
+                    us = hrt_us(established - syn);
+                    timing_add(&connect_time, us);
+
+                    if ( !wait_data )
+                    {
+                        result = RESULT_OK;
+                        break;
+                    }
+
+                    if ( http )
+                        tcp_send(pcb, (uint8_t*) HTTP_HEAD, sizeof(HTTP_HEAD) - 1, 0);
+
+                    state = TCPING_WAIT_DATA;
+                }
+                else if ( event == TCP_EVENT_REMOTE_RST )
+                    result = RESULT_REFUSED;
+                else if ( event == TCP_EVENT_ABORTED || hrt_us(stamp - syn) > timeout * 1000UL )
+                    result = RESULT_TIMEOUT;
+                else if ( done )
+                {
+                    attempts--;                         // interrupted, not counted
+                    tcp_close(pcb);
+                    state = TCPING_CLOSE;
+                }
+                break;
+
+            case TCPING_WAIT_DATA:
+                if ( event == TCP_EVENT_DATA_RECV || event == TCP_EVENT_PUSH )
+                {
+                    us = hrt_us(stamp - established);
+                    timing_add(&first_byte, us);
+                    tcp_recv(pcb, buf, BUFLEN);
+                    result = RESULT_OK;
+                }
+                else if ( event == TCP_EVENT_CLOSE || event == TCP_EVENT_REMOTE_RST )
+                    result = RESULT_CLOSED;
+                else if ( hrt_us(stamp - established) > timeout * 1000UL || done )
+                    result = RESULT_NO_DATA;
+                break;
+
+            /* Wait for the stack to release the connection, as telnet does
+             * after a local close, but not forever
+             */
+            case TCPING_CLOSE:
+                if ( (tcp_util_conn_state(pcb, &connection_state) && connection_state.state == FREE) ||
+                     (stack_time() - attempt_start) > (timeout + CLOSE_TIMEOUT) || done )
+                {
+                    pcb = -1;
+                    state = TCPING_IDLE;
+                }
+                break;
+        }
+
+        /* Report the attempt and close its connection
+         */
+        if ( result >= 0 )
+        {
+            results[result]++;
+
+            if ( !quiet )
+            {
+                printf("connect to %s:%d seq=%lu", ip, port, attempts);
+                if ( result == RESULT_OK || result == RESULT_NO_DATA || result == RESULT_CLOSED )
+                {
+                    us = hrt_us(established - syn);
+                    printf(" connect=%lu.%03lu ms", us / 1000, us % 1000);
+                }
+                if ( result == RESULT_OK && wait_data )
+                {
+                    us = hrt_us(stamp - established);
+                    printf(" first byte=%lu.%03lu ms", us / 1000, us % 1000);
+                }
+                if ( result != RESULT_OK )
+                    printf(" %s", result_text[result]);
+                printf("\n");
+            }
+
+            if ( result != RESULT_REFUSED )
+                tcp_close(pcb);
+
+            state = (result == RESULT_REFUSED) ? TCPING_IDLE : TCPING_CLOSE;
+        }
+
+        if ( state == TCPING_IDLE && (done || count == 0) )
+            break;
+    }
+
+    /* Statistics
+     */
+    failed = attempts - results[RESULT_OK];
+    loss = attempts ? (failed * 1000UL / attempts) : 0;
+
+    printf("\n--- %s:%d tcping statistics ---\n", ip, port);
+    printf("%lu connections, %lu succeeded, ", attempts, results[RESULT_OK]);
+    for ( i = RESULT_REFUSED; i < RESULTS; i++ )
+    {
+        if ( results[i] )
+            printf("%lu %s, ", results[i], result_text[i]);
+    }
+    printf("%lu.%lu%% failed, time %lums\n", loss / 10, loss % 10, stack_time() - start_time);
+
+    conn_avg = timing_print("connect   ", &connect_time);
+    data_avg = timing_print("first byte", &first_byte);
+
+    printf("TCPINGSTAT dst=%s port=%d tx=%lu ok=%lu refused=%lu timeout=%lu nodata=%lu closed=%lu failed=%lu.%lu "
+           "conn_min=%lu conn_avg=%lu conn_max=%lu data_min=%lu data_avg=%lu data_max=%lu\n",
+           ip, port, attempts, results[RESULT_OK], results[RESULT_REFUSED], results[RESULT_TIMEOUT],
+           results[RESULT_NO_DATA], results[RESULT_CLOSED], loss / 10, loss % 10,
+           connect_time.min, conn_avg, connect_time.max, first_byte.min, data_avg, first_byte.max);
+
+    slip_close();
+
+    return (failed != 0);
+}
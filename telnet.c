@@ -33,6 +33,8 @@
 #include    <dos.h>
 #include    <time.h>
 #include    <signal.h>
+#include    <unistd.h>
+#include    <i86.h>
 
 #include    "ip/netif.h"
 #include    "ip/stack.h"
@@ -42,9 +44,17 @@
 
 #include    "ip/slip.h"     // TODO for slip_close(), remove once this is in a stack_close() call
 
+#include    "vt100.h"
+#include    "inflate.h"
+#include    "zmodem.h"
+#include    "rate.h"
+
 /* -----------------------------------------
    Definitions
 ----------------------------------------- */
+#define     xEOF                236
+#define     SUSP                237
+#define     ABORT               238
 #define     SE                  240
 #define     NOP                 241
 #define     DM                  242
@@ -62,13 +72,67 @@
 #define     DONT                254
 #define     IAC                 255
 
+#define     CMD_BINARY          0
 #define     CMD_ECHO            1
 #define     CMD_SUP_GOAHEAD     3
+#define     CMD_TERMINAL_TYPE   24
 #define     CMD_WINDOW_SIZE     31
+#define     CMD_LINEMODE        34
+#define     CMD_COMPRESS2       86          // MCCP v2, server output is zlib compressed after IAC SB 86 IAC SE
+
+#define     BINARY_TX           0x01        // Binary transmission flags, client sends binary
+#define     BINARY_RX           0x02        // Server sends binary
+
+#define     SB_IS               0           // Sub-negotiation IS and SEND
+#define     SB_SEND             1
+#define     SB_LEN              64          // Longest sub-negotiation kept, longer ones are truncated
+
+#define     LM_MODE             1           // LINEMODE sub-negotiations (RFC 1184)
+#define     LM_FORWARDMASK      2
+#define     LM_SLC              3
+
+#define     MODE_EDIT           0x01        // LINEMODE MODE mask bits
+#define     MODE_TRAPSIG        0x02
+#define     MODE_ACK            0x04
+#define     MODE_SUPPORTED      (MODE_EDIT | MODE_TRAPSIG)
+
+#define     SLC_IP              3           // Special characters, SLC function codes
+#define     SLC_ABORT           7
+#define     SLC_EOF             8
+#define     SLC_SUSP            9
+#define     SLC_EC              10
+#define     SLC_EL              11
+#define     SLC_EW              12
+#define     SLC_COUNT           19
+#define     SLC_LEVELBITS       0x03
+#define     SLC_NOSUPPORT       0
+#define     SLC_DISABLED        0xff        // Character value of a function with no character
+
+#define     LINE_LEN            128         // Local line editing and keystroke coalescing buffer
+#define     COALESCE_MS         30          // Character mode keystrokes are held this long for more to follow
+
+#define     TN_DATA             0           // Telnet stream parser states
+#define     TN_IAC              1
+#define     TN_OPTION           2
+#define     TN_SB               3
+#define     TN_SB_IAC           4
+
+#define     CAPTURE_MAGIC       "TNC1"      // Session capture file signature
+#define     CAPTURE_BUF         4096        // Capture file buffer
 
 #define     TELNET_PORT         23
-#define     MY_PORT             (30000+TELNET_PORT)
+#define     MY_PORT             (30000+TELNET_PORT) // Local port of the first session, the next ones follow
 #define     BUFLEN              1536
+#define     TELNET_SESSIONS     4           // Concurrent sessions
+#define     KEY_ESC             0x1b
+#define     KEY_CTRL_PGUP       (0x84 | VT100_KEY_EXT)  // Browse the scrollback history
+#define     KEY_CTRL_PGDN       (0x76 | VT100_KEY_EXT)
+#define     HISTORY_KB          32          // Default scrollback history size per session
+#define     KEY_ALT_1           (0x78 | VT100_KEY_EXT)  // Alt-1 to Alt-4 select a session
+
+#define     USAGE               "Usage: telnet [-n] [-b kbytes] [-c capture_file] address[:port] [address[:port] ...]\n" \
+                                "       telnet [-n] [-b kbytes] [-c capture_file] address [port]\n"                      \
+                                "       telnet -r capture_file"
 
 #define     TELNET_IDLE         0
 #define     TELNET_DATA_AVAIL   1
@@ -77,25 +141,123 @@
 #define     TELNET_LOCAL_CLOSE  4
 #define     TELNET_CON_ABORT    5
 
+/* -----------------------------------------
+   Types and data structures
+----------------------------------------- */
+
+/* Telnet stream parser state, kept between received segments
+ * so commands and sub-negotiations can be split anywhere.
+ * While MCCP compression is on, received data goes through the
+ * decompressor and its output is parsed as the telnet stream.
+ */
+typedef struct
+{
+    int             state;
+    uint8_t         command;                    // WILL, WONT, DO or DONT waiting for its option
+    uint8_t         sb[SB_LEN];                 // Sub-negotiation option and parameters
+    int             sb_len;
+    int             compressed;                 // '1' inflater is active
+    inflate_t       inflater;
+    uint32_t        bytes_in;                   // Compressed bytes received
+    uint32_t        bytes_out;                  // Bytes they decompressed to
+} telnet_parser_t;
+
+/* Keyboard input state.
+ * In LINEMODE EDIT mode a line is edited and echoed locally, and
+ * sent when it is complete. Otherwise, keystrokes that follow each other
+ * closely are sent together in one segment.
+ */
+typedef struct
+{
+    uint8_t         mode;                       // LINEMODE MODE mask, '0' in character mode
+    uint8_t         slc[SLC_COUNT];             // Special character values by SLC function
+    uint8_t         line[LINE_LEN];             // Edited line or coalesced keystrokes, not IAC escaped
+    int             line_len;
+    uint32_t        first_key;                  // Time first coalesced keystroke was buffered
+} telnet_editor_t;
+
+/* A telnet session, its connection, stream parser, keyboard and terminal state.
+ * Sessions are allocated at start up. Only the displayed session's terminal
+ * is rendered, the others keep receiving into their shadow screen and history.
+ * While a ZMODEM transfer is active, received text goes to the transfer
+ * instead of the terminal.
+ */
+typedef struct
+{
+    int             id;                         // Index in session table, also the terminal ID
+    int             open;                       // '1' until the connection is closed
+    pcbid_t         pcb;
+    int             state;                      // TELNET_* connection state
+    int             compress_error;
+    int             binary;                     // BINARY_TX and BINARY_RX option state
+    char            host[17];
+    telnet_parser_t parser;
+    telnet_editor_t editor;
+    vt100_t         terminal;
+    history_t       history;
+    zmodem_t        zm;
+} telnet_session_t;
+
 /* -----------------------------------------
    Static prototypes
 ----------------------------------------- */
 static void notify_callback(pcbid_t, tcp_event_t);
 static void ctrl_break(int);
-static void negotiate(pcbid_t, uint8_t*, int);
+static telnet_session_t *telnet_session_new(int);
+static int  telnet_session_connect(telnet_session_t*, ip4_addr_t, int, ip4_addr_t);
+static int  telnet_session_run(telnet_session_t*);
+static void telnet_session_end(telnet_session_t*);
+static void telnet_switch(telnet_session_t*);
+static void telnet_message(telnet_session_t*, const char*);
+static void negotiate(telnet_session_t*, uint8_t, uint8_t);
+static void subnegotiate(telnet_session_t*, uint8_t*, int);
+static void telnet_reply(int, const uint8_t*, int);
+static void telnet_receive(telnet_session_t*, uint8_t*, int);
+static int  telnet_input(telnet_session_t*, uint8_t*, int);
+static void telnet_data(telnet_session_t*, uint8_t*, int);
+static void telnet_inflated(void*, uint8_t*, int);
+static void linemode(telnet_session_t*, uint8_t*, int);
+static void telnet_editor_init(telnet_editor_t*);
+static int  telnet_keyboard(void);
+static int  telnet_edit(telnet_session_t*, int);
+static void telnet_echo(telnet_session_t*, const char*, int);
+static int  telnet_send_line(telnet_session_t*);
+static int  telnet_command(telnet_session_t*, uint8_t);
+static int  telnet_send(telnet_session_t*, uint8_t*, int);
+static void telnet_binary(telnet_session_t*);
+static int  telnet_zmodem_send(void*, const uint8_t*, int);
+static void telnet_zmodem_status(void*, const char*);
+static int  telnet_zmodem_ask(void*, char*, int);
+static void telnet_capture(uint8_t*, int, uint32_t);
+static int  telnet_replay(char*);
+static void telnet_reset(telnet_session_t*);
+static void telnet_idle(void);
 
-/* -----------------------------------------
-   Types and data structures
------------------------------------------ */
+/* Halt the CPU until the next interrupt. STI takes effect after
+ * the following instruction, so an interrupt cannot slip in between
+ * enabling interrupts and halting.
+ */
+void cpu_halt(void);
+#pragma aux cpu_halt =  \
+    "sti"               \
+    "hlt"               \
+    modify exact [];
 
 /* -----------------------------------------
    Globals
 ----------------------------------------- */
-pcbid_t         telnet_client = -1;
-int             telnet_state = TELNET_IDLE;
+telnet_session_t *sessions[TELNET_SESSIONS];
+int             session_count = 0;
+telnet_session_t *current = NULL;               // Displayed session, receives keyboard input
 uint8_t         buf[BUFLEN];
-uint8_t         telnet_opt[3];
 char            ip[17];
+FILE           *capture_file = NULL;
+uint32_t        capture_start;
+int             replay = 0;
+int             idle_enabled = 1;
+int             history_kb = HISTORY_KB;
+uint32_t        loop_count = 0;
+uint32_t        idle_count = 0;
 
 /*------------------------------------------------
  * main()
@@ -105,11 +267,13 @@ char            ip[17];
 int main(int argc , char *argv[])
 {
     struct net_interface_t *netif;
-    struct tcp_conn_state_t telnet_connection_state;
-    ip4_addr_t              telnet_server_address;
+    ip4_addr_t              host_address[TELNET_SESSIONS];
+    int                     host_port[TELNET_SESSIONS];
+    telnet_session_t       *session;
 
-    int                     port, linkState, len, rv, i, dos_result = 0;
-    ip4_err_t               result;
+    int                     c, i, open, linkState, busy, dos_result = 0;
+    char                   *colon;
+    uint32_t                session_start;
 
     ip4_addr_t              gateway = 0;
     ip4_addr_t              net_mask = 0;
@@ -117,21 +281,89 @@ int main(int argc , char *argv[])
 
     /* parse command line variables
      */
-    if (argc < 2 || argc > 3)
+    while ( (c = getopt(argc, argv, ":c:r:nb:")) != -1 )
     {
-        printf("Usage: telnet address [port]\n");
-        return -1;
+        switch ( c )
+        {
+            case 'c':
+                // Capture received stream of the first session
+                capture_file = fopen(optarg, "wb");
+                if ( capture_file == NULL )
+                {
+                    printf("Cannot create capture file '%s'\n", optarg);
+                    return -1;
+                }
+                setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUF);
+                fwrite(CAPTURE_MAGIC, 1, 4, capture_file);
+                break;
+
+            case 'r':
+                // Replay a captured stream as a rendering benchmark
+                return telnet_replay(optarg);
+
+            case 'n':
+                // Busy poll, do not idle the CPU
+                idle_enabled = 0;
+                break;
+
+            case 'b':
+                // Scrollback history size per session, '0' for none
+                history_kb = atoi(optarg);
+                if ( history_kb < 0 || history_kb > (HISTORY_BLOCKS * (HISTORY_BLOCK / 1024)) )
+                {
+                    printf("History size is 0 to %u KB\n", HISTORY_BLOCKS * (HISTORY_BLOCK / 1024));
+                    return -1;
+                }
+                break;
+
+            case ':':
+                printf("'-%c' requires an argument\n", optopt);
+                return -1;
+
+            default:
+                printf("%s\n", USAGE);
+                return -1;
+        }
     }
 
-    if ( stack_ip4addr_aton(argv[1], &telnet_server_address) == 0 )
+    if ( (argc - optind) < 1 )
     {
-        printf("Server address must be in IPv4 format 0.0.0.0\n");
+        printf("%s\n", USAGE);
         return -1;
     }
 
-    port = 23;
-    if (argc == 3)
-        port = atoi(argv[2]);
+    /* Hosts are 'address[:port]'. A port number following a single
+     * address is also accepted, as in 'telnet address port'
+     */
+    for ( i = optind; i < argc; i++ )
+    {
+        if ( (argc - optind) == 2 && i == (optind + 1) && strchr(argv[i], '.') == NULL )
+        {
+            host_port[0] = atoi(argv[i]);
+            continue;
+        }
+
+        if ( session_count == TELNET_SESSIONS )
+        {
+            printf("Up to %d sessions\n", TELNET_SESSIONS);
+            return -1;
+        }
+
+        host_port[session_count] = TELNET_PORT;
+        if ( (colon = strchr(argv[i], ':')) != NULL )
+        {
+            *colon = 0;
+            host_port[session_count] = atoi(colon + 1);
+        }
+
+        if ( stack_ip4addr_aton(argv[i], &host_address[session_count]) == 0 )
+        {
+            printf("Server address must be in IPv4 format 0.0.0.0\n");
+            return -1;
+        }
+
+        session_count++;
+    }
 
     /* Initialize IP stack
      */
@@ -155,41 +387,55 @@ int main(int argc , char *argv[])
                               net_mask,
                               gateway);
 
-    /* initialize telnet TCP client
+    /* initialize telnet TCP clients, one per session
      */
-    tcp_init();                                                                 // initialize TCP
-    telnet_client = tcp_new();                                                  // get a TCP
-    assert(telnet_client >= 0);                                                 // make sure it is valid
-    assert(tcp_bind(telnet_client, local_host, MY_PORT) == ERR_OK);             // bind
-    assert(tcp_notify(telnet_client, notify_callback) == ERR_OK);               // notify on remote connection close
+    tcp_init();                                         // initialize TCP
 
-    result = tcp_connect(telnet_client, telnet_server_address, port);           // try to connect
-    if ( result != ERR_OK )
+    for ( i = 0; i < session_count; i++ )
     {
-        printf("connect failed. Error\n");
-        return -1;
-    }
+        if ( (session = telnet_session_new(i)) == NULL )
+        {
+            printf("Out of memory for session %d\n", i + 1);
+            return -1;
+        }
 
-    stack_ip4addr_ntoa(telnet_server_address, ip, sizeof(ip));
-    printf("trying %s...\n", ip);
+        if ( telnet_session_connect(session, host_address[i], host_port[i], local_host) != 0 )
+        {
+            printf("connect failed. Error\n");
+            return -1;
+        }
+    }
 
     /* setup Ctrl-Break / Ctrl-C signal call back
      */
     //signal(SIGBREAK, ctrl_break);
     signal(SIGINT, ctrl_break);
 
+    /* Terminal emulation replaces ANSI.SYS, start with the first session
+     */
+    telnet_switch(sessions[0]);
+
+    capture_start = stack_time();
+    session_start = capture_start;
+
     /* main loop
-     *
+     * Every pass polls the interface, timers and keyboard, and runs all
+     * sessions. A pass that finds nothing to do idles the CPU until the next
+     * interrupt: a serial receive, a key press or the 55 mili-second timer tick.
      */
     while ( 1 )
     {
+        loop_count++;
+        busy = 0;
+
         /* periodically poll link state and if a change occurred from the last
          * test propagate the notification
          */
         if ( interface_link_state(netif) != linkState )
         {
             linkState = interface_link_state(netif);
-            printf("link state change, now = '%s'\n", linkState ? "up" : "down");
+            telnet_message(current, linkState ? "link state change, now = 'up'" : "link state change, now = 'down'");
+            busy = 1;
         }
 
         /* periodically poll for received frames,
@@ -201,109 +447,74 @@ int main(int argc , char *argv[])
          */
         stack_timers();
 
-        /* Process received data or termination notifications.
-         * In IDLE state, simply monitor the state of the connection and
-         * close the client if the connection is closed (FREE).
-         * This is a work around to allow graceful connection closure
-         * after a locally initiated close.
-         */
-        if ( telnet_state == TELNET_IDLE )
-        {
-            if ( tcp_util_conn_state(telnet_client, &telnet_connection_state) &&
-                 telnet_connection_state.state == FREE )
-            {
-                break;
-            }
-        }
-        /* Process TCP packet for command options or
-         * text data to output on the local terminal
+        /* Process received data or termination notifications of each session,
+         * exit when all sessions are closed
          */
-        else if ( telnet_state == TELNET_DATA_AVAIL )
+        for ( i = 0, open = 0; i < session_count; i++ )
         {
-            rv = tcp_recv(telnet_client, buf, BUFLEN);
-            if ( rv < 0 )
-            {
-                dos_result = -1;
-                break;
-            }
-            else if ( rv > 0 )
-            {
-                i = 0;
-                while ( i < rv )
-                {
-                    if ( buf[i] == IAC )
-                    {
-                        telnet_opt[0] = buf[i++];
-                        telnet_opt[1] = buf[i++];   // get 2 more bytes
-                        telnet_opt[2] = buf[i++];
-                        negotiate(telnet_client, telnet_opt, sizeof(telnet_opt));
-                    }
-                    else
-                    {
-                        putch(buf[i]);
-                        i++;
-                    }
-                }
-            }
-            else
-            {
-/*              TODO
-                printf("Connection closed by the remote end\n\r");
-                return 0;
-*/
-            }
+            session = sessions[i];
+            if ( !session->open )
+                continue;
 
-            telnet_state = TELNET_IDLE;
-        }
-        /* A RESET notification will be issues by the stack when the remote
-         * server is not accepting connections, and an ABORT when a connection
-         * attempt times out. In either case exit the client.
-         */
-        else if ( telnet_state == TELNET_REMOTE_RESET || telnet_state == TELNET_CON_ABORT )
-        {
-            break;
-        }
-        /* Initiate a connection close if the local user or server
-         * issued a close request. Idle the client to allow the TCP
-         * handler to gracefully close the connection.
-         */
-        else if ( telnet_state == TELNET_REMOTE_CLOSE || telnet_state == TELNET_LOCAL_CLOSE )
-        {
-            if ( (result = tcp_close(telnet_client)) != ERR_OK )
-            {
-                printf("\ntcp_close() returned %d\n", result);
+            if ( session->state != TELNET_IDLE || session->zm.role != ZM_OFF )
+                busy = 1;
+
+            if ( telnet_session_run(session) < 0 )
                 dos_result = -1;
-            }
 
-            telnet_state = TELNET_IDLE;
+            if ( session->open )
+                zmodem_poll(&session->zm, stack_time());
+
+            open += session->open;
         }
-        /* *** debug assertion telnet_state > max. states ***
-         */
-        else
-        {
-            tcp_close(telnet_client);
-            dos_result = -1;
-            printf("\n*** Bug check ***\n");
+
+        if ( open == 0 )
             break;
-        }
 
-        /* collect data from keyboard and transmit
-         * TODO the RFC calls for transmitting <CR><LF> but things seem to work well
-         * with only a <CR>
+        /* collect data from keyboard and transmit to the displayed session
+         * TODO the RFC calls for transmitting <CR><LF> in character mode but things
+         * seem to work well with only a <CR>
          */
         if ( kbhit() )
+            busy = 1;
+
+        if ( telnet_keyboard() < 0 )
         {
-            buf[0] = getch();
-            if ( tcp_send(telnet_client, buf, 1, 0) < 0 )
-            {
-                dos_result = -1;
-                break;
-            }
+            current->state = TELNET_LOCAL_CLOSE;
+            dos_result = -1;
         }
+
+        if ( !busy && idle_enabled )
+            telnet_idle();
     }
 
+    vt100_restore();
+
     slip_close();
 
+    if ( capture_file )
+        fclose(capture_file);
+
+    for ( i = 0; i < session_count; i++ )
+    {
+        session = sessions[i];
+
+        if ( session->compress_error )
+            printf("\n%s: MCCP decompression error.\n", session->host);
+
+        if ( session->parser.bytes_in )
+            printf("\n%s: MCCP %lu bytes received, %lu decompressed\n",
+                   session->host, session->parser.bytes_in, session->parser.bytes_out);
+
+        history_free(&session->history);
+        free(session);
+    }
+
+    session_start = stack_time() - session_start;
+    printf("\n%lu loop passes in %lu.%01lu sec, %lu idle (%lu%%)\n",
+           loop_count, session_start / 1000, (session_start % 1000) / 100, idle_count,
+           (loop_count < 0x01000000UL) ? (idle_count * 100 / loop_count) : (idle_count / (loop_count / 100)));
+
     printf("\nConnection closed.\n");
 
     return dos_result;
@@ -320,8 +531,19 @@ int main(int argc , char *argv[])
  */
 void notify_callback(pcbid_t connection, tcp_event_t reason)
 {
-    ip4_addr_t  ip4addr;
-    int         recvResult, i;
+    telnet_session_t   *session;
+    ip4_addr_t          ip4addr;
+    char                text[48];
+    int                 i;
+
+    for ( i = 0, session = NULL; i < session_count; i++ )
+    {
+        if ( sessions[i]->pcb == connection )
+            session = sessions[i];
+    }
+
+    if ( session == NULL )
+        return;
 
     ip4addr = tcp_remote_addr(connection);
     stack_ip4addr_ntoa(ip4addr, ip, sizeof(ip));
@@ -329,35 +551,38 @@ void notify_callback(pcbid_t connection, tcp_event_t reason)
     switch ( reason )
     {
         case TCP_EVENT_CLOSE:
-            printf("\nconnection closed by %s\n", ip);
-            telnet_state = TELNET_REMOTE_CLOSE;         // server closed the connection, issue a close to go from CLOSE_WAIT to LAST_ACK
+            sprintf(text, "connection closed by %s", ip);
+            telnet_message(session, text);
+            session->state = TELNET_REMOTE_CLOSE;       // server closed the connection, issue a close to go from CLOSE_WAIT to LAST_ACK
             break;
 
         case TCP_EVENT_ABORTED:
-            printf("\nconnection aborted\n");
-            telnet_state = TELNET_CON_ABORT;            // too many connection retries
+            telnet_message(session, "connection aborted");
+            session->state = TELNET_CON_ABORT;          // too many connection retries
             break;
 
         case TCP_EVENT_REMOTE_RST:
-            printf("\nconnection reset by %s\n", ip);
-            telnet_state = TELNET_REMOTE_RESET;
+            sprintf(text, "connection reset by %s", ip);
+            telnet_message(session, text);
+            session->state = TELNET_REMOTE_RESET;
             break;
 
         case TCP_EVENT_DATA_RECV:
         case TCP_EVENT_PUSH:
-            telnet_state = TELNET_DATA_AVAIL;
+            session->state = TELNET_DATA_AVAIL;
             break;
 
         default:
-            printf("\nunknown event %d from %s\n", reason, ip);
-            telnet_state = TELNET_LOCAL_CLOSE;
+            sprintf(text, "unknown event %d from %s", reason, ip);
+            telnet_message(session, text);
+            session->state = TELNET_LOCAL_CLOSE;
     }
 }
 
 /*------------------------------------------------
  * ctrl_break()
  *
- *  Ctrl-Break / Ctrl-C function
+ *  Ctrl-Break / Ctrl-C function, closes the displayed session
  *
  * param:  signal type
  * return: none
@@ -365,64 +590,1309 @@ void notify_callback(pcbid_t connection, tcp_event_t reason)
  */
 void ctrl_break(int sig_no)
 {
-    telnet_state = TELNET_LOCAL_CLOSE;
+    if ( current )
+        current->state = TELNET_LOCAL_CLOSE;
 }
 
 /*------------------------------------------------
- * negotiate()
+ * telnet_session_new()
  *
- *  TELNET negotiation phase of the connection.
- *  Will respond with WONT to any DO coming from the server except for window size and echo,
- *  and will encourage the server to DO echo and suppress go ahead.
- *  Screen size setting, advertised as 24 x 80 by the client.
+ *  Allocate and initialize a session.
  *
- * param:  Connection PCB,data buffer, and data buffer length
- * return: none
+ * param:  Session index
+ * return: Pointer to session, NULL if out of memory
  *
  */
-void negotiate(pcbid_t sock, uint8_t *buf, int len)
+telnet_session_t *telnet_session_new(int id)
 {
-    int     i;
-    uint8_t tmp1[] = {IAC, WILL, CMD_WINDOW_SIZE};
-    uint8_t tmp2[] = {IAC, SB, CMD_WINDOW_SIZE, 0, 80, 0, 24, IAC, SE};
+    telnet_session_t   *session;
 
-    /* Responses to server's DO commands
-     */
-    if ( buf[1] == DO )
+    session = (telnet_session_t*) calloc(1, sizeof(telnet_session_t));
+    if ( session == NULL )
+        return NULL;
+
+    session->id = id;
+    session->pcb = -1;
+    session->state = TELNET_IDLE;
+    telnet_editor_init(&session->editor);
+    vt100_init(&session->terminal, id, telnet_reply);
+    history_init(&session->history, history_kb, VT100_BLANK);
+    vt100_history(&session->terminal, &session->history);
+    zmodem_init(&session->zm, telnet_zmodem_send, telnet_zmodem_status, telnet_zmodem_ask, session);
+
+    sessions[id] = session;
+
+    return session;
+}
+
+/*------------------------------------------------
+ * telnet_session_connect()
+ *
+ *  Open a session's TCP connection.
+ *  Each session binds its own local port.
+ *
+ * param:  Session, server address and port, local address
+ * return: '0' connection attempt started, '-1' on error
+ *
+ */
+int telnet_session_connect(telnet_session_t *session, ip4_addr_t address, int port, ip4_addr_t local_host)
+{
+    char    text[32];
+
+    session->pcb = tcp_new();                                                       // get a TCP
+    assert(session->pcb >= 0);                                                      // make sure it is valid
+    assert(tcp_bind(session->pcb, local_host, MY_PORT + session->id) == ERR_OK);    // bind
+    assert(tcp_notify(session->pcb, notify_callback) == ERR_OK);                    // notify on remote connection close
+
+    if ( tcp_connect(session->pcb, address, port) != ERR_OK )                       // try to connect
+        return -1;
+
+    session->open = 1;
+
+    stack_ip4addr_ntoa(address, session->host, sizeof(session->host));
+    sprintf(text, "trying %s...", session->host);
+    telnet_message(session, text);
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * telnet_session_run()
+ *
+ *  Process received data or termination notifications of a session.
+ *  In IDLE state, simply monitor the state of the connection and
+ *  end the session if the connection is closed (FREE).
+ *  This is a work around to allow graceful connection closure
+ *  after a locally initiated close.
+ *
+ * param:  Session
+ * return: '-1' on error, '0' otherwise
+ *
+ */
+int telnet_session_run(telnet_session_t *session)
+{
+    struct tcp_conn_state_t connection_state;
+    ip4_err_t               result;
+    char                    text[32];
+    int                     rv;
+
+    if ( session->state == TELNET_IDLE )
     {
-        if ( buf[2] == CMD_WINDOW_SIZE )
+        if ( tcp_util_conn_state(session->pcb, &connection_state) &&
+             connection_state.state == FREE )
         {
-            if ( tcp_send(sock, tmp1, sizeof(tmp1), 0) < 0 )
-                exit(1);
+            telnet_session_end(session);
+        }
+    }
+    /* Process TCP packet for command options or
+     * text data to output on the session's terminal
+     */
+    else if ( session->state == TELNET_DATA_AVAIL )
+    {
+        session->state = TELNET_IDLE;
 
-            if ( tcp_send(sock, tmp2, sizeof(tmp2), 0) < 0)
-                exit(1);
+        rv = tcp_recv(session->pcb, buf, BUFLEN);
+        if ( rv < 0 )
+        {
+            tcp_close(session->pcb);
+            telnet_session_end(session);
+            return -1;
+        }
+        else if ( rv > 0 )
+        {
+            if ( capture_file && session->id == 0 )
+                telnet_capture(buf, rv, stack_time() - capture_start);
 
-            return;     // return here !
+            telnet_receive(session, buf, rv);
+            vt100_flush(&session->terminal);
         }
-        else if ( buf[2] == CMD_ECHO )
-            buf[1] = WILL;
-        else
-            buf[1] = WONT;
     }
-    /* Responses to server's will requests
+    /* A RESET notification will be issues by the stack when the remote
+     * server is not accepting connections, and an ABORT when a connection
+     * attempt times out. In either case end the session.
      */
-    else if ( buf[1] == WILL )
+    else if ( session->state == TELNET_REMOTE_RESET || session->state == TELNET_CON_ABORT )
     {
-        if ( buf[2] == CMD_ECHO         ||
-             buf[2] == CMD_SUP_GOAHEAD     )
-            buf[1] = DO;
-        else
-            buf[1] = DONT;
+        telnet_session_end(session);
+    }
+    /* Initiate a connection close if the local user or server
+     * issued a close request. Idle the session to allow the TCP
+     * handler to gracefully close the connection.
+     */
+    else if ( session->state == TELNET_REMOTE_CLOSE || session->state == TELNET_LOCAL_CLOSE )
+    {
+        session->state = TELNET_IDLE;
+
+        if ( (result = tcp_close(session->pcb)) != ERR_OK )
+        {
+            sprintf(text, "tcp_close() returned %d", result);
+            telnet_message(session, text);
+            return -1;
+        }
     }
-    /* Ignore any bad commands
+    /* *** debug assertion session state > max. states ***
      */
     else
     {
-        //printf("\nnegotiate(): found bad command.\n");
-        return;     // return here !
+        tcp_close(session->pcb);
+        telnet_message(session, "*** Bug check ***");
+        telnet_session_end(session);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * telnet_session_end()
+ *
+ *  End a closed session. Its screen is kept, and if it
+ *  is displayed the next open session is shown.
+ *
+ * param:  Session
+ * return: none
+ *
+ */
+void telnet_session_end(telnet_session_t *session)
+{
+    int     i, next;
+
+    session->open = 0;
+
+    if ( session->parser.compressed )
+    {
+        inflate_end(&session->parser.inflater);
+        session->parser.compressed = 0;
+    }
+
+    zmodem_cancel(&session->zm);
+
+    telnet_message(session, "session closed");
+
+    if ( session != current )
+        return;
+
+    for ( i = 1; i < session_count; i++ )
+    {
+        next = (session->id + i) % session_count;
+        if ( sessions[next]->open )
+        {
+            telnet_switch(sessions[next]);
+            break;
+        }
+    }
+}
+
+/*------------------------------------------------
+ * telnet_switch()
+ *
+ *  Display a session and direct keyboard input to it.
+ *  Keystrokes waiting to be coalesced in the previous session are sent first.
+ *
+ * param:  Session
+ * return: none
+ *
+ */
+void telnet_switch(telnet_session_t *session)
+{
+    if ( current && current != session && current->open &&
+         !(current->editor.mode & MODE_EDIT) )
+    {
+        telnet_send_line(current);
+    }
+
+    current = session;
+    vt100_show(&session->terminal);
+}
+
+/*------------------------------------------------
+ * telnet_message()
+ *
+ *  Show a status message on a session's terminal.
+ *
+ * param:  Session, message text
+ * return: none
+ *
+ */
+void telnet_message(telnet_session_t *session, const char *text)
+{
+    vt100_write(&session->terminal, (const uint8_t*) "\r\n[", 3);
+    vt100_write(&session->terminal, (const uint8_t*) text, strlen(text));
+    vt100_write(&session->terminal, (const uint8_t*) "]\r\n", 3);
+    vt100_flush(&session->terminal);
+}
+
+/*------------------------------------------------
+ * telnet_receive()
+ *
+ *  Process a received TCP segment.
+ *  Plain data is parsed directly. Once the server starts MCCP compression,
+ *  the rest of the segment and following segments are decompressed, and the
+ *  output is parsed as it is produced. Data after the end of the compressed
+ *  stream is parsed as plain data again.
+ *
+ * param:  Session, received data and its length
+ * return: none
+ *
+ */
+void telnet_receive(telnet_session_t *session, uint8_t *data, int len)
+{
+    telnet_parser_t *parser = &session->parser;
+    int              used, result;
+
+    while ( len > 0 )
+    {
+        if ( parser->compressed )
+        {
+            result = inflate_input(&parser->inflater, data, len, &used);
+            parser->bytes_in += used;
+
+            if ( result != INFLATE_OK )
+            {
+                inflate_end(&parser->inflater);
+                parser->compressed = 0;
+            }
+
+            if ( result == INFLATE_ERROR )
+            {
+                /* The stream cannot be resynchronized, RFC calls for closing the connection
+                 */
+                session->compress_error = 1;
+                session->state = TELNET_LOCAL_CLOSE;
+                break;
+            }
+        }
+        else
+        {
+            used = telnet_input(session, data, len);
+        }
+
+        data += used;
+        len -= used;
     }
+}
+
+/*------------------------------------------------
+ * telnet_inflated()
+ *
+ *  Parse decompressed telnet stream data.
+ *
+ * param:  Session, decompressed data and its length
+ * return: none
+ *
+ */
+void telnet_inflated(void *context, uint8_t *data, int len)
+{
+    telnet_session_t *session = (telnet_session_t*) context;
+
+    session->parser.bytes_out += len;
+    telnet_input(session, data, len);
+}
+
+/*------------------------------------------------
+ * telnet_input()
+ *
+ *  Parse a segment of the telnet stream.
+ *  Runs of text between commands are passed on in place, with one call
+ *  per run. An escaped IAC IAC is passed as a single 0xff text byte.
+ *  Commands and sub-negotiations may be split across segments, the parser
+ *  state carries over to the next call.
+ *  Parsing stops right after the sub-negotiation that starts MCCP compression,
+ *  the data following it is compressed.
+ *
+ * param:  Session, data and its length
+ * return: Number of bytes parsed
+ *
+ */
+int telnet_input(telnet_session_t *session, uint8_t *data, int len)
+{
+    telnet_parser_t *parser = &session->parser;
+    uint8_t         *start, *end, *run;
+    uint8_t          c;
+
+    start = data;
+    end = data + len;
+
+    while ( data < end )
+    {
+        if ( parser->state == TN_DATA )
+        {
+            run = memchr(data, IAC, end - data);
+            if ( run == NULL )
+                run = end;
+
+            if ( run > data )
+                telnet_data(session, data, run - data);
+
+            if ( run == end )
+                break;
+
+            parser->state = TN_IAC;
+            data = run + 1;
+            continue;
+        }
+
+        c = *data++;
+
+        switch ( parser->state )
+        {
+            case TN_IAC:
+                if ( c == IAC )
+                {
+                    /* Escaped 0xff data byte, pass the second IAC in place
+                     */
+                    parser->state = TN_DATA;
+                    telnet_data(session, data - 1, 1);
+                }
+                else if ( c >= WILL )
+                {
+                    parser->command = c;
+                    parser->state = TN_OPTION;
+                }
+                else if ( c == SB )
+                {
+                    parser->sb_len = 0;
+                    parser->state = TN_SB;
+                }
+                else
+                {
+                    parser->state = TN_DATA;        // NOP, GA, DM etc. are ignored
+                }
+                break;
+
+            case TN_OPTION:
+                negotiate(session, parser->command, c);
+                parser->state = TN_DATA;
+                break;
+
+            case TN_SB:
+                if ( c == IAC )
+                    parser->state = TN_SB_IAC;
+                else if ( parser->sb_len < SB_LEN )
+                    parser->sb[parser->sb_len++] = c;
+                break;
+
+            case TN_SB_IAC:
+                if ( c == SE )
+                {
+                    parser->state = TN_DATA;
+                    if ( parser->sb_len >= 1 && parser->sb[0] == CMD_COMPRESS2 )
+                    {
+                        if ( !parser->compressed )
+                        {
+                            inflate_init(&parser->inflater, telnet_inflated, session);
+                            parser->compressed = 1;
+                            return (data - start);
+                        }
+                    }
+                    else
+                    {
+                        subnegotiate(session, parser->sb, parser->sb_len);
+                    }
+                }
+                else if ( c == IAC )
+                {
+                    if ( parser->sb_len < SB_LEN )
+                        parser->sb[parser->sb_len++] = IAC;
+                    parser->state = TN_SB;
+                }
+                else
+                {
+                    parser->state = TN_DATA;        // Malformed sub-negotiation, drop it
+                }
+                break;
+
+            default:
+                parser->state = TN_DATA;
+        }
+    }
+
+    return len;
+}
+
+/*------------------------------------------------
+ * telnet_data()
+ *
+ *  Pass a run of text from the telnet stream to the terminal or to an active
+ *  ZMODEM transfer. Text going to the terminal is scanned for the header
+ *  that starts a transfer, and text left after a transfer ends goes back
+ *  to the terminal. Transfers are not started when replaying a capture.
+ *
+ * param:  Session, text and its length
+ * return: none
+ *
+ */
+void telnet_data(telnet_session_t *session, uint8_t *data, int len)
+{
+    zmodem_t   *zm = &session->zm;
+    int         used;
+
+    if ( replay )
+    {
+        vt100_write(&session->terminal, data, len);
+        return;
+    }
+
+    while ( len > 0 )
+    {
+        if ( zm->role != ZM_OFF )
+        {
+            used = zmodem_input(zm, data, len);
+        }
+        else
+        {
+            used = zmodem_detect(zm, data, len);
+            if ( used < 0 )
+            {
+                vt100_write(&session->terminal, data, len);
+                break;
+            }
+
+            /* Leave the start of the header off the screen
+             */
+            if ( used > 6 )
+                vt100_write(&session->terminal, data, used - 6);
+
+            telnet_binary(session);
+            telnet_message(session, (zm->role == ZM_RECEIVE) ? "ZMODEM receive, ESC to cancel" :
+                                                                "ZMODEM send, ESC to cancel");
+        }
+
+        data += used;
+        len -= used;
+    }
+}
+
+/*------------------------------------------------
+ * negotiate()
+ *
+ *  TELNET negotiation phase of the connection.
+ *  Will respond with WONT to any DO coming from the server except for window size,
+ *  terminal type, LINEMODE and echo, and will encourage the server to DO echo, suppress go ahead
+ *  and MCCP v2 compression.
+ *  Binary transmission is accepted in both directions. Its state is tracked so that
+ *  only changes are answered, which also covers the replies to telnet_binary().
+ *  Screen size setting, advertised as 25 x 80 by the client.
+ *
+ * param:  Session, command and option
+ * return: none
+ *
+ */
+void negotiate(telnet_session_t *session, uint8_t command, uint8_t option)
+{
+    uint8_t reply[3];
+    uint8_t tmp1[] = {IAC, WILL, CMD_WINDOW_SIZE};
+    uint8_t tmp2[] = {IAC, SB, CMD_WINDOW_SIZE, 0, VT100_COLS, 0, VT100_ROWS, IAC, SE};
+
+    reply[0] = IAC;
+    reply[1] = command;
+    reply[2] = option;
+
+    /* Binary transmission, agree to any change
+     */
+    if ( option == CMD_BINARY )
+    {
+        if ( command == DO && !(session->binary & BINARY_TX) )
+        {
+            session->binary |= BINARY_TX;
+            reply[1] = WILL;
+        }
+        else if ( command == DONT && (session->binary & BINARY_TX) )
+        {
+            session->binary &= ~BINARY_TX;
+            reply[1] = WONT;
+        }
+        else if ( command == WILL && !(session->binary & BINARY_RX) )
+        {
+            session->binary |= BINARY_RX;
+            reply[1] = DO;
+        }
+        else if ( command == WONT && (session->binary & BINARY_RX) )
+        {
+            session->binary &= ~BINARY_RX;
+            reply[1] = DONT;
+        }
+        else
+        {
+            return;     // return here !
+        }
+    }
+    /* Responses to server's DO commands
+     */
+    else if ( command == DO )
+    {
+        if ( option == CMD_WINDOW_SIZE )
+        {
+            if ( telnet_send(session, tmp1, sizeof(tmp1)) < 0 ||
+                 telnet_send(session, tmp2, sizeof(tmp2)) < 0 )
+                session->state = TELNET_LOCAL_CLOSE;
+
+            return;     // return here !
+        }
+        else if ( option == CMD_ECHO          ||
+                  option == CMD_TERMINAL_TYPE ||
+                  option == CMD_LINEMODE         )
+            reply[1] = WILL;
+        else
+            reply[1] = WONT;
+    }
+    /* Responses to server's will requests
+     */
+    else if ( command == WILL )
+    {
+        if ( option == CMD_ECHO         ||
+             option == CMD_SUP_GOAHEAD  ||
+             option == CMD_COMPRESS2       )
+            reply[1] = DO;
+        else
+            reply[1] = DONT;
+    }
+    /* Ignore WONT, DONT
+     */
+    else
+    {
+        return;     // return here !
+    }
+
+    if ( telnet_send(session, reply, sizeof(reply)) < 0 )
+        session->state = TELNET_LOCAL_CLOSE;
+}
+
+/*------------------------------------------------
+ * subnegotiate()
+ *
+ *  Respond to a server sub-negotiation.
+ *  The terminal type is reported as VT100, LINEMODE is handled by linemode().
+ *
+ * param:  Session, sub-negotiation option and parameters, and their length
+ * return: none
+ *
+ */
+void subnegotiate(telnet_session_t *session, uint8_t *sb, int len)
+{
+    uint8_t tmp1[] = {IAC, SB, CMD_TERMINAL_TYPE, SB_IS, 'V', 'T', '1', '0', '0', IAC, SE};
+
+    if ( len >= 2 && sb[0] == CMD_TERMINAL_TYPE && sb[1] == SB_SEND )
+    {
+        if ( telnet_send(session, tmp1, sizeof(tmp1)) < 0 )
+            session->state = TELNET_LOCAL_CLOSE;
+    }
+    else if ( len >= 2 && sb[0] == CMD_LINEMODE )
+    {
+        linemode(session, &sb[1], len - 1);
+    }
+}
+
+/*------------------------------------------------
+ * linemode()
+ *
+ *  LINEMODE sub-negotiation (RFC 1184).
+ *  MODE is acknowledged with the EDIT and TRAPSIG bits the client supports,
+ *  FORWARDMASK is refused, and SLC special character values are adopted
+ *  for the characters the local line editor uses. Switching EDIT mode on or off
+ *  first sends any buffered keystrokes or partially edited line.
+ *
+ * param:  Session, LINEMODE sub-negotiation parameters and their length
+ * return: none
+ *
+ */
+void linemode(telnet_session_t *session, uint8_t *sb, int len)
+{
+    telnet_editor_t *ed = &session->editor;
+    uint8_t reply[] = {IAC, SB, CMD_LINEMODE, LM_MODE, 0, IAC, SE};
+    uint8_t wont_forwardmask[] = {IAC, SB, CMD_LINEMODE, WONT, LM_FORWARDMASK, IAC, SE};
+    uint8_t mode;
+    int     i;
+
+    if ( sb[0] == LM_MODE && len >= 2 )
+    {
+        mode = sb[1] & MODE_SUPPORTED;
+
+        if ( (mode ^ ed->mode) & MODE_EDIT )
+            telnet_send_line(session);
+
+        ed->mode = mode;
+
+        /* An acknowledgment of a mode proposed by the client needs no reply
+         */
+        if ( sb[1] & MODE_ACK )
+            return;
+
+        /* Acknowledge when all requested modes are supported,
+         * otherwise propose the supported subset
+         */
+        reply[4] = mode;
+        if ( mode == (sb[1] & ~MODE_ACK) )
+            reply[4] |= MODE_ACK;
+
+        if ( telnet_send(session, reply, sizeof(reply)) < 0 )
+            session->state = TELNET_LOCAL_CLOSE;
+    }
+    else if ( sb[0] == DO && len >= 2 && sb[1] == LM_FORWARDMASK )
+    {
+        if ( telnet_send(session, wont_forwardmask, sizeof(wont_forwardmask)) < 0 )
+            session->state = TELNET_LOCAL_CLOSE;
+    }
+    else if ( sb[0] == LM_SLC )
+    {
+        for ( i = 1; (i + 2) < len; i += 3 )
+        {
+            if ( sb[i] == 0 || sb[i] >= SLC_COUNT )
+                continue;
+
+            if ( (sb[i + 1] & SLC_LEVELBITS) == SLC_NOSUPPORT )
+                ed->slc[sb[i]] = SLC_DISABLED;
+            else
+                ed->slc[sb[i]] = sb[i + 2];
+        }
+    }
+}
+
+/*------------------------------------------------
+ * telnet_reply()
+ *
+ *  Send a terminal response (cursor position report, device attributes)
+ *  to the server.
+ *
+ * param:  Terminal ID, which is the session index, response and response length
+ * return: none
+ *
+ */
+void telnet_reply(int id, const uint8_t *response, int len)
+{
+    if ( telnet_send(sessions[id], (uint8_t*) response, len) < 0 )
+        sessions[id]->state = TELNET_LOCAL_CLOSE;
+}
+
+/*------------------------------------------------
+ * telnet_editor_init()
+ *
+ *  Initialize keyboard state to character mode
+ *  and default special characters.
+ *
+ * param:  Keyboard state
+ * return: none
+ *
+ */
+void telnet_editor_init(telnet_editor_t *ed)
+{
+    memset(ed, 0, sizeof(telnet_editor_t));
+    memset(ed->slc, SLC_DISABLED, SLC_COUNT);
+
+    ed->slc[SLC_IP] = 0x03;         // ^C
+    ed->slc[SLC_ABORT] = 0x1c;      // ^\ (FS)
+    ed->slc[SLC_EOF] = 0x04;        // ^D
+    ed->slc[SLC_SUSP] = 0x1a;       // ^Z
+    ed->slc[SLC_EC] = 0x08;         // BS
+    ed->slc[SLC_EL] = 0x15;         // ^U
+    ed->slc[SLC_EW] = 0x17;         // ^W
+}
+
+/*------------------------------------------------
+ * telnet_keyboard()
+ *
+ *  Collect keystrokes and transmit them.
+ *  In EDIT mode keys go to the local line editor. In character mode
+ *  keystrokes are buffered and sent when COALESCE_MS passed since the first
+ *  one, when Enter is pressed, or when the buffer is full, so typed-ahead or
+ *  fast typing goes out in one segment instead of one segment per key.
+ *  Alt-1 to Alt-4 switch to another session, Ctrl-PgUp and Ctrl-PgDn browse the
+ *  scrollback history, other keys go to the displayed session.
+ *  ESC cancels the displayed session's ZMODEM transfer.
+ *
+ * param:  none
+ * return: '-1' on send error, '0' otherwise
+ *
+ */
+int telnet_keyboard(void)
+{
+    telnet_editor_t *ed;
+    uint8_t          seq[VT100_SEQ_LEN];
+    int              key, len;
+
+    while ( kbhit() )
+    {
+        key = getch();
+        if ( key == 0 || key == 0xe0 )
+            key = getch() | VT100_KEY_EXT;
+
+        if ( key >= KEY_ALT_1 && key < (KEY_ALT_1 + session_count) )
+        {
+            telnet_switch(sessions[key - KEY_ALT_1]);
+            continue;
+        }
+
+        /* Browse the history a page at a time, any other key
+         * returns to the screen and is then handled as usual
+         */
+        if ( key == KEY_CTRL_PGUP || key == KEY_CTRL_PGDN )
+        {
+            vt100_view(&current->terminal, (key == KEY_CTRL_PGUP) ? (VT100_ROWS - 1) : -(VT100_ROWS - 1));
+            continue;
+        }
+
+        if ( current->terminal.view )
+            vt100_view(&current->terminal, -current->terminal.view);
+
+        if ( !current->open )
+            continue;
+
+        /* Keys other than ESC are dropped during a file transfer
+         */
+        if ( current->zm.role != ZM_OFF )
+        {
+            if ( key == KEY_ESC )
+                zmodem_cancel(&current->zm);
+
+            continue;
+        }
+
+        ed = &current->editor;
+
+        if ( ed->mode & MODE_EDIT )
+        {
+            if ( telnet_edit(current, key) < 0 )
+                return -1;
+
+            continue;
+        }
+
+        len = vt100_key(&current->terminal, key, seq);
+        if ( len <= 0 )
+            continue;
+
+        if ( (ed->line_len + len) > LINE_LEN && telnet_send_line(current) < 0 )
+            return -1;
+
+        if ( ed->line_len == 0 )
+            ed->first_key = stack_time();
+
+        memcpy(&ed->line[ed->line_len], seq, len);
+        ed->line_len += len;
+
+        if ( key == '\r' && telnet_send_line(current) < 0 )
+            return -1;
+    }
+
+    ed = &current->editor;
+    if ( current->open && !(ed->mode & MODE_EDIT) && ed->line_len &&
+         (stack_time() - ed->first_key) >= COALESCE_MS )
+    {
+        return telnet_send_line(current);
+    }
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * telnet_edit()
+ *
+ *  Local line editing in LINEMODE EDIT mode.
+ *  Characters are echoed to the terminal and kept until Enter sends the line
+ *  with a CR LF. Erase character, erase word and erase line work on the
+ *  buffered line. With TRAPSIG, the interrupt, suspend and abort characters
+ *  discard the line and are sent as telnet commands. Keys that produce
+ *  escape sequences send the line so far followed by the sequence.
+ *
+ * param:  Session, key code
+ * return: '-1' on send error, '0' otherwise
+ *
+ */
+int telnet_edit(telnet_session_t *session, int key)
+{
+    telnet_editor_t *ed = &session->editor;
+    uint8_t          seq[VT100_SEQ_LEN];
+    uint8_t          c;
+    int              len, in_word;
+
+    if ( key & VT100_KEY_EXT )
+    {
+        len = vt100_key(&session->terminal, key, seq);
+        if ( len <= 0 )
+            return 0;
+
+        if ( telnet_send_line(session) < 0 || telnet_send(session, seq, len) < 0 )
+            return -1;
+
+        return 0;
+    }
+
+    c = (uint8_t) key;
+
+    if ( (ed->mode & MODE_TRAPSIG) && c != SLC_DISABLED &&
+         (c == ed->slc[SLC_IP] || c == ed->slc[SLC_SUSP] || c == ed->slc[SLC_ABORT]) )
+    {
+        ed->line_len = 0;
+        telnet_echo(session, "\r\n", 2);
+
+        if ( c == ed->slc[SLC_IP] )
+            return telnet_command(session, IP);
+        else if ( c == ed->slc[SLC_SUSP] )
+            return telnet_command(session, SUSP);
+        else
+            return telnet_command(session, ABORT);
+    }
+
+    if ( c == '\r' )
+    {
+        telnet_echo(session, "\r\n", 2);
+        if ( (ed->line_len + 2) > LINE_LEN && telnet_send_line(session) < 0 )
+            return -1;
+
+        ed->line[ed->line_len++] = '\r';
+        ed->line[ed->line_len++] = '\n';
+
+        return telnet_send_line(session);
+    }
+    else if ( c == ed->slc[SLC_EOF] && c != SLC_DISABLED )
+    {
+        if ( telnet_send_line(session) < 0 )
+            return -1;
+
+        return telnet_command(session, xEOF);
+    }
+    else if ( (c == ed->slc[SLC_EC] || c == 0x7f) && c != SLC_DISABLED )
+    {
+        if ( ed->line_len )
+        {
+            ed->line_len--;
+            telnet_echo(session, "\b \b", 3);
+        }
+    }
+    else if ( (c == ed->slc[SLC_EW] || c == ed->slc[SLC_EL]) && c != SLC_DISABLED )
+    {
+        in_word = 0;
+        while ( ed->line_len )
+        {
+            if ( c == ed->slc[SLC_EW] )
+            {
+                if ( ed->line[ed->line_len - 1] != ' ' )
+                    in_word = 1;
+                else if ( in_word )
+                    break;
+            }
+
+            ed->line_len--;
+            telnet_echo(session, "\b \b", 3);
+        }
+    }
+    else if ( c >= ' ' || c == '\t' )
+    {
+        if ( ed->line_len < (LINE_LEN - 2) )
+        {
+            ed->line[ed->line_len++] = c;
+            telnet_echo(session, (char*) &c, 1);
+        }
+    }
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * telnet_echo()
+ *
+ *  Echo locally edited text to the terminal.
+ *
+ * param:  Session, text and its length
+ * return: none
+ *
+ */
+void telnet_echo(telnet_session_t *session, const char *text, int len)
+{
+    vt100_write(&session->terminal, (const uint8_t*) text, len);
+    vt100_flush(&session->terminal);
+}
+
+/*------------------------------------------------
+ * telnet_send_line()
+ *
+ *  Send the buffered line or keystrokes in one segment,
+ *  with 0xff data bytes escaped as IAC IAC.
+ *
+ * param:  Session
+ * return: '-1' on send error, '0' otherwise
+ *
+ */
+int telnet_send_line(telnet_session_t *session)
+{
+    telnet_editor_t *ed = &session->editor;
+    uint8_t          out[2 * LINE_LEN];
+    int              i, len;
+
+    for ( i = 0, len = 0; i < ed->line_len; i++ )
+    {
+        if ( ed->line[i] == IAC )
+            out[len++] = IAC;
+        out[len++] = ed->line[i];
+    }
+
+    ed->line_len = 0;
+
+    if ( len && telnet_send(session, out, len) < 0 )
+        return -1;
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * telnet_command()
+ *
+ *  Send a telnet command.
+ *
+ * param:  Session, command
+ * return: '-1' on send error, '0' otherwise
+ *
+ */
+int telnet_command(telnet_session_t *session, uint8_t command)
+{
+    uint8_t cmd[2];
+
+    cmd[0] = IAC;
+    cmd[1] = command;
+
+    if ( telnet_send(session, cmd, sizeof(cmd)) < 0 )
+        return -1;
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * telnet_send()
+ *
+ *  Send data to the server.
+ *  Nothing is sent while replaying a capture.
+ *
+ * param:  Session, data and its length
+ * return: Result of tcp_send(), or data length when replaying
+ *
+ */
+int telnet_send(telnet_session_t *session, uint8_t *data, int len)
+{
+    if ( replay )
+        return len;
+
+    return tcp_send(session->pcb, data, len, 0);
+}
+
+/*------------------------------------------------
+ * telnet_binary()
+ *
+ *  Ask for binary transmission in both directions, so CR and NUL
+ *  in ZMODEM data are passed unchanged. Binary mode stays on after the transfer.
+ *
+ * param:  Session
+ * return: none
+ *
+ */
+void telnet_binary(telnet_session_t *session)
+{
+    uint8_t will_binary[] = {IAC, WILL, CMD_BINARY};
+    uint8_t do_binary[] = {IAC, DO, CMD_BINARY};
+
+    if ( !(session->binary & BINARY_TX) )
+    {
+        session->binary |= BINARY_TX;
+        if ( telnet_send(session, will_binary, sizeof(will_binary)) < 0 )
+            session->state = TELNET_LOCAL_CLOSE;
+    }
+
+    if ( !(session->binary & BINARY_RX) )
+    {
+        session->binary |= BINARY_RX;
+        if ( telnet_send(session, do_binary, sizeof(do_binary)) < 0 )
+            session->state = TELNET_LOCAL_CLOSE;
+    }
+}
+
+/*------------------------------------------------
+ * telnet_zmodem_send()
+ *
+ *  ZMODEM output function. ZMODEM output never contains
+ *  0xff bytes, so no IAC escaping is needed.
+ *
+ * param:  Session, data and its length
+ * return: Number of bytes accepted for sending, '-1' on error
+ *
+ */
+int telnet_zmodem_send(void *context, const uint8_t *data, int len)
+{
+    int     rv;
+
+    rv = telnet_send((telnet_session_t*) context, (uint8_t*) data, len);
+    if ( rv < 0 )
+        return -1;
+
+    return rv;
+}
+
+/*------------------------------------------------
+ * telnet_zmodem_status()
+ *
+ *  Show ZMODEM transfer status on the session's status line,
+ *  the line the cursor is on.
+ *
+ * param:  Session, status text
+ * return: none
+ *
+ */
+void telnet_zmodem_status(void *context, const char *text)
+{
+    telnet_session_t *session = (telnet_session_t*) context;
+
+    vt100_write(&session->terminal, (const uint8_t*) "\r[", 2);
+    vt100_write(&session->terminal, (const uint8_t*) text, strlen(text));
+    vt100_write(&session->terminal, (const uint8_t*) "]\x1b[K", 4);
+    vt100_flush(&session->terminal);
+}
+
+/*------------------------------------------------
+ * telnet_zmodem_ask()
+ *
+ *  Prompt for the name of a file to send. The session is displayed
+ *  first if it is not. The network is not serviced while the name is typed.
+ *
+ * param:  Session, name buffer and its size
+ * return: Name length, '0' for no more files
+ *
+ */
+int telnet_zmodem_ask(void *context, char *name, int size)
+{
+    telnet_session_t *session = (telnet_session_t*) context;
+    char    c;
+    int     len, key;
+
+    if ( session != current )
+        telnet_switch(session);
+
+    telnet_echo(session, "\r\nZMODEM file to send (Enter when done): ", 41);
+
+    len = 0;
+    while ( 1 )
+    {
+        key = getch();
+        if ( key == 0 || key == 0xe0 )
+        {
+            getch();
+            continue;
+        }
+
+        c = (char) key;
+
+        if ( c == '\r' )
+        {
+            break;
+        }
+        else if ( c == KEY_ESC )
+        {
+            len = 0;
+            break;
+        }
+        else if ( c == '\b' )
+        {
+            if ( len )
+            {
+                len--;
+                telnet_echo(session, "\b \b", 3);
+            }
+        }
+        else if ( c > ' ' && len < (size - 1) )
+        {
+            name[len++] = c;
+            telnet_echo(session, &c, 1);
+        }
+    }
+
+    name[len] = 0;
+    telnet_echo(session, "\r\n", 2);
+
+    return len;
+}
+
+/*------------------------------------------------
+ * telnet_capture()
+ *
+ *  Append a received segment to the capture file.
+ *  A record is a 32 bit time stamp in mili-seconds from the start of the
+ *  session, a 16 bit length and the raw segment data.
+ *
+ * param:  Received data, its length and time stamp
+ * return: none
+ *
+ */
+void telnet_capture(uint8_t *data, int len, uint32_t time_stamp)
+{
+    uint16_t    length;
+
+    length = (uint16_t) len;
+
+    if ( fwrite(&time_stamp, sizeof(uint32_t), 1, capture_file) != 1 ||
+         fwrite(&length, sizeof(uint16_t), 1, capture_file) != 1 ||
+         fwrite(data, 1, len, capture_file) != len )
+    {
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+}
+
+/*------------------------------------------------
+ * telnet_replay()
+ *
+ *  Replay a captured session through the receive, parse and render
+ *  path as fast as possible, and report the time it took.
+ *  The capture is run three times: reading the file only, parsing into
+ *  a terminal that is not displayed, and parsing with rendering to the
+ *  screen. Parse and render times are the differences between the runs,
+ *  which keeps the coarse clock() resolution out of per-segment timing.
+ *  Use a capture that takes a few seconds to replay for stable results.
+ *
+ * param:  Capture file name
+ * return: DOS exit code
+ *
+ */
+int telnet_replay(char *file_name)
+{
+    static vt100_t  offscreen;
+
+    telnet_session_t *session;
+    FILE       *replay_file;
+    char        magic[4];
+    uint32_t    time_stamp, captured, bytes, segments;
+    uint32_t    elapsed[3], parse, render;
+    uint16_t    length;
+    clock_t     start;
+    int         pass;
+
+    replay_file = fopen(file_name, "rb");
+    if ( replay_file == NULL )
+    {
+        printf("Cannot open capture file '%s'\n", file_name);
+        return -1;
+    }
+
+    if ( fread(magic, 1, 4, replay_file) != 4 || memcmp(magic, CAPTURE_MAGIC, 4) != 0 )
+    {
+        printf("'%s' is not a telnet capture file\n", file_name);
+        fclose(replay_file);
+        return -1;
+    }
+
+    setvbuf(replay_file, NULL, _IOFBF, CAPTURE_BUF);
+
+    if ( (session = telnet_session_new(0)) == NULL )
+    {
+        printf("Out of memory\n");
+        fclose(replay_file);
+        return -1;
+    }
+
+    session_count = 1;
+    current = session;
+
+    replay = 1;
+    vt100_init(&offscreen, 1, NULL);
+
+    for ( pass = 0; pass < 3; pass++ )
+    {
+        fseek(replay_file, 4L, SEEK_SET);
+        telnet_reset(session);
+
+        if ( pass == 1 )
+            vt100_show(&offscreen);
+        else if ( pass == 2 )
+            vt100_show(&session->terminal);
+
+        bytes = 0;
+        segments = 0;
+        captured = 0;
+
+        start = clock();
+
+        while ( fread(&time_stamp, sizeof(uint32_t), 1, replay_file) == 1 &&
+                fread(&length, sizeof(uint16_t), 1, replay_file) == 1 &&
+                length <= BUFLEN &&
+                fread(buf, 1, length, replay_file) == length )
+        {
+            bytes += length;
+            segments++;
+            captured = time_stamp;
+
+            if ( pass > 0 )
+            {
+                telnet_receive(session, buf, length);
+                vt100_flush(&session->terminal);
+            }
+        }
+
+        elapsed[pass] = (uint32_t)(clock() - start) * 1000UL / CLOCKS_PER_SEC;
+    }
+
+    vt100_restore();
+    fclose(replay_file);
+
+    if ( session->parser.compressed )
+        inflate_end(&session->parser.inflater);
+
+    parse = (elapsed[1] > elapsed[0]) ? (elapsed[1] - elapsed[0]) : 0;
+    render = (elapsed[2] > elapsed[1]) ? (elapsed[2] - elapsed[1]) : 0;
+
+    printf("\nReplayed %lu bytes in %lu segments, captured over %lu.%01lu sec\n",
+           bytes, segments, captured / 1000, (captured % 1000) / 100);
+    printf("  file read   %6lu ms\n", elapsed[0]);
+    printf("  parse       %6lu ms\n", parse);
+    printf("  render      %6lu ms\n", render);
+    printf("  parse+render %5lu ms, %lu bytes/sec\n", parse + render, rate_bps(bytes, parse + render));
+
+    if ( session->parser.bytes_in )
+        printf("  MCCP        %lu bytes decompressed to %lu\n", session->parser.bytes_in, session->parser.bytes_out);
+
+    history_free(&session->history);
+    free(session);
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * telnet_reset()
+ *
+ *  Reset stream parser, keyboard, terminal and history state
+ *  to that of a new session.
+ *
+ * param:  Session
+ * return: none
+ *
+ */
+void telnet_reset(telnet_session_t *session)
+{
+    if ( session->parser.compressed )
+        inflate_end(&session->parser.inflater);
+
+    memset(&session->parser, 0, sizeof(telnet_parser_t));
+    telnet_editor_init(&session->editor);
+    vt100_init(&session->terminal, session->id, telnet_reply);
+    history_clear(&session->history);
+    vt100_history(&session->terminal, &session->history);
+}
+
+/*------------------------------------------------
+ * telnet_idle()
+ *
+ *  Give up the CPU when there is no work.
+ *  INT 28h lets TSRs such as print spoolers run, then the CPU halts
+ *  until the next interrupt, so serial receive interrupts no longer compete
+ *  with a spinning loop. A frame that completes between the last poll and
+ *  the HLT waits for the next interrupt, at most one timer tick.
+ *  Under a multitasker the HLT is trapped and releases the time slice.
+ *
+ * param:  none
+ * return: none
+ *
+ */
+void telnet_idle(void)
+{
+    union REGS  regs;
+
+    idle_count++;
 
-    if ( tcp_send(sock, buf, len, 0) < 0 )
-        exit(1);
+    int86(0x28, &regs, &regs);
+    cpu_halt();
 }
@@ -0,0 +1,162 @@
+/*
+ *
+ * inflate_test.c
+ *
+ *  Regression test for the streaming decompressor in inflate.c,
+ *  built for the host with 'make test', not for DOS.
+ *  A valid dynamic Huffman stream is fed whole and one byte at a time,
+ *  and malformed streams must fail without touching memory outside the
+ *  decompressor, which is best checked with a build that has
+ *  -fsanitize=address added to HOSTCC.
+ *
+ */
+
+#include    <stdlib.h>
+#include    <stdio.h>
+#include    <string.h>
+
+#include    "inflate.h"
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     TEXT_LINES          40
+#define     TEXT_MAX            1024
+
+/* -----------------------------------------
+   Static prototypes
+----------------------------------------- */
+static void test_output(void*, uint8_t*, int);
+static int  test_stream(const char*, const uint8_t*, int, int, int);
+
+/* -----------------------------------------
+   Globals
+----------------------------------------- */
+/* zlib stream with one dynamic Huffman block, of the text built by main()
+ */
+static const uint8_t dynamic_block[] =
+{
+    0x78, 0xda, 0x6d, 0x92, 0x49, 0x0e, 0xc3, 0x20, 0x0c, 0x45, 0xf7, 0x48, 0xdc, 0x25,
+    0xd8, 0x19, 0xff, 0x6d, 0x3a, 0xb7, 0x49, 0xe7, 0xb9, 0xb7, 0xaf, 0x83, 0x54, 0x05,
+    0xe3, 0xee, 0xe0, 0x0b, 0xe3, 0xa7, 0x67, 0x17, 0x98, 0xcd, 0x17, 0xcb, 0xd5, 0x7a,
+    0xb3, 0xdd, 0x79, 0x17, 0xf0, 0x3b, 0xf7, 0xc3, 0xfe, 0x70, 0x3c, 0x79, 0x47, 0x50,
+    0xc1, 0xf9, 0x72, 0xbd, 0xdd, 0x1f, 0xde, 0x31, 0x54, 0xea, 0x5d, 0x09, 0xf3, 0xea,
+    0xe9, 0x5d, 0x85, 0x34, 0xf4, 0xae, 0x46, 0xfe, 0xe6, 0xe5, 0x5d, 0x33, 0x11, 0xf4,
+    0x83, 0x77, 0x6d, 0xc6, 0x30, 0xd6, 0x75, 0x09, 0x85, 0x50, 0x16, 0xc8, 0x98, 0x24,
+    0x0b, 0x13, 0x80, 0xdc, 0x08, 0x9a, 0x46, 0x22, 0xb6, 0xbd, 0xdf, 0x1f, 0xc9, 0xcb,
+    0xb4, 0x7d, 0x2c, 0xae, 0x0c, 0x41, 0xfc, 0xa0, 0x56, 0x2a, 0x24, 0x68, 0x60, 0xd4,
+    0x48, 0xda, 0x42, 0x09, 0x0c, 0x1d, 0xac, 0x3e, 0x2a, 0x90, 0xca, 0xa3, 0xa0, 0x19,
+    0xa2, 0x78, 0x9a, 0x28, 0xe4, 0xc6, 0xd9, 0x1c, 0x24, 0x2a, 0x6d, 0xfb, 0xd1, 0x39,
+    0x55, 0xc8, 0xec, 0x51, 0x6d, 0x10, 0x46, 0xef, 0xd4, 0x40, 0x3b, 0xa4, 0x36, 0xc7,
+    0x88, 0xd5, 0x5d, 0xaa, 0x43, 0x46, 0x5f, 0x98, 0x95, 0x90, 0x30, 0x20, 0x55, 0xc8,
+    0x04, 0xe3, 0x8f, 0x19, 0x89, 0x3c, 0x2e, 0x91, 0x9b, 0xe3, 0xca, 0xb6, 0x8f, 0x85,
+    0xb5, 0x9e, 0x87, 0x24, 0xcd, 0x9f, 0xad, 0x94, 0xb8, 0x85, 0x76, 0xc8, 0x1d, 0xfe,
+    0xec, 0xee, 0x17, 0x7b, 0xfe, 0x06, 0x11
+};
+
+/* Dynamic block header with an empty code length code,
+ * all code length code lengths are zero
+ */
+static const uint8_t empty_codelen_code[] =
+{
+    0x78, 0x01, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+/* Dynamic block header with an incomplete code length code,
+ * a single code length code of one bit
+ */
+static const uint8_t incomplete_codelen_code[] =
+{
+    0x78, 0x01, 0x05, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+/* zlib header with CINFO 15, an 8MB history window
+ */
+static const uint8_t oversize_window[] =
+{
+    0xf8, 0x00, 0x03, 0x00
+};
+
+static uint8_t  text[TEXT_MAX];
+static int      text_len = 0;
+static uint8_t  result[TEXT_MAX];
+static int      result_len;
+
+/*------------------------------------------------
+ * main()
+ *
+ */
+int main(int argc, char* argv[])
+{
+    const char *letters = "abcdefghijklmnopqrstuvwxyz";
+    int         i, failed = 0;
+
+    for ( i = 0; i < TEXT_LINES; i++ )
+        text_len += sprintf((char*) &text[text_len], "%d:%.*s\r\n", i, 9 + (i * 5) % 11, &letters[i % 7]);
+
+    failed += test_stream("dynamic block", dynamic_block, sizeof(dynamic_block), 0, INFLATE_DONE);
+    failed += test_stream("dynamic block, byte by byte", dynamic_block, sizeof(dynamic_block), 1, INFLATE_DONE);
+    failed += test_stream("empty code length code", empty_codelen_code, sizeof(empty_codelen_code), 0, INFLATE_ERROR);
+    failed += test_stream("incomplete code length code", incomplete_codelen_code, sizeof(incomplete_codelen_code), 0, INFLATE_ERROR);
+    failed += test_stream("oversize window", oversize_window, sizeof(oversize_window), 0, INFLATE_ERROR);
+
+    printf("%s\n", failed ? "FAILED" : "passed");
+
+    return failed;
+}
+
+/*------------------------------------------------
+ * test_output()
+ *
+ *  Collect decompressed output.
+ *
+ * param:  Context (unused), output data and its length
+ * return: none
+ *
+ */
+static void test_output(void *context, uint8_t *data, int len)
+{
+    if ( (result_len + len) <= TEXT_MAX )
+        memcpy(&result[result_len], data, len);
+    result_len += len;
+}
+
+/*------------------------------------------------
+ * test_stream()
+ *
+ *  Decompress a stream and check the result, and for a stream that
+ *  should decompress, its output.
+ *
+ * param:  Test name, stream and its length, '1' to feed one byte at a time, expected result
+ * return: '0' passed, '1' failed
+ *
+ */
+static int test_stream(const char *name, const uint8_t *stream, int len, int bytewise, int expected)
+{
+    inflate_t   inf;
+    int         pos, consumed, status;
+
+    result_len = 0;
+    inflate_init(&inf, test_output, NULL);
+
+    pos = 0;
+    status = INFLATE_OK;
+    while ( status == INFLATE_OK && pos < len )
+    {
+        status = inflate_input(&inf, &stream[pos], bytewise ? 1 : (len - pos), &consumed);
+        pos += consumed;
+    }
+
+    inflate_end(&inf);
+
+    if ( status != expected ||
+         (expected == INFLATE_DONE && (result_len != text_len || memcmp(result, text, text_len) != 0)) )
+    {
+        printf("%-30s failed, status %d, %d bytes out\n", name, status, result_len);
+        return 1;
+    }
+
+    printf("%-30s ok\n", name);
+
+    return 0;
+}
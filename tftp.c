@@ -2,17 +2,39 @@
  *
  * tftp.c
  *
- *  A client for the Trivial file Transfer Protocol,
+ *  A client and server for the Trivial file Transfer Protocol,
  *  which can be used to transfer files to and from remote machines.
  *  This tftp client has no interactive mode, it is limited to command line only.
- *  Default block size 512 bytes, default time out 5 sec with no retry.
+ *  Default block size 512 bytes, default time out 5 sec with retries.
+ *  The client negotiates transfer size and timeout options (RFC 2349),
+ *  pre-allocates the output file of a 'get' and reports transfer progress.
+ *  Block size (RFC 2348) and window size (RFC 7440) are negotiated on request.
+ *  Multiple files can be transferred in one session from a list file or
+ *  with DOS wild cards, with up to four transfers running concurrently.
+ *  In server mode the program serves read and write requests for one
+ *  DOS directory, to up to four clients concurrently.
+ *  Each transfer ends with a summary of block round trip times, retransmissions,
+ *  duplicates and time spent in disk I/O, optionally also logged as one line per file.
+ *  A CRC-32 of the data is calculated as blocks are read or written, and a received
+ *  file can be verified against a '<file>.crc' sidecar fetched from the server.
  *
- *  tftp [-V | -h ] [-m <mode>] -g | -p  <file> <host>
+ *  tftp [-V | -h ] [-n] [-v] [-t <timeout>] [-b <blksize>] [-w <windowsize>] [-c <count>]
+ *       [-o <log>] [-m <mode>] -g | -p  <file> | -l <list> <host>
+ *  tftp [-V | -h ] [-o <log>] -s <directory>
  *
  *  -V          version info
  *  -h          help
+ *  -n          no option negotiation
+ *  -v          verify 'get' files with CRC-32 from <file>.crc on the server
+ *  -t          retransmit timeout in seconds [1..255]
+ *  -b          block size to negotiate [8..1468]
+ *  -w          window size to negotiate [1..16]
+ *  -c          concurrent transfers [1..4]
  *  -g          "get" command
- *  -p          "put" command
+ *  -p          "put" command, <file> can include DOS wild cards
+ *  -l          list file with one "get <file>" or "put <file>" per line
+ *  -s          server mode, serve files from <directory>
+ *  -o          append a statistics line per transfer to <log>
  *  <file>      file name
  *  <host>      remote host IPv4 address
  *
@@ -24,6 +46,7 @@
  *      Block size:     https://tools.ietf.org/html/rfc2348
  *      Timeout:        https://tools.ietf.org/html/rfc2349
  *                      https://tools.ietf.org/html/rfc1123#page-44
+ *      Window size:    https://tools.ietf.org/html/rfc7440
  *
  *  TODO:
  *      Handle Ctrl-C and Ctrl-break
@@ -36,8 +59,12 @@
 #include    <string.h>
 #include    <assert.h>
 #include    <errno.h>
+#include    <ctype.h>
 //#include    <signal.h>
 #include    <unistd.h>
+#include    <io.h>
+#include    <dos.h>
+#include    <conio.h>
 
 #include    "ip/netif.h"
 #include    "ip/stack.h"
@@ -47,17 +74,31 @@
 
 #include    "ip/slip.h"     // TODO for slip_close(), remove once this is in a stack_close() call
 
+#include    "crc32.h"
+#include    "rate.h"
+
 /* -----------------------------------------
    definitions
 ----------------------------------------- */
 #define     VERSION                 "v1.0"
-#define     USAGE                   "Usage: tftp [-V | -h ] -g | -p  <file> <host>"
+#define     USAGE                   "Usage: tftp [-V | -h ] [-n] [-v] [-t <timeout>] [-b <blksize>] [-w <windowsize>]\n" \
+                                    "            [-c <count>] [-o <log>] -g | -p  <file> | -l <list> <host>\n"           \
+                                    "       tftp [-o <log>] -s <directory>"
 #define     HELP                    USAGE                                   \
                                     "\n"                                    \
                                     "-V     version info\n"                 \
                                     "-h     help\n"                         \
+                                    "-n     no option negotiation\n"        \
+                                    "-v     verify 'get' with <file>.crc\n" \
+                                    "-t     timeout in seconds [1..255]\n"  \
+                                    "-b     block size [8..1468]\n"         \
+                                    "-w     window size [1..16]\n"          \
+                                    "-c     concurrent transfers [1..4]\n"  \
                                     "-g     'get' command\n"                \
-                                    "-p     'put' command\n"                \
+                                    "-p     'put' command, wild cards ok\n" \
+                                    "-l     list of 'get|put <file>'\n"     \
+                                    "-s     server mode, ESC to exit\n"     \
+                                    "-o     transfer statistics log\n"      \
                                     "<file> file name to send or receive\n" \
                                     "<host> remote host IPv4 address\n"
 
@@ -69,12 +110,36 @@
 #define     TFTP_OP_ERR             5
 #define     TFTP_OP_OACK            6
 
-#define     TFTP_DATA               512     // Bytes
-#define     TFTP_DEF_TIMEOUT        5000    // Simple timeout in mili-seconds
-#define     TFTP_DEF_PACKET_SIZE    (TFTP_DATA + sizeof(uint16_t) + sizeof(uint16_t))
-
-#define     TFTP_STATE_SEND_REQ     0       // TFTP client states
-#define     TFTP_STATE_WAIT         1
+#define     TFTP_DATA               512     // Bytes, default block size
+#define     TFTP_MIN_BLKSIZE        8       // RFC 2348 block size range
+#define     TFTP_MAX_BLKSIZE        1468    // Fits a 1500 byte SLIP MTU
+#define     TFTP_MAX_WINDOW         16      // Blocks in flight, re-read from the file on retransmit
+#define     TFTP_DEF_TIMEOUT        5       // Default timeout in seconds
+#define     TFTP_MAX_TIMEOUT        255     // RFC 2349 timeout option range [1..255]
+#define     TFTP_RETRIES            3       // Retransmissions before giving up
+#define     TFTP_HDR_SIZE           (sizeof(uint16_t) + sizeof(uint16_t))
+#define     TFTP_MAX_PACKET_SIZE    (TFTP_MAX_BLKSIZE + TFTP_HDR_SIZE)
+#define     TFTP_FILE_BUFF          4096    // File stream buffer, a multiple of common cluster sizes
+
+#define     TFTP_OPT_TSIZE          "tsize"
+#define     TFTP_OPT_TIMEOUT        "timeout"
+#define     TFTP_OPT_BLKSIZE        "blksize"
+#define     TFTP_OPT_WINDOWSIZE     "windowsize"
+
+#define     TFTP_PROGRESS_INTERVAL  1000    // Progress display interval in mili-seconds
+#define     TFTP_RTT_BUCKETS        7       // Round trip time histogram buckets, see rtt_limit[]
+#define     TFTP_SIDECAR_EXT        ".crc"  // Checksum sidecar file name extension on the server
+#define     TFTP_SIDECAR_LEN        80      // Sidecar text kept, the CRC is the first word
+
+#define     TFTP_MAX_SESSIONS       4       // Concurrent transfers, each on its own UDP port
+#define     TFTP_LIST_LINE          (_MAX_PATH + 8)
+
+#define     TFTP_STATE_IDLE         0       // TFTP session states
+#define     TFTP_STATE_SEND_REQ     1
+#define     TFTP_STATE_WAIT         2
+
+#define     TFTP_ROLE_SEND          1       // Session sends DATA and receives ACKs
+#define     TFTP_ROLE_RECV          2       // Session receives DATA and sends ACKs
 
 #define     TFTP_MODE_BIN           1
 #define     TFTP_MODE_ASCII         2
@@ -82,6 +147,8 @@
 #define     TFTP_PORT               69      // TFTP port number
 #define     MY_PORT                 (30000+TFTP_PORT)
 
+#define     ESC                     27      // Exit server mode
+
 /* -----------------------------------------
    Types and data structures
 ----------------------------------------- */
@@ -111,20 +178,110 @@ typedef enum
     TERMINATED_UNACCEPTABLE_OPTION = 8,
 } tftp_err_t;
 
+/* Transfer statistics.
+ * Round trip times are sampled only for blocks and ACKs that were sent once (Karn's rule).
+ * Disk time covers file reads, writes and seeks, the rest of the
+ * transfer time is spent waiting on the network.
+ */
+typedef struct
+{
+    uint32_t            rtt_min;
+    uint32_t            rtt_max;
+    uint32_t            rtt_sum;
+    uint32_t            rtt_count;
+    uint32_t            rtt_hist[TFTP_RTT_BUCKETS];
+    uint32_t            retransmits;
+    uint32_t            duplicates;
+    uint32_t            disk_time;
+} tftp_stats_t;
+
+/* A single file transfer, one per concurrent session.
+ * Each session owns a UDP PCB bound to its own local port (transfer ID),
+ * and its own transmit and receive buffers.
+ * Block counters are 32 bit and wrap to the 16 bit block ID on the wire.
+ */
+typedef struct
+{
+    int                 state;
+    int                 server;                 // '1' session serves a remote client
+    int                 action;                 // TFTP_OP_RRQ or TFTP_OP_WRQ
+    int                 role;                   // TFTP_ROLE_SEND or TFTP_ROLE_RECV
+    int                 established;            // Options settled, transfer started
+    struct udp_pcb_t   *pcb;
+    uint16_t            local_port;
+    ip4_addr_t          peer_address;
+    uint16_t            peer_port;
+    uint16_t            last_peer_port;         // Transfer ID of previous transfer on this port
+    FILE               *pfile;
+    char                file_spec[_MAX_PATH];   // Full file specifier including drive and path
+    char                file_name[16];          // File name and extension (8.3 DOS format)
+    int                 options;
+    int                 timeout;
+    uint16_t            blksize;
+    uint16_t            windowsize;
+    uint32_t            tsize;                  // Transfer size, '0' if not known
+    uint32_t            block_acked;            // Send: last block ACKed, receive: last block received in order
+    uint32_t            block_next;             // Send: next block to send
+    uint32_t            block_last;             // Send: final block, '0' until end of file is read
+    uint32_t            block_reack;            // Receive: block last re-ACKed after out of order data
+    uint16_t            window_count;           // Receive: blocks received since last ACK
+    uint32_t            block_high;             // Send: highest block sent, lower blocks are retransmissions
+    uint32_t            block_time[TFTP_MAX_WINDOW]; // Send: transmit time of blocks in the window
+    uint16_t            block_retx;             // Send: bit map of retransmitted blocks in the window
+    uint32_t            ack_time;               // Receive: transmit time of last ACK, '0' if retransmitted
+    uint32_t            crc;                    // CRC-32 of the data transferred so far
+    int                 verify;                 // '1' verify a received file against its '.crc' sidecar
+    int                 sidecar;                // '1' sidecar is being fetched, ahead of the file
+    uint32_t            crc_expected;           // CRC-32 read from the sidecar
+    char                sidecar_text[TFTP_SIDECAR_LEN];
+    tftp_stats_t        stats;
+    uint16_t            rx_length;              // Length of last received TFTP packet
+    uint16_t            tx_length;              // Length of last sent TFTP packet, for retransmission
+    int                 retries;
+    uint32_t            send_time;
+    uint32_t            start_time;
+    uint32_t            last_display;
+    uint32_t            xfr_bytes;
+    uint8_t             tx_data[TFTP_MAX_PACKET_SIZE];
+    uint8_t             rx_data[TFTP_MAX_PACKET_SIZE];
+} tftp_session_t;
+
 /* -----------------------------------------
    Globals
 ----------------------------------------- */
-struct udp_pcb_t   *tftp;
 ip4_addr_t          tftp_server_address;
-uint16_t            tftp_server_port = TFTP_PORT;
-uint16_t            byte_count = 0;
 
-tftp_t             *tftp_payload;
-uint8_t             tftp_tx_data[TFTP_DEF_PACKET_SIZE];
-uint8_t             tftp_rx_data[TFTP_DEF_PACKET_SIZE];
-uint8_t             file_read_buff[TFTP_DATA];
+int                 tftp_options = 1;       // Negotiate 'tsize' and 'timeout' options
+int                 tftp_timeout = TFTP_DEF_TIMEOUT;
+uint16_t            tftp_blksize = TFTP_DATA;
+uint16_t            tftp_windowsize = 1;
+int                 tftp_concurrency = 1;
+int                 tftp_verify = 0;        // Verify 'get' files against a '.crc' sidecar
+
+tftp_session_t      sessions[TFTP_MAX_SESSIONS];
+
+struct udp_pcb_t   *tftpd;                  // Server mode request listener
+char               *tftpd_dir = NULL;
+uint8_t             tftpd_tx_data[TFTP_HDR_SIZE + 1];
+
+FILE               *job_list = NULL;        // Job source: list file,
+int                 job_single = 0;         // or a single command line file,
+int                 job_wildcard = 0;       // optionally expanded with wild cards
+int                 job_action = TFTP_OP_NONE;
+char                job_spec[_MAX_PATH];
+char                job_drive[_MAX_DRIVE];
+char                job_dir[_MAX_DIR];
+struct find_t       job_find;
+
+int                 files_ok = 0;
+int                 files_failed = 0;
+uint32_t            bytes_total = 0;
+
+FILE               *tftp_log = NULL;        // Transfer statistics log
+
+uint16_t            rtt_limit[TFTP_RTT_BUCKETS-1] = {20, 50, 100, 200, 500, 1000};  // mSec
 
-int                 tftp_client_state = TFTP_STATE_SEND_REQ;
+char                ip[17];
 
 char               *tftp_error_text[] = {"Not defined, see error text",         // 0
                                          "File not found",                      // 1
@@ -141,10 +298,35 @@ char               *tftp_error_text[] = {"Not defined, see error text",
    Function prototypes
 ----------------------------------------- */
 void      tftp_response(struct pbuf_t* const, const ip4_addr_t, const uint16_t);
-ip4_err_t tftp_send_req(ip4_addr_t, uint16_t, uint16_t, char *);
-ip4_err_t tftp_send_ack(ip4_addr_t, uint16_t, uint16_t);
-ip4_err_t tftp_send_data(ip4_addr_t, uint16_t, uint16_t, uint8_t *, int);
-ip4_err_t tftp_send_error(ip4_addr_t, uint16_t, tftp_err_t);
+void      tftpd_request(struct pbuf_t* const, const ip4_addr_t, const uint16_t);
+int       tftp_next_job(int *, char *, int);
+int       tftp_file_busy(char *);
+FILE     *tftp_file_open(char *, int);
+int       tftp_session_start(tftp_session_t *, int, char *);
+void      tftp_session_request(tftp_session_t *);
+void      tftp_session_reset(tftp_session_t *);
+void      tftpd_session_start(tftp_session_t *, ip4_addr_t, uint16_t);
+void      tftp_session_end(tftp_session_t *, int);
+void      tftp_session_complete(tftp_session_t *);
+void      tftp_session_run(tftp_session_t *);
+void      tftp_session_input(tftp_session_t *);
+void      tftp_recv_data(tftp_session_t *);
+void      tftp_recv_ack(tftp_session_t *, uint16_t);
+void      tftp_send_window(tftp_session_t *);
+void      tftp_rewind(tftp_session_t *);
+ip4_err_t tftp_send_packet(tftp_session_t *, int);
+ip4_err_t tftp_send_req(tftp_session_t *);
+ip4_err_t tftp_send_ack(tftp_session_t *, uint16_t);
+ip4_err_t tftp_send_error(tftp_session_t *, tftp_err_t);
+ip4_err_t tftp_resend(tftp_session_t *);
+int       tftp_parse_oack(tftp_session_t *);
+int       tftp_disk_space(char *, uint32_t);
+void      tftp_preallocate(tftp_session_t *);
+void      tftp_progress(tftp_session_t *, int);
+void      tftp_rtt_sample(tftp_session_t *, uint32_t);
+void      tftp_stats_print(tftp_session_t *);
+void      tftp_stats_log(tftp_session_t *, int);
+int       tftp_sidecar_crc(tftp_session_t *);
 void      tftp_get_filename(char *, char *, int);
 
 /*------------------------------------------------
@@ -154,29 +336,24 @@ void      tftp_get_filename(char *, char *, int);
  */
 int main(int argc, char* argv[])
 {
-    int                     c;
+    int                     c, i;
     char                   *xfr_mode, *host_ip;
-
-    char                   *file_spec;              // Full file specifier including drive and path
-    char                    file_name[16] = {0};    // File name and extension (8.3 DOS format)
-
-    FILE                   *pfile;
+    char                   *list_spec = NULL;
 
     struct net_interface_t *netif;
     int                     linkState;
-    ip4_err_t               result;
-
-    uint32_t                send_time;
-    uint16_t                op_code;
-    uint16_t                block_number = 0;
 
     ip4_addr_t              gateway = 0;
     ip4_addr_t              net_mask = 0;
     ip4_addr_t              local_host = 0;
 
-    int                     dos_exit = 0;
+    int                     pending = 0;            // A job is waiting for a free session
+    int                     pending_action;
+    char                    pending_spec[_MAX_PATH];
+    int                     jobs_done = 0;
+    int                     active;
+
     int                     done = 0;
-    int                     action = TFTP_OP_NONE;
     int                     mode = TFTP_MODE_BIN;
 
     /* parse command line variables
@@ -187,7 +364,7 @@ int main(int argc, char* argv[])
         return -1;
     }
 
-    while ( ( c = getopt(argc, argv, ":Vhp:g:m:")) != -1 )
+    while ( ( c = getopt(argc, argv, ":Vhnvt:b:w:c:p:g:l:s:o:m:")) != -1 )
     {
         switch ( c )
         {
@@ -199,17 +376,90 @@ int main(int argc, char* argv[])
                 printf("%s\n", HELP);
                 return 0;
 
+            case 'n':
+                // Do not negotiate options
+                tftp_options = 0;
+                break;
+
+            case 'v':
+                // Verify received files against a CRC-32 sidecar
+                tftp_verify = 1;
+                break;
+
+            case 't':
+                // Retransmit timeout to negotiate
+                tftp_timeout = atoi(optarg);
+                if ( tftp_timeout < 1 || tftp_timeout > TFTP_MAX_TIMEOUT )
+                {
+                    printf( "'-t' timeout out of range [1..%d]\n", TFTP_MAX_TIMEOUT);
+                    return 1;
+                }
+                break;
+
+            case 'b':
+                // Block size to negotiate
+                i = atoi(optarg);
+                if ( i < TFTP_MIN_BLKSIZE || i > TFTP_MAX_BLKSIZE )
+                {
+                    printf( "'-b' block size out of range [%d..%d]\n", TFTP_MIN_BLKSIZE, TFTP_MAX_BLKSIZE);
+                    return 1;
+                }
+                tftp_blksize = i;
+                break;
+
+            case 'w':
+                // Window size to negotiate
+                i = atoi(optarg);
+                if ( i < 1 || i > TFTP_MAX_WINDOW )
+                {
+                    printf( "'-w' window size out of range [1..%d]\n", TFTP_MAX_WINDOW);
+                    return 1;
+                }
+                tftp_windowsize = i;
+                break;
+
+            case 'c':
+                // Concurrent transfers
+                tftp_concurrency = atoi(optarg);
+                if ( tftp_concurrency < 1 || tftp_concurrency > TFTP_MAX_SESSIONS )
+                {
+                    printf( "'-c' count out of range [1..%d]\n", TFTP_MAX_SESSIONS);
+                    return 1;
+                }
+                break;
+
             case 'p':
                 // Set write to server ('put')
-                file_spec = optarg;
-                action = TFTP_OP_WRQ;
+                strcpy_s(job_spec, sizeof(job_spec), optarg);
+                job_action = TFTP_OP_WRQ;
+                job_single = 1;
                 break;
 
             case 'g':
                 // Set read from server ('get')
-                file_spec = optarg;
-                tftp_get_filename(file_spec, file_name, sizeof(file_name));
-                action = TFTP_OP_RRQ;
+                strcpy_s(job_spec, sizeof(job_spec), optarg);
+                job_action = TFTP_OP_RRQ;
+                job_single = 1;
+                break;
+
+            case 'l':
+                // Transfer list file
+                list_spec = optarg;
+                break;
+
+            case 's':
+                // Server mode
+                tftpd_dir = optarg;
+                break;
+
+            case 'o':
+                // Statistics log file
+                tftp_log = fopen(optarg, "a");
+                if ( tftp_log == NULL )
+                {
+                    printf("Log file open error %d\n", errno);
+                    return 1;
+                }
                 break;
 
             case 'm':
@@ -233,7 +483,15 @@ int main(int argc, char* argv[])
             case ':':
                 if ( optopt == 'm')
                     printf( "'-%c' without mode parameter\n", optopt);
-                else if ( optopt == 'p' || optopt == 'g' )
+                else if ( optopt == 't' )
+                    printf( "'-%c' without timeout value\n", optopt);
+                else if ( optopt == 'b' || optopt == 'w' )
+                    printf( "'-%c' without size value\n", optopt);
+                else if ( optopt == 'c' )
+                    printf( "'-%c' without transfer count\n", optopt);
+                else if ( optopt == 's' )
+                    printf( "'-%c' without directory\n", optopt);
+                else if ( optopt == 'p' || optopt == 'g' || optopt == 'l' || optopt == 'o' )
                     printf( "'-%c' without file name\n", optopt);
                 return 1;
 
@@ -243,52 +501,50 @@ int main(int argc, char* argv[])
         }
     }
 
-    if ( action == TFTP_OP_NONE )
-    {
-        printf( "'-p' or '-g' with file name is required\n");
-        return 1;
-    }
-
-    if ( optind < argc )
+    if ( tftpd_dir )
     {
-        host_ip = argv[optind];
-        if ( !stack_ip4addr_aton(host_ip, &tftp_server_address) )
+        if ( job_single || list_spec )
         {
-            printf( "Host IP address is not in IPv4 format\n");
+            printf( "'-s' server mode cannot be used with '-p', '-g' or '-l'\n");
             return 1;
         }
-    }
-    else
-    {
-        printf( "Host IP address is required\n");
-        return 1;
-    }
-
-/*
-    printf("file-and-path=%s\n", file_spec);
-    printf("file=%s\n", file_name);
-    printf("host=%s\n", host_ip);
-    printf("action=%d\n", action);
-    printf("mode=%d\n", mode);
 
-    return 0;
-*/
-
-    /* Prepare file for IO
-     */
-    if ( action == TFTP_OP_RRQ )
-    {
-        pfile = fopen(file_spec, "wb");
+        /* The server accepts as many concurrent clients as it has sessions
+         */
+        tftp_concurrency = TFTP_MAX_SESSIONS;
     }
     else
     {
-        pfile = fopen(file_spec, "rb");
+        if ( (job_single == 0) == (list_spec == NULL) )
+        {
+            printf( "One of '-p' or '-g' with file name, or '-l' with list file is required\n");
+            return 1;
+        }
+
+        if ( optind < argc )
+        {
+            host_ip = argv[optind];
+            if ( !stack_ip4addr_aton(host_ip, &tftp_server_address) )
+            {
+                printf( "Host IP address is not in IPv4 format\n");
+                return 1;
+            }
+        }
+        else
+        {
+            printf( "Host IP address is required\n");
+            return 1;
+        }
     }
 
-    if ( pfile == NULL )
+    if ( list_spec )
     {
-        printf("File open error %d\n", errno);
-        return 1;
+        job_list = fopen(list_spec, "r");
+        if ( job_list == NULL )
+        {
+            printf("List file open error %d\n", errno);
+            return 1;
+        }
     }
 
     /* Initialize IP stack
@@ -317,13 +573,32 @@ int main(int argc, char* argv[])
      */
     linkState = interface_link_state(netif);
 
-    /* Prepare UDP protocol and initialize for TFTP
+    /* Prepare UDP protocol and initialize a PCB for each TFTP session.
+     * All sessions share one receive callback that dispatches by local port.
+     * In server mode, requests are received on the TFTP port and each transfer
+     * continues on a session's port.
      */
     udp_init();
-    tftp = udp_new();
-    assert(tftp);
-    assert(udp_bind(tftp, local_host, MY_PORT) == ERR_OK);
-    assert(udp_recv(tftp, tftp_response) == ERR_OK);
+    for ( i = 0; i < tftp_concurrency; i++ )
+    {
+        sessions[i].state = TFTP_STATE_IDLE;
+        sessions[i].local_port = MY_PORT + i;
+        sessions[i].last_peer_port = TFTP_PORT;
+        sessions[i].pcb = udp_new();
+        assert(sessions[i].pcb);
+        assert(udp_bind(sessions[i].pcb, local_host, sessions[i].local_port) == ERR_OK);
+        assert(udp_recv(sessions[i].pcb, tftp_response) == ERR_OK);
+    }
+
+    if ( tftpd_dir )
+    {
+        tftpd = udp_new();
+        assert(tftpd);
+        assert(udp_bind(tftpd, local_host, TFTP_PORT) == ERR_OK);
+        assert(udp_recv(tftpd, tftpd_request) == ERR_OK);
+
+        printf("Serving %s, press ESC to exit\n", tftpd_dir);
+    }
 
     /* Main TFTP loop
      */
@@ -346,325 +621,1671 @@ int main(int argc, char* argv[])
          */
         stack_timers();
 
-        switch ( tftp_client_state )
+        /* Server mode runs until stopped from the keyboard,
+         * new sessions are started by requests from clients.
+         */
+        if ( tftpd_dir )
         {
-            /* Initiate connection by sending a read or write request to the server
-             */
-            case TFTP_STATE_SEND_REQ:
-
-                result = tftp_send_req(tftp_server_address, tftp_server_port, action, file_name);
-
-                send_time = stack_time();
-
-                if ( result == ERR_OK ||
-                     result == ERR_ARP_QUEUE )
-                {
-                    /* Wait for TFTP server response
-                     */
-                    tftp_client_state = TFTP_STATE_WAIT;
-                }
-                else if ( result == ERR_ARP_NONE )
-                {
-                    /* TFTP server address could not be resolved or was not found.
-                     * Exit with error.
-                     * Will not happen with SLIP.
-                     */
-                    printf("Cannot resolve TFTP server address\n");
-                    dos_exit = 1;
-                    done = 1;
-                }
-                else
-                {
-                    printf("Error code %d\n", result);
-                    dos_exit = 1;
-                    done = 1;
-                }
+            for ( i = 0; i < tftp_concurrency; i++ )
+            {
+                if ( sessions[i].state != TFTP_STATE_IDLE )
+                    tftp_session_run(&sessions[i]);
+            }
 
-                break;
+            if ( kbhit() && getch() == ESC )
+                done = 1;
 
-            /* Wait for response packet: DATA, ACK, ERR, or OACK
-             * and monitor for a timeout.
-             * Use first response to extract server port number for next transmission.
-             */
-            case TFTP_STATE_WAIT:
-                tftp_payload = (tftp_t *) &tftp_rx_data[0];
-                op_code = stack_ntoh(tftp_payload->opcode);
+            continue;
+        }
 
-                /* No response yet, process time-outs
-                 */
-                if ( op_code == TFTP_OP_NONE )
-                {
-                    if ( (stack_time() - send_time) > TFTP_DEF_TIMEOUT )
-                    {
-                        printf("No response from TFTP server\n");
-                        dos_exit = 1;
-                        done = 1;
-                    }
-                }
+        /* Start the next job on any idle session, as long as the same file
+         * is not already in transfer, and run all active sessions.
+         */
+        active = 0;
 
-                /* Received data packet for read request or previous a read ACK,
-                 * store the data and send an ACK
-                 */
-                else if ( op_code == TFTP_OP_DATA &&
-                          action == TFTP_OP_RRQ )
+        for ( i = 0; i < tftp_concurrency; i++ )
+        {
+            if ( sessions[i].state == TFTP_STATE_IDLE )
+            {
+                if ( !pending && !jobs_done )
                 {
-                    block_number++;
-
-                    if ( stack_ntoh(tftp_payload->ptr.block_id) != block_number )
-                    {
-                        tftp_send_error(tftp_server_address, tftp_server_port, UNKNOWN_ID);
-                        printf("Bad block ID (expected %d, received %d)\n", block_number, stack_ntoh(tftp_payload->ptr.block_id));
-                        dos_exit = 1;
-                        done = 1;
-                    }
-                    else if ( fwrite(tftp_rx_data + 2 * sizeof(uint16_t), sizeof(uint8_t), byte_count, pfile) != byte_count )
-                    {
-                        tftp_send_error(tftp_server_address, tftp_server_port, DISK_FULL);
-                        printf("Output file write error\n");
-                        dos_exit = 1;
-                        done = 1;
-                    }
-                    else
-                    {
-                        tftp_send_ack(tftp_server_address, tftp_server_port, block_number);
-                        send_time = stack_time();
-                    }
-
-                    // Complete the exchange if partial block was received
-                    if ( byte_count < TFTP_DATA )
-                    {
-                        block_number--;
-                        printf("Receive complete (%lu bytes)\n", ((uint32_t) block_number * TFTP_DATA + byte_count));
-                        dos_exit = 0;
-                        done = 1;
-                    }
+                    pending = tftp_next_job(&pending_action, pending_spec, sizeof(pending_spec));
+                    jobs_done = !pending;
                 }
 
-                /* Received an ACK for data sent or a write request,
-                 * send next data block.
-                 */
-                else if ( op_code == TFTP_OP_ACK &&
-                          action == TFTP_OP_WRQ )
+                if ( pending && !tftp_file_busy(pending_spec) )
                 {
-                    if ( stack_ntoh(tftp_payload->ptr.block_id) != block_number )
-                    {
-                        tftp_send_error(tftp_server_address, tftp_server_port, UNKNOWN_ID);
-                        printf("Bad block ID (expected %u, received %u)\n", block_number, stack_ntoh(tftp_payload->ptr.block_id));
-                        dos_exit = 1;
-                        done = 1;
-                    }
-                    else
-                    {
-                        byte_count = fread(file_read_buff, sizeof(uint8_t), TFTP_DATA, pfile);
-
-                        if (  ferror(pfile) )
-                        {
-                            tftp_send_error(tftp_server_address, tftp_server_port, ACCESS_VIOLATION);
-                            printf("File read error\n");
-                            dos_exit = 1;
-                            done = 1;
-                        }
-                        else
-                        {
-                            block_number++;
-                            tftp_send_data(tftp_server_address, tftp_server_port,
-                                           block_number, file_read_buff, byte_count);
-                            send_time = stack_time();
-
-                            // Complete the exchange if partial block was read from the file (don't wait for ACK)
-                            if ( byte_count < TFTP_DATA )
-                            {
-                                block_number--;
-                                printf("Send complete (%lu bytes)\n", ((uint32_t) block_number * TFTP_DATA + byte_count));
-                                dos_exit = 0;
-                                done = 1;
-                            }
-                        }
-                    }
+                    pending = 0;
+                    if ( !tftp_session_start(&sessions[i], pending_action, pending_spec) )
+                        files_failed++;
                 }
+            }
 
-                /* Received and error condition from the server
-                 */
-                else if ( op_code == TFTP_OP_ERR )
-                {
-                    printf("Server error: %s\n", tftp_error_text[stack_ntoh(tftp_payload->ptr.err_code)]);
-                    dos_exit = 1;
-                    done = 1;
-                }
+            if ( sessions[i].state != TFTP_STATE_IDLE )
+            {
+                tftp_session_run(&sessions[i]);
+                active++;
+            }
+        }
 
-                /* Send and error to the server and abort, including for:
-                 *  TFTP_OP_RRQ, TFTP_OP_WRQ, TFTP_OP_OACK
-                 */
-                else
-                {
-                    tftp_send_error(tftp_server_address, tftp_server_port, ILLIGAL_OPERATION);
-                    printf("Unexpected response code %u\n", op_code);
-                    dos_exit = 1;
-                    done = 1;
-                }
+        if ( jobs_done && !pending && active == 0 )
+            done = 1;
 
-                break;
+    } /* End of main loop */
 
-            default:
-                printf("*** Bug check (tftp_client_state=%d) ***\n", tftp_client_state);
-                dos_exit = 1;
-                done = 1;
-        }
+    for ( i = 0; i < tftp_concurrency; i++ )
+    {
+        if ( sessions[i].state != TFTP_STATE_IDLE )
+            tftp_session_end(&sessions[i], 1);
+    }
 
-    } /* End of main loop */
+    if ( job_list )
+        fclose(job_list);
 
-    fclose(pfile);
+    if ( tftp_log )
+        fclose(tftp_log);
 
     slip_close();
 
-    return dos_exit;
+    if ( (files_ok + files_failed) > 1 )
+        printf("%d file(s) transferred (%lu bytes), %d failed\n", files_ok, bytes_total, files_failed);
+
+    return (files_failed ? 1 : 0);
 }
 
 /*------------------------------------------------
  * tftp_response()
  *
- *  Callback to receive TFTP server responses.
- *  Copy pbuf data into TFTP input buffer and update server port after first server response.
+ *  Callback to receive TFTP packets of a transfer in progress.
+ *  Find the session by the destination (local) port of the datagram,
+ *  copy pbuf data into the session's TFTP input buffer and process it.
+ *  Packets are processed here and not in the main loop, because with a
+ *  window size larger than one several may arrive back to back.
+ *  Datagrams from a transfer ID other than the session's peer are dropped,
+ *  this includes late retransmissions from a previous transfer on the same port.
  *
  * param:  pointer to response pbuf, source IP address and source port
- * return: This function changes global variable (1) the server port 'tftp_server_port' after
- *         the first packet is received, and (2) reflects the byte count 'byte_count' of the
- *         received TFTP transfer.
+ * return: This function changes the session's (1) peer port 'peer_port' after
+ *         the first packet is received, and (2) the packet length 'rx_length'.
  *
  */
 void tftp_response(struct pbuf_t* const p, const ip4_addr_t srcIP, const uint16_t srcPort)
 {
-    byte_count = p->len-(FRAME_HDR_LEN+IP_HDR_LEN+UDP_HDR_LEN);
+    tftp_session_t *session = NULL;
+    uint16_t        dest_port, src_port;
+    int             i;
+
+    dest_port = stack_ntoh(*((uint16_t *) &(p->pbuf[(FRAME_HDR_LEN+IP_HDR_LEN+sizeof(uint16_t))])));
+    src_port = stack_ntoh(srcPort);
+
+    for ( i = 0; i < tftp_concurrency; i++ )
+    {
+        if ( sessions[i].local_port == dest_port &&
+             sessions[i].state == TFTP_STATE_WAIT )
+        {
+            session = &sessions[i];
+            break;
+        }
+    }
+
+    if ( session == NULL ||
+         srcIP != session->peer_address ||
+         (session->peer_port != TFTP_PORT && session->peer_port != src_port) ||
+         (session->peer_port == TFTP_PORT && session->last_peer_port == src_port) )
+    {
+        return;
+    }
+
+    session->rx_length = p->len-(FRAME_HDR_LEN+IP_HDR_LEN+UDP_HDR_LEN);
 
-    memcpy_s(tftp_rx_data, sizeof(tftp_rx_data),
-             &(p->pbuf[(FRAME_HDR_LEN+IP_HDR_LEN+UDP_HDR_LEN)]), byte_count);
+    if ( session->rx_length < TFTP_HDR_SIZE ||
+         session->rx_length > sizeof(session->rx_data) )
+    {
+        return;
+    }
 
-    byte_count -= 2 * sizeof(uint16_t); // Adjust for opcode and block number
+    memcpy_s(session->rx_data, sizeof(session->rx_data),
+             &(p->pbuf[(FRAME_HDR_LEN+IP_HDR_LEN+UDP_HDR_LEN)]), session->rx_length);
 
-    if ( tftp_server_port == TFTP_PORT )
-        tftp_server_port = stack_ntoh(srcPort);
+    if ( session->peer_port == TFTP_PORT )
+        session->peer_port = src_port;
+
+    tftp_session_input(session);
 }
 
 /*------------------------------------------------
- * tftp_send_req()
+ * tftpd_request()
  *
- *  Sent TFTP read or write request.
- *  The request code is NOT checked to be either '1'=Read or '2'=Write.
- *  Function always requests an 'octet' (binary) mode transfer, with no other options.
+ *  Server mode callback to receive read and write requests on the TFTP port.
+ *  A request is handed to an idle session that continues the transfer on
+ *  its own port. Retransmitted requests of a transfer in progress are ignored.
  *
- * param:  Server IP and port number, request type, and pointer to file name
- * return: Clears global receive data buffer, and returns stack error code
+ * param:  pointer to request pbuf, source IP address and source port
+ * return: none
  *
  */
-ip4_err_t tftp_send_req(ip4_addr_t server_ip, uint16_t server_port, uint16_t request_type, char *file_name)
+void tftpd_request(struct pbuf_t* const p, const ip4_addr_t srcIP, const uint16_t srcPort)
 {
-    ip4_err_t   result;
-    char       *options;
-    int         options_length;
+    tftp_session_t *session = NULL;
+    tftp_t         *tftp_payload;
+    uint16_t        length, src_port, op_code;
+    int             i;
+
+    length = p->len-(FRAME_HDR_LEN+IP_HDR_LEN+UDP_HDR_LEN);
+    src_port = stack_ntoh(srcPort);
 
-    memset(tftp_rx_data, 0, sizeof(tftp_rx_data));
+    tftp_payload = (tftp_t *) &(p->pbuf[(FRAME_HDR_LEN+IP_HDR_LEN+UDP_HDR_LEN)]);
+    op_code = stack_ntoh(tftp_payload->opcode);
 
-    tftp_payload = (tftp_t *) &tftp_tx_data[0];
+    if ( length < TFTP_HDR_SIZE ||
+         (op_code != TFTP_OP_RRQ && op_code != TFTP_OP_WRQ) )
+    {
+        return;
+    }
+
+    for ( i = 0; i < tftp_concurrency; i++ )
+    {
+        if ( sessions[i].state != TFTP_STATE_IDLE )
+        {
+            if ( sessions[i].peer_address == srcIP && sessions[i].peer_port == src_port )
+                return;
+        }
+        else if ( session == NULL )
+        {
+            session = &sessions[i];
+        }
+    }
 
-    tftp_payload->opcode = stack_hton(request_type);
+    /* No free session, reject the request from the TFTP port
+     */
+    if ( session == NULL || length > sizeof(session->rx_data) )
+    {
+        tftp_payload = (tftp_t *) &tftpd_tx_data[0];
+        tftp_payload->opcode = stack_hton(TFTP_OP_ERR);
+        tftp_payload->ptr.err_code = stack_hton(NOT_DEFINED);
+        tftp_payload->payload = 0;
+        udp_sendto(tftpd, tftpd_tx_data, sizeof(tftpd_tx_data), srcIP, src_port);
+        return;
+    }
 
-    options = &(tftp_payload->ptr.options);
+    memcpy_s(session->rx_data, sizeof(session->rx_data),
+             &(p->pbuf[(FRAME_HDR_LEN+IP_HDR_LEN+UDP_HDR_LEN)]), length);
+    session->rx_length = length;
 
-    strcpy_s(options, TFTP_DATA, file_name);
-    options_length = strnlen_s(file_name, TFTP_DATA) + 1;
+    tftpd_session_start(session, srcIP, src_port);
+}
 
-    strcpy_s(options + options_length, TFTP_DATA, "octet"); // TODO Always binary mode
-    options_length += 6;                                    // TODO "octet\0"
+/*------------------------------------------------
+ * tftp_next_job()
+ *
+ *  Get the next file to transfer from the list file or command line.
+ *  A 'put' file specifier with DOS wild cards is expanded to all matching files.
+ *  List file lines are "get <file>" or "put <file>", blank lines and
+ *  lines starting with '#' are ignored. Bad entries are reported and counted as failed.
+ *
+ * param:  Pointer to action output, file specifier output buffer and its length
+ * return: '1' a job was returned, '0' no more jobs
+ *
+ */
+int tftp_next_job(int *action, char *file_spec, int file_spec_len)
+{
+    char    line[TFTP_LIST_LINE];
+    char   *verb, *spec;
+
+    while ( 1 )
+    {
+        /* Continue a wild card expansion in progress
+         */
+        if ( job_wildcard )
+        {
+            if ( _dos_findnext(&job_find) == 0 )
+            {
+                _makepath(file_spec, job_drive, job_dir, job_find.name, NULL);
+                *action = TFTP_OP_WRQ;
+                return 1;
+            }
 
-    options_length += sizeof(uint16_t);
+            job_wildcard = 0;
+        }
 
-    result = udp_sendto(tftp, (uint8_t*) &tftp_tx_data[0], options_length,
-                        server_ip, server_port);
+        /* Next job from the list file or the command line
+         */
+        if ( job_list )
+        {
+            if ( fgets(line, sizeof(line), job_list) == NULL )
+                return 0;
 
-    return result;
+            verb = strtok(line, " \t\r\n");
+            if ( verb == NULL || *verb == '#' )
+                continue;
+
+            spec = strtok(NULL, " \t\r\n");
+            if ( spec == NULL )
+            {
+                printf("List entry '%s' without file name\n", verb);
+                files_failed++;
+                continue;
+            }
+
+            if ( stricmp(verb, "get") == 0 )
+            {
+                job_action = TFTP_OP_RRQ;
+            }
+            else if ( stricmp(verb, "put") == 0 )
+            {
+                job_action = TFTP_OP_WRQ;
+            }
+            else
+            {
+                printf("List entry '%s' is not 'get' or 'put'\n", verb);
+                files_failed++;
+                continue;
+            }
+
+            strcpy_s(job_spec, sizeof(job_spec), spec);
+        }
+        else if ( job_single )
+        {
+            job_single = 0;
+        }
+        else
+        {
+            return 0;
+        }
+
+        if ( strpbrk(job_spec, "*?") )
+        {
+            if ( job_action != TFTP_OP_WRQ )
+            {
+                printf("Wild cards are only valid with 'put' (%s)\n", job_spec);
+                files_failed++;
+                continue;
+            }
+
+            _splitpath(job_spec, job_drive, job_dir, NULL, NULL);
+
+            if ( _dos_findfirst(job_spec, _A_NORMAL, &job_find) != 0 )
+            {
+                printf("No files match %s\n", job_spec);
+                files_failed++;
+                continue;
+            }
+
+            _makepath(file_spec, job_drive, job_dir, job_find.name, NULL);
+            job_wildcard = 1;
+        }
+        else
+        {
+            strcpy_s(file_spec, file_spec_len, job_spec);
+        }
+
+        *action = job_action;
+        return 1;
+    }
 }
 
 /*------------------------------------------------
- * tftp_send_ack()
+ * tftp_file_busy()
  *
- *  Sent TFTP ACK message.
+ *  Check if a file is being transferred by an active session.
+ *  Only independent files are transferred concurrently.
  *
- * param:  Server IP and port number, block ID being ACKed
- * return: Clears global receive data buffer, and returns stack error code
+ * param:  File specifier
+ * return: '1' file in use by a session, '0' not in use
  *
  */
-ip4_err_t tftp_send_ack(ip4_addr_t server_ip, uint16_t server_port, uint16_t block_id)
+int tftp_file_busy(char *file_spec)
 {
-    ip4_err_t   result;
+    char    file_name[16];
+    int     i;
 
-    memset(tftp_rx_data, 0, sizeof(tftp_rx_data));
+    tftp_get_filename(file_spec, file_name, sizeof(file_name));
 
-    tftp_payload = (tftp_t *) &tftp_tx_data[0];
+    for ( i = 0; i < tftp_concurrency; i++ )
+    {
+        if ( sessions[i].state != TFTP_STATE_IDLE &&
+             (stricmp(sessions[i].file_spec, file_spec) == 0 ||
+              stricmp(sessions[i].file_name, file_name) == 0) )
+            return 1;
+    }
 
-    tftp_payload->opcode = stack_hton(TFTP_OP_ACK);
-    tftp_payload->ptr.block_id = stack_hton(block_id);
+    return 0;
+}
+
+/*------------------------------------------------
+ * tftp_file_open()
+ *
+ *  Open a file for a transfer, in binary mode and with a large stream buffer
+ *  so DOS reads and writes whole clusters instead of single blocks.
+ *  Client and server transfers both use this path.
+ *
+ * param:  File specifier, '1' to create a file for writing or '0' to open a file for reading
+ * return: File stream, or NULL if the file could not be opened
+ *
+ */
+FILE *tftp_file_open(char *file_spec, int write_file)
+{
+    FILE   *pfile;
 
-    result = udp_sendto(tftp, (uint8_t*) &tftp_tx_data[0], (2 * sizeof(uint16_t)),
-                        server_ip, server_port);
+    pfile = fopen(file_spec, write_file ? "wb" : "rb");
 
-    return result;
+    if ( pfile )
+        setvbuf(pfile, NULL, _IOFBF, TFTP_FILE_BUFF);
+
+    return pfile;
 }
 
 /*------------------------------------------------
- * tftp_send_data()
+ * tftp_session_start()
  *
- *  Sent TFTP data to server.
+ *  Open the local file and prepare a client session for a new transfer.
+ *  The size of a file being sent is advertised with the 'tsize' option.
  *
- * param:  Server IP and port number, block ID and pointer to data buffer with its size.
- * return: Clears global receive data buffer, and returns stack error code
+ * param:  Pointer to an idle session, transfer type and file specifier
+ * return: '1' session started, '0' file could not be opened
  *
  */
-ip4_err_t tftp_send_data(ip4_addr_t server_ip, uint16_t server_port,
-                         uint16_t block_id, uint8_t *buffer, int byte_count)
+int tftp_session_start(tftp_session_t *session, int action, char *file_spec)
 {
-    ip4_err_t   result;
+    strcpy_s(session->file_spec, sizeof(session->file_spec), file_spec);
+    tftp_get_filename(file_spec, session->file_name, sizeof(session->file_name));
 
-    memset(tftp_rx_data, 0, sizeof(tftp_rx_data));
+    session->pfile = tftp_file_open(file_spec, (action == TFTP_OP_RRQ));
 
-    tftp_payload = (tftp_t *) &tftp_tx_data[0];
+    if ( session->pfile == NULL )
+    {
+        printf("%s: File open error %d\n", session->file_name, errno);
+        return 0;
+    }
 
-    tftp_payload->opcode = stack_hton(TFTP_OP_DATA);
-    tftp_payload->ptr.block_id = stack_hton(block_id);
+    session->server = 0;
+    session->action = action;
+    session->role = (action == TFTP_OP_RRQ) ? TFTP_ROLE_RECV : TFTP_ROLE_SEND;
+    session->peer_address = tftp_server_address;
+    session->verify = (tftp_verify && action == TFTP_OP_RRQ);
+    session->sidecar = session->verify;
+    session->crc_expected = 0;
+    memset(session->sidecar_text, 0, sizeof(session->sidecar_text));
 
-    memcpy_s(&(tftp_payload->payload), (sizeof(tftp_tx_data) - 2 * sizeof(uint16_t)),
-             buffer, byte_count);
+    tftp_session_request(session);
 
-    result = udp_sendto(tftp, (uint8_t*) &tftp_tx_data[0], (byte_count + 2 * sizeof(uint16_t)),
-                        server_ip, server_port);
+    return 1;
+}
 
-    return result;
+/*------------------------------------------------
+ * tftp_session_request()
+ *
+ *  Prepare a client session to send a new request to the server,
+ *  for the file or for its checksum sidecar.
+ *
+ * param:  Pointer to session with an open file
+ * return: none
+ *
+ */
+void tftp_session_request(tftp_session_t *session)
+{
+    session->established = 0;
+    session->options = tftp_options;
+    session->timeout = tftp_timeout;
+    session->blksize = tftp_options ? tftp_blksize : TFTP_DATA;
+    session->windowsize = tftp_options ? tftp_windowsize : 1;
+    session->tsize = (session->action == TFTP_OP_WRQ) ? filelength(fileno(session->pfile)) : 0;
+    session->peer_port = TFTP_PORT;
+
+    tftp_session_reset(session);
+
+    session->state = TFTP_STATE_SEND_REQ;
 }
 
 /*------------------------------------------------
- * tftp_send_error()
+ * tftp_session_reset()
  *
- *  Sent TFTP error from client to server.
+ *  Reset block counters, checksum and statistics of a session
+ *  to the start of a transfer.
  *
- * param:  Server IP and port number, error code
- * return: Clears global receive data buffer, and returns stack error code
+ * param:  Pointer to session
+ * return: none
  *
  */
-ip4_err_t tftp_send_error(ip4_addr_t server_ip, uint16_t server_port, tftp_err_t error_code)
+void tftp_session_reset(tftp_session_t *session)
 {
-    ip4_err_t   result;
+    session->block_acked = 0;
+    session->block_next = 1;
+    session->block_last = 0;
+    session->block_reack = 0xffffffffUL;
+    session->window_count = 0;
+    session->block_high = 0;
+    session->block_retx = 0;
+    session->ack_time = 0;
+    session->retries = TFTP_RETRIES;
+    session->last_display = 0;
+    session->xfr_bytes = 0;
+    session->crc = 0;
+    memset(&session->stats, 0, sizeof(tftp_stats_t));
+}
 
-    memset(tftp_rx_data, 0, sizeof(tftp_rx_data));
+/*------------------------------------------------
+ * tftpd_session_start()
+ *
+ *  Start a server session from a read or write request in the session's
+ *  receive buffer. Validate the file name, open the file in the served directory
+ *  and answer the request options the server supports with an OACK.
+ *  Without options, a read request is answered with the first data block
+ *  and a write request with ACK of block '0'.
+ *  Errors are sent from the session port and leave the session idle.
+ *
+ * param:  Pointer to an idle session, client IP address and port
+ * return: none
+ *
+ */
+void tftpd_session_start(tftp_session_t *session, ip4_addr_t client_ip, uint16_t client_port)
+{
+    tftp_t     *tftp_payload;
+    char       *option, *value, *end, *oack;
+    long        number;
+    int         oack_length = 0;
+    tftp_err_t  error = NOT_DEFINED;
+
+    tftp_payload = (tftp_t *) &(session->rx_data[0]);
+
+    session->server = 1;
+    session->action = stack_ntoh(tftp_payload->opcode);
+    session->role = (session->action == TFTP_OP_RRQ) ? TFTP_ROLE_SEND : TFTP_ROLE_RECV;
+    session->established = 1;
+    session->options = 0;
+    session->timeout = tftp_timeout;
+    session->blksize = TFTP_DATA;
+    session->windowsize = 1;
+    session->tsize = 0;
+    session->peer_address = client_ip;
+    session->peer_port = client_port;
+    session->verify = 0;
+    session->sidecar = 0;
+    session->pfile = NULL;
+
+    tftp_session_reset(session);
+
+    stack_ip4addr_ntoa(client_ip, ip, sizeof(ip));
+
+    /* File name and mode, then option/value pairs
+     */
+    option = &(tftp_payload->ptr.options);
+    end = (char *) &(session->rx_data[0]) + session->rx_length;
+    value = option + strnlen_s(option, end - option) + 1;
 
-    tftp_payload = (tftp_t *) &tftp_tx_data[0];
+    if ( value >= end ||
+         (value + strnlen_s(value, end - value)) >= end )
+    {
+        error = ILLIGAL_OPERATION;
+        goto reject;
+    }
 
-    tftp_payload->opcode = stack_hton(TFTP_OP_ERR);
-    tftp_payload->ptr.err_code = stack_hton(error_code);
-    tftp_payload->payload = 0;  // No error text
+    /* Only plain DOS file names in the served directory,
+     * no drive, path or parent directory references
+     */
+    if ( strpbrk(option, ":\\/") || option[0] == '.' ||
+         strnlen_s(option, sizeof(session->file_name)) >= sizeof(session->file_name) )
+    {
+        error = ACCESS_VIOLATION;
+        goto reject;
+    }
 
-    result = udp_sendto(tftp, (uint8_t*) &tftp_tx_data[0], (2 * sizeof(uint16_t) + 1),
-                        server_ip, server_port);
+    strcpy_s(session->file_name, sizeof(session->file_name), option);
+    _makepath(session->file_spec, NULL, tftpd_dir, session->file_name, NULL);
 
-    return result;
+    /* Files are transferred as they are on disk, so only binary mode,
+     * a netascii request is refused rather than served with DOS line endings
+     */
+    if ( stricmp(value, "octet") != 0 )
+    {
+        error = ILLIGAL_OPERATION;
+        goto reject;
+    }
+
+    printf("%s %s from %s:%u\n", (session->action == TFTP_OP_RRQ) ? "RRQ" : "WRQ",
+           session->file_name, ip, client_port);
+
+    /* A file is read from the start, but an existing file is not overwritten,
+     * and a file to write is only created once its options are accepted
+     */
+    if ( session->action == TFTP_OP_RRQ )
+    {
+        session->pfile = tftp_file_open(session->file_spec, 0);
+        if ( session->pfile == NULL )
+        {
+            error = FILE_NOT_FOUND;
+            goto reject;
+        }
+    }
+    else if ( access(session->file_spec, F_OK) == 0 )
+    {
+        error = FILE_EXISTS;
+        goto reject;
+    }
+
+    /* Options, unknown options are ignored and not acknowledged
+     */
+    oack = &(((tftp_t *) &(session->tx_data[0]))->ptr.options);
+    option = value + strnlen_s(value, end - value) + 1;
+
+    while ( option < end )
+    {
+        value = option + strnlen_s(option, end - option) + 1;
+        if ( value >= end )
+            break;
+
+        number = atol(value);
+
+        if ( stricmp(option, TFTP_OPT_BLKSIZE) == 0 && number >= TFTP_MIN_BLKSIZE )
+        {
+            session->blksize = (number > TFTP_MAX_BLKSIZE) ? TFTP_MAX_BLKSIZE : (uint16_t) number;
+            oack_length += sprintf(oack + oack_length, "%s%c%u", TFTP_OPT_BLKSIZE, 0, session->blksize) + 1;
+        }
+        else if ( stricmp(option, TFTP_OPT_WINDOWSIZE) == 0 && number >= 1 )
+        {
+            session->windowsize = (number > TFTP_MAX_WINDOW) ? TFTP_MAX_WINDOW : (uint16_t) number;
+            oack_length += sprintf(oack + oack_length, "%s%c%u", TFTP_OPT_WINDOWSIZE, 0, session->windowsize) + 1;
+        }
+        else if ( stricmp(option, TFTP_OPT_TIMEOUT) == 0 && number >= 1 && number <= TFTP_MAX_TIMEOUT )
+        {
+            session->timeout = (int) number;
+            oack_length += sprintf(oack + oack_length, "%s%c%d", TFTP_OPT_TIMEOUT, 0, session->timeout) + 1;
+        }
+        else if ( stricmp(option, TFTP_OPT_TSIZE) == 0 )
+        {
+            if ( session->action == TFTP_OP_RRQ )
+            {
+                session->tsize = filelength(fileno(session->pfile));
+            }
+            else
+            {
+                session->tsize = strtoul(value, NULL, 10);
+                if ( !tftp_disk_space(session->file_spec, session->tsize) )
+                {
+                    error = DISK_FULL;
+                    goto reject;
+                }
+            }
+            oack_length += sprintf(oack + oack_length, "%s%c%lu", TFTP_OPT_TSIZE, 0, session->tsize) + 1;
+        }
+
+        option = value + strnlen_s(value, end - value) + 1;
+    }
+
+    if ( session->action == TFTP_OP_WRQ )
+    {
+        session->pfile = tftp_file_open(session->file_spec, 1);
+        if ( session->pfile == NULL )
+        {
+            error = ACCESS_VIOLATION;
+            goto reject;
+        }
+        tftp_preallocate(session);
+    }
+
+    session->send_time = stack_time();
+    session->start_time = session->send_time;
+    session->state = TFTP_STATE_WAIT;
+
+    if ( oack_length )
+    {
+        /* OACK, wait for ACK of block '0' on a read request,
+         * or DATA of block '1' on a write request
+         */
+        ((tftp_t *) &(session->tx_data[0]))->opcode = stack_hton(TFTP_OP_OACK);
+        tftp_send_packet(session, oack_length + sizeof(uint16_t));
+    }
+    else if ( session->action == TFTP_OP_RRQ )
+    {
+        tftp_send_window(session);
+    }
+    else
+    {
+        tftp_send_ack(session, 0);
+    }
+
+    return;
+
+reject:
+    tftp_send_error(session, error);
+    printf("%s from %s:%u rejected: %s\n", session->file_name, ip, client_port, tftp_error_text[error]);
+    if ( session->pfile )
+        fclose(session->pfile);
+    session->pfile = NULL;
+    session->last_peer_port = client_port;
+    session->state = TFTP_STATE_IDLE;
+}
+
+/*------------------------------------------------
+ * tftp_session_end()
+ *
+ *  Close the local file of a transfer, count and log the result and
+ *  return the session to idle. A failed receive is trimmed to the bytes
+ *  actually received, so a file pre-allocated to its transfer size does
+ *  not look complete with stale disk contents at its end.
+ *
+ * param:  Pointer to session, '0' transfer completed or '1' transfer failed
+ * return: none
+ *
+ */
+void tftp_session_end(tftp_session_t *session, int failed)
+{
+    uint32_t    disk_start;
+
+    disk_start = stack_time();
+    if ( failed && session->role == TFTP_ROLE_RECV && !session->sidecar &&
+         session->tsize > session->xfr_bytes )
+    {
+        fflush(session->pfile);
+        chsize(fileno(session->pfile), session->xfr_bytes);
+    }
+    fclose(session->pfile);
+    session->pfile = NULL;
+    session->stats.disk_time += stack_time() - disk_start;
+
+    tftp_stats_log(session, failed);
+
+    if ( failed )
+    {
+        files_failed++;
+    }
+    else
+    {
+        files_ok++;
+        bytes_total += session->xfr_bytes;
+    }
+
+    session->last_peer_port = session->peer_port;
+    session->state = TFTP_STATE_IDLE;
+}
+
+/*------------------------------------------------
+ * tftp_session_complete()
+ *
+ *  Successful end of a transfer. Trim pre-allocated space of a received
+ *  file if the sender under-delivered, verify its CRC-32 if required, and report.
+ *  A completed checksum sidecar is followed by the request for the file itself.
+ *
+ * param:  Pointer to session
+ * return: none
+ *
+ */
+void tftp_session_complete(tftp_session_t *session)
+{
+    uint32_t    disk_start;
+
+    if ( session->sidecar )
+    {
+        if ( !tftp_sidecar_crc(session) )
+        {
+            printf("%s: No CRC-32 in %s%s, file will not be verified\n",
+                   session->file_name, session->file_name, TFTP_SIDECAR_EXT);
+            session->verify = 0;
+        }
+
+        session->sidecar = 0;
+        session->last_peer_port = session->peer_port;
+        tftp_session_request(session);
+        return;
+    }
+
+    if ( session->role == TFTP_ROLE_RECV )
+    {
+        if ( session->tsize > session->xfr_bytes )
+        {
+            disk_start = stack_time();
+            fflush(session->pfile);
+            chsize(fileno(session->pfile), session->xfr_bytes);
+            session->stats.disk_time += stack_time() - disk_start;
+        }
+    }
+    else
+    {
+        session->xfr_bytes = ftell(session->pfile);
+    }
+
+    tftp_progress(session, 1);
+    printf("%s: %s complete (%lu bytes)\n", session->file_name,
+           (session->role == TFTP_ROLE_RECV) ? "Receive" : "Send", session->xfr_bytes);
+    tftp_stats_print(session);
+
+    if ( session->verify )
+    {
+        if ( session->crc != session->crc_expected )
+        {
+            printf("%s: CRC-32 %08lx does not match %08lx, file is corrupt\n",
+                   session->file_name, session->crc, session->crc_expected);
+            tftp_session_end(session, 1);
+            return;
+        }
+
+        printf("%s: CRC-32 verified\n", session->file_name);
+    }
+
+    tftp_session_end(session, 0);
+}
+
+/*------------------------------------------------
+ * tftp_session_run()
+ *
+ *  Run one step of a session's transfer:
+ *  send a client's request, and monitor for a timeout.
+ *  Received packets are processed by tftp_session_input() as they arrive.
+ *  On a timeout a sender goes back to the first block not acknowledged
+ *  and resends the window, otherwise the last packet is retransmitted.
+ *
+ * param:  Pointer to an active session
+ * return: none
+ *
+ */
+void tftp_session_run(tftp_session_t *session)
+{
+    ip4_err_t   result;
+
+    switch ( session->state )
+    {
+        /* Initiate connection by sending a read or write request to the server
+         */
+        case TFTP_STATE_SEND_REQ:
+
+            result = tftp_send_req(session);
+
+            session->start_time = session->send_time;
+
+            if ( result == ERR_OK ||
+                 result == ERR_ARP_QUEUE )
+            {
+                /* Wait for TFTP server response
+                 */
+                session->state = TFTP_STATE_WAIT;
+            }
+            else if ( result == ERR_ARP_NONE )
+            {
+                /* TFTP server address could not be resolved or was not found.
+                 * Exit with error.
+                 * Will not happen with SLIP.
+                 */
+                printf("%s: Cannot resolve TFTP server address\n", session->file_name);
+                tftp_session_end(session, 1);
+            }
+            else
+            {
+                printf("%s: Error code %d\n", session->file_name, result);
+                tftp_session_end(session, 1);
+            }
+
+            break;
+
+        /* Monitor for a response timeout
+         */
+        case TFTP_STATE_WAIT:
+            if ( (stack_time() - session->send_time) > ((uint32_t) session->timeout * 1000) )
+            {
+                if ( session->retries-- == 0 )
+                {
+                    printf("\n%s: No response from TFTP %s\n", session->file_name, session->server ? "client" : "server");
+                    tftp_session_end(session, 1);
+                }
+                else if ( session->role == TFTP_ROLE_SEND &&
+                          session->block_next > (session->block_acked + 1) )
+                {
+                    tftp_rewind(session);
+                    tftp_send_window(session);
+                }
+                else
+                {
+                    session->stats.retransmits++;
+                    session->ack_time = 0;
+                    tftp_resend(session);
+                }
+            }
+            break;
+
+        default:
+            printf("*** Bug check (session state=%d) ***\n", session->state);
+            tftp_session_end(session, 1);
+    }
+}
+
+/*------------------------------------------------
+ * tftp_session_input()
+ *
+ *  Process a packet in the session's receive buffer: DATA, ACK, ERR, or OACK.
+ *  A client that gets DATA or ACK in response to a request with options
+ *  falls back to the protocol defaults, since the server ignored the options.
+ *
+ * param:  Pointer to session
+ * return: none
+ *
+ */
+void tftp_session_input(tftp_session_t *session)
+{
+    tftp_t     *tftp_payload;
+    uint16_t    op_code;
+
+    tftp_payload = (tftp_t *) &(session->rx_data[0]);
+    op_code = stack_ntoh(tftp_payload->opcode);
+
+    if ( !session->established &&
+         (op_code == TFTP_OP_DATA || op_code == TFTP_OP_ACK) )
+    {
+        session->blksize = TFTP_DATA;
+        session->windowsize = 1;
+        session->established = 1;
+    }
+
+    /* Option acknowledgment for a client request.
+     * For a read request, check the advertised transfer size against free disk space,
+     * pre-allocate the output file and ACK block '0' to start the transfer.
+     * For a write request the OACK stands for ACK of block '0'.
+     */
+    if ( op_code == TFTP_OP_OACK && !session->established )
+    {
+        if ( !tftp_parse_oack(session) )
+        {
+            tftp_send_error(session, TERMINATED_UNACCEPTABLE_OPTION);
+            printf("%s: Bad option acknowledgment\n", session->file_name);
+            tftp_session_end(session, 1);
+            return;
+        }
+
+        session->established = 1;
+        session->retries = TFTP_RETRIES;
+
+        if ( session->role == TFTP_ROLE_RECV && session->sidecar )
+        {
+            tftp_send_ack(session, 0);
+        }
+        else if ( session->role == TFTP_ROLE_RECV )
+        {
+            if ( !tftp_disk_space(session->file_spec, session->tsize) )
+            {
+                tftp_send_error(session, DISK_FULL);
+                printf("%s: Not enough disk space for %lu bytes\n", session->file_name, session->tsize);
+                tftp_session_end(session, 1);
+                return;
+            }
+
+            tftp_preallocate(session);
+            tftp_send_ack(session, 0);
+        }
+        else
+        {
+            tftp_send_window(session);
+        }
+    }
+
+    /* Repeated OACK, the server did not get our ACK of block '0'
+     */
+    else if ( op_code == TFTP_OP_OACK && !session->server )
+    {
+        if ( session->role == TFTP_ROLE_RECV && session->block_acked == 0 )
+            tftp_send_ack(session, 0);
+    }
+
+    /* Data block for a receiving session
+     */
+    else if ( op_code == TFTP_OP_DATA &&
+              session->role == TFTP_ROLE_RECV )
+    {
+        tftp_recv_data(session);
+    }
+
+    /* Acknowledgment for a sending session
+     */
+    else if ( op_code == TFTP_OP_ACK &&
+              session->role == TFTP_ROLE_SEND )
+    {
+        tftp_recv_ack(session, stack_ntoh(tftp_payload->ptr.block_id));
+    }
+
+    /* Server refused our options, repeat the request without them
+     */
+    else if ( op_code == TFTP_OP_ERR &&
+              stack_ntoh(tftp_payload->ptr.err_code) == TERMINATED_UNACCEPTABLE_OPTION &&
+              !session->server && session->options && !session->established )
+    {
+        session->options = 0;
+        session->blksize = TFTP_DATA;
+        session->windowsize = 1;
+        session->last_peer_port = session->peer_port;
+        session->peer_port = TFTP_PORT;
+        session->state = TFTP_STATE_SEND_REQ;
+    }
+
+    /* No checksum sidecar on the server, get the file without verification
+     */
+    else if ( op_code == TFTP_OP_ERR && session->sidecar )
+    {
+        printf("%s: No %s%s on server, file will not be verified\n",
+               session->file_name, session->file_name, TFTP_SIDECAR_EXT);
+        session->sidecar = 0;
+        session->verify = 0;
+        session->last_peer_port = session->peer_port;
+        tftp_session_request(session);
+    }
+
+    /* Received and error condition from the peer
+     */
+    else if ( op_code == TFTP_OP_ERR )
+    {
+        printf("\n%s: %s error: %s\n", session->file_name, session->server ? "Client" : "Server",
+               tftp_error_text[(stack_ntoh(tftp_payload->ptr.err_code) <= TERMINATED_UNACCEPTABLE_OPTION) ?
+                               stack_ntoh(tftp_payload->ptr.err_code) : NOT_DEFINED]);
+        tftp_session_end(session, 1);
+    }
+
+    /* Send and error to the peer and abort, including for:
+     *  TFTP_OP_RRQ, TFTP_OP_WRQ, late TFTP_OP_OACK
+     */
+    else
+    {
+        tftp_send_error(session, ILLIGAL_OPERATION);
+        printf("\n%s: Unexpected packet code %u\n", session->file_name, op_code);
+        tftp_session_end(session, 1);
+    }
+}
+
+/*------------------------------------------------
+ * tftp_recv_data()
+ *
+ *  Receive a data block. An in-order block is written to the file
+ *  and ACKed at the end of each window or with the final (short) block.
+ *  A duplicate or out of order block is answered once with an ACK of the
+ *  last block received in order, so the sender resumes from there (RFC 7440).
+ *  The round trip time is sampled from an ACK to the next block in order.
+ *  File data is added to the CRC as it is written, sidecar data is kept in memory.
+ *
+ * param:  Pointer to session
+ * return: none
+ *
+ */
+void tftp_recv_data(tftp_session_t *session)
+{
+    uint16_t    block_id, byte_count, keep;
+    uint32_t    disk_start;
+    size_t      written;
+
+    block_id = stack_ntoh(((tftp_t *) &(session->rx_data[0]))->ptr.block_id);
+    byte_count = session->rx_length - TFTP_HDR_SIZE;
+
+    if ( block_id != (uint16_t)(session->block_acked + 1) || byte_count > session->blksize )
+    {
+        if ( (uint16_t)((uint16_t) session->block_acked - block_id) < 0x8000 )
+            session->stats.duplicates++;
+
+        if ( session->block_reack != session->block_acked )
+        {
+            session->block_reack = session->block_acked;
+            session->window_count = 0;
+            tftp_send_ack(session, (uint16_t) session->block_acked);
+            session->ack_time = 0;
+        }
+        return;
+    }
+
+    if ( session->ack_time )
+    {
+        tftp_rtt_sample(session, stack_time() - session->ack_time);
+        session->ack_time = 0;
+    }
+
+    if ( session->sidecar )
+    {
+        /* Keep the start of the sidecar text, the rest is not needed
+         */
+        if ( session->xfr_bytes < (TFTP_SIDECAR_LEN - 1) )
+        {
+            keep = (TFTP_SIDECAR_LEN - 1) - (uint16_t) session->xfr_bytes;
+            if ( keep > byte_count )
+                keep = byte_count;
+            memcpy(&(session->sidecar_text[session->xfr_bytes]), &(session->rx_data[TFTP_HDR_SIZE]), keep);
+        }
+        written = byte_count;
+    }
+    else
+    {
+        session->crc = crc32_update(session->crc, &(session->rx_data[TFTP_HDR_SIZE]), byte_count);
+
+        disk_start = stack_time();
+        written = fwrite(&(session->rx_data[TFTP_HDR_SIZE]), sizeof(uint8_t), byte_count, session->pfile);
+        session->stats.disk_time += stack_time() - disk_start;
+    }
+
+    if ( written != byte_count )
+    {
+        tftp_send_error(session, DISK_FULL);
+        printf("\n%s: Output file write error\n", session->file_name);
+        tftp_session_end(session, 1);
+        return;
+    }
+
+    session->block_acked++;
+    session->xfr_bytes += byte_count;
+    session->window_count++;
+    session->retries = TFTP_RETRIES;
+
+    // Complete the exchange if partial block was received
+    if ( byte_count < session->blksize )
+    {
+        tftp_send_ack(session, (uint16_t) session->block_acked);
+        tftp_session_complete(session);
+        return;
+    }
+
+    if ( session->window_count >= session->windowsize )
+    {
+        session->window_count = 0;
+        tftp_send_ack(session, (uint16_t) session->block_acked);
+    }
+
+    tftp_progress(session, 0);
+}
+
+/*------------------------------------------------
+ * tftp_recv_ack()
+ *
+ *  Receive an acknowledgment, slide the window and send more blocks.
+ *  An ACK inside the window that does not cover all blocks sent means the
+ *  receiver lost a block, so sending resumes after the acknowledged block.
+ *  A repeated ACK of the window start is ignored with a window of one block
+ *  (Sorcerer's Apprentice), and restarts the window otherwise.
+ *  The round trip time is sampled from the acknowledged block, if it was sent only once.
+ *
+ * param:  Pointer to session and block ID acknowledged
+ * return: none
+ *
+ */
+void tftp_recv_ack(tftp_session_t *session, uint16_t block_id)
+{
+    uint32_t    in_flight;
+    uint16_t    advance;
+    int         slot;
+
+    in_flight = session->block_next - 1 - session->block_acked;
+    advance = block_id - (uint16_t) session->block_acked;
+
+    if ( advance > in_flight )
+    {
+        session->stats.duplicates++;
+        return;
+    }
+
+    if ( advance == 0 )
+    {
+        if ( in_flight == 0 )
+        {
+            tftp_send_window(session);
+        }
+        else
+        {
+            session->stats.duplicates++;
+            if ( session->windowsize > 1 )
+            {
+                tftp_rewind(session);
+                tftp_send_window(session);
+            }
+        }
+        return;
+    }
+
+    session->block_acked += advance;
+    session->retries = TFTP_RETRIES;
+
+    slot = (int)(session->block_acked % TFTP_MAX_WINDOW);
+    if ( (session->block_retx & (1 << slot)) == 0 )
+        tftp_rtt_sample(session, stack_time() - session->block_time[slot]);
+
+    if ( session->block_last && session->block_acked == session->block_last )
+    {
+        tftp_session_complete(session);
+        return;
+    }
+
+    if ( advance < in_flight )
+        tftp_rewind(session);
+
+    session->xfr_bytes = session->block_acked * session->blksize;
+    tftp_progress(session, 0);
+
+    tftp_send_window(session);
+}
+
+/*------------------------------------------------
+ * tftp_send_window()
+ *
+ *  Read and send data blocks until the window is full or the final block was sent.
+ *  A block shorter than the block size, including an empty one, is the final block.
+ *
+ * param:  Pointer to a sending session
+ * return: none
+ *
+ */
+void tftp_send_window(tftp_session_t *session)
+{
+    tftp_t     *tftp_payload;
+    uint16_t    byte_count;
+    uint32_t    disk_start;
+    int         slot;
+
+    tftp_payload = (tftp_t *) &(session->tx_data[0]);
+
+    while ( session->block_next <= (session->block_acked + session->windowsize) &&
+            (session->block_last == 0 || session->block_next <= session->block_last) )
+    {
+        disk_start = stack_time();
+        byte_count = fread(&(session->tx_data[TFTP_HDR_SIZE]), sizeof(uint8_t), session->blksize, session->pfile);
+        session->stats.disk_time += stack_time() - disk_start;
+
+        if ( ferror(session->pfile) )
+        {
+            tftp_send_error(session, ACCESS_VIOLATION);
+            printf("\n%s: File read error\n", session->file_name);
+            tftp_session_end(session, 1);
+            return;
+        }
+
+        if ( byte_count < session->blksize )
+            session->block_last = session->block_next;
+
+        tftp_payload->opcode = stack_hton(TFTP_OP_DATA);
+        tftp_payload->ptr.block_id = stack_hton((uint16_t) session->block_next);
+        tftp_send_packet(session, byte_count + TFTP_HDR_SIZE);
+
+        /* Keep the first transmit time of a block for round trip time,
+         * and mark retransmitted blocks so they are not sampled.
+         * The CRC is accumulated once per block, on first transmission.
+         */
+        slot = (int)(session->block_next % TFTP_MAX_WINDOW);
+        if ( session->block_next <= session->block_high )
+        {
+            session->stats.retransmits++;
+            session->block_retx |= (1 << slot);
+        }
+        else
+        {
+            session->block_high = session->block_next;
+            session->block_retx &= ~(1 << slot);
+            session->block_time[slot] = session->send_time;
+            session->crc = crc32_update(session->crc, &(session->tx_data[TFTP_HDR_SIZE]), byte_count);
+        }
+
+        session->block_next++;
+    }
+}
+
+/*------------------------------------------------
+ * tftp_rewind()
+ *
+ *  Go back to the first block not acknowledged. The file stream is
+ *  re-positioned so the blocks are read again from the stream buffer.
+ *
+ * param:  Pointer to a sending session
+ * return: none
+ *
+ */
+void tftp_rewind(tftp_session_t *session)
+{
+    uint32_t    disk_start;
+
+    disk_start = stack_time();
+    session->block_next = session->block_acked + 1;
+    fseek(session->pfile, (long) session->block_acked * session->blksize, SEEK_SET);
+    session->stats.disk_time += stack_time() - disk_start;
+}
+
+/*------------------------------------------------
+ * tftp_send_packet()
+ *
+ *  Sent the TFTP packet in the session transmit buffer to the peer,
+ *  and keep its length for retransmission.
+ *
+ * param:  Pointer to session, packet length
+ * return: Stack error code
+ *
+ */
+ip4_err_t tftp_send_packet(tftp_session_t *session, int length)
+{
+    session->tx_length = length;
+    session->send_time = stack_time();
+
+    return udp_sendto(session->pcb, (uint8_t*) &(session->tx_data[0]), length,
+                      session->peer_address, session->peer_port);
+}
+
+/*------------------------------------------------
+ * tftp_send_req()
+ *
+ *  Sent TFTP read or write request, for the session's file or its checksum sidecar.
+ *  Function always requests an 'octet' (binary) mode transfer.
+ *  Unless disabled, the request carries the 'tsize' and 'timeout' options (RFC 2349),
+ *  with a zero 'tsize' for a read request and the file size for a write request,
+ *  and 'blksize' and 'windowsize' options when they differ from the defaults.
+ *
+ * param:  Pointer to session
+ * return: Stack error code
+ *
+ */
+ip4_err_t tftp_send_req(tftp_session_t *session)
+{
+    tftp_t     *tftp_payload;
+    char       *options;
+    int         options_length;
+
+    tftp_payload = (tftp_t *) &(session->tx_data[0]);
+
+    tftp_payload->opcode = stack_hton(session->action);
+
+    options = &(tftp_payload->ptr.options);
+
+    if ( session->sidecar )
+        options_length = sprintf(options, "%s%s", session->file_name, TFTP_SIDECAR_EXT) + 1;
+    else
+        options_length = sprintf(options, "%s", session->file_name) + 1;
+
+    strcpy_s(options + options_length, TFTP_DATA, "octet"); // TODO Always binary mode
+    options_length += 6;                                    // TODO "octet\0"
+
+    if ( session->options )
+    {
+        options_length += sprintf(options + options_length, "%s%c%lu%c%s%c%d",
+                                  TFTP_OPT_TSIZE, 0,
+                                  session->tsize, 0,
+                                  TFTP_OPT_TIMEOUT, 0,
+                                  session->timeout) + 1;
+
+        if ( session->blksize != TFTP_DATA )
+            options_length += sprintf(options + options_length, "%s%c%u",
+                                      TFTP_OPT_BLKSIZE, 0, session->blksize) + 1;
+
+        if ( session->windowsize != 1 )
+            options_length += sprintf(options + options_length, "%s%c%u",
+                                      TFTP_OPT_WINDOWSIZE, 0, session->windowsize) + 1;
+    }
+
+    return tftp_send_packet(session, options_length + sizeof(uint16_t));
+}
+
+/*------------------------------------------------
+ * tftp_send_ack()
+ *
+ *  Sent TFTP ACK message.
+ *
+ * param:  Pointer to session, block ID being ACKed
+ * return: Stack error code
+ *
+ */
+ip4_err_t tftp_send_ack(tftp_session_t *session, uint16_t block_id)
+{
+    tftp_t     *tftp_payload;
+    ip4_err_t   result;
+
+    tftp_payload = (tftp_t *) &(session->tx_data[0]);
+
+    tftp_payload->opcode = stack_hton(TFTP_OP_ACK);
+    tftp_payload->ptr.block_id = stack_hton(block_id);
+
+    result = tftp_send_packet(session, TFTP_HDR_SIZE);
+    session->ack_time = session->send_time;
+
+    return result;
+}
+
+/*------------------------------------------------
+ * tftp_send_error()
+ *
+ *  Sent TFTP error to the peer.
+ *
+ * param:  Pointer to session, error code
+ * return: Stack error code
+ *
+ */
+ip4_err_t tftp_send_error(tftp_session_t *session, tftp_err_t error_code)
+{
+    tftp_t     *tftp_payload;
+
+    tftp_payload = (tftp_t *) &(session->tx_data[0]);
+
+    tftp_payload->opcode = stack_hton(TFTP_OP_ERR);
+    tftp_payload->ptr.err_code = stack_hton(error_code);
+    tftp_payload->payload = 0;  // No error text
+
+    return tftp_send_packet(session, TFTP_HDR_SIZE + 1);
+}
+
+/*------------------------------------------------
+ * tftp_resend()
+ *
+ *  Retransmit the last TFTP packet sent, after a response timeout.
+ *
+ * param:  Pointer to session
+ * return: Stack error code
+ *
+ */
+ip4_err_t tftp_resend(tftp_session_t *session)
+{
+    return tftp_send_packet(session, session->tx_length);
+}
+
+/*------------------------------------------------
+ * tftp_parse_oack()
+ *
+ *  Parse the option/value pairs of an option acknowledgment
+ *  in the session receive buffer, and update the negotiated values.
+ *  The server may lower block and window size, but not raise them.
+ *
+ * param:  Pointer to session
+ * return: '1' options accepted, '0' malformed OACK or an option that was not requested
+ *
+ */
+int tftp_parse_oack(tftp_session_t *session)
+{
+    char   *option, *value, *end;
+    long    number;
+
+    option = &(((tftp_t *) &(session->rx_data[0]))->ptr.options);
+    end = (char *) &(session->rx_data[0]) + session->rx_length;
+
+    while ( option < end )
+    {
+        value = option + strnlen_s(option, end - option) + 1;
+        if ( value >= end )
+            return 0;
+
+        number = atol(value);
+
+        if ( stricmp(option, TFTP_OPT_TSIZE) == 0 )
+        {
+            session->tsize = strtoul(value, NULL, 10);
+        }
+        else if ( stricmp(option, TFTP_OPT_TIMEOUT) == 0 )
+        {
+            if ( number < 1 || number > TFTP_MAX_TIMEOUT )
+                return 0;
+            session->timeout = (int) number;
+        }
+        else if ( stricmp(option, TFTP_OPT_BLKSIZE) == 0 )
+        {
+            if ( number < TFTP_MIN_BLKSIZE || number > session->blksize )
+                return 0;
+            session->blksize = (uint16_t) number;
+        }
+        else if ( stricmp(option, TFTP_OPT_WINDOWSIZE) == 0 )
+        {
+            if ( number < 1 || number > session->windowsize )
+                return 0;
+            session->windowsize = (uint16_t) number;
+        }
+        else
+        {
+            return 0;
+        }
+
+        option = value + strnlen_s(value, end - value) + 1;
+    }
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * tftp_disk_space()
+ *
+ *  Check that the drive of the output file has enough free clusters
+ *  to hold a file of the given size.
+ *
+ * param:  Full file specifier and file size in bytes
+ * return: '1' enough space or size/space unknown, '0' not enough space
+ *
+ */
+int tftp_disk_space(char *file_specifier, uint32_t size)
+{
+    struct diskfree_t   disk_info;
+    char                drive[_MAX_DRIVE];
+    unsigned            drive_number = 0;   // Default drive
+    uint32_t            cluster_size;
+
+    if ( size == 0 )
+        return 1;
+
+    _splitpath(file_specifier, drive, NULL, NULL, NULL);
+    if ( drive[0] )
+        drive_number = toupper(drive[0]) - 'A' + 1;
+
+    if ( _dos_getdiskfree(drive_number, &disk_info) != 0 )
+        return 1;
+
+    cluster_size = (uint32_t) disk_info.sectors_per_cluster * disk_info.bytes_per_sector;
+
+    return ( ((size + cluster_size - 1) / cluster_size) <= disk_info.avail_clusters );
+}
+
+/*------------------------------------------------
+ * tftp_preallocate()
+ *
+ *  Pre-allocate the output file to its final size so DOS builds
+ *  the FAT chain once instead of extending it cluster by cluster.
+ *  A zero-length DOS write at the target offset sets the file size
+ *  without writing any data. Failures are ignored, the file will grow as it is written.
+ *
+ * param:  Pointer to session with open output file and its expected size
+ * return: none
+ *
+ */
+void tftp_preallocate(tftp_session_t *session)
+{
+    int         handle;
+    unsigned    written;
+    uint32_t    disk_start;
+
+    if ( session->tsize == 0 )
+        return;
+
+    disk_start = stack_time();
+
+    fflush(session->pfile);
+    handle = fileno(session->pfile);
+
+    if ( lseek(handle, session->tsize, SEEK_SET) == session->tsize )
+        _dos_write(handle, session->tx_data, 0, &written);
+
+    fseek(session->pfile, 0L, SEEK_SET);
+
+    session->stats.disk_time += stack_time() - disk_start;
+}
+
+/*------------------------------------------------
+ * tftp_progress()
+ *
+ *  Display transfer progress, throughput and, when transfer size is known,
+ *  percent complete and estimated time to completion.
+ *  Display is refreshed on the same line at a set interval,
+ *  and only when a single client transfer is running at a time.
+ *
+ * param:  Pointer to session, and '1' to force a final display
+ * return: none
+ *
+ */
+void tftp_progress(tftp_session_t *session, int final)
+{
+    uint32_t    now, elapsed, rate, eta, percent;
+
+    if ( tftp_concurrency > 1 )
+        return;
+
+    now = stack_time();
+    if ( !final && (now - session->last_display) < TFTP_PROGRESS_INTERVAL )
+        return;
+
+    session->last_display = now;
+
+    elapsed = now - session->start_time;
+    rate = rate_bps(session->xfr_bytes, elapsed);
+
+    if ( session->tsize && session->xfr_bytes <= session->tsize )
+    {
+        eta = rate ? ((session->tsize - session->xfr_bytes) / rate) : 0;
+        percent = (session->tsize < 0x01000000UL) ? (session->xfr_bytes * 100 / session->tsize) :
+                                                    (session->xfr_bytes / (session->tsize / 100));
+        printf("\r%lu of %lu bytes (%lu%%) %lu B/s ETA %02lu:%02lu ",
+               session->xfr_bytes, session->tsize, percent, rate, eta / 60, eta % 60);
+    }
+    else
+    {
+        printf("\r%lu bytes %lu B/s ", session->xfr_bytes, rate);
+    }
+
+    if ( final )
+        printf("\n");
+}
+
+/*------------------------------------------------
+ * tftp_rtt_sample()
+ *
+ *  Add a round trip time sample to the session statistics.
+ *
+ * param:  Pointer to session, round trip time in mili-seconds
+ * return: none
+ *
+ */
+void tftp_rtt_sample(tftp_session_t *session, uint32_t rtt)
+{
+    tftp_stats_t   *stats;
+    int             bucket;
+
+    stats = &session->stats;
+
+    if ( stats->rtt_count == 0 || rtt < stats->rtt_min )
+        stats->rtt_min = rtt;
+    if ( rtt > stats->rtt_max )
+        stats->rtt_max = rtt;
+
+    stats->rtt_sum += rtt;
+    stats->rtt_count++;
+
+    for ( bucket = 0; bucket < (TFTP_RTT_BUCKETS - 1); bucket++ )
+    {
+        if ( rtt < rtt_limit[bucket] )
+            break;
+    }
+
+    stats->rtt_hist[bucket]++;
+}
+
+/*------------------------------------------------
+ * tftp_stats_print()
+ *
+ *  Print a summary of the transfer statistics.
+ *
+ * param:  Pointer to session
+ * return: none
+ *
+ */
+void tftp_stats_print(tftp_session_t *session)
+{
+    tftp_stats_t   *stats;
+    uint32_t        elapsed;
+    int             bucket;
+
+    stats = &session->stats;
+    elapsed = stack_time() - session->start_time;
+
+    printf("  %lu.%lu sec, %lu B/s, block %u, window %u, CRC-32 %08lx\n",
+           elapsed / 1000, (elapsed % 1000) / 100, rate_bps(session->xfr_bytes, elapsed),
+           session->blksize, session->windowsize, session->crc);
+
+    printf("  RTT min/avg/max %lu/%lu/%lu mSec, %lu retransmitted, %lu duplicate\n",
+           stats->rtt_min, stats->rtt_count ? (stats->rtt_sum / stats->rtt_count) : 0UL,
+           stats->rtt_max, stats->retransmits, stats->duplicates);
+
+    printf("  RTT");
+    for ( bucket = 0; bucket < (TFTP_RTT_BUCKETS - 1); bucket++ )
+        printf(" <%u:%lu", rtt_limit[bucket], stats->rtt_hist[bucket]);
+    printf(" >=%u:%lu\n", rtt_limit[TFTP_RTT_BUCKETS - 2], stats->rtt_hist[TFTP_RTT_BUCKETS - 1]);
+
+    printf("  Disk I/O %lu mSec, network wait %lu mSec\n",
+           stats->disk_time, (elapsed > stats->disk_time) ? (elapsed - stats->disk_time) : 0UL);
+}
+
+/*------------------------------------------------
+ * tftp_stats_log()
+ *
+ *  Append one line of 'name=value' transfer statistics to the log file,
+ *  for completed and failed transfers. Times are in mili-seconds and
+ *  'hist' lists the RTT histogram counts in the order of rtt_limit[].
+ *
+ * param:  Pointer to session, '0' transfer completed or '1' transfer failed
+ * return: none
+ *
+ */
+void tftp_stats_log(tftp_session_t *session, int failed)
+{
+    tftp_stats_t   *stats;
+    uint32_t        elapsed;
+    int             bucket;
+
+    if ( tftp_log == NULL )
+        return;
+
+    stats = &session->stats;
+    elapsed = stack_time() - session->start_time;
+
+    stack_ip4addr_ntoa(session->peer_address, ip, sizeof(ip));
+
+    fprintf(tftp_log, "tftp file=%s op=%s peer=%s result=%s bytes=%lu ms=%lu bps=%lu blksize=%u window=%u",
+            session->file_name,
+            (session->action == TFTP_OP_RRQ) ? "rrq" : "wrq",
+            ip,
+            failed ? "fail" : "ok",
+            session->xfr_bytes,
+            elapsed,
+            rate_bps(session->xfr_bytes, elapsed),
+            session->blksize,
+            session->windowsize);
+
+    fprintf(tftp_log, " rtt_min=%lu rtt_avg=%lu rtt_max=%lu rtt_n=%lu hist=",
+            stats->rtt_min,
+            stats->rtt_count ? (stats->rtt_sum / stats->rtt_count) : 0UL,
+            stats->rtt_max,
+            stats->rtt_count);
+
+    for ( bucket = 0; bucket < TFTP_RTT_BUCKETS; bucket++ )
+        fprintf(tftp_log, "%s%lu", bucket ? "," : "", stats->rtt_hist[bucket]);
+
+    fprintf(tftp_log, " retx=%lu dup=%lu disk_ms=%lu net_ms=%lu crc=%08lx\n",
+            stats->retransmits,
+            stats->duplicates,
+            stats->disk_time,
+            (elapsed > stats->disk_time) ? (elapsed - stats->disk_time) : 0UL,
+            session->crc);
+
+    fflush(tftp_log);
+}
+
+/*------------------------------------------------
+ * tftp_sidecar_crc()
+ *
+ *  Read the expected CRC-32 from the sidecar text, a single 8 digit hex
+ *  number or the first word of a "<crc> <file name>" line.
+ *
+ * param:  Pointer to session with the sidecar text
+ * return: '1' CRC found and stored in 'crc_expected', '0' no CRC in the text
+ *
+ */
+int tftp_sidecar_crc(tftp_session_t *session)
+{
+    char   *text, *end;
+
+    text = session->sidecar_text;
+    while ( isspace(*text) )
+        text++;
+
+    session->crc_expected = strtoul(text, &end, 16);
+
+    if ( (end - text) != 8 ||
+         (*end != 0 && !isspace(*end)) )
+        return 0;
+
+    return 1;
 }
 
 /*------------------------------------------------
@@ -0,0 +1,687 @@
+/*
+ *  traceroute.c
+ *
+ *      Network route trace for PC-XT
+ *      ICMP echo requests are sent with increasing TTL, and each router along
+ *      the path that drops one returns an ICMP Time Exceeded message carrying the
+ *      header of the request, which identifies the hop and probe it answers.
+ *      All hops are probed at once, back to back on the link, so a trace takes
+ *      about one reply timeout regardless of the number of hops.
+ *
+ *      The IP stack has no way to set the TTL of a packet and does not pass
+ *      ICMP error messages to applications, so traceroute does not use it.
+ *      It runs the SLIP link on COM1 itself, like the stack's SLIP interface
+ *      does, and builds and parses the IP and ICMP headers of its probes and
+ *      replies. SLIP is point to point, so every probe goes out on the link
+ *      and only the LOCALHOST address is needed. The UART is polled for both
+ *      directions, one byte at a time, so replies are not lost while a probe
+ *      is being sent.
+ *
+ *      Usage: traceroute [-V] [-b baud] [-m max_hops] [-q queries] [-w wait] destination_ip_address
+ *
+ *      resources:
+ *          SLIP:   https://tools.ietf.org/html/rfc1055
+ *          ICMP:   https://tools.ietf.org/html/rfc792
+ *
+ */
+
+#include    <stdlib.h>
+#include    <stdio.h>
+#include    <string.h>
+#include    <signal.h>
+#include    <conio.h>
+#include    <dos.h>
+#include    <i86.h>
+
+#include    "hrtimer.h"
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     VERSION                 "v1.1"
+#define     USAGE                   "traceroute [-V] [-b baud] [-m max_hops] [-q queries] [-w wait] destination_ip_address\n" \
+                                    "  -b {default=7} 0=110, 1=150, 2=300, 3=600,\n"    \
+                                    "                 4=1200, 5=2400, 6=4800, 7=9600\n"
+
+#define     MAX_HOPS                30
+#define     MAX_QUERIES             5
+#define     DEF_QUERIES             3
+#define     DEF_WAIT                3000            // reply wait in mSec
+#define     DEF_BAUD                7               // INT 14h rate code, 9600 baud
+#define     CHECK_INTERVAL          20              // mSec between time out and print checks
+#define     COUNTS_PER_MSEC         (HRT_HZ / 1000)
+
+#define     TRACE_IDENT             0x7472          // 'tr'
+#define     PROBE_PAYLOAD           32
+
+// IP and ICMP
+#define     IP_HDR_LEN              20
+#define     ICMP_HDR_LEN            8
+#define     IP_VER_IHL              0x45
+#define     IP_PROTOCOL_ICMP        1
+#define     PROBE_LEN               (IP_HDR_LEN + ICMP_HDR_LEN + PROBE_PAYLOAD)
+
+#define     ICMP_ECHO_REPLY         0
+#define     ICMP_DEST_UNREACH       3
+#define     ICMP_ECHO_REQUEST       8
+#define     ICMP_TIME_EXCEEDED      11
+
+// SLIP (RFC 1055)
+#define     SLIP_END                0xc0
+#define     SLIP_ESC                0xdb
+#define     SLIP_ESC_END            0xdc
+#define     SLIP_ESC_ESC            0xdd
+#define     SLIP_MTU                1006            // largest frame received, longer ones are dropped
+
+// 8250 UART
+#define     UART_DATA               0               // receive and transmit register
+#define     UART_LSR                5               // line status register
+#define     LSR_DATA_READY          0x01
+#define     LSR_THR_EMPTY           0x20
+
+// Probe state
+#define     PROBE_IDLE              0
+#define     PROBE_SENT              1
+#define     PROBE_DONE              2
+#define     PROBE_LOST              3
+
+/* -----------------------------------------
+   Types and data structures
+----------------------------------------- */
+struct probe_t
+{
+    int         state;
+    uint32_t    sent;           // high resolution time stamp, when the last byte left
+    uint32_t    rtt;            // in uSec
+    uint8_t     from[4];        // responding router or the destination
+    uint8_t     type;           // ICMP type and code of the reply
+    uint8_t     code;
+};
+
+/* -----------------------------------------
+   Globals
+----------------------------------------- */
+struct probe_t  probes[MAX_HOPS][MAX_QUERIES];
+
+uint8_t         destination[4];
+uint8_t         local_host[4];
+int             max_hops = MAX_HOPS;
+int             queries = DEF_QUERIES;
+uint32_t        wait = DEF_WAIT;
+int             last_hop;       // lowest hop the destination answered from, 'max_hops' until then
+int             pending = 0;    // probes waiting for a reply
+volatile int    done = 0;
+
+// SLIP link
+int             com_base;
+uint8_t         tx_frame[2 * PROBE_LEN + 2];
+int             tx_len = 0;
+int             tx_pos = 0;
+struct probe_t *tx_probe = NULL;
+uint8_t         rx_frame[SLIP_MTU];
+int             rx_len = 0;
+int             rx_escape = 0;
+int             rx_overrun = 0;
+uint16_t        ip_ident = 0;
+
+/*------------------------------------------------
+ * trace_aton()
+ *
+ *  Convert a dotted decimal IPv4 address.
+ *
+ * param:  address string, output address in network byte order
+ * return: '1' converted, '0' not an IPv4 address
+ *
+ */
+int trace_aton(const char *text, uint8_t *addr)
+{
+    unsigned    a, b, c, d;
+    char        extra;
+
+    if ( sscanf(text, "%u.%u.%u.%u%c", &a, &b, &c, &d, &extra) != 4 ||
+         a > 255 || b > 255 || c > 255 || d > 255 )
+        return 0;
+
+    addr[0] = (uint8_t) a;
+    addr[1] = (uint8_t) b;
+    addr[2] = (uint8_t) c;
+    addr[3] = (uint8_t) d;
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * trace_checksum()
+ *
+ *  Internet checksum of a header.
+ *
+ * param:  pointer to data and its length in bytes
+ * return: one's complement checksum, to store high byte first
+ *
+ */
+uint16_t trace_checksum(const uint8_t *data, int len)
+{
+    uint32_t    sum = 0;
+
+    for ( ; len > 1; len -= 2, data += 2 )
+        sum += ((uint16_t) data[0] << 8) | data[1];
+
+    if ( len )
+        sum += (uint16_t) data[0] << 8;
+
+    while ( sum >> 16 )
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return (uint16_t) ~sum;
+}
+
+/*------------------------------------------------
+ * trace_input()
+ *
+ *  Process a received IP packet.
+ *  An echo reply comes from the destination and carries the probe's sequence
+ *  number. A Time Exceeded or Destination Unreachable message carries the IP
+ *  header and the first 8 bytes of the probe, which hold its identifier and
+ *  sequence number. The sequence number gives the hop and query.
+ *
+ * param:  pointer to the packet and its length
+ * return: none
+ *
+ */
+void trace_input(uint8_t *packet, int len)
+{
+    struct probe_t *probe;
+    uint8_t        *icmp, *probe_ip, *probe_icmp;
+    uint32_t        now;
+    uint16_t        seq;
+    int             hop, query, hdr_len, probe_hdr_len;
+
+    now = hrt_read();
+
+    hdr_len = (packet[0] & 0x0f) * 4;
+    if ( len < (IP_HDR_LEN + ICMP_HDR_LEN) || (packet[0] & 0xf0) != 0x40 ||
+         hdr_len < IP_HDR_LEN || len < (hdr_len + ICMP_HDR_LEN) ||
+         packet[9] != IP_PROTOCOL_ICMP ||
+         memcmp(&packet[16], local_host, 4) != 0 ||
+         trace_checksum(packet, hdr_len) != 0 )
+        return;
+
+    icmp = &packet[hdr_len];
+
+    switch ( icmp[0] )
+    {
+        case ICMP_ECHO_REPLY:
+            if ( ((icmp[4] << 8) | icmp[5]) != TRACE_IDENT || memcmp(&packet[12], destination, 4) != 0 )
+                return;
+            seq = (icmp[6] << 8) | icmp[7];
+            break;
+
+        case ICMP_TIME_EXCEEDED:
+        case ICMP_DEST_UNREACH:
+            probe_ip = &icmp[ICMP_HDR_LEN];
+            probe_hdr_len = (probe_ip[0] & 0x0f) * 4;
+            if ( len < (hdr_len + ICMP_HDR_LEN + IP_HDR_LEN) || probe_hdr_len < IP_HDR_LEN ||
+                 len < (hdr_len + ICMP_HDR_LEN + probe_hdr_len + ICMP_HDR_LEN) )
+                return;
+            probe_icmp = &probe_ip[probe_hdr_len];
+            if ( probe_ip[9] != IP_PROTOCOL_ICMP ||
+                 memcmp(&probe_ip[16], destination, 4) != 0 ||
+                 probe_icmp[0] != ICMP_ECHO_REQUEST ||
+                 ((probe_icmp[4] << 8) | probe_icmp[5]) != TRACE_IDENT )
+                return;
+            seq = (probe_icmp[6] << 8) | probe_icmp[7];
+            break;
+
+        default:
+            return;
+    }
+
+    hop = seq / MAX_QUERIES;
+    query = seq % MAX_QUERIES;
+    if ( hop >= max_hops || query >= queries )
+        return;
+
+    probe = &probes[hop][query];
+    if ( probe->state == PROBE_DONE || probe->state == PROBE_IDLE )
+        return;
+
+    if ( probe->state == PROBE_SENT )
+        pending--;
+
+    probe->state = PROBE_DONE;
+    probe->rtt = hrt_us(now - probe->sent);
+    memcpy(probe->from, &packet[12], 4);
+    probe->type = icmp[0];
+    probe->code = icmp[1];
+
+    /* The destination, or an unreachable destination, ends the path
+     */
+    if ( icmp[0] != ICMP_TIME_EXCEEDED && hop < last_hop )
+        last_hop = hop;
+}
+
+/*------------------------------------------------
+ * slip_receive()
+ *
+ *  Decode a received SLIP byte, and pass complete
+ *  frames on as IP packets.
+ *
+ * param:  received byte
+ * return: none
+ *
+ */
+void slip_receive(uint8_t c)
+{
+    if ( c == SLIP_END )
+    {
+        if ( rx_len && !rx_overrun )
+            trace_input(rx_frame, rx_len);
+        rx_len = 0;
+        rx_escape = 0;
+        rx_overrun = 0;
+        return;
+    }
+
+    if ( c == SLIP_ESC )
+    {
+        rx_escape = 1;
+        return;
+    }
+
+    if ( rx_escape )
+    {
+        if ( c == SLIP_ESC_END )
+            c = SLIP_END;
+        else if ( c == SLIP_ESC_ESC )
+            c = SLIP_ESC;
+        rx_escape = 0;
+    }
+
+    if ( rx_len < SLIP_MTU )
+        rx_frame[rx_len++] = c;
+    else
+        rx_overrun = 1;
+}
+
+/*------------------------------------------------
+ * slip_poll()
+ *
+ *  Move bytes between the UART and the SLIP frames,
+ *  received bytes first so none is overrun.
+ *
+ * param:  none
+ * return: none
+ *
+ */
+void slip_poll(void)
+{
+    uint8_t     status;
+
+    status = inp(com_base + UART_LSR);
+
+    while ( status & LSR_DATA_READY )
+    {
+        slip_receive(inp(com_base + UART_DATA));
+        status = inp(com_base + UART_LSR);
+    }
+
+    if ( tx_pos < tx_len && (status & LSR_THR_EMPTY) )
+    {
+        outp(com_base + UART_DATA, tx_frame[tx_pos++]);
+
+        /* Time the probe from the end of its frame, so the round trip
+         * does not include the time its own bytes took on the link
+         */
+        if ( tx_pos == tx_len && tx_probe )
+        {
+            tx_probe->sent = hrt_read();
+            tx_probe = NULL;
+        }
+    }
+}
+
+/*------------------------------------------------
+ * trace_send()
+ *
+ *  Build the next probe and queue it as a SLIP frame. Probes go out
+ *  by query and then by hop, so every hop gets its first probe before
+ *  any hop gets a second.
+ *
+ * param:  pointer to the next probe number, counting from '0'
+ * return: none
+ *
+ */
+void trace_send(int *next)
+{
+    struct probe_t *probe;
+    uint8_t         packet[PROBE_LEN];
+    uint16_t        seq, checksum;
+    int             hop, query, i;
+
+    hop = *next % max_hops;
+    query = *next / max_hops;
+    (*next)++;
+
+    /* No need to probe past the destination
+     */
+    if ( hop > last_hop )
+        return;
+
+    probe = &probes[hop][query];
+    seq = (uint16_t)(hop * MAX_QUERIES + query);
+
+    memset(packet, 0, sizeof(packet));
+    packet[0] = IP_VER_IHL;
+    packet[2] = (uint8_t)(PROBE_LEN >> 8);
+    packet[3] = (uint8_t) PROBE_LEN;
+    packet[4] = (uint8_t)(ip_ident >> 8);
+    packet[5] = (uint8_t) ip_ident;
+    packet[8] = (uint8_t)(hop + 1);
+    packet[9] = IP_PROTOCOL_ICMP;
+    memcpy(&packet[12], local_host, 4);
+    memcpy(&packet[16], destination, 4);
+    checksum = trace_checksum(packet, IP_HDR_LEN);
+    packet[10] = (uint8_t)(checksum >> 8);
+    packet[11] = (uint8_t) checksum;
+    ip_ident++;
+
+    packet[IP_HDR_LEN] = ICMP_ECHO_REQUEST;
+    packet[IP_HDR_LEN + 4] = (uint8_t)(TRACE_IDENT >> 8);
+    packet[IP_HDR_LEN + 5] = (uint8_t) TRACE_IDENT;
+    packet[IP_HDR_LEN + 6] = (uint8_t)(seq >> 8);
+    packet[IP_HDR_LEN + 7] = (uint8_t) seq;
+    for ( i = 0; i < PROBE_PAYLOAD; i++ )
+        packet[IP_HDR_LEN + ICMP_HDR_LEN + i] = (uint8_t) i;
+    checksum = trace_checksum(&packet[IP_HDR_LEN], ICMP_HDR_LEN + PROBE_PAYLOAD);
+    packet[IP_HDR_LEN + 2] = (uint8_t)(checksum >> 8);
+    packet[IP_HDR_LEN + 3] = (uint8_t) checksum;
+
+    /* SLIP frame, with an END before it to flush any line noise
+     */
+    tx_len = 0;
+    tx_frame[tx_len++] = SLIP_END;
+    for ( i = 0; i < PROBE_LEN; i++ )
+    {
+        if ( packet[i] == SLIP_END )
+        {
+            tx_frame[tx_len++] = SLIP_ESC;
+            tx_frame[tx_len++] = SLIP_ESC_END;
+        }
+        else if ( packet[i] == SLIP_ESC )
+        {
+            tx_frame[tx_len++] = SLIP_ESC;
+            tx_frame[tx_len++] = SLIP_ESC_ESC;
+        }
+        else
+        {
+            tx_frame[tx_len++] = packet[i];
+        }
+    }
+    tx_frame[tx_len++] = SLIP_END;
+    tx_pos = 0;
+
+    probe->sent = hrt_read();
+    probe->state = PROBE_SENT;
+    tx_probe = probe;
+    pending++;
+}
+
+/*------------------------------------------------
+ * trace_timeout()
+ *
+ *  Mark probes that were not answered in time as lost.
+ *
+ * param:  none
+ * return: none
+ *
+ */
+void trace_timeout(void)
+{
+    uint32_t    now;
+    int         hop, query;
+
+    now = hrt_read();
+
+    for ( hop = 0; hop < max_hops; hop++ )
+    {
+        for ( query = 0; query < queries; query++ )
+        {
+            if ( probes[hop][query].state == PROBE_SENT &&
+                 &probes[hop][query] != tx_probe &&
+                 (now - probes[hop][query].sent) > (wait * COUNTS_PER_MSEC) )
+            {
+                probes[hop][query].state = PROBE_LOST;
+                pending--;
+            }
+        }
+    }
+}
+
+/*------------------------------------------------
+ * trace_hop_done()
+ *
+ *  Check if all of a hop's probes were answered or timed out.
+ *
+ * param:  hop, counting from '0'
+ * return: '1' hop is complete, '0' not yet
+ *
+ */
+int trace_hop_done(int hop)
+{
+    int     query;
+
+    for ( query = 0; query < queries; query++ )
+    {
+        if ( probes[hop][query].state == PROBE_IDLE ||
+             probes[hop][query].state == PROBE_SENT )
+            return 0;
+    }
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * trace_print()
+ *
+ *  Print one hop, with the responding address, and again
+ *  whenever a later query was answered from a different address.
+ *
+ * param:  hop, counting from '0'
+ * return: none
+ *
+ */
+void trace_print(int hop)
+{
+    struct probe_t *probe;
+    uint8_t         from[4] = {0, 0, 0, 0};
+    char            ip[16];
+    int             query;
+
+    printf("%2d ", hop + 1);
+
+    for ( query = 0; query < queries; query++ )
+    {
+        probe = &probes[hop][query];
+
+        if ( probe->state != PROBE_DONE )
+        {
+            printf(" *");
+            continue;
+        }
+
+        if ( memcmp(probe->from, from, 4) != 0 )
+        {
+            memcpy(from, probe->from, 4);
+            sprintf(ip, "%u.%u.%u.%u", from[0], from[1], from[2], from[3]);
+            printf(" %-15s", ip);
+        }
+
+        printf("  %lu.%03lu ms", probe->rtt / 1000, probe->rtt % 1000);
+
+        if ( probe->type == ICMP_DEST_UNREACH )
+        {
+            switch ( probe->code )
+            {
+                case 0:  printf(" !N"); break;
+                case 1:  printf(" !H"); break;
+                case 2:  printf(" !P"); break;
+                case 3:  break;                                 // port unreachable is the destination
+                case 4:  printf(" !F"); break;
+                default: printf(" !X"); break;
+            }
+        }
+    }
+
+    printf("\n");
+}
+
+/*------------------------------------------------
+ * ctrl_break()
+ *
+ *  Ctrl-Break / Ctrl-C function
+ *
+ * param:  signal type
+ * return: none
+ *
+ */
+void ctrl_break(int sig_no)
+{
+    done = 1;
+}
+
+/*------------------------------------------------
+ * main()
+ *
+ *
+ */
+int main(int argc, char* argv[])
+{
+    union REGS      regs;
+    char           *local;
+    int             i, conv = 0, baud = DEF_BAUD;
+    int             next_probe, probe_count, next_print;
+    uint32_t        last_check = 0, start_time;
+
+    /* parse command line variables
+     */
+    if ( argc == 1 )
+    {
+        printf("%s\n", USAGE);
+        return -1;
+    }
+
+    for ( i = 1; i < argc; i++ )
+    {
+        if ( strcmp(argv[i], "-V") == 0 )
+        {
+            printf("traceroute.exe %s %s %s\n", VERSION, __DATE__, __TIME__);
+            return 0;
+        }
+        else if ( strcmp(argv[i], "-b") == 0 && (i + 1) < argc )
+        {
+            i++;
+            baud = atoi(argv[i]);
+            if ( baud < 0 || baud > 7 )
+                baud = DEF_BAUD;
+        }
+        else if ( strcmp(argv[i], "-m") == 0 && (i + 1) < argc )
+        {
+            i++;
+            max_hops = atoi(argv[i]);
+            if ( max_hops < 1 || max_hops > MAX_HOPS )
+                max_hops = MAX_HOPS;
+        }
+        else if ( strcmp(argv[i], "-q") == 0 && (i + 1) < argc )
+        {
+            i++;
+            queries = atoi(argv[i]);
+            if ( queries < 1 || queries > MAX_QUERIES )
+                queries = DEF_QUERIES;
+        }
+        else if ( strcmp(argv[i], "-w") == 0 && (i + 1) < argc )
+        {
+            i++;
+            wait = atol(argv[i]);
+            if ( wait < 1 )
+                wait = DEF_WAIT;
+        }
+        else
+        {
+            conv = trace_aton(argv[i], destination);
+        }
+    }
+
+    if ( conv == 0 )
+    {
+        printf("Address must be in IPv4 format 0.0.0.0\n");
+        return -1;
+    }
+
+    local = getenv("LOCALHOST");
+    if ( local == NULL || !trace_aton(local, local_host) )
+    {
+        printf("Missing IP stack environment variable(s)\n");
+        return 1;
+    }
+
+    /* COM1 for SLIP, 8 bits no parity and one stop bit
+     */
+    com_base = (int) *((uint16_t __far*) MK_FP(0x40, 0));
+    if ( com_base == 0 )
+    {
+        printf("No COM1 port\n");
+        return 1;
+    }
+
+    regs.h.ah = 0;
+    regs.h.al = ((uint8_t) baud << 5) | 0x03;
+    regs.w.dx = 0;
+    int86(0x14, &regs, &regs);
+
+    while ( inp(com_base + UART_LSR) & LSR_DATA_READY )
+        inp(com_base + UART_DATA);
+
+    if ( !hrt_init() )
+        printf("PIT counter not usable, times have 55 mSec resolution\n");
+
+    printf("traceroute to %u.%u.%u.%u, %d hops max\n",
+           destination[0], destination[1], destination[2], destination[3], max_hops);
+
+    signal(SIGINT, ctrl_break);
+
+    last_hop = max_hops;
+    next_probe = 0;
+    next_print = 0;
+    probe_count = max_hops * queries;
+    start_time = hrt_read();
+
+    /* main loop
+     * queue the next probe as soon as the previous one left, and print
+     * each hop once it and all hops before it are complete. The UART is
+     * polled every pass, the probe table only every CHECK_INTERVAL.
+     */
+    while ( !done && next_print <= last_hop && next_print < max_hops )
+    {
+        slip_poll();
+
+        if ( next_probe < probe_count && tx_pos == tx_len )
+            trace_send(&next_probe);
+
+        if ( (hrt_read() - last_check) < (CHECK_INTERVAL * COUNTS_PER_MSEC) )
+            continue;
+
+        last_check = hrt_read();
+
+        trace_timeout();
+
+        while ( next_print <= last_hop && next_print < max_hops && trace_hop_done(next_print) )
+        {
+            trace_print(next_print);
+            next_print++;
+        }
+    }
+
+    printf("trace time %lums\n", hrt_us(hrt_read() - start_time) / 1000);
+
+    return (last_hop == max_hops);
+}
@@ -0,0 +1,1343 @@
+/*
+ *
+ * vt100.c
+ *
+ *  VT100/ANSI terminal emulation for the telnet client.
+ *  Host output is parsed into an 80x25 shadow screen, and the changes are
+ *  applied to the display with as few BIOS INT 10h calls as possible:
+ *  runs of identical cells are written with one AH=09h call, single changed
+ *  characters are written with AH=0Eh teletype output that advances the cursor,
+ *  and scrolling uses the BIOS scroll functions AH=06h/07h.
+ *  A second copy of the display contents is kept so that only cells that
+ *  actually changed are written, which keeps full screen redraws from
+ *  'vi' or 'top' ahead of the serial link.
+ *  Lines scrolled off the top of the screen are saved in an optional scrollback
+ *  history, which can be browsed without disturbing the shadow screen.
+ *
+ *  Supported:
+ *      C0 controls BEL BS HT LF VT FF CR SO SI CAN SUB ESC
+ *      ESC 7 8 D E M c = > ( ) #
+ *      CSI A B C D E F G H J K L M P X @ S T d f m r s u n c h l
+ *      SGR 0 1 4 5 7 22 24 25 27 30-37 39 40-47 49 90-97 100-107
+ *      DEC special graphics character set, mapped to code page 437
+ *
+ *  resources:
+ *      https://vt100.net/docs/vt100-ug/chapter3.html
+ *      https://vt100.net/emu/dec_ansi_parser
+ *      http://www.ctyme.com/intr/int-10.htm
+ *
+ */
+
+#include    <stdio.h>
+#include    <string.h>
+#include    <dos.h>
+#include    <i86.h>
+
+#include    "vt100.h"
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     VT_GROUND           0           // Parser states
+#define     VT_ESC              1
+#define     VT_ESC_CHARSET      2
+#define     VT_ESC_SKIP         3
+#define     VT_CSI              4
+#define     VT_OSC              5
+#define     VT_OSC_ESC          6
+
+#define     ESC                 27
+#define     BLANK               ' '
+
+#define     MONO_MODE           7           // Monochrome text video mode
+#define     CURSOR_HIDE         0x2000      // Cursor shape with start line bit 5 set
+
+/* -----------------------------------------
+   Static prototypes
+----------------------------------------- */
+static void    vt_execute(vt100_t*, uint8_t);
+static void    vt_esc_dispatch(vt100_t*, uint8_t);
+static void    vt_csi_dispatch(vt100_t*, uint8_t);
+static void    vt_sgr(vt100_t*);
+static void    vt_mode(vt100_t*, int);
+static void    vt_put(vt100_t*, uint8_t);
+static void    vt_linefeed(vt100_t*);
+static void    vt_reverse_index(vt100_t*);
+static void    vt_scroll_up(vt100_t*, int, int, int);
+static void    vt_scroll_down(vt100_t*, int, int, int);
+static void    vt_erase(vt100_t*, int, int, int, int);
+static void    vt_dirty(vt100_t*, int, int, int);
+static void    vt_goto(vt100_t*, int, int);
+static int     vt_param(vt100_t*, int, int);
+static uint8_t vt_attribute(vt100_t*);
+static void    vt_render(int, const uint16_t*, int, int);
+static void    vt_bios_cursor(int, int);
+static void    vt_bios_scroll(uint8_t, int, int, int, uint8_t);
+static void    vt_bios_cursor_shape(uint16_t);
+static void    vt_bios_probe(void);
+
+/* -----------------------------------------
+   Globals
+----------------------------------------- */
+static union  REGS      regs;
+static struct SREGS     segment_regs;
+
+static vt100_t         *display = 0;                        // Terminal being displayed
+static uint16_t         video[VT100_ROWS][VT100_COLS];      // Current display contents
+static int              bios_row = -1;                      // BIOS cursor position, '-1' unknown
+static int              bios_col = -1;
+static int              probed = 0;                         // Video mode and cursor shape were read
+static int              mono = 0;
+static uint16_t         cursor_shape = 0x0607;
+static int              cursor_hidden = 0;
+
+static const uint8_t    ansi_to_bios[8] = {0, 4, 2, 6, 1, 5, 3, 7};
+
+/* DEC special graphics characters 0x5f to 0x7e in code page 437
+ */
+static const uint8_t    dec_graphics[32] = {
+    0x20, 0x04, 0xb1, 0xf9, 0xf9, 0xf9, 0xf9, 0xf8,     // _ ` a b c d e f
+    0xf1, 0xf9, 0xf9, 0xd9, 0xbf, 0xda, 0xc0, 0xc5,     // g h i j k l m n
+    0xc4, 0xc4, 0xc4, 0xc4, 0xc4, 0xc3, 0xb4, 0xc1,     // o p q r s t u v
+    0xc2, 0xb3, 0xf3, 0xf2, 0xe3, 0xd8, 0x9c, 0xfa      // w x y z { | } ~
+};
+
+/*------------------------------------------------
+ * vt100_init()
+ *
+ *  Initialize a terminal to its power-up state with a blank screen.
+ *
+ * param:  Pointer to terminal, ID to pass to the reply function,
+ *         and the function that sends terminal responses to the host
+ * return: none
+ *
+ */
+void vt100_init(vt100_t *vt, int id, vt100_reply_t reply)
+{
+    if ( !probed )
+        vt_bios_probe();
+
+    memset(vt, 0, sizeof(vt100_t));
+
+    vt->id = id;
+    vt->reply = reply;
+    vt->bottom = VT100_ROWS - 1;
+    vt->fg = 7;
+    vt->autowrap = 1;
+    vt->cursor_visible = 1;
+    vt->attr = vt_attribute(vt);
+    vt->saved_attr = vt->attr;
+
+    vt_erase(vt, 0, 0, VT100_ROWS - 1, VT100_COLS - 1);
+}
+
+/*------------------------------------------------
+ * vt100_write()
+ *
+ *  Parse host output into the shadow screen.
+ *  Printable characters are handled in a tight loop, escape sequences
+ *  are parsed by a state machine that is kept between calls, so a sequence
+ *  may be split over any number of writes.
+ *
+ * param:  Pointer to terminal, data and data length
+ * return: none
+ *
+ */
+void vt100_write(vt100_t *vt, const uint8_t *data, int len)
+{
+    uint8_t     c;
+
+    while ( len-- )
+    {
+        c = *data++;
+
+        switch ( vt->state )
+        {
+            case VT_GROUND:
+                if ( c >= BLANK && c != 0x7f )
+                    vt_put(vt, c);
+                else
+                    vt_execute(vt, c);
+                break;
+
+            case VT_ESC:
+                if ( c < BLANK )
+                    vt_execute(vt, c);
+                else
+                    vt_esc_dispatch(vt, c);
+                break;
+
+            case VT_ESC_CHARSET:
+                vt->graphics[vt->private_mark] = (c == '0');
+                vt->state = VT_GROUND;
+                break;
+
+            case VT_ESC_SKIP:
+                vt->state = VT_GROUND;
+                break;
+
+            case VT_CSI:
+                if ( c >= '0' && c <= '9' )
+                {
+                    if ( vt->param_count == 0 )
+                        vt->param_count = 1;
+                    if ( vt->param_count <= VT100_PARAMS && vt->params[vt->param_count - 1] < 10000 )
+                        vt->params[vt->param_count - 1] = vt->params[vt->param_count - 1] * 10 + (c - '0');
+                }
+                else if ( c == ';' )
+                {
+                    if ( vt->param_count == 0 )
+                        vt->param_count = 1;
+                    if ( vt->param_count < VT100_PARAMS )
+                        vt->params[vt->param_count] = 0;
+                    vt->param_count++;
+                }
+                else if ( c >= '<' && c <= '?' )
+                {
+                    vt->private_mark = c;
+                }
+                else if ( c >= '@' && c <= '~' )
+                {
+                    if ( vt->param_count > VT100_PARAMS )
+                        vt->param_count = VT100_PARAMS;
+                    vt->state = VT_GROUND;
+                    vt_csi_dispatch(vt, c);
+                }
+                else if ( c < BLANK )
+                {
+                    vt_execute(vt, c);
+                }
+                break;
+
+            case VT_OSC:
+                // Operating system commands (window title etc.) are ignored
+                if ( c == 7 )
+                    vt->state = VT_GROUND;
+                else if ( c == ESC )
+                    vt->state = VT_OSC_ESC;
+                break;
+
+            case VT_OSC_ESC:
+                vt->state = (c == '\\') ? VT_GROUND : VT_OSC;
+                break;
+
+            default:
+                vt->state = VT_GROUND;
+        }
+    }
+}
+
+/*------------------------------------------------
+ * vt100_flush()
+ *
+ *  Apply shadow screen changes to the display.
+ *  Nothing is written while the scrollback history is browsed, the changes
+ *  stay marked until the view returns to the screen.
+ *
+ * param:  Pointer to terminal
+ * return: none
+ *
+ */
+void vt100_flush(vt100_t *vt)
+{
+    int         row;
+
+    if ( vt != display || vt->view )
+        return;
+
+    for ( row = 0; row < VT100_ROWS; row++ )
+    {
+        if ( vt->dirty_first[row] >= VT100_COLS )
+            continue;
+
+        vt_render(row, vt->screen[row], vt->dirty_first[row], vt->dirty_last[row]);
+        vt->dirty_first[row] = VT100_COLS;
+    }
+
+    if ( vt->cursor_visible == cursor_hidden )
+    {
+        vt_bios_cursor_shape(vt->cursor_visible ? cursor_shape : CURSOR_HIDE);
+        cursor_hidden = !vt->cursor_visible;
+    }
+
+    if ( bios_row != vt->row || bios_col != vt->col )
+        vt_bios_cursor(vt->row, vt->col);
+}
+
+/*------------------------------------------------
+ * vt100_show()
+ *
+ *  Make a terminal the displayed terminal and repaint the whole screen from it.
+ *  A terminal is always shown live, not scrolled back.
+ *
+ * param:  Pointer to terminal
+ * return: none
+ *
+ */
+void vt100_show(vt100_t *vt)
+{
+    int     row;
+
+    display = vt;
+    vt->view = 0;
+
+    /* Mark the display unknown so that every cell is written
+     */
+    memset(video, 0xff, sizeof(video));
+    for ( row = 0; row < VT100_ROWS; row++ )
+    {
+        vt->dirty_first[row] = 0;
+        vt->dirty_last[row] = VT100_COLS - 1;
+    }
+
+    bios_row = -1;
+    cursor_hidden = vt->cursor_visible;     // Force a cursor shape update
+
+    vt100_flush(vt);
+}
+
+/*------------------------------------------------
+ * vt100_restore()
+ *
+ *  Restore the cursor shape and leave the cursor
+ *  on the last line of the screen, before returning to DOS.
+ *
+ * param:  none
+ * return: none
+ *
+ */
+void vt100_restore(void)
+{
+    if ( display == 0 )
+        return;
+
+    vt_bios_cursor_shape(cursor_shape);
+    vt_bios_cursor(VT100_ROWS - 1, 0);
+    display = 0;
+}
+
+/*------------------------------------------------
+ * vt100_key()
+ *
+ *  Translate a keyboard key to the byte sequence a VT100 sends.
+ *
+ * param:  Pointer to terminal, key as returned by getch() or VT100_KEY_EXT with the
+ *         scan code of an extended key, and output buffer of VT100_SEQ_LEN bytes
+ * return: Sequence length, '0' if the key has no VT100 equivalent
+ *
+ */
+int vt100_key(vt100_t *vt, int key, uint8_t *seq)
+{
+    char   *code;
+
+    if ( !(key & VT100_KEY_EXT) )
+    {
+        seq[0] = (uint8_t) key;
+        return 1;
+    }
+
+    switch ( key & 0xff )
+    {
+        case 0x48: code = vt->cursor_keys ? "\033OA" : "\033[A"; break;    // Up
+        case 0x50: code = vt->cursor_keys ? "\033OB" : "\033[B"; break;    // Down
+        case 0x4d: code = vt->cursor_keys ? "\033OC" : "\033[C"; break;    // Right
+        case 0x4b: code = vt->cursor_keys ? "\033OD" : "\033[D"; break;    // Left
+        case 0x47: code = "\033[1~"; break;                                 // Home
+        case 0x4f: code = "\033[4~"; break;                                 // End
+        case 0x49: code = "\033[5~"; break;                                 // PgUp
+        case 0x51: code = "\033[6~"; break;                                 // PgDn
+        case 0x52: code = "\033[2~"; break;                                 // Ins
+        case 0x53: code = "\033[3~"; break;                                 // Del
+        case 0x3b: code = "\033OP"; break;                                  // F1 to F4 are PF1 to PF4
+        case 0x3c: code = "\033OQ"; break;
+        case 0x3d: code = "\033OR"; break;
+        case 0x3e: code = "\033OS"; break;
+        default:
+            return 0;
+    }
+
+    strcpy((char*) seq, code);
+
+    return strlen(code);
+}
+
+/*------------------------------------------------
+ * vt100_history()
+ *
+ *  Attach a scrollback history to a terminal.
+ *
+ * param:  Pointer to terminal, pointer to history or NULL for none
+ * return: none
+ *
+ */
+void vt100_history(vt100_t *vt, history_t *history)
+{
+    vt->history = history;
+    vt->view = 0;
+}
+
+/*------------------------------------------------
+ * vt100_view()
+ *
+ *  Scroll the displayed view back into the history or forward to the screen.
+ *  The view is drawn from history lines above the top rows of the screen, and
+ *  only cells that differ from the display are written. The cursor is hidden
+ *  while the view is scrolled back. Returning to the screen applies the
+ *  changes that arrived in the meantime.
+ *
+ * param:  Pointer to terminal, lines to scroll back, negative to scroll forward
+ * return: Lines the view is scrolled back, '0' is live
+ *
+ */
+int vt100_view(vt100_t *vt, int lines)
+{
+    static uint16_t cells[VT100_COLS];
+
+    int     view, row;
+
+    if ( vt->history == NULL )
+        return 0;
+
+    view = vt->view + lines;
+    if ( view > vt->history->lines )
+        view = vt->history->lines;
+    if ( view < 0 )
+        view = 0;
+
+    if ( view == vt->view )
+        return view;
+
+    vt->view = view;
+
+    if ( vt != display )
+        return view;
+
+    if ( view == 0 )
+    {
+        for ( row = 0; row < VT100_ROWS; row++ )
+        {
+            vt->dirty_first[row] = 0;
+            vt->dirty_last[row] = VT100_COLS - 1;
+        }
+
+        vt100_flush(vt);
+        return 0;
+    }
+
+    for ( row = 0; row < VT100_ROWS; row++ )
+    {
+        if ( row < view )
+        {
+            history_line(vt->history, view - row, cells, VT100_COLS);
+            vt_render(row, cells, 0, VT100_COLS - 1);
+        }
+        else
+        {
+            vt_render(row, vt->screen[row - view], 0, VT100_COLS - 1);
+        }
+    }
+
+    if ( !cursor_hidden )
+    {
+        vt_bios_cursor_shape(CURSOR_HIDE);
+        cursor_hidden = 1;
+    }
+
+    return view;
+}
+
+/*------------------------------------------------
+ * vt_execute()
+ *
+ *  Execute a C0 control character.
+ *
+ * param:  Pointer to terminal, control character
+ * return: none
+ *
+ */
+static void vt_execute(vt100_t *vt, uint8_t c)
+{
+    switch ( c )
+    {
+        case 7:                                 // BEL
+            regs.h.ah = 0x0e;
+            regs.h.al = 7;
+            regs.h.bh = 0;
+            int86x(0x10, &regs, &regs, &segment_regs);
+            break;
+
+        case 8:                                 // BS
+            if ( vt->col > 0 )
+                vt->col--;
+            vt->wrap_pending = 0;
+            break;
+
+        case 9:                                 // HT, fixed tab stops every 8 columns
+            vt->col = (vt->col + 8) & ~7;
+            if ( vt->col >= VT100_COLS )
+                vt->col = VT100_COLS - 1;
+            vt->wrap_pending = 0;
+            break;
+
+        case 10:                                // LF, VT, FF
+        case 11:
+        case 12:
+            vt_linefeed(vt);
+            break;
+
+        case 13:                                // CR
+            vt->col = 0;
+            vt->wrap_pending = 0;
+            break;
+
+        case 14:                                // SO
+            vt->shift = 1;
+            break;
+
+        case 15:                                // SI
+            vt->shift = 0;
+            break;
+
+        case 24:                                // CAN, SUB
+        case 26:
+            vt->state = VT_GROUND;
+            break;
+
+        case ESC:
+            vt->state = VT_ESC;
+            break;
+
+        default:;
+    }
+}
+
+/*------------------------------------------------
+ * vt_esc_dispatch()
+ *
+ *  Execute an escape sequence, or start a control sequence.
+ *
+ * param:  Pointer to terminal, character following ESC
+ * return: none
+ *
+ */
+static void vt_esc_dispatch(vt100_t *vt, uint8_t c)
+{
+    history_t  *history;
+
+    vt->state = VT_GROUND;
+
+    switch ( c )
+    {
+        case '[':                               // CSI
+            vt->state = VT_CSI;
+            vt->param_count = 0;
+            vt->params[0] = 0;
+            vt->private_mark = 0;
+            break;
+
+        case ']':                               // OSC
+            vt->state = VT_OSC;
+            break;
+
+        case '(':                               // Designate G0 or G1 character set
+        case ')':
+            vt->private_mark = (c == ')');
+            vt->state = VT_ESC_CHARSET;
+            break;
+
+        case '#':                               // Line size and alignment test, ignored
+            vt->state = VT_ESC_SKIP;
+            break;
+
+        case '7':                               // DECSC
+            vt->saved_row = vt->row;
+            vt->saved_col = vt->col;
+            vt->saved_attr = vt->attr;
+            break;
+
+        case '8':                               // DECRC
+            vt->row = vt->saved_row;
+            vt->col = vt->saved_col;
+            vt->attr = vt->saved_attr;
+            vt->wrap_pending = 0;
+            break;
+
+        case 'D':                               // IND
+            vt_linefeed(vt);
+            break;
+
+        case 'E':                               // NEL
+            vt->col = 0;
+            vt_linefeed(vt);
+            break;
+
+        case 'M':                               // RI
+            vt_reverse_index(vt);
+            break;
+
+        case 'c':                               // RIS, the history is kept
+            history = vt->history;
+            vt100_init(vt, vt->id, vt->reply);
+            vt->history = history;
+            if ( vt == display )
+                vt100_show(vt);
+            break;
+
+        case '=':                               // Keypad modes, ignored
+        case '>':
+        default:;
+    }
+}
+
+/*------------------------------------------------
+ * vt_csi_dispatch()
+ *
+ *  Execute a control sequence.
+ *
+ * param:  Pointer to terminal, final character
+ * return: none
+ *
+ */
+static void vt_csi_dispatch(vt100_t *vt, uint8_t c)
+{
+    int     n, i, top, bottom;
+    char    report[16];
+
+    n = vt_param(vt, 0, 1);
+
+    switch ( c )
+    {
+        case 'A':                               // CUU
+            top = (vt->row >= vt->top) ? vt->top : 0;
+            vt_goto(vt, (vt->row - n < top) ? top : vt->row - n, vt->col);
+            break;
+
+        case 'B':                               // CUD
+            bottom = (vt->row <= vt->bottom) ? vt->bottom : VT100_ROWS - 1;
+            vt_goto(vt, (vt->row + n > bottom) ? bottom : vt->row + n, vt->col);
+            break;
+
+        case 'C':                               // CUF
+            vt_goto(vt, vt->row, vt->col + n);
+            break;
+
+        case 'D':                               // CUB
+            vt_goto(vt, vt->row, vt->col - n);
+            break;
+
+        case 'E':                               // CNL
+            vt_goto(vt, vt->row + n, 0);
+            break;
+
+        case 'F':                               // CPL
+            vt_goto(vt, vt->row - n, 0);
+            break;
+
+        case 'G':                               // CHA
+        case '`':
+            vt_goto(vt, vt->row, n - 1);
+            break;
+
+        case 'd':                               // VPA
+            vt_goto(vt, n - 1 + (vt->origin ? vt->top : 0), vt->col);
+            break;
+
+        case 'H':                               // CUP
+        case 'f':
+            vt_goto(vt, n - 1 + (vt->origin ? vt->top : 0), vt_param(vt, 1, 1) - 1);
+            break;
+
+        case 'J':                               // ED
+            n = vt_param(vt, 0, 0);
+            if ( n == 0 )
+            {
+                vt_erase(vt, vt->row, vt->col, vt->row, VT100_COLS - 1);
+                if ( vt->row < (VT100_ROWS - 1) )
+                    vt_erase(vt, vt->row + 1, 0, VT100_ROWS - 1, VT100_COLS - 1);
+            }
+            else if ( n == 1 )
+            {
+                if ( vt->row > 0 )
+                    vt_erase(vt, 0, 0, vt->row - 1, VT100_COLS - 1);
+                vt_erase(vt, vt->row, 0, vt->row, vt->col);
+            }
+            else
+            {
+                vt_erase(vt, 0, 0, VT100_ROWS - 1, VT100_COLS - 1);
+            }
+            break;
+
+        case 'K':                               // EL
+            n = vt_param(vt, 0, 0);
+            if ( n == 0 )
+                vt_erase(vt, vt->row, vt->col, vt->row, VT100_COLS - 1);
+            else if ( n == 1 )
+                vt_erase(vt, vt->row, 0, vt->row, vt->col);
+            else
+                vt_erase(vt, vt->row, 0, vt->row, VT100_COLS - 1);
+            break;
+
+        case 'L':                               // IL
+            if ( vt->row >= vt->top && vt->row <= vt->bottom )
+                vt_scroll_down(vt, vt->row, vt->bottom, n);
+            vt->col = 0;
+            break;
+
+        case 'M':                               // DL
+            if ( vt->row >= vt->top && vt->row <= vt->bottom )
+                vt_scroll_up(vt, vt->row, vt->bottom, n);
+            vt->col = 0;
+            break;
+
+        case 'S':                               // SU
+            vt_scroll_up(vt, vt->top, vt->bottom, n);
+            break;
+
+        case 'T':                               // SD
+            vt_scroll_down(vt, vt->top, vt->bottom, n);
+            break;
+
+        case 'P':                               // DCH
+            if ( n > VT100_COLS - vt->col )
+                n = VT100_COLS - vt->col;
+            memmove(&vt->screen[vt->row][vt->col], &vt->screen[vt->row][vt->col + n],
+                    (VT100_COLS - vt->col - n) * sizeof(uint16_t));
+            vt_erase(vt, vt->row, VT100_COLS - n, vt->row, VT100_COLS - 1);
+            vt_dirty(vt, vt->row, vt->col, VT100_COLS - 1);
+            break;
+
+        case '@':                               // ICH
+            if ( n > VT100_COLS - vt->col )
+                n = VT100_COLS - vt->col;
+            memmove(&vt->screen[vt->row][vt->col + n], &vt->screen[vt->row][vt->col],
+                    (VT100_COLS - vt->col - n) * sizeof(uint16_t));
+            vt_erase(vt, vt->row, vt->col, vt->row, vt->col + n - 1);
+            vt_dirty(vt, vt->row, vt->col, VT100_COLS - 1);
+            break;
+
+        case 'X':                               // ECH
+            if ( n > VT100_COLS - vt->col )
+                n = VT100_COLS - vt->col;
+            vt_erase(vt, vt->row, vt->col, vt->row, vt->col + n - 1);
+            break;
+
+        case 'm':                               // SGR
+            vt_sgr(vt);
+            break;
+
+        case 'r':                               // DECSTBM
+            top = vt_param(vt, 0, 1) - 1;
+            bottom = vt_param(vt, 1, VT100_ROWS) - 1;
+            if ( bottom >= VT100_ROWS )
+                bottom = VT100_ROWS - 1;
+            if ( top < bottom )
+            {
+                vt->top = top;
+                vt->bottom = bottom;
+                vt_goto(vt, vt->origin ? top : 0, 0);
+            }
+            break;
+
+        case 's':                               // Save and restore cursor (ANSI.SYS)
+            vt->saved_row = vt->row;
+            vt->saved_col = vt->col;
+            break;
+
+        case 'u':
+            vt_goto(vt, vt->saved_row, vt->saved_col);
+            break;
+
+        case 'h':                               // SM and RM
+        case 'l':
+            for ( i = 0; i < (vt->param_count ? vt->param_count : 1); i++ )
+                vt_mode(vt, (c == 'h') ? vt->params[i] : -vt->params[i]);
+            break;
+
+        case 'n':                               // DSR
+            n = vt_param(vt, 0, 0);
+            if ( n == 5 && vt->reply )
+            {
+                vt->reply(vt->id, (uint8_t*) "\033[0n", 4);
+            }
+            else if ( n == 6 && vt->reply )
+            {
+                i = sprintf(report, "\033[%d;%dR",
+                            vt->row + 1 - (vt->origin ? vt->top : 0), vt->col + 1);
+                vt->reply(vt->id, (uint8_t*) report, i);
+            }
+            break;
+
+        case 'c':                               // DA, VT100 with no options
+            if ( vt_param(vt, 0, 0) == 0 && vt->private_mark == 0 && vt->reply )
+                vt->reply(vt->id, (uint8_t*) "\033[?1;0c", 7);
+            break;
+
+        default:;
+    }
+}
+
+/*------------------------------------------------
+ * vt_sgr()
+ *
+ *  Select graphic rendition, and update the BIOS attribute.
+ *
+ * param:  Pointer to terminal
+ * return: none
+ *
+ */
+static void vt_sgr(vt100_t *vt)
+{
+    int     i, p;
+
+    for ( i = 0; i < (vt->param_count ? vt->param_count : 1); i++ )
+    {
+        p = vt->params[i];
+
+        if ( p == 0 )
+        {
+            vt->fg = 7;
+            vt->bg = 0;
+            vt->bold = 0;
+            vt->underline = 0;
+            vt->blink = 0;
+            vt->reverse = 0;
+        }
+        else if ( p == 1 )
+            vt->bold = 1;
+        else if ( p == 4 )
+            vt->underline = 1;
+        else if ( p == 5 )
+            vt->blink = 1;
+        else if ( p == 7 )
+            vt->reverse = 1;
+        else if ( p == 22 )
+            vt->bold = 0;
+        else if ( p == 24 )
+            vt->underline = 0;
+        else if ( p == 25 )
+            vt->blink = 0;
+        else if ( p == 27 )
+            vt->reverse = 0;
+        else if ( p >= 30 && p <= 37 )
+            vt->fg = p - 30;
+        else if ( p == 39 )
+            vt->fg = 7;
+        else if ( p >= 40 && p <= 47 )
+            vt->bg = p - 40;
+        else if ( p == 49 )
+            vt->bg = 0;
+        else if ( p >= 90 && p <= 97 )
+            vt->fg = (p - 90) | 8;
+        else if ( p >= 100 && p <= 107 )
+            vt->bg = p - 100;
+    }
+
+    vt->attr = vt_attribute(vt);
+}
+
+/*------------------------------------------------
+ * vt_mode()
+ *
+ *  Set or reset a DEC private mode.
+ *
+ * param:  Pointer to terminal, mode number, negative to reset
+ * return: none
+ *
+ */
+static void vt_mode(vt100_t *vt, int mode)
+{
+    int     set;
+
+    if ( vt->private_mark != '?' )
+        return;
+
+    set = (mode > 0);
+    if ( mode < 0 )
+        mode = -mode;
+
+    switch ( mode )
+    {
+        case 1:                                 // DECCKM
+            vt->cursor_keys = set;
+            break;
+
+        case 6:                                 // DECOM
+            vt->origin = set;
+            vt_goto(vt, set ? vt->top : 0, 0);
+            break;
+
+        case 7:                                 // DECAWM
+            vt->autowrap = set;
+            break;
+
+        case 25:                                // DECTCEM
+            vt->cursor_visible = set;
+            break;
+
+        default:;
+    }
+}
+
+/*------------------------------------------------
+ * vt_put()
+ *
+ *  Write a printable character at the cursor and advance the cursor.
+ *  Writing to the last column leaves the cursor there, and the line wraps
+ *  when the next character is written (VT100 behavior).
+ *
+ * param:  Pointer to terminal, character
+ * return: none
+ *
+ */
+static void vt_put(vt100_t *vt, uint8_t c)
+{
+    if ( vt->wrap_pending )
+    {
+        vt->col = 0;
+        vt_linefeed(vt);
+    }
+
+    if ( vt->graphics[vt->shift] && c >= 0x5f && c <= 0x7e )
+        c = dec_graphics[c - 0x5f];
+
+    vt->screen[vt->row][vt->col] = c | ((uint16_t) vt->attr << 8);
+    vt_dirty(vt, vt->row, vt->col, vt->col);
+
+    if ( vt->col < (VT100_COLS - 1) )
+        vt->col++;
+    else
+        vt->wrap_pending = vt->autowrap;
+}
+
+/*------------------------------------------------
+ * vt_linefeed()
+ *
+ *  Move the cursor down one line, scroll the region at its bottom.
+ *
+ * param:  Pointer to terminal
+ * return: none
+ *
+ */
+static void vt_linefeed(vt100_t *vt)
+{
+    vt->wrap_pending = 0;
+
+    if ( vt->row == vt->bottom )
+        vt_scroll_up(vt, vt->top, vt->bottom, 1);
+    else if ( vt->row < (VT100_ROWS - 1) )
+        vt->row++;
+}
+
+/*------------------------------------------------
+ * vt_reverse_index()
+ *
+ *  Move the cursor up one line, scroll the region down at its top.
+ *
+ * param:  Pointer to terminal
+ * return: none
+ *
+ */
+static void vt_reverse_index(vt100_t *vt)
+{
+    vt->wrap_pending = 0;
+
+    if ( vt->row == vt->top )
+        vt_scroll_down(vt, vt->top, vt->bottom, 1);
+    else if ( vt->row > 0 )
+        vt->row--;
+}
+
+/*------------------------------------------------
+ * vt_scroll_up()
+ *
+ *  Scroll lines up and clear the lines at the bottom.
+ *  The shadow screen, the display copy and the display are scrolled together,
+ *  so rows with pending changes keep their dirty marks.
+ *  Lines leaving the top of the screen are added to the history. A view
+ *  into the history moves back with them, so it keeps showing the same lines.
+ *
+ * param:  Pointer to terminal, top and bottom row, line count
+ * return: none
+ *
+ */
+static void vt_scroll_up(vt100_t *vt, int top, int bottom, int lines)
+{
+    int         row, col;
+    uint16_t    blank;
+
+    if ( lines > (bottom - top + 1) )
+        lines = bottom - top + 1;
+
+    blank = BLANK | ((uint16_t) vt->attr << 8);
+
+    if ( top == 0 && vt->history )
+    {
+        for ( row = 0; row < lines; row++ )
+            history_push(vt->history, vt->screen[row], VT100_COLS);
+
+        if ( vt->view )
+        {
+            vt->view += lines;
+            if ( vt->view > vt->history->lines )
+                vt->view = vt->history->lines;
+        }
+    }
+
+    if ( lines <= (bottom - top) )
+    {
+        memmove(&vt->screen[top][0], &vt->screen[top + lines][0],
+                (bottom - top + 1 - lines) * VT100_COLS * sizeof(uint16_t));
+        memmove(&vt->dirty_first[top], &vt->dirty_first[top + lines], bottom - top + 1 - lines);
+        memmove(&vt->dirty_last[top], &vt->dirty_last[top + lines], bottom - top + 1 - lines);
+    }
+
+    for ( row = bottom - lines + 1; row <= bottom; row++ )
+    {
+        for ( col = 0; col < VT100_COLS; col++ )
+            vt->screen[row][col] = blank;
+        vt->dirty_first[row] = VT100_COLS;
+    }
+
+    if ( vt == display && vt->view == 0 )
+    {
+        if ( lines <= (bottom - top) )
+            memmove(&video[top][0], &video[top + lines][0],
+                    (bottom - top + 1 - lines) * VT100_COLS * sizeof(uint16_t));
+
+        for ( row = bottom - lines + 1; row <= bottom; row++ )
+            for ( col = 0; col < VT100_COLS; col++ )
+                video[row][col] = blank;
+
+        vt_bios_scroll(0x06, top, bottom, lines, vt->attr);
+    }
+}
+
+/*------------------------------------------------
+ * vt_scroll_down()
+ *
+ *  Scroll lines down and clear the lines at the top.
+ *
+ * param:  Pointer to terminal, top and bottom row, line count
+ * return: none
+ *
+ */
+static void vt_scroll_down(vt100_t *vt, int top, int bottom, int lines)
+{
+    int         row, col;
+    uint16_t    blank;
+
+    if ( lines > (bottom - top + 1) )
+        lines = bottom - top + 1;
+
+    blank = BLANK | ((uint16_t) vt->attr << 8);
+
+    if ( lines <= (bottom - top) )
+    {
+        memmove(&vt->screen[top + lines][0], &vt->screen[top][0],
+                (bottom - top + 1 - lines) * VT100_COLS * sizeof(uint16_t));
+        memmove(&vt->dirty_first[top + lines], &vt->dirty_first[top], bottom - top + 1 - lines);
+        memmove(&vt->dirty_last[top + lines], &vt->dirty_last[top], bottom - top + 1 - lines);
+    }
+
+    for ( row = top; row < top + lines; row++ )
+    {
+        for ( col = 0; col < VT100_COLS; col++ )
+            vt->screen[row][col] = blank;
+        vt->dirty_first[row] = VT100_COLS;
+    }
+
+    if ( vt == display && vt->view == 0 )
+    {
+        if ( lines <= (bottom - top) )
+            memmove(&video[top + lines][0], &video[top][0],
+                    (bottom - top + 1 - lines) * VT100_COLS * sizeof(uint16_t));
+
+        for ( row = top; row < top + lines; row++ )
+            for ( col = 0; col < VT100_COLS; col++ )
+                video[row][col] = blank;
+
+        vt_bios_scroll(0x07, top, bottom, lines, vt->attr);
+    }
+}
+
+/*------------------------------------------------
+ * vt_erase()
+ *
+ *  Clear a range of the screen, from a start position to an end position
+ *  in reading order, to blanks with the current attribute.
+ *
+ * param:  Pointer to terminal, start row and column, end row and column
+ * return: none
+ *
+ */
+static void vt_erase(vt100_t *vt, int row, int col, int end_row, int end_col)
+{
+    int         last;
+    uint16_t    blank;
+
+    blank = BLANK | ((uint16_t) vt->attr << 8);
+
+    for ( ; row <= end_row; row++ )
+    {
+        last = (row == end_row) ? end_col : VT100_COLS - 1;
+        vt_dirty(vt, row, col, last);
+
+        for ( ; col <= last; col++ )
+            vt->screen[row][col] = blank;
+
+        col = 0;
+    }
+}
+
+/*------------------------------------------------
+ * vt_dirty()
+ *
+ *  Extend the changed column range of a row.
+ *
+ * param:  Pointer to terminal, row, first and last changed column
+ * return: none
+ *
+ */
+static void vt_dirty(vt100_t *vt, int row, int first, int last)
+{
+    if ( vt->dirty_first[row] >= VT100_COLS )
+    {
+        vt->dirty_first[row] = first;
+        vt->dirty_last[row] = last;
+        return;
+    }
+
+    if ( first < vt->dirty_first[row] )
+        vt->dirty_first[row] = first;
+    if ( last > vt->dirty_last[row] )
+        vt->dirty_last[row] = last;
+}
+
+/*------------------------------------------------
+ * vt_goto()
+ *
+ *  Move the cursor, limited to the screen.
+ *
+ * param:  Pointer to terminal, row and column
+ * return: none
+ *
+ */
+static void vt_goto(vt100_t *vt, int row, int col)
+{
+    if ( row < 0 )
+        row = 0;
+    else if ( row >= VT100_ROWS )
+        row = VT100_ROWS - 1;
+
+    if ( col < 0 )
+        col = 0;
+    else if ( col >= VT100_COLS )
+        col = VT100_COLS - 1;
+
+    vt->row = row;
+    vt->col = col;
+    vt->wrap_pending = 0;
+}
+
+/*------------------------------------------------
+ * vt_param()
+ *
+ *  Get a control sequence parameter.
+ *
+ * param:  Pointer to terminal, parameter index, default for a missing or '0' parameter
+ * return: Parameter value
+ *
+ */
+static int vt_param(vt100_t *vt, int index, int def)
+{
+    if ( index >= vt->param_count || vt->params[index] == 0 )
+        return def;
+
+    return vt->params[index];
+}
+
+/*------------------------------------------------
+ * vt_attribute()
+ *
+ *  Convert SGR state to a BIOS text attribute.
+ *  On a monochrome adapter only normal, bold, underline and reverse are used.
+ *
+ * param:  Pointer to terminal
+ * return: BIOS attribute
+ *
+ */
+static uint8_t vt_attribute(vt100_t *vt)
+{
+    uint8_t     fg, bg;
+
+    if ( mono )
+    {
+        if ( vt->reverse )
+            fg = 0x70;
+        else if ( vt->underline )
+            fg = 0x01;
+        else
+            fg = 0x07;
+
+        if ( vt->bold && !vt->reverse )
+            fg |= 0x08;
+        if ( vt->blink )
+            fg |= 0x80;
+
+        return fg;
+    }
+
+    fg = ansi_to_bios[vt->fg & 7] | ((vt->bold || (vt->fg & 8)) ? 0x08 : 0);
+    bg = ansi_to_bios[vt->bg & 7];
+
+    if ( vt->reverse )
+        return (uint8_t)(((fg & 0x07) << 4) | bg | (vt->blink ? 0x80 : 0));
+
+    return (uint8_t)((bg << 4) | fg | (vt->blink ? 0x80 : 0));
+}
+
+/*------------------------------------------------
+ * vt_render()
+ *
+ *  Write a range of cells of a display row.
+ *  Only cells that differ from the display are written. A run of identical
+ *  cells is written with one AH=09h call; a single character with an unchanged
+ *  attribute is written with AH=0Eh, which moves the cursor on its own.
+ *  The BIOS cursor is moved only when the next write is not where it already is.
+ *
+ * param:  Display row, its cells, first and last column
+ * return: none
+ *
+ */
+static void vt_render(int row, const uint16_t *cells, int col, int last)
+{
+    int         run;
+    uint16_t    cell;
+    uint8_t     c;
+
+    while ( col <= last )
+    {
+        cell = cells[col];
+
+        if ( cell == video[row][col] )
+        {
+            col++;
+            continue;
+        }
+
+        for ( run = 1; (col + run) <= last && cells[col + run] == cell; run++ );
+
+        if ( bios_row != row || bios_col != col )
+            vt_bios_cursor(row, col);
+
+        c = (uint8_t) cell;
+
+        if ( run == 1 &&
+             (cell & 0xff00) == (video[row][col] & 0xff00) &&
+             col < (VT100_COLS - 1) &&
+             c != 7 && c != 8 && c != 10 && c != 13 )
+        {
+            /* Teletype output, writes the character and advances the cursor
+             */
+            regs.h.ah = 0x0e;
+            regs.h.al = c;
+            regs.h.bh = 0;
+            int86x(0x10, &regs, &regs, &segment_regs);
+            bios_col++;
+        }
+        else
+        {
+            regs.h.ah = 0x09;
+            regs.h.al = c;
+            regs.h.bh = 0;
+            regs.h.bl = (uint8_t)(cell >> 8);
+            regs.w.cx = run;
+            int86x(0x10, &regs, &regs, &segment_regs);
+        }
+
+        while ( run-- )
+            video[row][col++] = cell;
+    }
+}
+
+/*------------------------------------------------
+ * vt_bios_cursor()
+ *
+ *  Set BIOS cursor position on page 0.
+ *
+ * param:  Row and column
+ * return: none
+ *
+ */
+static void vt_bios_cursor(int row, int col)
+{
+    regs.h.ah = 0x02;
+    regs.h.bh = 0;
+    regs.h.dh = (uint8_t) row;
+    regs.h.dl = (uint8_t) col;
+    int86x(0x10, &regs, &regs, &segment_regs);
+
+    bios_row = row;
+    bios_col = col;
+}
+
+/*------------------------------------------------
+ * vt_bios_scroll()
+ *
+ *  Scroll a full width window of the screen up (AH=06h) or down (AH=07h).
+ *
+ * param:  BIOS function, top and bottom row, line count and fill attribute
+ * return: none
+ *
+ */
+static void vt_bios_scroll(uint8_t function, int top, int bottom, int lines, uint8_t attr)
+{
+    regs.h.ah = function;
+    regs.h.al = (lines > (bottom - top)) ? 0 : (uint8_t) lines;    // '0' clears the window
+    regs.h.bh = attr;
+    regs.h.ch = (uint8_t) top;
+    regs.h.cl = 0;
+    regs.h.dh = (uint8_t) bottom;
+    regs.h.dl = VT100_COLS - 1;
+    int86x(0x10, &regs, &regs, &segment_regs);
+}
+
+/*------------------------------------------------
+ * vt_bios_cursor_shape()
+ *
+ *  Set BIOS cursor shape, used to hide and show the cursor.
+ *
+ * param:  Cursor start and end scan lines
+ * return: none
+ *
+ */
+static void vt_bios_cursor_shape(uint16_t shape)
+{
+    regs.h.ah = 0x01;
+    regs.w.cx = shape;
+    int86x(0x10, &regs, &regs, &segment_regs);
+}
+
+/*------------------------------------------------
+ * vt_bios_probe()
+ *
+ *  Read the video mode, to select color or monochrome attributes,
+ *  and the cursor shape to restore when the cursor is shown.
+ *
+ * param:  none
+ * return: none
+ *
+ */
+static void vt_bios_probe(void)
+{
+    regs.h.ah = 0x0f;
+    int86x(0x10, &regs, &regs, &segment_regs);
+    mono = (regs.h.al == MONO_MODE);
+
+    regs.h.ah = 0x03;
+    regs.h.bh = 0;
+    int86x(0x10, &regs, &regs, &segment_regs);
+    cursor_shape = regs.w.cx;
+
+    probed = 1;
+}
@@ -0,0 +1,1493 @@
+/*
+ *
+ * zmodem.c
+ *
+ *  ZMODEM file transfer engine for use inside a terminal session.
+ *  The engine does no I/O of its own on the connection. Received bytes are passed
+ *  to zmodem_input(), and output goes through a send function that may accept
+ *  only part of it, the rest is retried from zmodem_poll(). This lets the
+ *  transfer run from the telnet event loop over the existing TCP connection.
+ *
+ *  A transfer starts when zmodem_detect() finds a ZRQINIT header (remote 'sz',
+ *  receive files) or a ZRINIT header (remote 'rz', send files) in the terminal
+ *  stream. Files are received into the current directory with DOS 8.3 names.
+ *  When sending, the ask function is called for each file name until it
+ *  returns an empty name.
+ *
+ *  Since the connection is reliable, the sender streams ZCRCG subpackets and
+ *  asks for an acknowledgment with ZCRCQ every few subpackets, keeping up to
+ *  ZM_WINDOW bytes unacknowledged. A receiver that declares a buffer size gets
+ *  ZCRCW at each buffer's worth of data instead.
+ *  Output escapes 0xff (as ZRUB1) and CR in addition to the standard ZDLE/XON/XOFF
+ *  escapes, so telnet IAC and CR handling never see them.
+ *
+ *  resources:
+ *      http://pauillac.inria.fr/~doligez/zmodem/zmodem.txt
+ *
+ */
+
+#include    <stdlib.h>
+#include    <string.h>
+#include    <ctype.h>
+#include    <io.h>
+
+#include    "zmodem.h"
+#include    "crc16.h"
+#include    "crc32.h"
+
+/* -----------------------------------------
+   Definitions
+----------------------------------------- */
+#define     ZPAD                '*'         // Frame characters
+#define     ZDLE                0x18
+#define     ZBIN                'A'
+#define     ZHEX                'B'
+#define     ZBIN32              'C'
+#define     ZCRCE               'h'         // Subpacket ends, frame ends
+#define     ZCRCG               'i'         // Subpacket ends, frame continues
+#define     ZCRCQ               'j'         // Frame continues, ZACK expected
+#define     ZCRCW               'k'         // Frame ends, ZACK expected
+#define     ZRUB0               'l'
+#define     ZRUB1               'm'
+#define     XON                 0x11
+#define     XOFF                0x13
+#define     CAN                 0x18
+#define     BS                  0x08
+
+#define     ZRQINIT             0           // Frame types
+#define     ZRINIT              1
+#define     ZSINIT              2
+#define     ZACK                3
+#define     ZFILE               4
+#define     ZSKIP               5
+#define     ZNAK                6
+#define     ZABORT              7
+#define     ZFIN                8
+#define     ZRPOS               9
+#define     ZDATA               10
+#define     ZEOF                11
+#define     ZFERR               12
+#define     ZCAN                16
+
+#define     CANFDX              0x01        // ZRINIT capability flags in ZF0
+#define     CANOVIO             0x02
+#define     CANFC32             0x20
+#define     ZCBIN               1           // ZFILE conversion option in ZF0, binary
+
+#define     RX_SEEK             0           // Frame input parser states
+#define     RX_PAD              1
+#define     RX_ZDLE             2
+#define     RX_HEX              3
+#define     RX_BIN              4
+#define     RX_DATA             5
+#define     RX_CRC              6
+#define     RX_FIN              7
+
+#define     R_INIT              1           // Receiver states
+#define     R_SINIT             2
+#define     R_FILE              3
+#define     R_DATA              4
+#define     R_FIN               5
+
+#define     S_INIT              11          // Sender states
+#define     S_FILE              12
+#define     S_DATA              13
+#define     S_WAIT              14
+#define     S_EOF               15
+#define     S_FIN               16
+
+#define     PENDING             -1          // Unescaping results
+#define     BAD                 -2
+#define     FRAME_END           0x100
+
+#define     ZM_TIMEOUT          10000       // Mili-seconds without progress before a retry
+#define     ZM_RETRIES          10
+#define     ZM_SHOW             1000        // Progress display interval
+#define     ZM_ACK_EVERY        4           // Streaming subpackets between ZCRCQ
+#define     ZM_FILE_BUF         4096
+
+/* -----------------------------------------
+   Static prototypes
+----------------------------------------- */
+static void zm_start(zmodem_t*, int);
+static void zm_end(zmodem_t*, const char*);
+static void zm_rx_char(zmodem_t*, uint8_t);
+static int  zm_unescape(zmodem_t*, uint8_t);
+static int  zm_hex_decode(zmodem_t*);
+static int  zm_header_crc_ok(zmodem_t*);
+static int  zm_data_crc_ok(zmodem_t*);
+static void zm_header(zmodem_t*);
+static void zm_subpacket(zmodem_t*);
+static void zm_receiver_header(zmodem_t*, int, uint32_t);
+static void zm_receiver_data(zmodem_t*);
+static void zm_sender_header(zmodem_t*, int, uint32_t);
+static void zm_send_file(zmodem_t*);
+static void zm_send_file_header(zmodem_t*);
+static void zm_send_data(zmodem_t*);
+static void zm_open_file(zmodem_t*);
+static void zm_dos_name(const char*, char*);
+static int  zm_unique_name(char*);
+static void zm_timeout(zmodem_t*);
+static void zm_progress(zmodem_t*, int);
+static void zm_put(zmodem_t*, uint8_t);
+static void zm_put_escaped(zmodem_t*, uint8_t);
+static void zm_hex_header(zmodem_t*, int, uint32_t);
+static void zm_bin_header(zmodem_t*, int, uint32_t);
+static void zm_put_subpacket(zmodem_t*, int, int);
+static void zm_flush(zmodem_t*);
+
+/* -----------------------------------------
+   Globals
+----------------------------------------- */
+static const char   hex_digits[] = "0123456789abcdef";
+
+/*------------------------------------------------
+ * zmodem_init()
+ *
+ *  Initialize a ZMODEM engine, idle until a transfer is detected.
+ *
+ * param:  Pointer to engine, send, status and ask functions, and their context
+ * return: none
+ *
+ */
+void zmodem_init(zmodem_t *zm, zmodem_send_t send, zmodem_status_t status, zmodem_ask_t ask, void *context)
+{
+    memset(zm, 0, sizeof(zmodem_t));
+
+    zm->send = send;
+    zm->status = status;
+    zm->ask = ask;
+    zm->context = context;
+}
+
+/*------------------------------------------------
+ * zmodem_detect()
+ *
+ *  Scan terminal data for the start of a ZRQINIT or ZRINIT hex header,
+ *  and start a receive or send transfer when one is found.
+ *  The header may be split across calls.
+ *
+ * param:  Pointer to engine, terminal data and its length
+ * return: Number of bytes up to and including the detected header type,
+ *         the rest belongs to the transfer, or -1 if no header started
+ *
+ */
+int zmodem_detect(zmodem_t *zm, const uint8_t *data, int len)
+{
+    static const uint8_t pattern[] = {ZPAD, ZPAD, ZDLE, ZHEX, '0'};
+
+    const uint8_t  *p;
+    uint8_t         c;
+    int             i;
+
+    for ( i = 0; i < len; i++ )
+    {
+        if ( zm->detect == 0 )
+        {
+            p = memchr(&data[i], ZPAD, len - i);
+            if ( p == NULL )
+                return -1;
+
+            i = p - data;
+        }
+
+        c = data[i];
+
+        if ( zm->detect == sizeof(pattern) )
+        {
+            if ( c == '0' || c == '1' )
+            {
+                zm_start(zm, c - '0');
+                return (i + 1);
+            }
+
+            zm->detect = 0;
+        }
+        else if ( c == pattern[zm->detect] )
+        {
+            zm->detect++;
+            continue;
+        }
+
+        if ( c == ZPAD )
+            zm->detect = (zm->detect == 2) ? 2 : 1;
+        else
+            zm->detect = 0;
+    }
+
+    return -1;
+}
+
+/*------------------------------------------------
+ * zmodem_input()
+ *
+ *  Process received transfer data.
+ *  Processing stops when the transfer ends, the rest of the data
+ *  is terminal data again.
+ *
+ * param:  Pointer to engine, received data and its length
+ * return: Number of bytes used by the transfer
+ *
+ */
+int zmodem_input(zmodem_t *zm, const uint8_t *data, int len)
+{
+    int     i;
+
+    for ( i = 0; i < len && zm->role != ZM_OFF; i++ )
+    {
+        if ( data[i] == CAN )
+        {
+            if ( ++zm->can_count >= 5 )
+            {
+                zm_end(zm, "ZMODEM transfer cancelled by remote");
+                return (i + 1);
+            }
+        }
+        else
+        {
+            zm->can_count = 0;
+        }
+
+        /* Receiver after ZFIN, the sender ends the session with "OO"
+         */
+        if ( zm->rx_state == RX_FIN )
+        {
+            if ( data[i] != 'O' )
+            {
+                zm_end(zm, NULL);
+                return i;
+            }
+
+            if ( ++zm->rx_count == 2 )
+            {
+                zm_end(zm, NULL);
+                return (i + 1);
+            }
+
+            continue;
+        }
+
+        zm_rx_char(zm, data[i]);
+    }
+
+    zm_flush(zm);
+
+    return i;
+}
+
+/*------------------------------------------------
+ * zmodem_poll()
+ *
+ *  Send pending output, stream file data, handle timeouts
+ *  and show progress.
+ *
+ * param:  Pointer to engine, time in mili-seconds
+ * return: none
+ *
+ */
+void zmodem_poll(zmodem_t *zm, uint32_t now)
+{
+    zm->now = now;
+
+    zm_flush(zm);
+
+    if ( zm->role == ZM_OFF )
+        return;
+
+    if ( zm->role == ZM_SEND && zm->state == S_DATA && zm->out_len == 0 )
+        zm_send_data(zm);
+
+    if ( (now - zm->timer) > ZM_TIMEOUT )
+        zm_timeout(zm);
+
+    if ( (now - zm->shown) > ZM_SHOW && zm->file )
+        zm_progress(zm, 0);
+}
+
+/*------------------------------------------------
+ * zmodem_cancel()
+ *
+ *  Cancel the transfer from the local side.
+ *
+ * param:  Pointer to engine
+ * return: none
+ *
+ */
+void zmodem_cancel(zmodem_t *zm)
+{
+    int     i;
+
+    if ( zm->role == ZM_OFF )
+        return;
+
+    zm->out_len = 0;
+    zm->out_pos = 0;
+
+    for ( i = 0; i < 8; i++ )
+        zm_put(zm, CAN);
+    for ( i = 0; i < 8; i++ )
+        zm_put(zm, BS);
+
+    zm_flush(zm);
+    zm_end(zm, "ZMODEM transfer cancelled");
+}
+
+/*------------------------------------------------
+ * zm_start()
+ *
+ *  Start a transfer from a detected header. The first two hex
+ *  digits of the header were consumed by detection.
+ *
+ * param:  Pointer to engine, header type ZRQINIT or ZRINIT
+ * return: none
+ *
+ */
+static void zm_start(zmodem_t *zm, int type)
+{
+    zm->role = (type == ZRQINIT) ? ZM_RECEIVE : ZM_SEND;
+    zm->state = (type == ZRQINIT) ? R_INIT : S_INIT;
+    zm->detect = 0;
+
+    zm->rx_state = RX_HEX;
+    zm->rx_format = ZHEX;
+    zm->rx_escape = 0;
+    zm->rx_hex[0] = '0';
+    zm->rx_hex[1] = (char)('0' + type);
+    zm->rx_count = 2;
+    zm->can_count = 0;
+
+    zm->file = NULL;
+    zm->timer = zm->now;
+    zm->retries = 0;
+    zm->out_len = 0;
+    zm->out_pos = 0;
+}
+
+/*------------------------------------------------
+ * zm_end()
+ *
+ *  End the transfer and return to terminal mode.
+ *
+ * param:  Pointer to engine, message to show or NULL
+ * return: none
+ *
+ */
+static void zm_end(zmodem_t *zm, const char *message)
+{
+    if ( zm->file )
+    {
+        fclose(zm->file);
+        zm->file = NULL;
+    }
+
+    zm->role = ZM_OFF;
+    zm->state = 0;
+    zm->rx_state = RX_SEEK;
+    zm->detect = 0;
+
+    if ( message )
+        zm->status(zm->context, message);
+}
+
+/*------------------------------------------------
+ * zm_rx_char()
+ *
+ *  Frame input parser, one character at a time.
+ *
+ * param:  Pointer to engine, received character
+ * return: none
+ *
+ */
+static void zm_rx_char(zmodem_t *zm, uint8_t c)
+{
+    int     v;
+
+    switch ( zm->rx_state )
+    {
+        case RX_SEEK:
+            if ( c == ZPAD )
+                zm->rx_state = RX_PAD;
+            break;
+
+        case RX_PAD:
+            if ( c == ZDLE )
+                zm->rx_state = RX_ZDLE;
+            else if ( c != ZPAD )
+                zm->rx_state = RX_SEEK;
+            break;
+
+        case RX_ZDLE:
+            zm->rx_format = c;
+            zm->rx_count = 0;
+            zm->rx_escape = 0;
+            if ( c == ZHEX )
+                zm->rx_state = RX_HEX;
+            else if ( c == ZBIN || c == ZBIN32 )
+                zm->rx_state = RX_BIN;
+            else
+                zm->rx_state = RX_SEEK;
+            break;
+
+        case RX_HEX:
+            if ( !isxdigit(c) )
+            {
+                zm->rx_state = RX_SEEK;
+                break;
+            }
+
+            zm->rx_hex[zm->rx_count++] = (char) c;
+            if ( zm->rx_count == sizeof(zm->rx_hex) )
+            {
+                zm->rx_state = RX_SEEK;
+                if ( zm_hex_decode(zm) && zm_header_crc_ok(zm) )
+                    zm_header(zm);
+            }
+            break;
+
+        case RX_BIN:
+            v = zm_unescape(zm, c);
+            if ( v == PENDING )
+                break;
+
+            if ( v == BAD || (v & FRAME_END) )
+            {
+                zm->rx_state = RX_SEEK;
+                break;
+            }
+
+            zm->rx_hdr[zm->rx_count++] = (uint8_t) v;
+            if ( zm->rx_count == ((zm->rx_format == ZBIN32) ? 9 : 7) )
+            {
+                zm->rx_state = RX_SEEK;
+                if ( zm_header_crc_ok(zm) )
+                    zm_header(zm);
+            }
+            break;
+
+        case RX_DATA:
+            v = zm_unescape(zm, c);
+            if ( v == PENDING )
+                break;
+
+            if ( v == BAD || (!(v & FRAME_END) && zm->data_len == ZM_BLOCK) )
+            {
+                zm->rx_state = RX_SEEK;
+                zm->data_len = 0;
+                if ( zm->role == ZM_RECEIVE && zm->state == R_DATA )
+                    zm_hex_header(zm, ZRPOS, zm->pos);
+                break;
+            }
+
+            if ( v & FRAME_END )
+            {
+                zm->rx_end = v & 0xff;
+                zm->rx_count = 0;
+                zm->rx_state = RX_CRC;
+            }
+            else
+            {
+                zm->data[zm->data_len++] = (uint8_t) v;
+            }
+            break;
+
+        case RX_CRC:
+            v = zm_unescape(zm, c);
+            if ( v == PENDING )
+                break;
+
+            if ( v == BAD || (v & FRAME_END) )
+            {
+                zm->rx_state = RX_SEEK;
+                zm->data_len = 0;
+                break;
+            }
+
+            zm->rx_crc[zm->rx_count++] = (uint8_t) v;
+            if ( zm->rx_count < (zm->rx_crc32 ? 4 : 2) )
+                break;
+
+            if ( zm_data_crc_ok(zm) )
+            {
+                zm->rx_state = (zm->rx_end == ZCRCG || zm->rx_end == ZCRCQ) ? RX_DATA : RX_SEEK;
+                zm_subpacket(zm);
+            }
+            else
+            {
+                zm->rx_state = RX_SEEK;
+                if ( zm->role == ZM_RECEIVE && zm->state == R_DATA )
+                    zm_hex_header(zm, ZRPOS, zm->pos);
+            }
+
+            zm->data_len = 0;
+            break;
+
+        default:
+            zm->rx_state = RX_SEEK;
+    }
+}
+
+/*------------------------------------------------
+ * zm_unescape()
+ *
+ *  Decode ZDLE escapes in binary headers and subpackets.
+ *  Unescaped XON/XOFF are flow control noise and are dropped.
+ *
+ * param:  Pointer to engine, received character
+ * return: Byte value, FRAME_END or-ed with a subpacket end type,
+ *         PENDING if no byte is complete, or BAD
+ *
+ */
+static int zm_unescape(zmodem_t *zm, uint8_t c)
+{
+    if ( zm->rx_escape )
+    {
+        zm->rx_escape = 0;
+
+        if ( c >= ZCRCE && c <= ZCRCW )
+            return (FRAME_END | c);
+        else if ( c == ZRUB0 )
+            return 0x7f;
+        else if ( c == ZRUB1 )
+            return 0xff;
+        else if ( (c & 0x60) == 0x40 )
+            return (c ^ 0x40);
+
+        return BAD;
+    }
+
+    if ( c == ZDLE )
+    {
+        zm->rx_escape = 1;
+        return PENDING;
+    }
+
+    if ( (c & 0x7f) == XON || (c & 0x7f) == XOFF )
+        return PENDING;
+
+    return c;
+}
+
+/*------------------------------------------------
+ * zm_hex_decode()
+ *
+ *  Convert hex header digits to header bytes.
+ *
+ * param:  Pointer to engine, digits already checked by the parser
+ * return: '1' converted
+ *
+ */
+static int zm_hex_decode(zmodem_t *zm)
+{
+    int     i, hi, lo;
+
+    for ( i = 0; i < 7; i++ )
+    {
+        hi = tolower(zm->rx_hex[2 * i]);
+        lo = tolower(zm->rx_hex[2 * i + 1]);
+        hi = isdigit(hi) ? (hi - '0') : (hi - 'a' + 10);
+        lo = isdigit(lo) ? (lo - '0') : (lo - 'a' + 10);
+        zm->rx_hdr[i] = (uint8_t)((hi << 4) | lo);
+    }
+
+    return 1;
+}
+
+/*------------------------------------------------
+ * zm_header_crc_ok()
+ *
+ *  Check the CRC of a received header. Hex and ZBIN headers have a
+ *  CRC-16 sent high byte first, ZBIN32 headers a CRC-32 sent low byte first.
+ *
+ * param:  Pointer to engine
+ * return: '1' CRC is good
+ *
+ */
+static int zm_header_crc_ok(zmodem_t *zm)
+{
+    uint32_t    crc;
+
+    if ( zm->rx_format == ZBIN32 )
+    {
+        crc = (uint32_t) zm->rx_hdr[5] | ((uint32_t) zm->rx_hdr[6] << 8) |
+              ((uint32_t) zm->rx_hdr[7] << 16) | ((uint32_t) zm->rx_hdr[8] << 24);
+        return (crc32_update(0, zm->rx_hdr, 5) == crc);
+    }
+
+    return (crc16_ccitt_tab(zm->rx_hdr, 5) == (uint16_t)((zm->rx_hdr[5] << 8) | zm->rx_hdr[6]));
+}
+
+/*------------------------------------------------
+ * zm_data_crc_ok()
+ *
+ *  Check the CRC of a received subpacket, which covers the data
+ *  and the frame end type.
+ *
+ * param:  Pointer to engine
+ * return: '1' CRC is good
+ *
+ */
+static int zm_data_crc_ok(zmodem_t *zm)
+{
+    uint32_t    crc;
+
+    zm->data[zm->data_len] = (uint8_t) zm->rx_end;
+
+    if ( zm->rx_crc32 )
+    {
+        crc = (uint32_t) zm->rx_crc[0] | ((uint32_t) zm->rx_crc[1] << 8) |
+              ((uint32_t) zm->rx_crc[2] << 16) | ((uint32_t) zm->rx_crc[3] << 24);
+        return (crc32_update(0, zm->data, zm->data_len + 1) == crc);
+    }
+
+    return (crc16_ccitt_tab(zm->data, zm->data_len + 1) == (uint16_t)((zm->rx_crc[0] << 8) | zm->rx_crc[1]));
+}
+
+/*------------------------------------------------
+ * zm_header()
+ *
+ *  Dispatch a received header. Data subpackets that follow
+ *  use the CRC type of the header.
+ *
+ * param:  Pointer to engine
+ * return: none
+ *
+ */
+static void zm_header(zmodem_t *zm)
+{
+    uint32_t    pos;
+
+    pos = (uint32_t) zm->rx_hdr[1] | ((uint32_t) zm->rx_hdr[2] << 8) |
+          ((uint32_t) zm->rx_hdr[3] << 16) | ((uint32_t) zm->rx_hdr[4] << 24);
+
+    zm->rx_crc32 = (zm->rx_format == ZBIN32);
+    zm->data_len = 0;
+    zm->timer = zm->now;
+    zm->retries = 0;
+
+    if ( zm->rx_hdr[0] == ZABORT || zm->rx_hdr[0] == ZFERR || zm->rx_hdr[0] == ZCAN )
+    {
+        zm_end(zm, "ZMODEM transfer aborted by remote");
+        return;
+    }
+
+    if ( zm->role == ZM_RECEIVE )
+        zm_receiver_header(zm, zm->rx_hdr[0], pos);
+    else
+        zm_sender_header(zm, zm->rx_hdr[0], pos);
+}
+
+/*------------------------------------------------
+ * zm_subpacket()
+ *
+ *  Handle a received data subpacket.
+ *
+ * param:  Pointer to engine
+ * return: none
+ *
+ */
+static void zm_subpacket(zmodem_t *zm)
+{
+    zm->timer = zm->now;
+    zm->retries = 0;
+
+    if ( zm->role == ZM_RECEIVE )
+        zm_receiver_data(zm);
+}
+
+/*------------------------------------------------
+ * zm_receiver_header()
+ *
+ *  Receiver handling of a header from the sender.
+ *
+ * param:  Pointer to engine, header type and position/flags
+ * return: none
+ *
+ */
+static void zm_receiver_header(zmodem_t *zm, int type, uint32_t pos)
+{
+    switch ( type )
+    {
+        case ZRQINIT:
+            zm->state = R_INIT;
+            zm_hex_header(zm, ZRINIT, (uint32_t)(CANFDX | CANOVIO | CANFC32) << 24);
+            break;
+
+        case ZSINIT:
+            zm->state = R_SINIT;
+            zm->rx_state = RX_DATA;
+            break;
+
+        case ZFILE:
+            zm->state = R_FILE;
+            zm->rx_state = RX_DATA;
+            break;
+
+        case ZDATA:
+            if ( zm->file == NULL )
+                break;
+
+            if ( pos != zm->pos )
+            {
+                zm_hex_header(zm, ZRPOS, zm->pos);
+                break;
+            }
+
+            zm->state = R_DATA;
+            zm->rx_state = RX_DATA;
+            break;
+
+        case ZEOF:
+            if ( zm->file == NULL || pos != zm->pos )
+                break;
+
+            zm_progress(zm, 1);
+            fclose(zm->file);
+            zm->file = NULL;
+
+            zm->state = R_INIT;
+            zm_hex_header(zm, ZRINIT, (uint32_t)(CANFDX | CANOVIO | CANFC32) << 24);
+            break;
+
+        case ZFIN:
+            zm->state = R_FIN;
+            zm->rx_state = RX_FIN;
+            zm->rx_count = 0;
+            zm_hex_header(zm, ZFIN, 0);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*------------------------------------------------
+ * zm_receiver_data()
+ *
+ *  Receiver handling of a data subpacket: the ZSINIT attention string,
+ *  the ZFILE file information or file data.
+ *
+ * param:  Pointer to engine
+ * return: none
+ *
+ */
+static void zm_receiver_data(zmodem_t *zm)
+{
+    switch ( zm->state )
+    {
+        case R_SINIT:
+            zm->state = R_INIT;
+            zm_hex_header(zm, ZACK, 1);
+            break;
+
+        case R_FILE:
+            zm_open_file(zm);
+            break;
+
+        case R_DATA:
+            if ( zm->data_len &&
+                 fwrite(zm->data, 1, zm->data_len, zm->file) != (size_t) zm->data_len )
+            {
+                zmodem_cancel(zm);
+                zm->status(zm->context, "ZMODEM file write error");
+                break;
+            }
+
+            zm->pos += zm->data_len;
+
+            if ( zm->rx_end == ZCRCW || zm->rx_end == ZCRCQ )
+                zm_hex_header(zm, ZACK, zm->pos);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*------------------------------------------------
+ * zm_open_file()
+ *
+ *  Open a file for the ZFILE information subpacket, which holds the
+ *  file name, and the file size and other fields as text.
+ *  The name is converted to a DOS 8.3 name in the current directory,
+ *  and made unique so no existing file is overwritten. The file is
+ *  skipped when no unique name is left.
+ *
+ * param:  Pointer to engine
+ * return: none
+ *
+ */
+static void zm_open_file(zmodem_t *zm)
+{
+    int     name_len;
+
+    zm->data[zm->data_len] = 0;
+    name_len = strlen((char*) zm->data);
+
+    zm->size = 0;
+    if ( (name_len + 1) < zm->data_len )
+        zm->size = strtoul((char*) &zm->data[name_len + 1], NULL, 10);
+
+    zm_dos_name((char*) zm->data, zm->name);
+
+    if ( !zm_unique_name(zm->name) )
+    {
+        zm->status(zm->context, "ZMODEM file exists, skipped");
+        zm->state = R_INIT;
+        zm_hex_header(zm, ZSKIP, 0);
+        return;
+    }
+
+    zm->file = fopen(zm->name, "wb");
+    if ( zm->file == NULL )
+    {
+        zm->state = R_INIT;
+        zm_hex_header(zm, ZSKIP, 0);
+        return;
+    }
+
+    setvbuf(zm->file, NULL, _IOFBF, ZM_FILE_BUF);
+
+    zm->pos = 0;
+    zm->start = zm->now;
+    zm->shown = zm->now;
+    zm->state = R_DATA;
+    zm_hex_header(zm, ZRPOS, 0);
+}
+
+/*------------------------------------------------
+ * zm_dos_name()
+ *
+ *  Make a DOS 8.3 file name from a remote path name.
+ *
+ * param:  Remote path name, output buffer of at least 13 characters
+ * return: none
+ *
+ */
+static void zm_dos_name(const char *path, char *name)
+{
+    const char *base, *ext, *p;
+    int         i, len;
+
+    base = path;
+    for ( p = path; *p; p++ )
+    {
+        if ( *p == '/' || *p == '\\' || *p == ':' )
+            base = p + 1;
+    }
+
+    ext = strrchr(base, '.');
+    if ( ext == base )
+        ext = NULL;
+
+    len = 0;
+    for ( p = base; *p && *p != '.' && len < 8; p++ )
+        name[len++] = *p;
+
+    if ( len == 0 )
+    {
+        strcpy(name, "ZMODEM");
+        len = 6;
+    }
+
+    if ( ext && ext[1] )
+    {
+        name[len++] = '.';
+        for ( i = 1; ext[i] && i <= 3; i++ )
+            name[len++] = ext[i];
+    }
+
+    name[len] = 0;
+
+    for ( i = 0; i < len; i++ )
+    {
+        if ( !isalnum(name[i]) && name[i] != '.' && strchr("_-$~!#%&", name[i]) == NULL )
+            name[i] = '_';
+        name[i] = (char) toupper(name[i]);
+    }
+}
+
+/*------------------------------------------------
+ * zm_unique_name()
+ *
+ *  Change a DOS file name that already exists to one that does not,
+ *  so remote names shortened to the same 8.3 name do not overwrite each
+ *  other or local files. A digit 1 to 9 is added to a short base name,
+ *  or replaces the last character of an 8 character one.
+ *
+ * param:  DOS file name, changed in place
+ * return: '1' the name does not exist, '0' no unique name was found
+ *
+ */
+static int zm_unique_name(char *name)
+{
+    char    ext[5];
+    char   *dot;
+    int     base_len;
+    char    digit;
+
+    if ( access(name, F_OK) != 0 )
+        return 1;
+
+    dot = strchr(name, '.');
+    base_len = dot ? (int)(dot - name) : strlen(name);
+    strcpy(ext, dot ? dot : "");
+
+    if ( base_len == 8 )
+        base_len--;
+
+    for ( digit = '1'; digit <= '9'; digit++ )
+    {
+        name[base_len] = digit;
+        strcpy(&name[base_len + 1], ext);
+        if ( access(name, F_OK) != 0 )
+            return 1;
+    }
+
+    return 0;
+}
+
+/*------------------------------------------------
+ * zm_sender_header()
+ *
+ *  Sender handling of a header from the receiver.
+ *
+ * param:  Pointer to engine, header type and position/flags
+ * return: none
+ *
+ */
+static void zm_sender_header(zmodem_t *zm, int type, uint32_t pos)
+{
+    switch ( type )
+    {
+        case ZRINIT:
+            if ( zm->state != S_INIT && zm->state != S_EOF && zm->state != S_FILE )
+                break;
+
+            zm->rx_buffer = (uint16_t)(pos & 0xffff);
+            zm->use_crc32 = ((pos >> 24) & CANFC32) != 0;
+            zm->window = zm->rx_buffer ? zm->rx_buffer : ZM_WINDOW;
+
+            if ( zm->state == S_EOF && zm->file )
+            {
+                zm_progress(zm, 1);
+                fclose(zm->file);
+                zm->file = NULL;
+            }
+
+            if ( zm->state != S_FILE )
+                zm_send_file(zm);
+            break;
+
+        case ZRPOS:
+            if ( zm->file == NULL || pos > zm->size ||
+                 (zm->state != S_FILE && zm->state != S_DATA && zm->state != S_WAIT && zm->state != S_EOF) )
+                break;
+
+            fseek(zm->file, (long) pos, SEEK_SET);
+            zm->pos = pos;
+            zm->acked = pos;
+            zm->packets = 0;
+            zm->state = S_DATA;
+
+            zm->out_len = 0;
+            zm->out_pos = 0;
+            zm_bin_header(zm, ZDATA, pos);
+            break;
+
+        case ZACK:
+            if ( pos > zm->acked && pos <= zm->pos )
+                zm->acked = pos;
+
+            if ( zm->state == S_WAIT && zm->acked == zm->pos )
+            {
+                zm->state = S_DATA;
+                zm_bin_header(zm, ZDATA, zm->pos);
+            }
+            break;
+
+        case ZSKIP:
+            if ( zm->file )
+            {
+                fclose(zm->file);
+                zm->file = NULL;
+                zm->status(zm->context, "ZMODEM file skipped by remote");
+            }
+            zm->state = S_EOF;
+            break;
+
+        case ZNAK:
+            if ( zm->state == S_FILE )
+                zm_send_file_header(zm);
+            else if ( zm->state == S_EOF || zm->state == S_FIN )
+                zm_hex_header(zm, zm->last_type, zm->last_pos);
+            break;
+
+        case ZFIN:
+            if ( zm->state == S_FIN )
+            {
+                zm_put(zm, 'O');
+                zm_put(zm, 'O');
+                zm_flush(zm);
+                zm_end(zm, NULL);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*------------------------------------------------
+ * zm_send_file()
+ *
+ *  Ask for the next file to send and offer it to the receiver,
+ *  or end the session if there is none.
+ *
+ * param:  Pointer to engine
+ * return: none
+ *
+ */
+static void zm_send_file(zmodem_t *zm)
+{
+    zm->name[0] = 0;
+
+    if ( zm->ask(zm->context, zm->name, sizeof(zm->name)) > 0 )
+    {
+        zm->file = fopen(zm->name, "rb");
+        if ( zm->file == NULL )
+            zm->status(zm->context, "ZMODEM cannot open file");
+    }
+
+    if ( zm->file == NULL )
+    {
+        zm->state = S_FIN;
+        zm_hex_header(zm, ZFIN, 0);
+        return;
+    }
+
+    setvbuf(zm->file, NULL, _IOFBF, ZM_FILE_BUF);
+
+    fseek(zm->file, 0L, SEEK_END);
+    zm->size = (uint32_t) ftell(zm->file);
+    fseek(zm->file, 0L, SEEK_SET);
+
+    zm->pos = 0;
+    zm->acked = 0;
+    zm->start = zm->now;
+    zm->shown = zm->now;
+    zm->state = S_FILE;
+
+    zm_send_file_header(zm);
+}
+
+/*------------------------------------------------
+ * zm_send_file_header()
+ *
+ *  Send the ZFILE header and the file information subpacket
+ *  with the file name without its DOS path, and the file size.
+ *
+ * param:  Pointer to engine
+ * return: none
+ *
+ */
+static void zm_send_file_header(zmodem_t *zm)
+{
+    const char *base, *p;
+    int         len;
+
+    base = zm->name;
+    for ( p = zm->name; *p; p++ )
+    {
+        if ( *p == '\\' || *p == ':' || *p == '/' )
+            base = p + 1;
+    }
+
+    for ( len = 0; base[len] && len < (ZM_NAME_LEN - 1); len++ )
+        zm->data[len] = (uint8_t) tolower(base[len]);
+    zm->data[len++] = 0;
+
+    len += sprintf((char*) &zm->data[len], "%lu 0 100644 0 1 %lu", zm->size, zm->size);
+    zm->data[len++] = 0;
+
+    zm->out_len = 0;
+    zm->out_pos = 0;
+    zm_bin_header(zm, ZFILE, (uint32_t) ZCBIN << 24);
+    zm_put_subpacket(zm, len, ZCRCW);
+}
+
+/*------------------------------------------------
+ * zm_send_data()
+ *
+ *  Stream the next file data subpacket, while the unacknowledged data
+ *  is within the window. The last subpacket ends the frame and is followed
+ *  by ZEOF.
+ *
+ * param:  Pointer to engine
+ * return: none
+ *
+ */
+static void zm_send_data(zmodem_t *zm)
+{
+    uint32_t    left;
+    int         len, end;
+
+    if ( (zm->pos - zm->acked) >= zm->window )
+        return;
+
+    left = zm->size - zm->pos;
+    len = (left < ZM_BLOCK) ? (int) left : ZM_BLOCK;
+
+    if ( len && fread(zm->data, 1, len, zm->file) != (size_t) len )
+    {
+        zmodem_cancel(zm);
+        zm->status(zm->context, "ZMODEM file read error");
+        return;
+    }
+
+    if ( (zm->pos + len) >= zm->size )
+    {
+        end = ZCRCE;
+    }
+    else if ( zm->rx_buffer && (zm->pos + len + ZM_BLOCK - zm->acked) > zm->rx_buffer )
+    {
+        end = ZCRCW;
+        zm->state = S_WAIT;
+    }
+    else if ( ++zm->packets >= ZM_ACK_EVERY )
+    {
+        end = ZCRCQ;
+        zm->packets = 0;
+    }
+    else
+    {
+        end = ZCRCG;
+    }
+
+    zm_put_subpacket(zm, len, end);
+    zm->pos += len;
+
+    if ( end == ZCRCE )
+    {
+        zm->state = S_EOF;
+        zm_hex_header(zm, ZEOF, zm->size);
+    }
+
+    zm_flush(zm);
+}
+
+/*------------------------------------------------
+ * zm_timeout()
+ *
+ *  No progress for ZM_TIMEOUT, repeat the last request or
+ *  restart the data stream from the last acknowledged position.
+ *
+ * param:  Pointer to engine
+ * return: none
+ *
+ */
+static void zm_timeout(zmodem_t *zm)
+{
+    zm->timer = zm->now;
+
+    if ( zm->state == R_FIN )
+    {
+        zm_end(zm, NULL);
+        return;
+    }
+
+    if ( ++zm->retries > ZM_RETRIES )
+    {
+        zmodem_cancel(zm);
+        zm->status(zm->context, "ZMODEM transfer timed out");
+        return;
+    }
+
+    switch ( zm->state )
+    {
+        case R_DATA:
+            zm_hex_header(zm, ZRPOS, zm->pos);
+            break;
+
+        case S_FILE:
+            zm_send_file_header(zm);
+            break;
+
+        case S_DATA:
+        case S_WAIT:
+            fseek(zm->file, (long) zm->acked, SEEK_SET);
+            zm->pos = zm->acked;
+            zm->state = S_DATA;
+            zm->out_len = 0;
+            zm->out_pos = 0;
+            zm_bin_header(zm, ZDATA, zm->pos);
+            break;
+
+        default:
+            zm_hex_header(zm, zm->last_type, zm->last_pos);
+    }
+
+    zm_flush(zm);
+}
+
+/*------------------------------------------------
+ * zm_progress()
+ *
+ *  Show file transfer progress, or the result when a file is done.
+ *
+ * param:  Pointer to engine, '1' file is complete
+ * return: none
+ *
+ */
+static void zm_progress(zmodem_t *zm, int done)
+{
+    char        text[80];
+    uint32_t    elapsed, rate;
+
+    zm->shown = zm->now;
+
+    elapsed = zm->now - zm->start;
+    if ( elapsed < 100 )
+        elapsed = 100;
+    rate = (zm->pos < 0x10000000UL) ? ((zm->pos * 10) / (elapsed / 100)) : (zm->pos / (elapsed / 1000 + 1));
+
+    if ( done )
+        sprintf(text, "ZMODEM %s %s, %lu bytes, %lu B/s", zm->name,
+                (zm->role == ZM_RECEIVE) ? "received" : "sent", zm->pos, rate);
+    else
+        sprintf(text, "ZMODEM %s %s %lu of %lu bytes, %lu B/s",
+                (zm->role == ZM_RECEIVE) ? "receiving" : "sending", zm->name, zm->pos, zm->size, rate);
+
+    zm->status(zm->context, text);
+}
+
+/*------------------------------------------------
+ * zm_put()
+ *
+ *  Add a character to the output buffer, making room from
+ *  already sent output when it is full.
+ *
+ * param:  Pointer to engine, character
+ * return: none
+ *
+ */
+static void zm_put(zmodem_t *zm, uint8_t c)
+{
+    if ( zm->out_len == sizeof(zm->out) && zm->out_pos )
+    {
+        memmove(zm->out, &zm->out[zm->out_pos], zm->out_len - zm->out_pos);
+        zm->out_len -= zm->out_pos;
+        zm->out_pos = 0;
+    }
+
+    if ( zm->out_len < sizeof(zm->out) )
+        zm->out[zm->out_len++] = c;
+}
+
+/*------------------------------------------------
+ * zm_put_escaped()
+ *
+ *  Add a character to the output buffer with ZDLE escaping.
+ *
+ * param:  Pointer to engine, character
+ * return: none
+ *
+ */
+static void zm_put_escaped(zmodem_t *zm, uint8_t c)
+{
+    switch ( c & 0x7f )
+    {
+        case ZDLE:
+        case 0x10:
+        case XON:
+        case XOFF:
+        case '\r':
+            zm_put(zm, ZDLE);
+            zm_put(zm, (uint8_t)(c ^ 0x40));
+            break;
+
+        case 0x7f:
+            zm_put(zm, ZDLE);
+            zm_put(zm, (uint8_t)((c == 0xff) ? ZRUB1 : ZRUB0));
+            break;
+
+        default:
+            zm_put(zm, c);
+    }
+}
+
+/*------------------------------------------------
+ * zm_hex_header()
+ *
+ *  Send a hex header.
+ *
+ * param:  Pointer to engine, header type, position or flags
+ * return: none
+ *
+ */
+static void zm_hex_header(zmodem_t *zm, int type, uint32_t pos)
+{
+    uint8_t     hdr[7];
+    uint16_t    crc;
+    int         i;
+
+    zm->last_type = type;
+    zm->last_pos = pos;
+
+    hdr[0] = (uint8_t) type;
+    for ( i = 1; i < 5; i++ )
+    {
+        hdr[i] = (uint8_t) pos;
+        pos >>= 8;
+    }
+
+    crc = crc16_ccitt_tab(hdr, 5);
+    hdr[5] = (uint8_t)(crc >> 8);
+    hdr[6] = (uint8_t) crc;
+
+    zm_put(zm, ZPAD);
+    zm_put(zm, ZPAD);
+    zm_put(zm, ZDLE);
+    zm_put(zm, ZHEX);
+
+    for ( i = 0; i < 7; i++ )
+    {
+        zm_put(zm, hex_digits[hdr[i] >> 4]);
+        zm_put(zm, hex_digits[hdr[i] & 0x0f]);
+    }
+
+    zm_put(zm, '\r');
+    zm_put(zm, '\n' | 0x80);
+
+    if ( type != ZFIN && type != ZACK )
+        zm_put(zm, XON);
+}
+
+/*------------------------------------------------
+ * zm_bin_header()
+ *
+ *  Send a binary header, with a CRC-32 if the receiver supports it.
+ *
+ * param:  Pointer to engine, header type, position or flags
+ * return: none
+ *
+ */
+static void zm_bin_header(zmodem_t *zm, int type, uint32_t pos)
+{
+    uint8_t     hdr[5];
+    uint32_t    crc;
+    int         i;
+
+    zm->last_type = type;
+    zm->last_pos = pos;
+
+    hdr[0] = (uint8_t) type;
+    for ( i = 1; i < 5; i++ )
+    {
+        hdr[i] = (uint8_t) pos;
+        pos >>= 8;
+    }
+
+    zm_put(zm, ZPAD);
+    zm_put(zm, ZDLE);
+    zm_put(zm, (uint8_t)(zm->use_crc32 ? ZBIN32 : ZBIN));
+
+    for ( i = 0; i < 5; i++ )
+        zm_put_escaped(zm, hdr[i]);
+
+    if ( zm->use_crc32 )
+    {
+        crc = crc32_update(0, hdr, 5);
+        for ( i = 0; i < 4; i++ )
+        {
+            zm_put_escaped(zm, (uint8_t) crc);
+            crc >>= 8;
+        }
+    }
+    else
+    {
+        crc = crc16_ccitt_tab(hdr, 5);
+        zm_put_escaped(zm, (uint8_t)(crc >> 8));
+        zm_put_escaped(zm, (uint8_t) crc);
+    }
+}
+
+/*------------------------------------------------
+ * zm_put_subpacket()
+ *
+ *  Send a data subpacket from the data buffer.
+ *
+ * param:  Pointer to engine, data length, subpacket end type
+ * return: none
+ *
+ */
+static void zm_put_subpacket(zmodem_t *zm, int len, int end)
+{
+    uint32_t    crc;
+    int         i;
+
+    for ( i = 0; i < len; i++ )
+        zm_put_escaped(zm, zm->data[i]);
+
+    zm_put(zm, ZDLE);
+    zm_put(zm, (uint8_t) end);
+
+    zm->data[len] = (uint8_t) end;
+
+    if ( zm->use_crc32 )
+    {
+        crc = crc32_update(0, zm->data, len + 1);
+        for ( i = 0; i < 4; i++ )
+        {
+            zm_put_escaped(zm, (uint8_t) crc);
+            crc >>= 8;
+        }
+    }
+    else
+    {
+        crc = crc16_ccitt_tab(zm->data, len + 1);
+        zm_put_escaped(zm, (uint8_t)(crc >> 8));
+        zm_put_escaped(zm, (uint8_t) crc);
+    }
+
+    if ( end == ZCRCW )
+        zm_put(zm, XON);
+}
+
+/*------------------------------------------------
+ * zm_flush()
+ *
+ *  Pass buffered output to the send function, as much as it accepts.
+ *
+ * param:  Pointer to engine
+ * return: none
+ *
+ */
+static void zm_flush(zmodem_t *zm)
+{
+    int     sent;
+
+    while ( zm->out_pos < zm->out_len )
+    {
+        sent = zm->send(zm->context, &zm->out[zm->out_pos], zm->out_len - zm->out_pos);
+        if ( sent < 0 )
+        {
+            zm->out_len = 0;
+            zm->out_pos = 0;
+            if ( zm->role != ZM_OFF )
+                zm_end(zm, "ZMODEM connection error");
+            return;
+        }
+
+        if ( sent == 0 )
+            break;
+
+        zm->out_pos += sent;
+        zm->timer = zm->now;
+    }
+
+    if ( zm->out_pos == zm->out_len )
+    {
+        zm->out_len = 0;
+        zm->out_pos = 0;
+    }
+}